@@ -0,0 +1,59 @@
+// addressing.c
+//
+//	- tick_cpu throughput for each addressing mode, and for each of the generator's instruction mixes.
+//	  Every ROM has 4 PRG banks, so the numbers include the driver switching banks every ~8000 instructions.
+#include "bench.h"
+
+#define CPU_ITERATIONS 20000000UL
+
+// Returns nanoseconds per instruction, or a negative number if the machine couldn't be booted.
+static double bench_tick(const ROMGEN_OPTIONS *options, double *cycles_per_instruction){
+	BENCH_MACHINE machine;
+	if(!bench_boot(&machine, options)){
+		return -1;
+	}
+
+	double start = platform_now();
+	for(unsigned long i = 0; i < CPU_ITERATIONS; i++){
+		tick_cpu(machine.cpu);
+	}
+	double elapsed = platform_now() - start;
+
+	*cycles_per_instruction = (double)machine.cpu->cycles / machine.cpu->instructions;
+	bench_sink += machine.cpu->A;
+	bench_shutdown(&machine);
+	return elapsed * 1e9 / CPU_ITERATIONS;
+}
+
+static void report(const char *name, double ns, double cycles_per_instruction){
+	printf("\t%-8s %6.2f ns/instruction, %5.1fM instructions/s, %.2f cycles/instruction\n",
+		name, ns, 1e3 / ns, cycles_per_instruction);
+}
+
+int main(){
+	ROMGEN_OPTIONS options = romgen_defaults();
+	options.prg_banks = 4;
+
+	printf("tick_cpu by addressing mode (%lu instructions each):\n", CPU_ITERATIONS);
+	options.mix = ROMGEN_MODE;
+	for(int mode = 0; mode < ADDRESSING_MODE_COUNT; mode++){
+		options.mode = (enum addressing_modes)mode;
+		double cpi, ns = bench_tick(&options, &cpi);
+		if(ns < 0){
+			return 1;
+		}
+		report(romgen_mode_names[mode], ns, cpi);
+	}
+
+	printf("tick_cpu by instruction mix (%lu instructions each):\n", CPU_ITERATIONS);
+	for(int mix = 0; mix < ROMGEN_MODE; mix++){
+		options.mix = (enum romgen_mixes)mix;
+		double cpi, ns = bench_tick(&options, &cpi);
+		if(ns < 0){
+			return 1;
+		}
+		report(romgen_mix_names[mix], ns, cpi);
+	}
+
+	return 0;
+}
@@ -0,0 +1,243 @@
+// apu.c
+//
+//	- Cost of the APU's sound for a frame with every channel busy (the noise at its fastest and the DMC looping
+//	  a sample at its fastest), synthesised at 48kHz, then the same frames with nobody listening, which is
+//	  what --bench and the runner pay. Then again with a pulse's period written every scanline, the way
+//	  vibrato does it, which stops the catch up 262 times a frame.
+//	- Cost to the emulation thread of handing a frame's samples to the WAV writer (see audio_out.h), writing
+//	  to /dev/null.
+//	- Checks IRQ, with small programs in RAM that turn an interrupt on, CLI and then sit in a 'JMP *' that idle
+//	  loop skipping skips, so the interrupts only arrive if the scheduler stops it for them. The frame
+//	  counter's has to come once every 29830 cycles while the handler acknowledges it, again as soon as the
+//	  handler returns if it doesn't (the line's level triggered), and never with I set. The DMC's, from a 17
+//	  byte sample that the handler starts again each time, has to come once every 17 sample reads, and the CPU
+//	  has to have been charged for every read.
+#include "bench.h"
+#include "../src/machine.h"
+#include "../src/apu.h"
+#include "../src/audio_out.h"
+
+#define APU_FRAMES 2000UL
+#define APU_SCANLINES 262
+#define APU_IRQ_FRAMES 120
+#define APU_IRQ_HANDLER 0x0480 // Where the IRQ handlers go, and the programs at 0x0400.
+
+static const uint8_t frame_irq_program[] = {
+	0xA9, 0x00,       // 0400 LDA #$00
+	0x8D, 0x17, 0x40, // 0402 STA $4017 (4 steps, frame interrupt on)
+	0x58,             // 0405 CLI
+	0x4C, 0x06, 0x04  // 0406 JMP $0406
+};
+
+static const uint8_t masked_irq_program[] = {
+	0xA9, 0x00,       // 0400 LDA #$00
+	0x8D, 0x17, 0x40, // 0402 STA $4017
+	0x4C, 0x05, 0x04  // 0405 JMP $0405 (I is still set from reset)
+};
+
+static const uint8_t dmc_irq_program[] = {
+	0xA9, 0x40,       // 0400 LDA #$40
+	0x8D, 0x17, 0x40, // 0402 STA $4017 (frame interrupt off)
+	0xA9, 0x8F,       // 0405 LDA #$8F
+	0x8D, 0x10, 0x40, // 0407 STA $4010 (interrupt at the end, no loop, fastest rate)
+	0xA9, 0x01,       // 040A LDA #$01
+	0x8D, 0x13, 0x40, // 040C STA $4013 (17 bytes, from $C000)
+	0xA9, 0x10,       // 040F LDA #$10
+	0x8D, 0x15, 0x40, // 0411 STA $4015 (play it)
+	0x58,             // 0414 CLI
+	0x4C, 0x15, 0x04  // 0415 JMP $0415
+};
+
+// Each counts its interrupts in $06-$07, then acknowledges (or doesn't) and returns.
+static const uint8_t acknowledging_handler[] = {
+	0xE6, 0x06,       // 0480 INC $06
+	0xD0, 0x02,       // 0482 BNE $0486
+	0xE6, 0x07,       // 0484 INC $07
+	0xAD, 0x15, 0x40, // 0486 LDA $4015 (acknowledges the frame interrupt)
+	0x40              // 0489 RTI
+};
+
+static const uint8_t forgetful_handler[] = {
+	0xE6, 0x06,       // 0480 INC $06
+	0xD0, 0x02,       // 0482 BNE $0486
+	0xE6, 0x07,       // 0484 INC $07
+	0x40              // 0486 RTI
+};
+
+static const uint8_t dmc_handler[] = {
+	0xE6, 0x06,       // 0480 INC $06
+	0xD0, 0x02,       // 0482 BNE $0486
+	0xE6, 0x07,       // 0484 INC $07
+	0xA9, 0x10,       // 0486 LDA #$10
+	0x8D, 0x15, 0x40, // 0488 STA $4015 (acknowledges the DMC's interrupt and plays the sample again)
+	0x40              // 048B RTI
+};
+
+static void write_register(APU *apu, uint16_t address, uint8_t value){
+	apu_write_register(apu, address, value);
+}
+
+static void set_channels(APU *apu){
+	write_register(apu, 0x4017, 0x40);
+	write_register(apu, 0x4015, 0x1F);
+	const uint8_t pulses[] = { 0xBF, 0x08, 0xFD, 0x00, 0x7F, 0x08, 0x40, 0x00 };
+	for(unsigned i = 0; i < sizeof(pulses); i++){
+		write_register(apu, (uint16_t)(0x4000 + i), pulses[i]);
+	}
+	write_register(apu, 0x4008, 0xFF);
+	write_register(apu, 0x400A, 0x7E);
+	write_register(apu, 0x400B, 0x01);
+	write_register(apu, 0x400C, 0x34);
+	write_register(apu, 0x400E, 0x00);
+	write_register(apu, 0x400F, 0x00);
+	write_register(apu, 0x4010, 0x4F);
+	write_register(apu, 0x4012, 0x00);
+	write_register(apu, 0x4013, 0xFF);
+	write_register(apu, 0x4015, 0x1F);
+}
+
+// Returns the seconds taken, and the samples made in 'samples'.
+static double run(APU *apu, bool vibrato, AUDIO_OUT *wav, uint64_t *samples){
+	const TIMING *timing = apu->timing;
+	int16_t out[2048];
+	uint64_t deltas = apu->deltas;
+	*samples = 0;
+	double start = platform_now();
+	for(unsigned long frame = 0; frame < APU_FRAMES; frame++){
+		uint64_t frame_start = apu->state.cycles;
+		if(vibrato){
+			for(unsigned line = 0; line < APU_SCANLINES; line++){
+				apu_catch_up(apu, frame_start + (uint64_t)(line * timing->cpu_cycles_per_frame / APU_SCANLINES));
+				write_register(apu, 0x4002, (uint8_t)(0xF0 + (line & 15)));
+			}
+		}
+		apu_end_frame(apu, frame_start + (uint64_t)timing->cpu_cycles_per_frame);
+		unsigned n;
+		while((n = apu_read_samples(apu, out, sizeof(out) / sizeof(out[0]))) != 0){
+			*samples += n;
+			bench_sink += (uint16_t)out[n - 1];
+			if(wav != NULL){
+				audio_out_push(wav, out, n);
+			}
+		}
+	}
+	bench_sink += (uint32_t)(apu->deltas - deltas);
+	return platform_now() - start;
+}
+
+// Boots a machine with 'program' and 'handler' in RAM and runs it for 'frames' frames, leaving it for the caller
+// to look at and shut down. Returns the number of interrupts the handler counted, or -1 if it couldn't boot.
+static long run_irq(BENCH_MACHINE *machine, const uint8_t *program, size_t program_size, const uint8_t *handler,
+	size_t handler_size, unsigned frames){
+	ROMGEN_OPTIONS options = romgen_defaults();
+	options.irq_vector = APU_IRQ_HANDLER;
+	if(!bench_boot(machine, &options)){
+		return -1;
+	}
+	memcpy(machine->mmu.ram + 0x400, program, program_size);
+	memcpy(machine->mmu.ram + APU_IRQ_HANDLER, handler, handler_size);
+	machine->cpu->PC = 0x400;
+	for(unsigned frame = 0; frame < frames; frame++){
+		machine_run_frame(machine->cpu);
+	}
+	return machine->mmu.ram[6] | machine->mmu.ram[7] << 8;
+}
+
+// Returns false if any of them went wrong.
+static bool check_irqs(){
+	printf("IRQ (%d NTSC frames each, waiting in an idle loop):\n", APU_IRQ_FRAMES);
+	BENCH_MACHINE machine;
+	long count = run_irq(&machine, frame_irq_program, sizeof(frame_irq_program), acknowledging_handler,
+		sizeof(acknowledging_handler), APU_IRQ_FRAMES);
+	if(count < 0){
+		return false;
+	}
+	long expected = (long)(machine.cpu->cycles / 29830);
+	bool frame_ok = count >= expected - 1 && count <= expected;
+	uint64_t skipped = machine.cpu->idle.skipped_cycles;
+	printf("	frame counter, acknowledged: %5ld, should be %ld (%.1f%% of cycles idle loop skipped)\n", count, expected,
+		skipped * 100.0 / machine.cpu->cycles);
+	frame_ok = frame_ok && skipped != 0;
+	bench_shutdown(&machine);
+
+	count = run_irq(&machine, frame_irq_program, sizeof(frame_irq_program), forgetful_handler, sizeof(forgetful_handler), 2);
+	if(count < 0){
+		return false;
+	}
+	bool level_ok = count > 1000;
+	printf("	frame counter, never acknowledged: %5ld in 2 frames, should be over 1000\n", count);
+	bench_shutdown(&machine);
+
+	count = run_irq(&machine, masked_irq_program, sizeof(masked_irq_program), acknowledging_handler,
+		sizeof(acknowledging_handler), APU_IRQ_FRAMES);
+	if(count < 0){
+		return false;
+	}
+	bool masked_ok = count == 0 && apu_irq(&machine.mmu.apu);
+	printf("	frame counter, I set: %5ld, should be 0 with the line left up (%s)\n", count,
+		apu_irq(&machine.mmu.apu) ? "up" : "down");
+	bench_shutdown(&machine);
+
+	count = run_irq(&machine, dmc_irq_program, sizeof(dmc_irq_program), dmc_handler, sizeof(dmc_handler), APU_IRQ_FRAMES);
+	if(count < 0){
+		return false;
+	}
+	const APU *apu = &machine.mmu.apu;
+	expected = (long)(apu->dmc_reads / 17);
+	bool dmc_ok = count >= expected - 1 && count <= expected && count != 0 && apu->stalled == apu->dmc_reads * APU_DMC_STALL;
+	printf("	DMC: %5ld, should be %ld, from %llu reads with %llu cycles stalled\n", count, expected,
+		(unsigned long long)apu->dmc_reads, (unsigned long long)apu->stalled);
+	bench_shutdown(&machine);
+
+	if(!(frame_ok && level_ok && masked_ok && dmc_ok)){
+		fprintf(stderr, "Fatal: IRQs weren't taken when they should have been.\n");
+		return false;
+	}
+	return true;
+}
+
+int main(){
+	if(!check_irqs()){
+		return 1;
+	}
+
+	ROMGEN_OPTIONS options = romgen_defaults();
+	BENCH_MACHINE machine;
+	if(!bench_boot(&machine, &options)){
+		return 1;
+	}
+	APU *apu = &machine.mmu.apu;
+	set_channels(apu);
+
+	printf("Sound (%lu NTSC frames each, all five channels playing):\n", APU_FRAMES);
+	const char *names[] = { "steady", "vibrato" };
+	for(int vibrato = 0; vibrato < 2; vibrato++){
+		uint64_t samples;
+		double silent = run(apu, vibrato, NULL, &samples);
+		if(!apu_start_output(apu, AUDIO_DEFAULT_RATE)){
+			return 1;
+		}
+		uint64_t deltas = apu->deltas;
+		double heard = run(apu, vibrato, NULL, &samples);
+		printf("\t%-8s %6.1f us/frame synthesised (%6.0f frames/s, %5.0f changes and %4.0f samples a frame), %5.1f us/frame "
+			"not\n", names[vibrato], heard * 1e6 / APU_FRAMES, APU_FRAMES / heard, (double)(apu->deltas - deltas) / APU_FRAMES,
+			(double)samples / APU_FRAMES, silent * 1e6 / APU_FRAMES);
+		destroy_blip(apu->blip);
+		apu->blip = NULL;
+	}
+
+	LOGGER logger = { NULL, NULL };
+	AUDIO_OUT *wav = new_audio_wav("/dev/null", AUDIO_DEFAULT_RATE, &logger);
+	if(wav == NULL || !apu_start_output(apu, AUDIO_DEFAULT_RATE)){
+		fprintf(stderr, "Fatal: couldn't open /dev/null for audio.\n");
+		return 1;
+	}
+	uint64_t samples;
+	double streamed = run(apu, false, wav, &samples);
+	audio_out_finish(wav);
+	printf("\tto a WAV %6.1f us/frame synthesised and handed over, %llu stall(s) waiting for the writer\n",
+		streamed * 1e6 / APU_FRAMES, (unsigned long long)wav->stalls);
+	destroy_audio_out(wav);
+	bench_shutdown(&machine);
+	return 0;
+}
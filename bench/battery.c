@@ -0,0 +1,101 @@
+// battery.c
+//
+//	- What saving battery RAM (see battery.h) costs the emulation thread. A game's work RAM changes every frame,
+//	  so each frame changes some of it and queues a save, the way the main loop does every 60 frames but as
+//	  often as it can, and that's timed against doing the same save synchronously (write, fsync, rename, fsync
+//	  the directory), which is what used to happen on the emulation thread. The saves go to a temporary
+//	  directory, so how long fsync takes depends on whatever that's on.
+//	- Checks that what's in the .sav after the final flush is the last thing written, that no .tmp file is left
+//	  behind, and that a save that can't be written is reported and then retried.
+#include "bench.h"
+#include "../src/battery.h"
+
+#include <sys/stat.h>
+
+#define BATTERY_SIZE 0x2000
+#define BATTERY_FRAMES 300 // Each way.
+
+static bool battery_file_is(const char *path, const uint8_t *expected){
+	uint8_t contents[BATTERY_SIZE + 1];
+	FILE *fp = fopen(path, "rb");
+	if(fp == NULL){
+		return false;
+	}
+	size_t len = fread(contents, 1, sizeof(contents), fp);
+	fclose(fp);
+	return len == BATTERY_SIZE && memcmp(contents, expected, BATTERY_SIZE) == 0;
+}
+
+// Counts what's logged, so the failure case can check it was reported.
+static void count_log(void *user, enum log_levels level, const char *message){
+	(void)message;
+	if(level == LOG_WARNING){
+		(*(unsigned*)user)++;
+	}
+}
+
+int main(){
+	char dir[] = "/tmp/agnt_battery_XXXXXX";
+	if(mkdtemp(dir) == NULL){
+		fprintf(stderr, "Fatal: couldn't make a temporary directory. errno = %d\n", errno);
+		return 1;
+	}
+	char path[64], tmp_path[80];
+	snprintf(path, sizeof(path), "%s/game.sav", dir);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	unsigned warnings = 0;
+	LOGGER logger = { count_log, &warnings };
+	uint8_t ram[BATTERY_SIZE] = { 0 };
+	BATTERY *battery = new_battery(path, ram, sizeof(ram), true, &logger);
+	if(battery == NULL){
+		fprintf(stderr, "Fatal: couldn't start the battery saver.\n");
+		return 1;
+	}
+
+	// First queued, as the main loop does, then flushed, as it used to.
+	uint32_t seed = 1;
+	double time[2] = { 0, 0 }, worst[2] = { 0, 0 };
+	for(unsigned frame = 0; frame < BATTERY_FRAMES * 2; frame++){
+		unsigned flushed = frame >= BATTERY_FRAMES;
+		for(unsigned i = 0; i < 64; i++){
+			ram[romgen_next(&seed) % BATTERY_SIZE] = (uint8_t)romgen_next(&seed);
+		}
+		double start = platform_now();
+		if(flushed){
+			battery_flush(battery, ram);
+		} else {
+			battery_queue(battery, ram);
+		}
+		double t = platform_now() - start;
+		time[flushed] += t;
+		worst[flushed] = t > worst[flushed] ? t : worst[flushed];
+	}
+	bool ok = battery_flush(battery, ram);
+	destroy_battery(battery);
+
+	struct stat st;
+	bool contents_ok = ok && battery_file_is(path, ram);
+	bool tmp_gone = stat(tmp_path, &st) != 0;
+	printf("Battery saves (%d bytes, %d frames each way, in %s):\n", BATTERY_SIZE, BATTERY_FRAMES, dir);
+	printf("\tqueued:  %8.2f us/frame, %8.2f us at worst\n", time[0] * 1e6 / BATTERY_FRAMES, worst[0] * 1e6);
+	printf("\tflushed: %8.2f us/frame, %8.2f us at worst\n", time[1] * 1e6 / BATTERY_FRAMES, worst[1] * 1e6);
+	printf("\tlast save on disk: %s, temporary file left: %s\n", contents_ok ? "yes" : "NO", tmp_gone ? "no" : "YES");
+	remove(path);
+
+	// Somewhere it can't be written: reported when it's made and again when it's flushed, and retried.
+	char missing[96];
+	snprintf(missing, sizeof(missing), "%s/missing/game.sav", dir);
+	warnings = 0;
+	battery = new_battery(missing, ram, sizeof(ram), true, &logger);
+	bool failed_ok = battery != NULL && warnings == 1;
+	if(battery != NULL){
+		battery_queue(battery, ram);
+		failed_ok = !battery_flush(battery, ram) && warnings >= 2 && failed_ok;
+		destroy_battery(battery);
+	}
+	printf("\tunwritable save reported and retried: %s\n", failed_ok ? "yes" : "NO");
+	rmdir(dir);
+
+	return contents_ok && tmp_gone && failed_ok ? 0 : 1;
+}
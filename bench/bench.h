@@ -0,0 +1,55 @@
+// bench.h
+//
+//	- Shared bits for the benchmarks: a machine booted from a generated ROM. They time themselves with
+//	  platform_now (see src/platform.h), like everything else.
+#ifndef bench_h
+#define bench_h
+
+#include "../src/cpu.h"
+#include "../src/platform.h"
+#include "romgen.h"
+
+#include <time.h>
+#include <unistd.h>
+
+// Results get added into this so the compiler can't throw the loops being measured away.
+static volatile uint32_t bench_sink;
+
+typedef struct {
+	CART *cart;
+	MMC mmc;
+	MMU mmu;
+	CPU *cpu;
+} BENCH_MACHINE;
+
+// Generates a ROM from 'options', loads it and resets the CPU. The machine has to be passed in rather than
+// returned since the MMU points at the MMC inside it. Returns false on failure.
+bool bench_boot(BENCH_MACHINE *machine, const ROMGEN_OPTIONS *options){
+	char path[256];
+	if(!romgen_write_temp(options, path, sizeof(path))){
+		fprintf(stderr, "Fatal: couldn't write benchmark ROM.\n");
+		return false;
+	}
+
+	machine->cart = new_cart(path);
+	unlink(path);
+	if(machine->cart == NULL){
+		return false;
+	}
+
+	machine->mmc = new_MMC(machine->cart, path);
+	machine->mmu = new_mmu(&machine->mmc);
+	memset(machine->mmu.ram, 0, 0x800);
+	machine->cpu = new_cpu(&machine->mmu);
+	machine->cpu->PC = cpu_read16(0xFFFC, &machine->mmc);
+	return true;
+}
+
+void bench_shutdown(BENCH_MACHINE *machine){
+	free(machine->cpu);
+	destroy_mmu(&machine->mmu);
+	destroy_mmc(&machine->mmc);
+	destroy_cart(machine->cart);
+}
+
+#endif
@@ -0,0 +1,72 @@
+// flags.c
+//
+//	- Benchmark for the lazy flag evaluation in cpu.h. Runs the same stream of values through the
+//	  old eager N/Z update and the lazy one, then runs the generated ROM's ALU mix (loads, EOR/ORA/AND and
+//	  friends) through tick_cpu to show what that's worth end to end.
+#include "bench.h"
+
+#define KERNEL_ITERATIONS 200000000UL
+#define CPU_ITERATIONS 50000000UL
+
+// These are called through a volatile function pointer so that, like in tick_cpu, the CPU state has
+// to live in memory rather than being kept in registers across the whole loop.
+static void eager_eor(CPU *cpu, uint8_t value){
+	// This is how EOR (and LDA/LDX/ORA) used to update the flags, with both bits being read, masked
+	// and written back on every instruction.
+	cpu->A ^= value;
+	cpu->F &= ~(FLAG_N | FLAG_Z);
+	cpu->F |= (cpu->A & FLAG_N) | (cpu->A ? 0 : FLAG_Z);
+}
+
+static void lazy_eor(CPU *cpu, uint8_t value){
+	cpu->A ^= value;
+	set_nz(cpu, cpu->A);
+}
+
+static double bench_kernel(void (*volatile kernel)(CPU*, uint8_t), const uint8_t *values, uint8_t *flags){
+	CPU cpu;
+	memset(&cpu, 0, sizeof(CPU));
+	cpu.F = 0x24;
+	double start = platform_now();
+	for(unsigned long i = 0; i < KERNEL_ITERATIONS; i++){
+		kernel(&cpu, values[i & 0xFF]);
+	}
+	double elapsed = platform_now() - start;
+	// Something has to read the flags eventually, which is where the lazy version pays for itself.
+	*flags = kernel == eager_eor ? cpu.F : cpu_get_flags(&cpu);
+	return elapsed;
+}
+
+int main(){
+	uint8_t values[256];
+	for(int i = 0; i < 256; i++){
+		values[i] = (uint8_t)(i * 167 + 13);
+	}
+
+	uint8_t eager_flags, lazy_flags;
+	double eager = bench_kernel(eager_eor, values, &eager_flags);
+	double lazy = bench_kernel(lazy_eor, values, &lazy_flags);
+	printf("EOR + N/Z update kernel (%lu updates):\n", KERNEL_ITERATIONS);
+	printf("\teager: %.3fs (%.2f ns/update), flags 0x%02X\n", eager, eager * 1e9 / KERNEL_ITERATIONS, eager_flags);
+	printf("\tlazy:  %.3fs (%.2f ns/update), flags 0x%02X\n", lazy, lazy * 1e9 / KERNEL_ITERATIONS, lazy_flags);
+
+	ROMGEN_OPTIONS options = romgen_defaults();
+	options.mix = ROMGEN_ALU;
+	BENCH_MACHINE machine;
+	if(!bench_boot(&machine, &options)){
+		return 1;
+	}
+	CPU *cpu = machine.cpu;
+
+	double start = platform_now();
+	for(unsigned long i = 0; i < CPU_ITERATIONS; i++){
+		tick_cpu(cpu);
+	}
+	double elapsed = platform_now() - start;
+	printf("tick_cpu, generated ALU mix (%lu instructions):\n", CPU_ITERATIONS);
+	printf("\t%.3fs (%.2f ns/instruction, %.1fM instructions/s), final flags 0x%02X\n",
+		elapsed, elapsed * 1e9 / CPU_ITERATIONS, CPU_ITERATIONS / elapsed / 1e6, cpu_get_flags(cpu));
+
+	bench_shutdown(&machine);
+	return 0;
+}
@@ -0,0 +1,78 @@
+// idle.c
+//
+//	- Cost of running frames with and without idle loop skipping: once on the generated ROM, which has no idle
+//	  loops so only the watching costs anything, and once on a small program in RAM that does about a third of
+//	  a frame's work and then waits for a flag, the way games wait for NMI. The flag is set at the end of each
+//	  frame, standing in for the NMI handler.
+#include "bench.h"
+#include "../src/idle.h"
+#include "../src/timing.h"
+
+#define IDLE_FRAMES 600UL
+
+static const uint8_t wait_program[] = {
+	0xA5, 0x05,       // 0400 LDA $05 <- wait for the flag
+	0xF0, 0xFC,       // 0402 BEQ $0400
+	0xA9, 0x00,       // 0404 LDA #$00
+	0x85, 0x05,       // 0406 STA $05
+	0xA0, 0x08,       // 0408 LDY #$08 <- about 10000 cycles of work
+	0xA2, 0xFF,       // 040A LDX #$FF
+	0xCA,             // 040C DEX
+	0xD0, 0xFD,       // 040D BNE $040C
+	0x88,             // 040F DEY
+	0xD0, 0xF8,       // 0410 BNE $040A
+	0x4C, 0x00, 0x04  // 0412 JMP $0400
+};
+
+static double run(BENCH_MACHINE *machine, bool skip, bool set_flag){
+	double frame_end = machine->cpu->cycles + timing_for(RP2C02)->cpu_cycles_per_frame;
+	double start = platform_now();
+	for(unsigned long frame = 0; frame < IDLE_FRAMES; frame++){
+		uint64_t end = (uint64_t)frame_end + (frame_end > (uint64_t)frame_end);
+		if(skip){
+			cpu_run_until(machine->cpu, &end);
+		} else {
+			while(machine->cpu->cycles < end){
+				tick_cpu(machine->cpu);
+			}
+		}
+		if(set_flag){
+			mmu_write(0x05, 1, &machine->mmu);
+		}
+		frame_end += timing_for(RP2C02)->cpu_cycles_per_frame;
+	}
+	return platform_now() - start;
+}
+
+static bool compare(const char *name, bool wait){
+	double elapsed[2];
+	uint64_t skipped = 0, cycles = 0;
+	for(int skip = 0; skip < 2; skip++){
+		ROMGEN_OPTIONS options = romgen_defaults();
+		BENCH_MACHINE machine;
+		if(!bench_boot(&machine, &options)){
+			return false;
+		}
+		if(wait){
+			memcpy(machine.mmu.ram + 0x400, wait_program, sizeof(wait_program));
+			machine.cpu->PC = 0x400;
+		}
+		uint64_t start_cycles = machine.cpu->cycles;
+		elapsed[skip] = run(&machine, skip, wait);
+		skipped = machine.cpu->idle.skipped_cycles;
+		cycles = machine.cpu->cycles - start_cycles;
+		bench_shutdown(&machine);
+	}
+
+	printf("\t%-20s %8.1f us/frame run, %8.1f us/frame skipping, %5.1f%% of cycles skipped\n", name,
+		elapsed[0] * 1e6 / IDLE_FRAMES, elapsed[1] * 1e6 / IDLE_FRAMES, cycles ? skipped * 100.0 / cycles : 0.0);
+	return true;
+}
+
+int main(){
+	printf("Idle loop skipping (%lu NTSC frames each):\n", IDLE_FRAMES);
+	if(!compare("generated ROM", false) || !compare("wait for flag", true)){
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,99 @@
+// lockstep.c
+//
+//	- Lockstep against the scalar interpreter, on a ROM where the lanes don't agree: each lane holds different
+//	  buttons, and the generated code branches on them. After every frame each lane has to match a machine run
+//	  on its own with the same input, register for register and byte for byte of RAM, so the scalar fallback
+//	  and the regrouping after a divergence are checked as well as timed.
+#include "bench.h"
+#include "../src/machine.h"
+#include "../src/lockstep.h"
+
+#define LOCKSTEP_BENCH_LANES 32
+#define LOCKSTEP_BENCH_FRAMES 60
+
+// Different for most lanes and most frames, but the same for a few, so there are groups bigger than one.
+static uint8_t lane_buttons(unsigned lane, unsigned frame){
+	return (uint8_t)(((lane * 7 + frame * 3) >> 2) & (BUTTON_A | BUTTON_B));
+}
+
+// Returns the number of differences between the lane and the machine, printing the first few.
+static unsigned compare_lane(LOCKSTEP *ls, unsigned lane, CPU *cpu, unsigned frame){
+	CPU *l = lockstep_lane_in(ls, lane);
+	unsigned differences = 0;
+	if(l->A != cpu->A || l->X != cpu->X || l->Y != cpu->Y || l->SP != cpu->SP || l->PC != cpu->PC
+		|| cpu_get_flags(l) != cpu_get_flags(cpu) || l->cycles != cpu->cycles || l->instructions != cpu->instructions){
+		fprintf(stderr, "\tframe %u lane %u: A %02X/%02X X %02X/%02X Y %02X/%02X SP %02X/%02X PC %04X/%04X "
+			"P %02X/%02X cycles %llu/%llu (lockstep/scalar)\n", frame, lane, l->A, cpu->A, l->X, cpu->X, l->Y, cpu->Y,
+			l->SP, cpu->SP, l->PC, cpu->PC, cpu_get_flags(l), cpu_get_flags(cpu), (unsigned long long)l->cycles,
+			(unsigned long long)cpu->cycles);
+		differences++;
+	}
+	for(unsigned address = 0; address < 0x800; address++){
+		if(ls->ram[address][lane] != cpu->mmu->ram[address]){
+			if(differences < 4){
+				fprintf(stderr, "\tframe %u lane %u: RAM %03X is %02X, should be %02X\n", frame, lane, address,
+					ls->ram[address][lane], cpu->mmu->ram[address]);
+			}
+			differences++;
+		}
+	}
+	return differences;
+}
+
+int main(){
+	ROMGEN_OPTIONS options = romgen_defaults();
+	options.prg_banks = 4;
+	options.mix = ROMGEN_INPUT;
+
+	BENCH_MACHINE machines[LOCKSTEP_BENCH_LANES];
+	for(unsigned lane = 0; lane < LOCKSTEP_BENCH_LANES; lane++){
+		if(!bench_boot(&machines[lane], &options)){
+			return 1;
+		}
+	}
+	LOCKSTEP *ls = new_lockstep(machines[0].cart, LOCKSTEP_BENCH_LANES);
+	if(ls == NULL){
+		fprintf(stderr, "Fatal: couldn't start the lockstep interpreter.\n");
+		return 1;
+	}
+
+	volatile sig_atomic_t stop = false;
+	double scalar = 0;
+	unsigned long differences = 0;
+	for(unsigned frame = 0; frame < LOCKSTEP_BENCH_FRAMES && differences == 0; frame++){
+		for(unsigned lane = 0; lane < LOCKSTEP_BENCH_LANES; lane++){
+			lockstep_set_buttons(ls, lane, 0, lane_buttons(lane, frame));
+			machines[lane].mmu.controllers.buttons[0] = lane_buttons(lane, frame);
+		}
+		lockstep_run_frames(ls, 1, &stop);
+
+		double start = platform_now();
+		for(unsigned lane = 0; lane < LOCKSTEP_BENCH_LANES; lane++){
+			machine_run_frame(machines[lane].cpu);
+		}
+		scalar += platform_now() - start;
+
+		for(unsigned lane = 0; lane < LOCKSTEP_BENCH_LANES; lane++){
+			differences += compare_lane(ls, lane, machines[lane].cpu, frame);
+		}
+	}
+
+	printf("Lockstep with diverging input (%d lanes, %d frames):\n", LOCKSTEP_BENCH_LANES, LOCKSTEP_BENCH_FRAMES);
+	printf("\tlockstep %8.3f ms, one at a time %8.3f ms, divergence rate %.4f, vector rate %.4f, %llu reconvergences\n",
+		ls->seconds * 1e3, scalar * 1e3, ls->steps ? (double)ls->divergent_steps / ls->steps : 0.0,
+		ls->lane_instructions ? (double)ls->vector_lane_instructions / ls->lane_instructions : 0.0,
+		(unsigned long long)ls->reconvergences);
+
+	bool ok = differences == 0 && ls->divergent_steps != 0 && ls->reconvergences != 0;
+	if(differences != 0){
+		fprintf(stderr, "Fatal: lockstep lanes don't match the scalar interpreter.\n");
+	} else if(!ok){
+		fprintf(stderr, "Fatal: the lanes never diverged, so nothing was checked.\n");
+	}
+
+	destroy_lockstep(ls);
+	for(unsigned lane = 0; lane < LOCKSTEP_BENCH_LANES; lane++){
+		bench_shutdown(&machines[lane]);
+	}
+	return ok ? 0 : 1;
+}
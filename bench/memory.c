@@ -0,0 +1,92 @@
+// memory.c
+//
+//	- Microbenchmarks for the memory access paths: mmu_read for RAM, PRG ROM and the unmapped slow path,
+//	  MMC1_cart_cpu_read called directly, and the 16-bit reads (cpu_read16 through the mapper, mmu_read16
+//	  through the page table).
+#include "bench.h"
+
+#define READ_ITERATIONS 100000000UL
+#define ADDRESS_COUNT 4096
+
+// Fills 'addresses' with pseudo-random addresses in [first, first + span).
+static void make_addresses(uint16_t *addresses, uint16_t first, uint32_t span){
+	uint32_t state = 0x12345678;
+	for(int i = 0; i < ADDRESS_COUNT; i++){
+		addresses[i] = first + romgen_next(&state) % span;
+	}
+}
+
+static void report(const char *name, double elapsed, unsigned long iterations){
+	printf("\t%-34s %.3fs (%.2f ns/read, %.1fM reads/s)\n", name, elapsed, elapsed * 1e9 / iterations, iterations / elapsed / 1e6);
+}
+
+static double bench_mmu_read(MMU *mmu, const uint16_t *addresses, unsigned long iterations){
+	uint32_t sum = 0;
+	double start = platform_now();
+	for(unsigned long i = 0; i < iterations; i++){
+		sum += mmu_read(addresses[i % ADDRESS_COUNT], mmu);
+	}
+	double elapsed = platform_now() - start;
+	bench_sink += sum;
+	return elapsed;
+}
+
+static double bench_mmc1_read(MMC1_ctx *ctx, const uint16_t *addresses, unsigned long iterations){
+	uint32_t sum = 0;
+	double start = platform_now();
+	for(unsigned long i = 0; i < iterations; i++){
+		sum += MMC1_cart_cpu_read(addresses[i % ADDRESS_COUNT], ctx);
+	}
+	double elapsed = platform_now() - start;
+	bench_sink += sum;
+	return elapsed;
+}
+
+static double bench_cpu_read16(MMC *mmc, const uint16_t *addresses, unsigned long iterations){
+	uint32_t sum = 0;
+	double start = platform_now();
+	for(unsigned long i = 0; i < iterations; i++){
+		sum += cpu_read16(addresses[i % ADDRESS_COUNT], mmc);
+	}
+	double elapsed = platform_now() - start;
+	bench_sink += sum;
+	return elapsed;
+}
+
+static double bench_mmu_read16(MMU *mmu, const uint16_t *addresses, unsigned long iterations){
+	uint32_t sum = 0;
+	double start = platform_now();
+	for(unsigned long i = 0; i < iterations; i++){
+		sum += mmu_read16(addresses[i % ADDRESS_COUNT], mmu);
+	}
+	double elapsed = platform_now() - start;
+	bench_sink += sum;
+	return elapsed;
+}
+
+int main(){
+	ROMGEN_OPTIONS options = romgen_defaults();
+	options.prg_banks = 8;
+
+	BENCH_MACHINE machine;
+	if(!bench_boot(&machine, &options)){
+		return 1;
+	}
+
+	uint16_t ram[ADDRESS_COUNT], rom[ADDRESS_COUNT], io[ADDRESS_COUNT], rom16[ADDRESS_COUNT];
+	make_addresses(ram, 0x0000, 0x2000);
+	make_addresses(rom, 0x8000, 0x8000);
+	make_addresses(io, 0x4000, 0x18);
+	make_addresses(rom16, 0x8000, 0x7FFF);
+
+	printf("Memory reads (%lu reads each, %d random addresses):\n", READ_ITERATIONS, ADDRESS_COUNT);
+	report("mmu_read, RAM and mirrors", bench_mmu_read(&machine.mmu, ram, READ_ITERATIONS), READ_ITERATIONS);
+	report("mmu_read, PRG ROM", bench_mmu_read(&machine.mmu, rom, READ_ITERATIONS), READ_ITERATIONS);
+	report("mmu_read, APU/IO (slow path)", bench_mmu_read(&machine.mmu, io, READ_ITERATIONS / 10), READ_ITERATIONS / 10);
+	report("MMC1_cart_cpu_read, PRG ROM", bench_mmc1_read((MMC1_ctx*)machine.mmc.ctx, rom, READ_ITERATIONS), READ_ITERATIONS);
+	report("cpu_read16, PRG ROM", bench_cpu_read16(&machine.mmc, rom16, READ_ITERATIONS), READ_ITERATIONS);
+	report("mmu_read16, PRG ROM", bench_mmu_read16(&machine.mmu, rom16, READ_ITERATIONS), READ_ITERATIONS);
+
+	bench_shutdown(&machine);
+	return 0;
+}
@@ -0,0 +1,724 @@
+// ppu.c
+//
+//	- The PPU against a model of it that runs one dot at a time, the way the real one does: the background goes
+//	  through 16 bit shift registers, each pixel is worked out on its own as it goes out, straight from CHR
+//	  rather than through the tile cache and render.h, and an odd NTSC frame only skips its last dot if
+//	  rendering is on at dot 339 of the pre-render line. Both get the same random register traffic at random
+//	  times, with the PPU caught up to each access in random sized pieces, and after every access their
+//	  positions, registers, flags and what the reads returned have to match. At the end of every frame so do
+//	  their pictures, byte for byte, and all of their memory. Run on NTSC, PAL and Dendy, each with a CHR ROM
+//	  cart and a CHR RAM one. The traffic also switches CHR banks partway through frames, which the tile cache
+//	  has to follow without throwing anything away, and on the CHR RAM cart about half the PPUDATA writes land
+//	  in the pattern tables, which it has to notice.
+//
+//	  The model also looks for the next line's sprites a dot at a time during dots 65-256, the way the real PPU
+//	  does, including reading the wrong bytes once it's found 8, so the sprite overflow flag goes up on the same
+//	  dot ppu_find_overflow says it will. Both reset OAMADDR during 257-320.
+//
+//	  The traffic keeps away from the things ppu.h knowingly doesn't do the way the real PPU does (listed at
+//	  the top of it): PPUDATA and OAMDATA aren't touched while the PPU is drawing; rendering is only turned on or
+//	  off in the part of a line's hblank before the next line's first tiles are fetched, though PPUMASK's other
+//	  bits change anywhere; PPUCTRL isn't written between the first two dots of a line, since ppu.h works sprites
+//	  out when it first draws rather than on dot 0, and the sprite size doesn't change during 65-256; and
+//	  nothing is written from the line before sprite 0 until the line after it, since sprite 0's hit is worked
+//	  out in one go too, unless it's already hit. Sprite 0 is moved somewhere new every vblank. The model is
+//	  the PPU as the nesdev wiki describes it, and it's only been checked against that: neither has been run
+//	  against test ROMs on real hardware.
+//	- The scheduler against the PPU, on the generated ROM, which never turns rendering on: at the end of every
+//	  frame, the next vblank event has to be exactly when the PPU gets to vblank, however many dots it's
+//	  fallen behind by not skipping any.
+#include "bench.h"
+#include "../src/machine.h"
+#include "../src/ppu.h"
+
+// The makefile builds this twice on x86-64, see there.
+#ifdef __SSSE3__
+#define PPU_CHECK_BUILD ", SSSE3"
+#else
+#define PPU_CHECK_BUILD ""
+#endif
+
+#define PPU_CHECK_FRAMES 200
+#define PPU_CHECK_MACHINE_FRAMES 600
+
+typedef struct {
+	const TIMING *timing;
+	MMC *mmc; // Shared with the PPU being checked, so CHR RAM writes are done twice, to no effect.
+
+	uint64_t time; // The master clock of the next dot.
+	uint64_t frame;
+	unsigned scanline;
+	unsigned dot;
+
+	uint8_t ctrl;
+	uint8_t mask;
+	uint8_t status;
+	uint8_t oam_addr;
+	uint8_t bus;
+	uint8_t read_buffer;
+	uint16_t v;
+	uint16_t t;
+	uint8_t x;
+	bool w;
+	uint8_t oam[0x100];
+	uint8_t palette[0x20];
+	uint8_t vram[0x800];
+
+	// The background as the real PPU has it: each tile is latched as it's fetched, loaded into the low half of
+	// the shift registers on the dot after, and shifted left a bit a dot from there.
+	uint8_t next_low;
+	uint8_t next_high;
+	uint8_t next_palette;
+	uint16_t pattern_low;
+	uint16_t pattern_high;
+	uint16_t palette_low;
+	uint16_t palette_high;
+
+	// The sprites on this line, the first 8 in OAM. Rows of pixels have the leftmost in the top bit.
+	struct {
+		uint8_t low;
+		uint8_t high;
+		uint8_t attributes;
+		uint8_t x;
+	} sprites[8];
+	unsigned sprite_count;
+	bool sprite0_here; // The first of them is sprite 0.
+
+	// Looking through OAM for the next line's sprites, as the real PPU does during dots 65-256, a dot to read a
+	// byte and a dot to copy it: the sprite it's on, the byte within it once it's looking for a 9th, how many
+	// it's found and how many dots are left of the one it's on. Only the overflow flag comes of it here.
+	unsigned evaluate_n;
+	unsigned evaluate_m;
+	unsigned evaluate_found;
+	unsigned evaluate_busy;
+	bool evaluate_done;
+
+	uint8_t picture[RENDER_WIDTH * RENDER_HEIGHT];
+
+	// Stats.
+	uint64_t sprite0_frames; // Frames sprite 0 hit on.
+	uint64_t overflow_frames; // Frames the sprite overflow flag went up on.
+	uint64_t long_frames; // Odd NTSC frames that didn't skip their dot.
+	uint64_t short_frames; // And that did.
+} MODEL;
+
+static MODEL new_model(MMC *mmc, const TIMING *timing){
+	MODEL m;
+	memset(&m, 0, sizeof(m));
+	m.mmc = mmc;
+	m.timing = timing;
+	return m;
+}
+
+static uint8_t model_read(MODEL *m, uint16_t address){
+	address &= 0x3FFF;
+	if(address < 0x2000){
+		return gpu_read(address, m->mmc);
+	}
+	if(address < 0x3F00){
+		return m->vram[nametable_address(address, m->mmc)];
+	}
+	unsigned index = address & 0x1F;
+	if(index >= 0x10 && (index & 3) == 0){
+		index -= 0x10;
+	}
+	return m->palette[index];
+}
+
+static void model_write(MODEL *m, uint16_t address, uint8_t value){
+	address &= 0x3FFF;
+	if(address < 0x2000){
+		gpu_write(address, value, m->mmc);
+	} else if(address < 0x3F00){
+		m->vram[nametable_address(address, m->mmc)] = value;
+	} else {
+		unsigned index = address & 0x1F;
+		if(index >= 0x10 && (index & 3) == 0){
+			index -= 0x10;
+		}
+		m->palette[index] = value & 0x3F;
+	}
+}
+
+static void model_increment_x(MODEL *m){
+	if((m->v & 0x001F) == 0x001F){
+		m->v = (m->v & ~0x001F) ^ 0x0400;
+	} else {
+		m->v++;
+	}
+}
+
+static void model_increment_y(MODEL *m){
+	unsigned fine = m->v >> 12, coarse = (m->v >> 5) & 0x1F;
+	uint16_t nametable = m->v & 0x0C00;
+	if(fine < 7){
+		fine++;
+	} else {
+		fine = 0;
+		if(coarse == 29){
+			coarse = 0;
+			nametable ^= 0x0800;
+		} else {
+			coarse = (coarse + 1) & 0x1F;
+		}
+	}
+	m->v = (uint16_t)((fine << 12) | nametable | (coarse << 5) | (m->v & 0x001F));
+}
+
+static void model_fetch(MODEL *m){
+	uint8_t tile = model_read(m, 0x2000 | (m->v & 0x0FFF));
+	uint8_t attribute = model_read(m, 0x23C0 | (m->v & 0x0C00) | ((m->v >> 4) & 0x38) | ((m->v >> 2) & 0x07));
+	unsigned quadrant = ((m->v >> 5) & 2) << 1 | (m->v & 2); // Bottom half, then right half, of the 4x4 tiles.
+	m->next_palette = (attribute >> quadrant) & 3;
+	uint16_t pattern = ((m->ctrl & PPUCTRL_BACKGROUND_TABLE) << 8) | (tile << 4) | (m->v >> 12);
+	m->next_low = model_read(m, pattern);
+	m->next_high = model_read(m, pattern + 8);
+}
+
+static uint8_t model_flip(uint8_t row){
+	uint8_t flipped = 0;
+	for(unsigned i = 0; i < 8; i++){
+		flipped |= ((row >> i) & 1) << (7 - i);
+	}
+	return flipped;
+}
+
+static void model_evaluate_sprites(MODEL *m, unsigned line){
+	unsigned height = (m->ctrl & PPUCTRL_SPRITE_16) ? 16 : 8;
+	m->sprite_count = 0;
+	m->sprite0_here = false;
+	for(unsigned i = 0; i < 64 && m->sprite_count < 8; i++){
+		const uint8_t *sprite = &m->oam[i * 4];
+		unsigned row = line - sprite[0] - 1;
+		if(line <= sprite[0] || row >= height){
+			continue;
+		}
+		uint8_t tile = sprite[1], attributes = sprite[2];
+		if(attributes & 0x80){
+			row = height - 1 - row;
+		}
+		uint16_t pattern;
+		if(height == 16){
+			pattern = ((tile & 1) << 12) | ((tile & 0xFE) << 4) | ((row & 8) << 1) | (row & 7);
+		} else {
+			pattern = ((m->ctrl & PPUCTRL_SPRITE_TABLE) << 9) | (tile << 4) | row;
+		}
+		uint8_t low = model_read(m, pattern), high = model_read(m, pattern + 8);
+		if(attributes & 0x40){
+			low = model_flip(low);
+			high = model_flip(high);
+		}
+		m->sprite0_here = m->sprite0_here || i == 0;
+		m->sprites[m->sprite_count].low = low;
+		m->sprites[m->sprite_count].high = high;
+		m->sprites[m->sprite_count].attributes = attributes;
+		m->sprites[m->sprite_count].x = sprite[3];
+		m->sprite_count++;
+	}
+}
+
+// A dot of looking for the next line's sprites, one of 65-256 with rendering on. Once it's found 8 it reads the
+// wrong bytes, see ppu_find_overflow.
+static void model_evaluate_dot(MODEL *m){
+	if(m->evaluate_busy != 0){
+		m->evaluate_busy--;
+		return;
+	}
+	if(m->evaluate_done){
+		return;
+	}
+	unsigned height = (m->ctrl & PPUCTRL_SPRITE_16) ? 16 : 8;
+	if(m->evaluate_found < 8){
+		bool here = m->scanline - m->oam[m->evaluate_n * 4] < height;
+		m->evaluate_found += here;
+		m->evaluate_busy = here ? 7 : 1; // Copying all 4 bytes, or just the Y.
+	} else if(m->scanline - m->oam[m->evaluate_n * 4 + m->evaluate_m] < height){
+		if(!(m->status & PPUSTATUS_OVERFLOW)){
+			m->overflow_frames++;
+		}
+		m->status |= PPUSTATUS_OVERFLOW;
+		m->evaluate_done = true;
+		return;
+	} else {
+		m->evaluate_m = (m->evaluate_m + 1) & 3;
+		m->evaluate_busy = 1;
+	}
+	m->evaluate_done = ++m->evaluate_n == 64;
+}
+
+// Pixel 'x' of the current line going out.
+static void model_pixel(MODEL *m, unsigned x){
+	uint8_t *out = &m->picture[m->scanline * RENDER_WIDTH + x];
+	uint8_t colour_mask = (m->mask & PPUMASK_GREYSCALE) ? 0x30 : 0x3F;
+	if(!(m->mask & PPUMASK_RENDERING)){
+		// The backdrop, or the palette entry 'v' points at if it points into the palette.
+		*out = ((m->v & 0x3F00) == 0x3F00 ? model_read(m, m->v) : m->palette[0]) & colour_mask;
+		return;
+	}
+
+	uint16_t bit = 0x8000 >> m->x;
+	unsigned background = ((m->pattern_low & bit) ? 1 : 0) | ((m->pattern_high & bit) ? 2 : 0);
+	unsigned background_palette = ((m->palette_low & bit) ? 1 : 0) | ((m->palette_high & bit) ? 2 : 0);
+
+	// The first opaque sprite here is the one that's drawn, whatever its priority.
+	unsigned sprite = 0;
+	uint8_t attributes = 0;
+	bool sprite0 = false;
+	for(unsigned i = 0; i < m->sprite_count; i++){
+		unsigned column = x - m->sprites[i].x;
+		if(column >= 8){
+			continue;
+		}
+		unsigned pixel = ((m->sprites[i].low >> (7 - column)) & 1) | (((m->sprites[i].high >> (7 - column)) & 1) << 1);
+		if(pixel != 0){
+			sprite0 = sprite0 || (i == 0 && m->sprite0_here);
+			if(sprite == 0){
+				sprite = pixel;
+				attributes = m->sprites[i].attributes;
+			}
+		}
+	}
+
+	bool both_left = (m->mask & (PPUMASK_BACKGROUND_LEFT | PPUMASK_SPRITES_LEFT)) == (PPUMASK_BACKGROUND_LEFT | PPUMASK_SPRITES_LEFT);
+	if(sprite0 && background != 0 && (m->mask & PPUMASK_RENDERING) == PPUMASK_RENDERING && x != 255 && (x >= 8 || both_left)){
+		if(!(m->status & PPUSTATUS_SPRITE0)){
+			m->sprite0_frames++;
+		}
+		m->status |= PPUSTATUS_SPRITE0;
+	}
+
+	if(!(m->mask & PPUMASK_BACKGROUND) || (x < 8 && !(m->mask & PPUMASK_BACKGROUND_LEFT))){
+		background = 0;
+	}
+	if(!(m->mask & PPUMASK_SPRITES) || (x < 8 && !(m->mask & PPUMASK_SPRITES_LEFT))){
+		sprite = 0;
+	}
+	unsigned index = 0;
+	if(sprite != 0 && (!(attributes & 0x20) || background == 0)){
+		index = 0x10 | ((attributes & 3) << 2) | sprite;
+	} else if(background != 0){
+		index = (background_palette << 2) | background;
+	}
+	*out = model_read(m, 0x3F00 | index) & colour_mask;
+}
+
+static void model_dot(MODEL *m){
+	unsigned line = m->scanline, dot = m->dot, pre_render = m->timing->scanlines - 1;
+	bool rendering = m->mask & PPUMASK_RENDERING;
+	if(line == m->timing->vblank_scanline && dot == 1){
+		m->status |= PPUSTATUS_VBLANK;
+	}
+	if(line == pre_render && dot == 1){
+		m->status &= ~(PPUSTATUS_VBLANK | PPUSTATUS_SPRITE0 | PPUSTATUS_OVERFLOW);
+	}
+
+	if(line < PPU_VISIBLE_LINES && dot == 0){
+		// Sprites for the line are worked out where it starts, as ppu.h does. See the top of the file.
+		m->sprite_count = 0;
+		m->sprite0_here = false;
+		if(rendering){
+			model_evaluate_sprites(m, line);
+		}
+	}
+	if(rendering && (line < PPU_VISIBLE_LINES || line == pre_render)){
+		if((dot >= 2 && dot <= 257) || (dot >= 322 && dot <= 337)){
+			m->pattern_low <<= 1;
+			m->pattern_high <<= 1;
+			m->palette_low <<= 1;
+			m->palette_high <<= 1;
+		}
+		if((dot >= 9 && dot <= 257 && dot % 8 == 1) || dot == 329 || dot == 337){
+			m->pattern_low = (m->pattern_low & 0xFF00) | m->next_low;
+			m->pattern_high = (m->pattern_high & 0xFF00) | m->next_high;
+			m->palette_low = (m->palette_low & 0xFF00) | ((m->next_palette & 1) ? 0xFF : 0);
+			m->palette_high = (m->palette_high & 0xFF00) | ((m->next_palette & 2) ? 0xFF : 0);
+		}
+	}
+	if(line < PPU_VISIBLE_LINES && dot >= 1 && dot <= 256){
+		model_pixel(m, dot - 1);
+	}
+	if(line < PPU_VISIBLE_LINES && dot == 65){
+		m->evaluate_n = m->evaluate_m = m->evaluate_found = m->evaluate_busy = 0;
+		m->evaluate_done = false;
+	}
+	if(rendering && line < PPU_VISIBLE_LINES && dot >= 65 && dot <= 256){
+		model_evaluate_dot(m);
+	}
+	if(rendering && (line < PPU_VISIBLE_LINES || line == pre_render)){
+		if(dot % 8 == 0 && ((dot >= 8 && dot <= 256) || dot == 328 || dot == 336)){
+			model_fetch(m);
+			model_increment_x(m);
+		}
+		if(dot == 256){
+			model_increment_y(m);
+		}
+		if(dot == 257){
+			m->v = (m->v & ~0x041F) | (m->t & 0x041F);
+		}
+		if(line == pre_render && dot >= 280 && dot <= 304){
+			m->v = (m->v & ~0x7BE0) | (m->t & 0x7BE0);
+		}
+		if(dot >= 257 && dot <= 320){
+			m->oam_addr = 0;
+		}
+	}
+
+	m->time += m->timing->ppu_divider;
+	m->dot++;
+	if(line == pre_render && dot == 339 && m->timing->scanlines == 262 && (m->frame & 1)){
+		// Odd NTSC frame. NTSC's the only one with 262 lines.
+		if(rendering){
+			m->short_frames++;
+			m->dot = PPU_DOTS_PER_LINE;
+		} else {
+			m->long_frames++;
+		}
+	}
+	if(m->dot == PPU_DOTS_PER_LINE){
+		m->dot = 0;
+		if(++m->scanline == m->timing->scanlines){
+			m->scanline = 0;
+			m->frame++;
+		}
+	}
+}
+
+static void model_run(MODEL *m, uint64_t time){
+	while(m->time <= time){
+		model_dot(m);
+	}
+}
+
+static uint8_t model_read_register(MODEL *m, uint16_t address){
+	uint8_t value = m->bus;
+	switch(address & 7){
+		case 2:
+			value = (m->status & 0xE0) | (m->bus & 0x1F);
+			m->status &= ~PPUSTATUS_VBLANK;
+			m->w = false;
+			break;
+		case 4:
+			value = m->oam[m->oam_addr];
+			break;
+		case 7:
+			if((m->v & 0x3FFF) >= 0x3F00){
+				value = (model_read(m, m->v) & 0x3F) | (m->bus & 0xC0);
+				m->read_buffer = model_read(m, (m->v & 0x2FFF));
+			} else {
+				value = m->read_buffer;
+				m->read_buffer = model_read(m, m->v);
+			}
+			m->v = (m->v + ((m->ctrl & PPUCTRL_INCREMENT_32) ? 32 : 1)) & 0x7FFF;
+			break;
+	}
+	m->bus = value;
+	return value;
+}
+
+static void model_write_register(MODEL *m, uint16_t address, uint8_t value){
+	m->bus = value;
+	switch(address & 7){
+		case 0:
+			m->ctrl = value;
+			m->t = (m->t & 0x73FF) | ((value & 3) << 10);
+			break;
+		case 1:
+			m->mask = value;
+			break;
+		case 3:
+			m->oam_addr = value;
+			break;
+		case 4:
+			m->oam[m->oam_addr] = value;
+			m->oam_addr++;
+			break;
+		case 5:
+			if(m->w){
+				m->t = (m->t & 0x0C1F) | ((value & 7) << 12) | ((value >> 3) << 5);
+			} else {
+				m->t = (m->t & 0x7FE0) | (value >> 3);
+				m->x = value & 7;
+			}
+			m->w = !m->w;
+			break;
+		case 6:
+			if(m->w){
+				m->t = (m->t & 0x7F00) | value;
+				m->v = m->t;
+			} else {
+				m->t = (m->t & 0x00FF) | ((value & 0x3F) << 8);
+			}
+			m->w = !m->w;
+			break;
+		case 7:
+			model_write(m, m->v, value);
+			m->v = (m->v + ((m->ctrl & PPUCTRL_INCREMENT_32) ? 32 : 1)) & 0x7FFF;
+			break;
+	}
+}
+
+// Returns the number of differences, printing them if there aren't already too many.
+static unsigned compare(const PPU *ppu, const MODEL *m, const char *after, unsigned long *total){
+	unsigned differences = 0;
+	if(ppu->time != m->time || ppu->frame != m->frame || ppu->scanline != m->scanline || ppu->dot != m->dot){
+		differences++;
+	}
+	if(ppu->ctrl != m->ctrl || ppu->mask != m->mask || ppu->status != m->status || ppu->oam_addr != m->oam_addr
+		|| ppu->bus != m->bus || ppu->read_buffer != m->read_buffer){
+		differences++;
+	}
+	if(ppu->v != m->v || ppu->t != m->t || ppu->x != m->x || ppu->w != m->w){
+		differences++;
+	}
+	if(differences != 0 && *total < 8){
+		fprintf(stderr, "\t%s, after %s: frame %llu/%llu line %u/%u dot %u/%u, status %02X/%02X, v %04X/%04X "
+			"t %04X/%04X x %u/%u w %d/%d (PPU/model)\n", ppu->timing->name, after, (unsigned long long)ppu->frame,
+			(unsigned long long)m->frame, ppu->scanline, m->scanline, ppu->dot, m->dot, ppu->status, m->status,
+			ppu->v, m->v, ppu->t, m->t, ppu->x, m->x, ppu->w, m->w);
+	}
+	*total += differences;
+	return differences;
+}
+
+// The same, for the picture and memory at the end of a frame.
+static unsigned compare_frame(const PPU *ppu, const MODEL *m, unsigned long *total){
+	unsigned differences = (memcmp(ppu->oam, m->oam, sizeof(m->oam)) != 0) + (memcmp(ppu->palette, m->palette, sizeof(m->palette)) != 0)
+		+ (memcmp(ppu->vram, m->vram, sizeof(m->vram)) != 0);
+	if(differences != 0 && *total < 8){
+		fprintf(stderr, "\t%s, frame %llu: OAM, palette or nametables differ\n", ppu->timing->name, (unsigned long long)m->frame);
+	}
+	for(unsigned i = 0; i < RENDER_WIDTH * RENDER_HEIGHT; i++){
+		if(ppu->picture[i] != m->picture[i]){
+			if(*total + differences < 8){
+				fprintf(stderr, "\t%s, frame %llu: pixel %u, %u is %02X, should be %02X\n", ppu->timing->name,
+					(unsigned long long)m->frame, i % RENDER_WIDTH, i / RENDER_WIDTH, ppu->picture[i], m->picture[i]);
+			}
+			differences++;
+			break;
+		}
+	}
+	*total += differences;
+	return differences;
+}
+
+// Whether an access is one of the ones the traffic keeps away from, see the top of the file.
+static bool avoided(const MODEL *m, unsigned reg, bool write, uint8_t value){
+	bool drawn = m->scanline < PPU_VISIBLE_LINES || m->scanline == m->timing->scanlines - 1;
+	if(drawn && (m->mask & PPUMASK_RENDERING) && (reg == 7 || (reg == 4 && write))){
+		return true;
+	}
+	if(!write){
+		return false;
+	}
+	bool switches_rendering = reg == 1 && !(m->mask & PPUMASK_RENDERING) != !(value & PPUMASK_RENDERING);
+	if(drawn && switches_rendering && (m->dot < 257 || m->dot > 320)){
+		return true;
+	}
+	if(m->scanline >= PPU_VISIBLE_LINES){
+		return false;
+	}
+	bool resizes_sprites = reg == 0 && ((value ^ m->ctrl) & PPUCTRL_SPRITE_16);
+	if((reg == 0 && m->dot == 1) || (resizes_sprites && m->dot >= 65 && m->dot <= 256)){
+		return true;
+	}
+	return !(m->status & PPUSTATUS_SPRITE0) && m->scanline - m->oam[0] <= 17u;
+}
+
+// The same start for both: everything filled in, sprite 0 somewhere it'll hit, rendering on.
+static void set_scene(PPU *ppu, MODEL *m, uint32_t *seed){
+	for(uint16_t address = 0; address < 0x2000; address++){
+		gpu_write(address, (uint8_t)romgen_next(seed), m->mmc); // Only does anything to CHR RAM.
+	}
+	for(unsigned i = 0; i < 0x800; i++){
+		ppu->vram[i] = m->vram[i] = (uint8_t)romgen_next(seed);
+	}
+	for(unsigned i = 0; i < 0x20; i++){
+		ppu->palette[i] = m->palette[i] = (uint8_t)(romgen_next(seed) & 0x3F);
+	}
+	for(unsigned i = 0; i < 0x100; i++){
+		ppu->oam[i] = m->oam[i] = (uint8_t)romgen_next(seed);
+	}
+	ppu->oam[0] = m->oam[0] = 100;
+	ppu->oam[2] = m->oam[2] = 0;
+	ppu->oam[3] = m->oam[3] = 100;
+	ppu_write_register(ppu, 0x2001, 0x1E);
+	model_write_register(m, 0x2001, 0x1E);
+}
+
+// Moves sprite 0 somewhere else through OAMADDR and OAMDATA, a quarter of the time into the left 8 pixels.
+static void move_sprite0(PPU *ppu, MODEL *m, uint32_t *seed){
+	uint32_t random = romgen_next(seed);
+	uint8_t sprite[4] = { (uint8_t)(random % 231), (uint8_t)(random >> 8), (uint8_t)((random >> 16) & 0xC0),
+		(uint8_t)((random >> 24) % 4 ? (random >> 12) : (random >> 12) & 7) };
+	ppu_write_register(ppu, 0x2003, 0);
+	model_write_register(m, 0x2003, 0);
+	for(unsigned i = 0; i < 4; i++){
+		ppu_write_register(ppu, 0x2004, sprite[i]);
+		model_write_register(m, 0x2004, sprite[i]);
+	}
+}
+
+// Writes an MMC1 register, a bit at a time as the CPU has to.
+static void mmc1_write(MMC *mmc, uint16_t address, uint8_t value){
+	for(unsigned i = 0; i < 5; i++){
+		cpu_write(address, (value >> i) & 1, mmc);
+	}
+}
+
+// Returns the number of differences.
+static unsigned long check_region(MMC *mmc, const char *cart, enum timing_modes mode, uint32_t seed){
+	const TIMING *timing = timing_for(mode);
+	PPU ppu = new_ppu(mmc, timing);
+	MODEL m = new_model(mmc, timing);
+	set_scene(&ppu, &m, &seed);
+
+	unsigned long differences = 0, accesses = 0, switches = 0;
+	uint64_t cycle = 0, moved = UINT64_MAX;
+	double start = platform_now();
+	while(m.frame < PPU_CHECK_FRAMES && differences == 0){
+		cycle += 1 + romgen_next(&seed) % 600;
+		uint64_t time = cycle * timing->cpu_divider;
+		for(unsigned pieces = romgen_next(&seed) % 3; pieces != 0 && ppu.time <= time; pieces--){
+			ppu_catch_up(&ppu, ppu.time + romgen_next(&seed) % (time - ppu.time + 1));
+		}
+		ppu_catch_up(&ppu, time);
+		uint64_t frame = m.frame;
+		model_run(&m, time);
+		if(m.frame != frame){
+			compare_frame(&ppu, &m, &differences);
+		}
+		if(m.scanline > timing->vblank_scanline && m.scanline < timing->scanlines - 1 && moved != m.frame){
+			move_sprite0(&ppu, &m, &seed);
+			compare(&ppu, &m, "moving sprite 0", &differences);
+			moved = m.frame;
+		}
+
+		uint32_t random = romgen_next(&seed);
+		if((random & 0xF0) == 0 && !avoided(&m, 0, true, m.ctrl)){
+			// 4KiB CHR banks, any mirroring, then a bank for each half of the pattern tables. Sprites and sprite 0
+			// are worked out when their line starts, so this keeps away from the same dots PPUCTRL does.
+			mmc1_write(mmc, 0x8000, 0x1C | (random & 3));
+			mmc1_write(mmc, 0xA000, (uint8_t)(random >> 8));
+			mmc1_write(mmc, 0xC000, (uint8_t)(random >> 16));
+			compare(&ppu, &m, "switching CHR banks", &differences);
+			switches++;
+			continue;
+		}
+		unsigned reg = random & 7;
+		bool write = random & 8;
+		uint8_t value = (uint8_t)(random >> 8);
+		if(reg == 1){
+			// Rendering on, mostly.
+			value = (random >> 16) % 4 ? value | PPUMASK_RENDERING : value & ~PPUMASK_RENDERING;
+		}
+		if(avoided(&m, reg, write, value)){
+			continue;
+		}
+
+		char after[32];
+		snprintf(after, sizeof(after), "%s %04X", write ? "writing" : "reading", 0x2000 + reg);
+		if(write){
+			ppu_write_register(&ppu, 0x2000 + reg, value);
+			model_write_register(&m, 0x2000 + reg, value);
+		} else {
+			uint8_t got = ppu_read_register(&ppu, 0x2000 + reg), expected = model_read_register(&m, 0x2000 + reg);
+			if(got != expected){
+				if(differences < 8){
+					fprintf(stderr, "\t%s, %s returned %02X, should be %02X\n", timing->name, after, got, expected);
+				}
+				differences++;
+			}
+		}
+		compare(&ppu, &m, after, &differences);
+		accesses++;
+	}
+
+	printf("\t%-6s %s %6lu accesses, %4lu bank switches, %lu wrong, sprite 0 hit on %3llu frames, overflow on %3llu, "
+		"%6.1f ms, tile cache %.2f%% hits, %5llu invalidations", timing->name, cart, accesses, switches, differences,
+		(unsigned long long)m.sprite0_frames, (unsigned long long)m.overflow_frames, (platform_now() - start) * 1e3,
+		tile_cache_hit_rate(ppu.tiles) * 100, (unsigned long long)ppu.tiles->invalidations);
+	if(timing->scanlines == 262){
+		printf(", %llu odd frames skipped their dot and %llu didn't", (unsigned long long)m.short_frames,
+			(unsigned long long)m.long_frames);
+	}
+	printf("\n");
+
+	bool chr_ram = ((MMC1_ctx*)mmc->ctx)->chr_ram != NULL;
+	bool exercised = m.sprite0_frames != 0 && m.overflow_frames != 0 && switches != 0 && (!chr_ram || ppu.tiles->invalidations != 0)
+		&& (timing->scanlines != 262 || (m.short_frames != 0 && m.long_frames != 0));
+	if(differences == 0 && !exercised){
+		fprintf(stderr, "Fatal: the %s %s traffic missed sprite 0, sprite overflow, bank switches, CHR RAM writes or the odd frame dot.\n",
+			timing->name, cart);
+		differences++;
+	}
+	destroy_ppu(&ppu);
+	return differences;
+}
+
+// Returns the number of frames the scheduler's vblank wasn't where the PPU's was.
+static unsigned long check_machine(BENCH_MACHINE *machine){
+	SCHEDULER *s = &machine->mmu.scheduler;
+	PPU *ppu = &machine->mmu.ppu;
+	unsigned long wrong = 0;
+	for(unsigned frame = 0; frame < PPU_CHECK_MACHINE_FRAMES; frame++){
+		machine_run_frame(machine->cpu);
+		uint64_t vblank = scheduler_time(s, EVENT_VBLANK);
+		ppu_catch_up(ppu, vblank - 1);
+		bool early = ppu->status & PPUSTATUS_VBLANK;
+		ppu_catch_up(ppu, vblank);
+		if(early || !(ppu->status & PPUSTATUS_VBLANK) || ppu->frame != s->frame){
+			if(wrong < 4){
+				fprintf(stderr, "\tframe %u: vblank event at %llu, PPU at frame %llu line %u dot %u\n", frame,
+					(unsigned long long)vblank, (unsigned long long)ppu->frame, ppu->scanline, ppu->dot);
+			}
+			wrong++;
+		}
+	}
+	// Rendering is never on, so no odd frame skips its dot.
+	uint64_t expected = PPU_CHECK_MACHINE_FRAMES / 2 * s->timing->ppu_divider;
+	printf("\tscheduler %u frames without rendering, %lu wrong, %llu master clocks behind the short frame grid\n",
+		PPU_CHECK_MACHINE_FRAMES, wrong, (unsigned long long)s->delay);
+	if(s->delay != expected){
+		fprintf(stderr, "\tshould be %llu behind\n", (unsigned long long)expected);
+		wrong++;
+	}
+	return wrong;
+}
+
+int main(){
+	printf("PPU against a per-dot model (%d frames each%s, random register traffic, caught up in random pieces):\n",
+		PPU_CHECK_FRAMES, PPU_CHECK_BUILD);
+	unsigned long differences = 0;
+	const struct {
+		const char *name;
+		unsigned chr_banks;
+	} carts[] = { { "CHR ROM", 2 }, { "CHR RAM", 0 } };
+	const enum timing_modes modes[] = { RP2C02, RP2C07, UA6538 };
+	for(unsigned cart = 0; cart < sizeof(carts) / sizeof(carts[0]); cart++){
+		ROMGEN_OPTIONS options = romgen_defaults();
+		options.chr_banks = carts[cart].chr_banks;
+		BENCH_MACHINE machine;
+		if(!bench_boot(&machine, &options)){
+			return 1;
+		}
+		for(unsigned i = 0; i < sizeof(modes) / sizeof(modes[0]); i++){
+			differences += check_region(&machine.mmc, carts[cart].name, modes[i], 1 + cart * 3 + i);
+		}
+		// The machine's own PPU goes back to being the one told about CHR changes.
+		mmc_attach_tile_cache(&machine.mmc, machine.mmu.ppu.tiles);
+		bench_shutdown(&machine);
+	}
+
+	ROMGEN_OPTIONS options = romgen_defaults();
+	BENCH_MACHINE machine;
+	if(!bench_boot(&machine, &options)){
+		return 1;
+	}
+	differences += check_machine(&machine);
+	bench_shutdown(&machine);
+
+	if(differences != 0){
+		fprintf(stderr, "Fatal: the PPU doesn't match the model.\n");
+	}
+	return differences == 0 ? 0 : 1;
+}
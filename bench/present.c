@@ -0,0 +1,72 @@
+// present.c
+//
+//	- Cost to the emulation thread of handing a frame over to the presentation thread (see present.h): copying
+//	  the picture into the triple buffer and publishing it, with a reader on another thread taking frames at a
+//	  60Hz display's rate. Once with the writer running flat out, which drops nearly everything, and once paced
+//	  at the NTSC frame rate, where drops and duplicates should only come from the two clocks drifting.
+#include "bench.h"
+#include "../src/present.h"
+
+#include <pthread.h>
+
+#define PRESENT_FRAMES 300UL
+
+typedef struct {
+	TRIPLE_BUFFER *buffer;
+	atomic_bool running;
+} READER;
+
+static void* reader(void *arg){
+	READER *r = (READER*)arg;
+	double next = platform_now();
+	while(atomic_load(&r->running)){
+		if(triple_buffer_take(r->buffer)){
+			bench_sink += triple_buffer_front(r->buffer)[0];
+		}
+		next += 1.0 / 60.0;
+		present_sleep_until(next);
+	}
+	return NULL;
+}
+
+static bool run(const char *name, bool paced){
+	TRIPLE_BUFFER *buffer = new_triple_buffer(RENDER_WIDTH * RENDER_HEIGHT);
+	uint8_t *picture = (uint8_t*)calloc(RENDER_WIDTH * RENDER_HEIGHT, sizeof(uint8_t));
+	if(buffer == NULL || picture == NULL){
+		return false;
+	}
+	READER r = { buffer, true };
+	pthread_t thread;
+	pthread_create(&thread, NULL, reader, &r);
+
+	unsigned long frames = paced ? PRESENT_FRAMES : PRESENT_FRAMES * 1000;
+	PACER pacer = new_pacer(timing_for(RP2C02));
+	double busy = 0;
+	for(unsigned long frame = 0; frame < frames; frame++){
+		picture[0] = (uint8_t)frame;
+		double start = platform_now();
+		memcpy(triple_buffer_back(buffer), picture, buffer->frame_size);
+		triple_buffer_publish(buffer);
+		busy += platform_now() - start;
+		if(paced){
+			presenter_pace(&pacer);
+		}
+	}
+	atomic_store(&r.running, false);
+	pthread_join(thread, NULL);
+
+	printf("\t%-10s %6.2f us/frame handing over, %7llu published, %7llu taken, %7llu dropped, %4llu duplicated\n", name,
+		busy * 1e6 / frames, (unsigned long long)atomic_load(&buffer->published), (unsigned long long)atomic_load(&buffer->taken),
+		(unsigned long long)atomic_load(&buffer->dropped), (unsigned long long)atomic_load(&buffer->duplicated));
+	destroy_triple_buffer(buffer);
+	free(picture);
+	return true;
+}
+
+int main(){
+	printf("Frame hand over (reader at 60Hz):\n");
+	if(!run("flat out", false) || !run("paced", true)){
+		return 1;
+	}
+	return 0;
+}
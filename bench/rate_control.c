@@ -0,0 +1,121 @@
+// rate_control.c
+//
+//	- How dynamic rate control (see rate_control.h) copes with the display and the sound card disagreeing about
+//	  the time, over ten minutes of simulated time each (so it runs in well under a second): the APU makes each
+//	  frame's samples into a ring the way the emulator does, and a pretend sound card takes them out in
+//	  callbacks at its own slightly wrong rate. Reports how long the ring took to settle on the target latency,
+//	  how far it wandered after that, how far the ratio moved, and the samples of silence and dropped. The
+//	  last case is the same as the one before it with the ratio left alone, which is what happened before.
+//	- Cost of the controller's update and resetting the APU's rates, once a frame.
+#include "bench.h"
+#include "../src/rate_control.h"
+#include "../src/audio_out.h"
+#include "../src/present.h"
+
+#define RATE_SECONDS 600.0
+#define RATE_CALLBACK 256 // What new_audio_device picks for the default latency at 48kHz.
+#define RATE_SETTLED_MS 2.0
+
+typedef struct {
+	const char *name;
+	enum timing_modes mode;
+	double reported_hz; // What the display says its refresh rate is, or 0 to run at the console's rate.
+	double refresh_hz; // What it really is.
+	double card_hz; // What the sound card really plays at, when it's asked for 48kHz.
+	bool control;
+} RATE_CASE;
+
+static bool run(const RATE_CASE *c){
+	const TIMING *timing = timing_for(c->mode);
+	APU apu = new_apu(NULL, timing);
+	AUDIO_RING *ring = new_audio_ring(AUDIO_DEVICE_RING);
+	if(ring == NULL || !apu_start_output(&apu, AUDIO_DEFAULT_RATE)){
+		return false;
+	}
+
+	// Locked to the display if it's close enough, like presenter_lock_pacer.
+	double console_period = timing->cpu_cycles_per_frame / timing_cpu_hz(timing);
+	bool locked = c->reported_hz != 0 && fabs(c->reported_hz * console_period - 1.0) <= PRESENT_LOCK_RANGE;
+	double period = locked ? 1.0 / c->reported_hz : console_period;
+	double frame_interval = locked ? 1.0 / c->refresh_hz : console_period;
+	RATE_CONTROL rc = new_rate_control(timing, period, AUDIO_DEFAULT_RATE, RATE_DEFAULT_LATENCY_MS);
+	size_t start_fill = (size_t)rc.target;
+
+	int16_t samples[2048];
+	double next_frame = 0, next_callback = 0;
+	bool playing = false;
+	uint64_t silence = 0, dropped = 0, frames = 0;
+	double settled = 0, min_fill = 1e9, max_fill = 0, min_ratio = 2, max_ratio = 0, update_time = 0;
+	while(next_frame < RATE_SECONDS){
+		if(!playing || next_frame <= next_callback){
+			apu_end_frame(&apu, apu.state.cycles + (uint64_t)timing->cpu_cycles_per_frame);
+			unsigned n;
+			while((n = apu_read_samples(&apu, samples, sizeof(samples) / sizeof(samples[0]))) != 0){
+				dropped += n - audio_ring_write(ring, samples, n);
+			}
+			if(!playing && audio_ring_fill(ring) >= start_fill){
+				playing = true;
+				next_callback = next_frame;
+			}
+			if(c->control){
+				double start = platform_now();
+				apu_set_ratio(&apu, rate_control_update(&rc, audio_ring_fill(ring)));
+				update_time += platform_now() - start;
+			} else {
+				apu_set_ratio(&apu, rc.base);
+				rate_control_update(&rc, audio_ring_fill(ring)); // Just for the telemetry.
+				rc.ratio = rc.base;
+			}
+
+			double error = fabs(rate_control_ms(&rc, rc.average - rc.target));
+			if(error > RATE_SETTLED_MS){
+				settled = next_frame;
+				min_fill = 1e9, max_fill = 0, min_ratio = 2, max_ratio = 0;
+			} else {
+				min_fill = rc.fill < min_fill ? rc.fill : min_fill;
+				max_fill = rc.fill > max_fill ? rc.fill : max_fill;
+				min_ratio = rc.ratio < min_ratio ? rc.ratio : min_ratio;
+				max_ratio = rc.ratio > max_ratio ? rc.ratio : max_ratio;
+			}
+			frames++;
+			next_frame += frame_interval;
+		} else {
+			silence += RATE_CALLBACK - audio_ring_read(ring, samples, RATE_CALLBACK);
+			next_callback += RATE_CALLBACK / c->card_hz;
+		}
+	}
+
+	if(settled < RATE_SECONDS - 1){
+		printf("\t%-34s settled in %5.1fs, then %5.1f-%5.1fms queued, ratio %.5f-%.5f (base %.5f), %6llu of silence, "
+			"%6llu dropped, %4.0f ns/update\n", c->name, settled, rate_control_ms(&rc, min_fill), rate_control_ms(&rc, max_fill),
+			min_ratio, max_ratio, rc.base, (unsigned long long)silence, (unsigned long long)dropped, update_time * 1e9 / frames);
+	} else {
+		printf("\t%-34s never settled, %5.1fms queued at the end, %6llu of silence, %6llu dropped\n", c->name,
+			rate_control_ms(&rc, rc.average), (unsigned long long)silence, (unsigned long long)dropped);
+	}
+	destroy_audio_ring(ring);
+	destroy_apu(&apu);
+	return true;
+}
+
+int main(){
+	const RATE_CASE cases[] = {
+		{ "NTSC, 60Hz display, card exact", RP2C02, 60, 60, 48000, true },
+		{ "NTSC, 59.94Hz display, card +0.2%", RP2C02, 60, 59.94, 48096, true },
+		{ "NTSC, 75Hz display, card -0.3%", RP2C02, 75, 75, 47856, true },
+		{ "PAL, 50Hz display, card +0.3%", RP2C07, 50, 50, 48144, true },
+		{ "NTSC, 59.94Hz display, card +0.2%", RP2C02, 60, 59.94, 48096, false },
+	};
+	printf("Dynamic rate control (%.0fms target, %.0f simulated seconds each, 48kHz asked for):\n", RATE_DEFAULT_LATENCY_MS,
+		RATE_SECONDS);
+	for(unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+		if(!cases[i].control){
+			printf("\twithout it:\n");
+		}
+		if(!run(&cases[i])){
+			fprintf(stderr, "Fatal: out of memory.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
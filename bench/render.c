@@ -0,0 +1,85 @@
+// render.c
+//
+//	- Cost of drawing a frame: the background plus 64 sprites, drawn a whole line at a time, then again with
+//	  the scroll changed partway through every line, which splits every line in two. Also the same frames
+//	  with drawing turned off, which is what's left of the PPU's time when nobody wants the picture.
+//	  Everything is done by catching the PPU up to the end of each frame, as the scheduler does.
+//	- How well the tile cache (see tile_cache.h) did over all of that, and how big it is.
+#include "bench.h"
+#include "../src/ppu.h"
+
+#define RENDER_FRAMES 2000UL
+
+static void write_register(PPU *ppu, uint16_t address, uint8_t value){
+	ppu_write_register(ppu, address, value);
+}
+
+static void set_address(PPU *ppu, uint16_t address){
+	write_register(ppu, 0x2006, address >> 8);
+	write_register(ppu, 0x2006, address & 0xFF);
+}
+
+// Fills both nametables and the palette, and spreads the sprites out so there are 8 on most lines.
+static void set_scene(PPU *ppu){
+	set_address(ppu, 0x2000);
+	for(unsigned i = 0; i < 0x800; i++){
+		write_register(ppu, 0x2007, (uint8_t)(i * 13 + (i >> 5)));
+	}
+	set_address(ppu, 0x3F00);
+	for(unsigned i = 0; i < 0x20; i++){
+		write_register(ppu, 0x2007, (uint8_t)(i * 5));
+	}
+	for(unsigned i = 0; i < 64; i++){
+		ppu->oam[i * 4] = (uint8_t)(i * 29 % 232);
+		ppu->oam[i * 4 + 1] = (uint8_t)(i * 3);
+		ppu->oam[i * 4 + 2] = (uint8_t)(i & 0xE3);
+		ppu->oam[i * 4 + 3] = (uint8_t)(i * 37);
+	}
+	write_register(ppu, 0x2000, 0x08);
+	write_register(ppu, 0x2001, 0x1E);
+}
+
+static double run(PPU *ppu, bool render, bool split){
+	const TIMING *timing = ppu->timing;
+	ppu->render = render;
+	double start = platform_now();
+	for(unsigned long frame = 0; frame < RENDER_FRAMES; frame++){
+		uint64_t frame_start = timing_frame_start(timing, ppu->frame) + ppu->delay;
+		write_register(ppu, 0x2005, (uint8_t)frame);
+		write_register(ppu, 0x2005, 0);
+		if(split){
+			for(unsigned line = 0; line < RENDER_HEIGHT; line++){
+				ppu_catch_up(ppu, frame_start + timing_master_at(timing, line, 128));
+				write_register(ppu, 0x2005, (uint8_t)(frame + line));
+				write_register(ppu, 0x2005, 0);
+			}
+		}
+		ppu_catch_up(ppu, timing_frame_start(timing, ppu->frame + 1) + ppu->delay - 1);
+		bench_sink += ppu->picture[frame % (RENDER_WIDTH * RENDER_HEIGHT)];
+	}
+	return platform_now() - start;
+}
+
+int main(){
+	ROMGEN_OPTIONS options = romgen_defaults();
+	BENCH_MACHINE machine;
+	if(!bench_boot(&machine, &options)){
+		return 1;
+	}
+	PPU *ppu = &machine.mmu.ppu;
+	set_scene(ppu);
+
+	printf("Rendering (%lu NTSC frames each, background and 64 sprites):\n", RENDER_FRAMES);
+	const char *names[] = { "whole lines", "split every line" };
+	for(int split = 0; split < 2; split++){
+		double drawn = run(ppu, true, split), skipped = run(ppu, false, split);
+		printf("\t%-18s %7.1f us/frame drawn (%6.0f frames/s), %6.1f us/frame not drawn\n", names[split],
+			drawn * 1e6 / RENDER_FRAMES, RENDER_FRAMES / drawn, skipped * 1e6 / RENDER_FRAMES);
+	}
+	const TILE_CACHE *tiles = ppu->tiles;
+	printf("\ttile cache: %.4f%% hits (%llu misses), %zu KiB for %zu CHR banks\n", tile_cache_hit_rate(tiles) * 100,
+		(unsigned long long)tiles->misses, tile_cache_bytes(tiles) / 1024, tiles->bank_count);
+
+	bench_shutdown(&machine);
+	return 0;
+}
@@ -0,0 +1,140 @@
+// rewind.c
+//
+//	- Rewind: the cost of recording a frame and of stepping back one, the average encoded size of a frame, and
+//	  so how much history fits in a 4MiB budget. Each instruction mix writes a different amount of RAM.
+//
+//	  Then a check that stepping back really does go back: a small ring is recorded into until it has wrapped
+//	  and dropped keyframes, stepped back part of the way, recorded into again, and so on. After every step
+//	  back the machine is saved again and has to match, byte for byte, what was saved when that frame was
+//	  recorded.
+#include "bench.h"
+#include "../src/rewind.h"
+
+#define REWIND_BUDGET (4 << 20)
+#define REWIND_FRAMES 3600
+#define REWIND_MAX_FRAMES (60 * 60 * 60)
+
+// Small enough that the check's ring wraps, and drops keyframes, many times over.
+#define CHECK_BUDGET (REWIND_CHUNKS * REWIND_CHUNK_BOUND + (32 << 10))
+#define CHECK_MAX_FRAMES 150
+#define CHECK_ROUNDS 20
+
+static void run_frame(CPU *cpu){
+	uint64_t end = cpu->cycles + 29781;
+	while(cpu->cycles < end){
+		tick_cpu(cpu);
+	}
+}
+
+// Returns the number of frames that didn't come back as they were recorded, or -1 if something failed outright.
+// 'wraps' and 'drops' count how often the ring wrapped around and how often its oldest keyframe (and the frames after it) was dropped.
+static long check_rewind(BENCH_MACHINE *machine, unsigned long *restores, unsigned long *wraps, unsigned long *drops){
+	REWIND *rw = new_rewind(machine->cpu, CHECK_BUDGET, CHECK_MAX_FRAMES, 60);
+	SAVESTATE *recorded = (SAVESTATE*)malloc(CHECK_MAX_FRAMES * sizeof(SAVESTATE));
+	SAVESTATE *restored = (SAVESTATE*)malloc(sizeof(SAVESTATE));
+	if(rw == NULL || recorded == NULL || restored == NULL){
+		free(recorded);
+		free(restored);
+		if(rw != NULL){
+			destroy_rewind(rw);
+		}
+		return -1;
+	}
+
+	long mismatches = 0;
+	for(unsigned round = 0; round < CHECK_ROUNDS && mismatches >= 0; round++){
+		// Record more than the ring holds, then step back through some of it (all of it, now and then).
+		for(unsigned frame = 0; frame < CHECK_MAX_FRAMES * 2; frame++){
+			run_frame(machine->cpu);
+			uint64_t first = rw->first_seq;
+			bool wrapped = rw->tail > rw->head;
+			if(!rewind_push(rw)){
+				mismatches = -1;
+				break;
+			}
+			*drops += rw->first_seq != first;
+			*wraps += wrapped && rw->tail <= rw->head;
+			memcpy(&recorded[(rw->first_seq + rw->count - 1) % CHECK_MAX_FRAMES], rw->current, sizeof(SAVESTATE));
+		}
+
+		unsigned steps = round % 4 == 3 ? CHECK_MAX_FRAMES : 17 + round * 5;
+		for(unsigned step = 0; step < steps && mismatches >= 0 && rewind_step_back(rw); step++){
+			uint64_t seq = rw->first_seq + rw->count - 1;
+			if(!savestate_save(machine->cpu, restored)){
+				mismatches = -1;
+			} else if(memcmp(restored, &recorded[seq % CHECK_MAX_FRAMES], sizeof(SAVESTATE)) != 0){
+				mismatches++;
+			}
+			(*restores)++;
+		}
+	}
+
+	free(recorded);
+	free(restored);
+	destroy_rewind(rw);
+	return mismatches;
+}
+
+int main(){
+	ROMGEN_OPTIONS options = romgen_defaults();
+	options.prg_banks = 4;
+
+	printf("Rewind (%d frames recorded then stepped back through, %dMiB budget, keyframe every 60 frames):\n",
+		REWIND_FRAMES, REWIND_BUDGET >> 20);
+	for(int mix = 0; mix < ROMGEN_MODE; mix++){
+		options.mix = (enum romgen_mixes)mix;
+		BENCH_MACHINE machine;
+		if(!bench_boot(&machine, &options)){
+			return 1;
+		}
+		REWIND *rw = new_rewind(machine.cpu, REWIND_BUDGET, REWIND_MAX_FRAMES, 60);
+
+		double push = 0;
+		for(int frame = 0; frame < REWIND_FRAMES; frame++){
+			run_frame(machine.cpu);
+			double start = platform_now();
+			rewind_push(rw);
+			push += platform_now() - start;
+		}
+
+		double bytes_per_frame = (double)rw->bytes_pushed / rw->frames_pushed;
+		double start = platform_now();
+		unsigned long steps = 0;
+		while(rewind_step_back(rw)){
+			steps++;
+		}
+		double step = steps ? (platform_now() - start) / steps : 0;
+
+		printf("\t%-8s push %6.2f us, step back %6.2f us, %7.1f bytes/frame, %6.1f minutes in budget\n",
+			romgen_mix_names[mix], push * 1e6 / REWIND_FRAMES, step * 1e6, bytes_per_frame,
+			REWIND_BUDGET / bytes_per_frame / 60 / 60);
+
+		bench_sink += machine.cpu->A;
+		destroy_rewind(rw);
+		bench_shutdown(&machine);
+	}
+
+	printf("Rewind check (%d byte ring, at most %d frames, %d rounds of recording and stepping back):\n",
+		(int)CHECK_BUDGET, CHECK_MAX_FRAMES, CHECK_ROUNDS);
+	bool ok = true;
+	for(int chr = 1; chr >= 0; chr--){
+		for(int mix = 0; mix < ROMGEN_MODE; mix++){
+			options.mix = (enum romgen_mixes)mix;
+			options.chr_banks = (unsigned)chr;
+			BENCH_MACHINE machine;
+			if(!bench_boot(&machine, &options)){
+				return 1;
+			}
+			unsigned long restores = 0, wraps = 0, drops = 0;
+			long mismatches = check_rewind(&machine, &restores, &wraps, &drops);
+			printf("\t%-8s %s %5lu restores, %4ld wrong, ring wrapped %3lu times, %4lu keyframes dropped\n",
+				romgen_mix_names[mix], chr ? "CHR ROM" : "CHR RAM", restores, mismatches, wraps, drops);
+			ok = ok && mismatches == 0 && wraps != 0 && drops != 0;
+			bench_shutdown(&machine);
+		}
+	}
+	if(!ok){
+		fprintf(stderr, "Fatal: rewind didn't put the machine back as it was, or the ring never wrapped.\n");
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+// romgen.c
+//
+//	- Command line front end for romgen.h, for making test ROMs to run outside of the benchmarks
+//	  (e.g. with 'AGNT-NES-Emulator --bench').
+#include "romgen.h"
+
+static void print_usage(){
+	printf(
+		"Usage:\n"
+		"\tromgen {args} {output file}\n"
+		"Arguments:\n"
+		"\t--prg-banks {count}\n"
+		"\t\tNumber of 16KiB PRG banks, 2-16. Defaults to 2.\n"
+		"\t--chr-banks {count}\n"
+		"\t\tNumber of 8KiB CHR banks, 0-16 (0 for CHR RAM). Defaults to 1.\n"
+		"\t--mix {alu, memory, branch, mixed, input, or an addressing mode: IMP, ACC, IMM, ZPG, ...}\n"
+		"\t\tThe instructions to fill the switchable banks with. Defaults to mixed.\n"
+		"\t--seed {number}\n"
+		"\t\tSeed for the mixed instruction streams. The same seed always gives the same ROM.\n"
+		"\t--battery\n"
+		"\t\tSets the battery bit in the header.\n"
+	);
+}
+
+static bool parse_mix(const char *name, ROMGEN_OPTIONS *options){
+	for(int mix = 0; mix < ROMGEN_MIX_COUNT; mix++){
+		if(mix != ROMGEN_MODE && strcmp(name, romgen_mix_names[mix]) == 0){
+			options->mix = (enum romgen_mixes)mix;
+			return true;
+		}
+	}
+	for(int mode = 0; mode < ADDRESSING_MODE_COUNT; mode++){
+		if(strcmp(name, romgen_mode_names[mode]) == 0){
+			options->mix = ROMGEN_MODE;
+			options->mode = (enum addressing_modes)mode;
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(int argc, const char *argv[]){
+	if(argc < 2){
+		print_usage();
+		return 1;
+	}
+
+	ROMGEN_OPTIONS options = romgen_defaults();
+	for(int i = 1; i < argc - 1; i++){
+		if(strcmp(argv[i], "--prg-banks") == 0 && i + 1 < argc - 1){
+			options.prg_banks = (unsigned)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--chr-banks") == 0 && i + 1 < argc - 1){
+			options.chr_banks = (unsigned)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--mix") == 0 && i + 1 < argc - 1){
+			if(!parse_mix(argv[++i], &options)){
+				fprintf(stderr, "Fatal: unknown instruction mix %s.\n", argv[i]);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc - 1){
+			options.seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--battery") == 0){
+			options.battery = true;
+		} else {
+			print_usage();
+			return 1;
+		}
+	}
+
+	if(!romgen_write(&options, argv[argc-1])){
+		fprintf(stderr, "Fatal: couldn't write %s (or the options are out of range). errno = %d\n", argv[argc-1], errno);
+		return 1;
+	}
+	return 0;
+}
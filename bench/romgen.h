@@ -0,0 +1,333 @@
+// romgen.h
+//
+//	- Generator for small synthetic MMC1 iNES images, so the benchmarks have something to run without
+//	  needing any real (copyrighted) ROMs. The last PRG bank is fixed at 0xC000 and holds a driver loop,
+//	  every other bank holds a block of instructions from the chosen mix followed by an RTS. The driver
+//	  switches to each bank in turn through the MMC1 shift register and JSRs into it, forever.
+//
+//	  Memory layout the generated code relies on:
+//		0x00-0x03: zeroed, read by the ALU mix.
+//		0x10-0x11: pointer to 0x0300, for the indirect addressing modes.
+//		0x20:      the driver's current bank.
+//		0x40-0x41: counters the input mix keeps, from the buttons held.
+//		0x0300:    scratch for absolute loads and stores.
+//	  X and Y are zero throughout, so indexed accesses land on the same addresses as their unindexed ones.
+#ifndef romgen_h
+#define romgen_h
+
+#include "../src/cpu.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+
+enum romgen_mixes {
+	ROMGEN_ALU,    // Loads and ALU ops on A, the kind of thing that dominates most game loops.
+	ROMGEN_MEMORY, // Loads, stores and read-modify-writes through RAM.
+	ROMGEN_BRANCH, // Compares and short branches, about half of them taken.
+	ROMGEN_MIXED,  // All of the above, picked at random.
+	ROMGEN_MODE,   // One instruction repeated, in the addressing mode given by ROMGEN_OPTIONS.mode.
+	ROMGEN_INPUT,  // Reads the first controller and branches on it, so machines with different input diverge.
+	ROMGEN_MIX_COUNT
+};
+
+const char *romgen_mix_names[ROMGEN_MIX_COUNT] = { "alu", "memory", "branch", "mixed", "mode", "input" };
+
+const char *romgen_mode_names[ADDRESSING_MODE_COUNT] = {
+	"IMP", "ACC", "IMM", "ZPG", "ZPX", "ZPY", "ABS", "ABX", "ABY", "IND", "IZX", "IZY", "REL"
+};
+
+typedef struct {
+	unsigned prg_banks; // 16KiB banks, at least 2 (one switchable, one fixed).
+	unsigned chr_banks; // 8KiB banks, 0 for CHR RAM.
+	enum romgen_mixes mix;
+	enum addressing_modes mode; // Only used by ROMGEN_MODE.
+	bool battery;
+	uint32_t seed;
+	uint16_t irq_vector; // Where IRQ goes, or 0 for the start of the driver, like reset and NMI.
+} ROMGEN_OPTIONS;
+
+ROMGEN_OPTIONS romgen_defaults(){
+	ROMGEN_OPTIONS options = { 2, 1, ROMGEN_MIXED, IMM, false, 1, 0 };
+	return options;
+}
+
+// Instruction templates. 'bytes' is the whole instruction, 'length' how much of it is used.
+typedef struct {
+	uint8_t bytes[3];
+	uint8_t length;
+} ROMGEN_INSN;
+
+static const ROMGEN_INSN romgen_alu[] = {
+	{ { 0xA9, 0x5A }, 2 },       // LDA #$5A
+	{ { 0x45, 0x00 }, 2 },       // EOR $00
+	{ { 0x05, 0x01 }, 2 },       // ORA $01
+	{ { 0x49, 0xFF }, 2 },       // EOR #$FF
+	{ { 0x29, 0x7F }, 2 },       // AND #$7F
+	{ { 0x69, 0x13 }, 2 },       // ADC #$13
+	{ { 0xE9, 0x07 }, 2 },       // SBC #$07
+	{ { 0xC9, 0x40 }, 2 },       // CMP #$40
+	{ { 0xA5, 0x03 }, 2 },       // LDA $03
+	{ { 0x0A }, 1 },             // ASL A
+	{ { 0x6A }, 1 },             // ROR A
+};
+
+static const ROMGEN_INSN romgen_memory[] = {
+	{ { 0xAD, 0x00, 0x03 }, 3 }, // LDA $0300
+	{ { 0x8D, 0x01, 0x03 }, 3 }, // STA $0301
+	{ { 0xBD, 0x02, 0x03 }, 3 }, // LDA $0302,X
+	{ { 0x99, 0x03, 0x03 }, 3 }, // STA $0303,Y
+	{ { 0x85, 0x30 }, 2 },       // STA $30
+	{ { 0xE6, 0x31 }, 2 },       // INC $31
+	{ { 0x46, 0x32 }, 2 },       // LSR $32
+	{ { 0xB1, 0x10 }, 2 },       // LDA ($10),Y
+	{ { 0x81, 0x10 }, 2 },       // STA ($10,X)
+	{ { 0xEE, 0x04, 0x03 }, 3 }, // INC $0304
+};
+
+static const ROMGEN_INSN romgen_branch[] = {
+	{ { 0xC9, 0x80 }, 2 },       // CMP #$80
+	{ { 0x90, 0x00 }, 2 },       // BCC *+2
+	{ { 0xD0, 0x00 }, 2 },       // BNE *+2
+	{ { 0x30, 0x00 }, 2 },       // BMI *+2
+	{ { 0xE0, 0x00 }, 2 },       // CPX #$00
+	{ { 0xF0, 0x00 }, 2 },       // BEQ *+2
+	{ { 0x69, 0x35 }, 2 },       // ADC #$35
+	{ { 0x10, 0x00 }, 2 },       // BPL *+2
+};
+
+// The input mix's block: strobe the controller, then read A and B and take a different path for each. Where
+// it goes next depends on the counters those paths keep, so once machines differ they keep on differing now
+// and then, and come back together at the end of each block.
+static const uint8_t romgen_input_block[] = {
+	0xA9, 0x01,       // LDA #$01
+	0x8D, 0x16, 0x40, // STA $4016
+	0x4A,             // LSR A
+	0x8D, 0x16, 0x40, // STA $4016
+	0xAD, 0x16, 0x40, // LDA $4016 (A)
+	0x29, 0x01,       // AND #$01
+	0xF0, 0x02,       // BEQ *+4
+	0xE6, 0x40,       // INC $40
+	0xAD, 0x16, 0x40, // LDA $4016 (B)
+	0x29, 0x01,       // AND #$01
+	0xF0, 0x04,       // BEQ *+6
+	0xE6, 0x41,       // INC $41
+	0xC6, 0x40,       // DEC $40
+	0xA5, 0x40,       // LDA $40
+	0x29, 0x03,       // AND #$03
+	0xD0, 0x03,       // BNE *+5
+	0xEE, 0x02, 0x03, // INC $0302
+	0xA5, 0x41,       // LDA $41
+};
+
+// One instruction per addressing mode, all of them loads where there's a choice. IND is special cased since
+// it needs a pointer to the following instruction.
+static const ROMGEN_INSN romgen_modes[ADDRESSING_MODE_COUNT] = {
+	[IMP] = { { 0x18 }, 1 },             // CLC
+	[ACC] = { { 0x0A }, 1 },             // ASL A
+	[IMM] = { { 0xA9, 0x5A }, 2 },       // LDA #$5A
+	[ZPG] = { { 0xA5, 0x30 }, 2 },       // LDA $30
+	[ZPX] = { { 0xB5, 0x30 }, 2 },       // LDA $30,X
+	[ZPY] = { { 0xB6, 0x00 }, 2 },       // LDX $00,Y (always loads 0, so X stays put)
+	[ABS] = { { 0xAD, 0x00, 0x03 }, 3 }, // LDA $0300
+	[ABX] = { { 0xBD, 0x00, 0x03 }, 3 }, // LDA $0300,X
+	[ABY] = { { 0xB9, 0x00, 0x03 }, 3 }, // LDA $0300,Y
+	[IND] = { { 0x6C }, 3 },             // JMP ($xxxx)
+	[IZX] = { { 0xA1, 0x10 }, 2 },       // LDA ($10,X)
+	[IZY] = { { 0xB1, 0x10 }, 2 },       // LDA ($10),Y
+	[REL] = { { 0xD0, 0x00 }, 2 },       // BNE *+2, always taken since A is never 0 going in
+};
+
+static uint32_t romgen_next(uint32_t *state){
+	// xorshift32, so the same seed gives the same ROM everywhere.
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static const ROMGEN_INSN* romgen_pick(const ROMGEN_OPTIONS *options, uint32_t *state){
+	switch(options->mix){
+		case ROMGEN_ALU:
+			return &romgen_alu[romgen_next(state) % (sizeof(romgen_alu) / sizeof(ROMGEN_INSN))];
+		case ROMGEN_MEMORY:
+			return &romgen_memory[romgen_next(state) % (sizeof(romgen_memory) / sizeof(ROMGEN_INSN))];
+		case ROMGEN_BRANCH:
+			return &romgen_branch[romgen_next(state) % (sizeof(romgen_branch) / sizeof(ROMGEN_INSN))];
+		case ROMGEN_MODE:
+			return &romgen_modes[options->mode];
+		default: {
+			enum romgen_mixes mix = (enum romgen_mixes)(romgen_next(state) % ROMGEN_MIXED);
+			ROMGEN_OPTIONS picked = *options;
+			picked.mix = mix;
+			return romgen_pick(&picked, state);
+		}
+	}
+}
+
+// Fills a switchable bank with instructions, then an RTS.
+static void romgen_fill_bank(uint8_t *bank, const ROMGEN_OPTIONS *options, uint32_t *state){
+	// LDA #$01 first, so the REL mix's branches have something non-zero to test.
+	size_t pc = 0;
+	bank[pc++] = 0xA9;
+	bank[pc++] = 0x01;
+
+	if(options->mix == ROMGEN_MODE && options->mode == IND){
+		// Each JMP ($xxxx) goes through its own pointer, kept in a table in the top of the bank, to the next
+		// JMP. The table starts on an even address so no pointer straddles a page (the JMP bug).
+		size_t table = 0x2800, count = (0x4000 - table) / 2 - 1;
+		for(size_t i = 0; i < count && pc + 4 <= table; i++){
+			uint16_t pointer = 0x8000 + table + i * 2, target = 0x8000 + pc + 3;
+			bank[pc++] = 0x6C;
+			bank[pc++] = pointer & 0xFF;
+			bank[pc++] = pointer >> 8;
+			bank[table + i * 2] = target & 0xFF;
+			bank[table + i * 2 + 1] = target >> 8;
+		}
+	} else if(options->mix == ROMGEN_INPUT){
+		// Blocks, with a few ALU instructions between them working on whatever the block left in A.
+		ROMGEN_OPTIONS alu = *options;
+		alu.mix = ROMGEN_ALU;
+		while(pc + sizeof(romgen_input_block) + 4 * 3 + 1 <= 0x4000){
+			memcpy(bank + pc, romgen_input_block, sizeof(romgen_input_block));
+			pc += sizeof(romgen_input_block);
+			for(uint32_t i = romgen_next(state) % 4; i > 0; i--){
+				const ROMGEN_INSN *insn = romgen_pick(&alu, state);
+				memcpy(bank + pc, insn->bytes, insn->length);
+				pc += insn->length;
+			}
+		}
+	} else {
+		for(;;){
+			const ROMGEN_INSN *insn = romgen_pick(options, state);
+			if(pc + insn->length + 1 > 0x4000){
+				break;
+			}
+			memcpy(bank + pc, insn->bytes, insn->length);
+			pc += insn->length;
+		}
+	}
+
+	bank[pc] = 0x60; // RTS
+}
+
+// Builds the driver in the fixed bank at 0xC000.
+static void romgen_fill_driver(uint8_t *bank, unsigned switchable_banks, uint16_t irq_vector){
+	const uint8_t driver[] = {
+		0x78,                   // C000 SEI
+		0xD8,                   // C001 CLD
+		0xA2, 0xFF,             // C002 LDX #$FF
+		0x9A,                   // C004 TXS
+		0xA9, 0x80,             // C005 LDA #$80
+		0x8D, 0x00, 0x80,       // C007 STA $8000 (reset the MMC1 shift register)
+		0xA9, 0x00,             // C00A LDA #$00
+		0xA2, 0x3F,             // C00C LDX #$3F
+		0x95, 0x00,             // C00E STA $00,X
+		0xCA,                   // C010 DEX
+		0x10, 0xFB,             // C011 BPL $C00E
+		0xA2, 0x00,             // C013 LDX #$00
+		0xA0, 0x00,             // C015 LDY #$00
+		0xA9, 0x03,             // C017 LDA #$03
+		0x85, 0x11,             // C019 STA $11 ($10 is already 0)
+		0xA9, 0x00,             // C01B LDA #$00 <- outer loop
+		0x85, 0x20,             // C01D STA $20
+		0xA5, 0x20,             // C01F LDA $20 <- inner loop
+		0x8D, 0x00, 0xE0,       // C021 STA $E000
+		0x4A,                   // C024 LSR A
+		0x8D, 0x00, 0xE0,       // C025 STA $E000
+		0x4A,                   // C028 LSR A
+		0x8D, 0x00, 0xE0,       // C029 STA $E000
+		0x4A,                   // C02C LSR A
+		0x8D, 0x00, 0xE0,       // C02D STA $E000
+		0x4A,                   // C030 LSR A
+		0x8D, 0x00, 0xE0,       // C031 STA $E000
+		0x20, 0x00, 0x80,       // C034 JSR $8000
+		0xA2, 0x00,             // C037 LDX #$00 (in case the bank changed them)
+		0xA0, 0x00,             // C039 LDY #$00
+		0xE6, 0x20,             // C03B INC $20
+		0xA5, 0x20,             // C03D LDA $20
+		0xC9, (uint8_t)switchable_banks, // C03F CMP #banks
+		0xD0, 0xDC,             // C041 BNE $C01F
+		0x4C, 0x1B, 0xC0,       // C043 JMP $C01B
+	};
+	memcpy(bank, driver, sizeof(driver));
+
+	// Reset, NMI and IRQ all go to the start of the driver, unless IRQ's been asked to go somewhere else.
+	for(int i = 0; i < 3; i++){
+		bank[0x3FFA + i * 2] = 0x00;
+		bank[0x3FFB + i * 2] = 0xC0;
+	}
+	if(irq_vector != 0){
+		bank[0x3FFE] = (uint8_t)irq_vector;
+		bank[0x3FFF] = (uint8_t)(irq_vector >> 8);
+	}
+}
+
+// Builds the image in memory. Returns NULL if the options don't make sense, otherwise the caller frees it.
+uint8_t* romgen_build(const ROMGEN_OPTIONS *options, size_t *size){
+	if(options->prg_banks < 2 || options->prg_banks > 16 || options->chr_banks > 16 || options->mix >= ROMGEN_MIX_COUNT
+		|| options->mode >= ADDRESSING_MODE_COUNT){
+		return NULL;
+	}
+
+	*size = 16 + (size_t)options->prg_banks * 0x4000 + (size_t)options->chr_banks * 0x2000;
+	uint8_t *image = (uint8_t*)malloc(*size);
+	memset(image, 0, *size);
+
+	// iNES header: mapper 1, horizontal mirroring, optional battery.
+	memcpy(image, "NES\x1A", 4);
+	image[4] = options->prg_banks;
+	image[5] = options->chr_banks;
+	image[6] = 0x10 | (options->battery ? 0x02 : 0x00);
+
+	uint32_t state = options->seed != 0 ? options->seed : 1;
+	uint8_t *prg = image + 16;
+	for(unsigned bank = 0; bank + 1 < options->prg_banks; bank++){
+		romgen_fill_bank(prg + bank * 0x4000, options, &state);
+	}
+	romgen_fill_driver(prg + (options->prg_banks - 1) * 0x4000, options->prg_banks - 1, options->irq_vector);
+
+	// CHR gets a recognisable pattern, which bench/render.c draws with.
+	uint8_t *chr = prg + options->prg_banks * 0x4000;
+	for(size_t i = 0; i < (size_t)options->chr_banks * 0x2000; i++){
+		chr[i] = (uint8_t)(i * 7);
+	}
+	return image;
+}
+
+// Writes the image to 'path'. Returns false on failure.
+bool romgen_write(const ROMGEN_OPTIONS *options, const char *path){
+	size_t size;
+	uint8_t *image = romgen_build(options, &size);
+	if(image == NULL){
+		return false;
+	}
+
+	FILE *fp = fopen(path, "wb");
+	bool ok = fp != NULL && fwrite(image, 1, size, fp) == size;
+	if(fp != NULL){
+		ok = fclose(fp) == 0 && ok;
+	}
+	free(image);
+	return ok;
+}
+
+// Writes the image to a new temporary file, putting its name in 'path'. Returns false on failure.
+bool romgen_write_temp(const ROMGEN_OPTIONS *options, char *path, size_t path_len){
+	const char *tmpdir = getenv("TMPDIR");
+	snprintf(path, path_len, "%s/agnt-romgen-XXXXXX", tmpdir != NULL ? tmpdir : "/tmp");
+
+	int fd = mkstemp(path);
+	if(fd == -1){
+		return false;
+	}
+	close(fd);
+	return romgen_write(options, path);
+}
+
+#endif
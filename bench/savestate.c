@@ -0,0 +1,60 @@
+// savestate.c
+//
+//	- Savestate save and load times (the generated cart has 8KiB of PRG RAM, so that's copied too), and the
+//	  time taken to write a state to disk and read it back.
+#include "bench.h"
+#include "../src/savestate.h"
+
+#define STATE_ITERATIONS 100000UL
+#define FILE_ITERATIONS 100UL
+
+static void report(const char *name, double elapsed, unsigned long iterations){
+	printf("\t%-20s %8.3f us each\n", name, elapsed * 1e6 / iterations);
+}
+
+int main(){
+	ROMGEN_OPTIONS options = romgen_defaults();
+
+	BENCH_MACHINE machine;
+	if(!bench_boot(&machine, &options)){
+		return 1;
+	}
+	for(int i = 0; i < 100000; i++){
+		tick_cpu(machine.cpu);
+	}
+
+	SAVESTATE *state = (SAVESTATE*)malloc(sizeof(SAVESTATE));
+	printf("Savestates (%zu bytes, %lu saves/loads, %lu file round trips):\n", sizeof(SAVESTATE), STATE_ITERATIONS, FILE_ITERATIONS);
+
+	double start = platform_now();
+	for(unsigned long i = 0; i < STATE_ITERATIONS; i++){
+		savestate_save(machine.cpu, state);
+		bench_sink += state->ram[i & 0x7FF];
+	}
+	report("savestate_save", platform_now() - start, STATE_ITERATIONS);
+
+	start = platform_now();
+	for(unsigned long i = 0; i < STATE_ITERATIONS; i++){
+		bench_sink += savestate_load(machine.cpu, state);
+	}
+	report("savestate_load", platform_now() - start, STATE_ITERATIONS);
+
+	char path[] = "/tmp/agnt-bench-state-XXXXXX";
+	int fd = mkstemp(path);
+	if(fd < 0){
+		fprintf(stderr, "Fatal: couldn't make a temporary file.\n");
+		return 1;
+	}
+	close(fd);
+
+	start = platform_now();
+	for(unsigned long i = 0; i < FILE_ITERATIONS; i++){
+		bench_sink += savestate_write(state, path) && savestate_read(state, path);
+	}
+	report("write + read (fsync)", platform_now() - start, FILE_ITERATIONS);
+	unlink(path);
+
+	free(state);
+	bench_shutdown(&machine);
+	return 0;
+}
@@ -0,0 +1,50 @@
+// video.c
+//
+//	- Cost to the emulation thread of streaming frames out (see video_out.h), in each format, to /dev/null.
+//	  Frames are queued as fast as they can be, so this is the writer thread's speed, and the stalls are the
+//	  emulator waiting on it. The same again with a queue of one frame, which is close to writing them in line.
+#include "bench.h"
+#include "../src/video_out.h"
+
+#define VIDEO_FRAMES 2000UL
+
+static bool run(const char *name, enum video_formats format, unsigned queue){
+	LOGGER logger = { NULL, NULL };
+	VIDEO_OUT *video = new_video_out("/dev/null", format, queue, timing_for(RP2C02), &logger);
+	uint8_t *picture = (uint8_t*)malloc(VIDEO_FRAME_PIXELS);
+	if(video == NULL || picture == NULL){
+		fprintf(stderr, "Fatal: couldn't open /dev/null for video.\n");
+		return false;
+	}
+	for(size_t i = 0; i < VIDEO_FRAME_PIXELS; i++){
+		picture[i] = (uint8_t)(i * 7 % 64);
+	}
+
+	double start = platform_now();
+	for(unsigned long frame = 0; frame < VIDEO_FRAMES; frame++){
+		picture[frame % VIDEO_FRAME_PIXELS] = (uint8_t)frame & 0x3F;
+		video_out_frame(video, picture);
+	}
+	double queued = platform_now() - start;
+	video_out_finish(video);
+	double finished = platform_now() - start;
+
+	printf("\t%-8s queue %2u %7.1f us/frame (%6.0f frames/s written), %4.1f frames/write, %4lu stalls, depth %.1f on average\n",
+		name, video->capacity, queued * 1e6 / VIDEO_FRAMES, VIDEO_FRAMES / finished,
+		video->writes ? (double)video->frames_written / video->writes : 0.0, (unsigned long)video->stalls,
+		(double)video->depth_total / video->frames_queued);
+	destroy_video_out(video);
+	free(picture);
+	return true;
+}
+
+int main(){
+	printf("Video streaming (%lu frames each, to /dev/null):\n", VIDEO_FRAMES);
+	const char *names[] = { "indexed", "rgb", "y4m" };
+	for(int format = VIDEO_INDEXED; format <= VIDEO_Y4M; format++){
+		if(!run(names[format], (enum video_formats)format, 0) || !run(names[format], (enum video_formats)format, 1)){
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,689 @@
+#ifndef apu_h
+#define apu_h
+
+// The APU: two pulse channels, a triangle, noise, the DMC (delta modulation, for samples) and the frame counter
+// that clocks their envelopes, sweeps and length counters.
+//
+// Like the PPU (see ppu.h), it isn't stepped every cycle. It's caught up (apu_catch_up) when something needs it
+// to be: the CPU touching its registers, a write to the cart's registers (the DMC reads samples from the cart,
+// so it has to be done with the old banks first), and the end of every frame. Catching up runs each channel
+// on its own from one frame counter step to the next, and a channel only does any work when its timer runs
+// out, which is at most once every 2 cycles for anything you can hear and usually far less.
+//
+// Sound comes out through a BLIP (see blip.h): each time a channel's output changes, the change goes into the
+// buffer as a band-limited step, and a frame's samples are ready once the frame's over (apu_end_frame). Without
+// a BLIP, which is how it starts, nothing's synthesised at all and the channels only keep the time, so the
+// registers still read back right. The channels are mixed linearly, using the usual approximation of the
+// console's (nonlinear) mixer, so they can each be synthesised separately.
+//
+// Everything that goes in a savestate is in APU_STATE, which has a fixed layout like SAVESTATE itself.
+//
+// The frame counter and the DMC can both hold the CPU's IRQ line up (apu_irq), until it's acknowledged through
+// $4015, $4017 or $4010. Catching up lazily would only notice that when something happened to catch the APU up,
+// so apu_next_irq says when it'll next go up by itself, worked out from the frame counter's position and how
+// many sample bytes the DMC has left, and the scheduler stops the CPU there (see mmu_schedule_apu). Each sample
+// byte the DMC reads stops the CPU for a few cycles, which are added up in 'stall' for the machine to charge
+// it. Those reads are scheduled the same way (apu_next_dmc_read), so that happens on the right instruction.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "mappers/delegator.h"
+#include "timing.h"
+#include "blip.h"
+
+#define APU_PULSE_WEIGHT 0.00752f // Output per step of each channel's level, from the mixer's approximation.
+#define APU_TRIANGLE_WEIGHT 0.00851f
+#define APU_NOISE_WEIGHT 0.00494f
+#define APU_DMC_WEIGHT 0.00335f
+#define APU_CHANNELS 5
+#define APU_DEFAULT_VOLUME 1.0f
+#define APU_BUFFER_SECONDS 0.125 // How many samples the BLIP can hold. Frames are read out as they finish, so this only needs to fit one.
+#define APU_DMC_STALL 4 // CPU cycles a DMC sample read takes from the CPU. It's 1-4 on the real one depending on what the CPU's doing, usually 4.
+
+#define APU_STATUS_DMC 0x10
+#define APU_STATUS_FRAME_IRQ 0x40
+#define APU_STATUS_DMC_IRQ 0x80
+
+// Frame counter steps.
+#define APU_QUARTER 1 // Envelopes and the triangle's linear counter.
+#define APU_HALF 2 // Length counters and sweeps.
+#define APU_IRQ 4
+#define APU_END 8 // Back to the start of the sequence.
+
+typedef struct {
+	uint8_t start;
+	uint8_t divider;
+	uint8_t decay;
+	uint8_t reserved;
+} APU_ENVELOPE;
+
+typedef struct {
+	uint8_t reg[4]; // $4000-$4003 (or $4004-$4007) as last written.
+	APU_ENVELOPE envelope;
+	uint16_t period; // The timer's reload value. Sweeps change this without touching reg[].
+	uint16_t timer; // CPU cycles until the sequencer next steps.
+	uint8_t length;
+	uint8_t step;
+	uint8_t sweep_divider;
+	uint8_t sweep_reload;
+} APU_PULSE;
+
+typedef struct {
+	uint8_t reg[4];
+	uint16_t period;
+	uint16_t timer;
+	uint8_t length;
+	uint8_t step;
+	uint8_t linear;
+	uint8_t linear_reload;
+} APU_TRIANGLE;
+
+typedef struct {
+	uint8_t reg[4];
+	APU_ENVELOPE envelope;
+	uint16_t timer;
+	uint16_t lfsr;
+	uint8_t length;
+	uint8_t reserved[3];
+} APU_NOISE;
+
+typedef struct {
+	uint8_t reg[4];
+	uint16_t timer;
+	uint16_t address; // Of the next sample byte.
+	uint16_t remaining; // Sample bytes left to read.
+	uint8_t output; // The 7 bit level.
+	uint8_t buffer; // The byte read ahead.
+	uint8_t buffer_full;
+	uint8_t shift; // The byte being played.
+	uint8_t bits; // Left in 'shift'.
+	uint8_t silence; // Nothing to play, because the buffer was empty when 'shift' ran out.
+	uint8_t irq;
+	uint8_t reserved[3];
+} APU_DMC;
+
+typedef struct {
+	uint64_t cycles; // The CPU cycle it's been caught up to.
+	uint32_t sequencer; // CPU cycles since the frame counter's sequence started.
+	uint8_t mode; // 0 for the 4 step sequence, 1 for the 5 step one.
+	uint8_t irq_inhibit;
+	uint8_t frame_irq;
+	uint8_t enabled; // $4015's enable bits for the pulses, triangle and noise.
+	APU_PULSE pulse[2];
+	APU_TRIANGLE triangle;
+	APU_NOISE noise;
+	APU_DMC dmc;
+} APU_STATE;
+
+_Static_assert(sizeof(APU_STATE) == 96, "APU_STATE has padding in it");
+
+typedef struct {
+	APU_STATE state;
+	MMC *mmc; // Where the DMC's samples come from.
+	const TIMING *timing;
+	const uint32_t (*steps)[5]; // The frame counter's sequences for this region, one for each mode.
+	const uint16_t *noise_periods;
+	const uint16_t *dmc_periods;
+
+	// Synthesis. Nothing's put in the BLIP while 'quiet' is set, which run-ahead uses for frames nobody will hear.
+	BLIP *blip;
+	bool quiet;
+	float volume;
+	uint64_t frame_start; // The CPU cycle the BLIP's current frame started on.
+	float levels[APU_CHANNELS]; // Each channel's output, as far as the BLIP knows.
+
+	unsigned stall; // CPU cycles the DMC's reads have taken that the CPU hasn't been charged for yet, see apu_take_stall.
+
+	// Stats.
+	uint64_t catch_ups;
+	uint64_t dmc_reads;
+	uint64_t stalled; // CPU cycles the DMC's reads have been charged for.
+	uint64_t deltas; // Changes put into the BLIP.
+} APU;
+
+static const uint8_t apu_lengths[32] = {
+	10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+	12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+// Which of the 8 steps are high, for each duty cycle (12.5%, 25%, 50% and 25% inverted).
+static const uint8_t apu_duties[4] = { 0x02, 0x06, 0x1E, 0xF9 };
+
+static const uint8_t apu_triangle_steps[32] = {
+	15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+// In CPU cycles. Dendy's APU is timed like an NTSC one.
+static const uint16_t apu_noise_periods_ntsc[16] = { 4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068 };
+static const uint16_t apu_noise_periods_pal[16] = { 4, 8, 14, 30, 60, 88, 118, 148, 188, 236, 354, 472, 708, 944, 1890, 3778 };
+static const uint16_t apu_dmc_periods_ntsc[16] = { 428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54 };
+static const uint16_t apu_dmc_periods_pal[16] = { 398, 354, 316, 298, 276, 236, 210, 198, 176, 148, 132, 118, 98, 78, 66, 50 };
+
+// When each step of the frame counter's sequences happens, in CPU cycles from the start, and what it does.
+static const uint32_t apu_steps_ntsc[2][5] = { { 7457, 14913, 22371, 29829, 29830 }, { 7457, 14913, 22371, 37281, 37282 } };
+static const uint32_t apu_steps_pal[2][5] = { { 8313, 16627, 24939, 33253, 33254 }, { 8313, 16627, 24939, 41565, 41566 } };
+static const uint8_t apu_step_actions[2][5] = {
+	{ APU_QUARTER, APU_QUARTER | APU_HALF, APU_QUARTER, APU_QUARTER | APU_HALF | APU_IRQ, APU_END },
+	{ APU_QUARTER, APU_QUARTER | APU_HALF, APU_QUARTER, APU_QUARTER | APU_HALF, APU_END }
+};
+
+static inline APU new_apu(MMC *mmc, const TIMING *timing){
+	APU apu;
+	memset(&apu, 0, sizeof(apu));
+	apu.mmc = mmc;
+	apu.timing = timing;
+	bool pal = timing->cpu_divider == timings[RP2C07].cpu_divider;
+	apu.steps = pal ? apu_steps_pal : apu_steps_ntsc;
+	apu.noise_periods = pal ? apu_noise_periods_pal : apu_noise_periods_ntsc;
+	apu.dmc_periods = pal ? apu_dmc_periods_pal : apu_dmc_periods_ntsc;
+	apu.volume = APU_DEFAULT_VOLUME;
+	apu.state.noise.lfsr = 1;
+	apu.state.dmc.bits = 8;
+	apu.state.dmc.silence = 1;
+	return apu;
+}
+
+static inline void destroy_apu(APU *apu){
+	if(apu->blip != NULL){
+		destroy_blip(apu->blip);
+	}
+}
+
+// Starts synthesising sound at 'sample_rate' samples a second. Returns false if out of memory.
+static inline bool apu_start_output(APU *apu, double sample_rate){
+	apu->blip = new_blip((unsigned)(sample_rate * APU_BUFFER_SECONDS), timing_cpu_hz(apu->timing), sample_rate);
+	apu->frame_start = apu->state.cycles;
+	return apu->blip != NULL;
+}
+
+// Makes 'ratio' times as many samples as it should from the next frame on, for dynamic rate control (see
+// rate_control.h). Only between frames, and only once output's started.
+static inline void apu_set_ratio(APU *apu, double ratio){
+	blip_set_rates(apu->blip, timing_cpu_hz(apu->timing) / ratio, apu->blip->sample_rate);
+}
+
+static inline bool apu_synthesising(const APU *apu){
+	return apu->blip != NULL && !apu->quiet;
+}
+
+// Channel 'channel' outputs 'level' from CPU cycle 'time' on.
+static inline void apu_output(APU *apu, unsigned channel, uint64_t time, float level){
+	if(level != apu->levels[channel] && apu_synthesising(apu)){
+		blip_add_delta(apu->blip, time - apu->frame_start, level - apu->levels[channel]);
+		apu->levels[channel] = level;
+		apu->deltas++;
+	}
+}
+
+// Runs a timer that's 'timer' cycles from running out and reloads with 'period' for 'elapsed' cycles. Returns
+// how many times it ran out.
+static inline uint32_t apu_run_timer(uint16_t *timer, unsigned period, uint64_t elapsed){
+	if(elapsed < *timer){
+		*timer -= (uint16_t)elapsed;
+		return 0;
+	}
+	elapsed -= *timer;
+	*timer = (uint16_t)(period - elapsed % period);
+	return (uint32_t)(1 + elapsed / period);
+}
+
+static inline unsigned apu_envelope_volume(const APU_ENVELOPE *envelope, uint8_t reg){
+	return reg & 0x10 ? reg & 0x0F : envelope->decay;
+}
+
+static inline void apu_clock_envelope(APU_ENVELOPE *envelope, uint8_t reg){
+	if(envelope->start){
+		envelope->start = 0;
+		envelope->decay = 15;
+		envelope->divider = reg & 0x0F;
+	} else if(envelope->divider == 0){
+		envelope->divider = reg & 0x0F;
+		if(envelope->decay != 0){
+			envelope->decay--;
+		} else if(reg & 0x20){
+			envelope->decay = 15;
+		}
+	} else {
+		envelope->divider--;
+	}
+}
+
+// Where a sweep would take the pulse's period. Pulse 1 negates with ones' complement, pulse 2 with two's.
+static inline int apu_sweep_target(const APU_PULSE *pulse, unsigned index){
+	int change = pulse->period >> (pulse->reg[1] & 7);
+	return pulse->reg[1] & 0x08 ? pulse->period - change - (index == 0) : pulse->period + change;
+}
+
+// A pulse is silenced with a period too short to hear, or one a sweep would take out of range, even if the
+// sweep's off.
+static inline bool apu_pulse_audible(const APU_PULSE *pulse, unsigned index){
+	return pulse->length != 0 && pulse->period >= 8 && apu_sweep_target(pulse, index) <= 0x7FF;
+}
+
+static inline void apu_run_pulse(APU *apu, unsigned index, uint64_t from, uint64_t to){
+	APU_PULSE *pulse = &apu->state.pulse[index];
+	unsigned period = (pulse->period + 1u) * 2;
+	unsigned volume = apu_pulse_audible(pulse, index) ? apu_envelope_volume(&pulse->envelope, pulse->reg[0]) : 0;
+	uint8_t duty = apu_duties[pulse->reg[0] >> 6];
+	float level = APU_PULSE_WEIGHT * volume;
+
+	// Nothing to hear, so only the sequencer's position matters.
+	if(volume == 0 || !apu_synthesising(apu)){
+		apu_output(apu, index, from, 0);
+		pulse->step = (uint8_t)((pulse->step + apu_run_timer(&pulse->timer, period, to - from)) & 7);
+		return;
+	}
+
+	uint64_t time = from;
+	apu_output(apu, index, time, duty >> pulse->step & 1 ? level : 0);
+	while(time + pulse->timer <= to){
+		time += pulse->timer;
+		pulse->timer = (uint16_t)period;
+		pulse->step = (pulse->step + 1) & 7;
+		apu_output(apu, index, time, duty >> pulse->step & 1 ? level : 0);
+	}
+	pulse->timer -= (uint16_t)(to - time);
+}
+
+// The triangle holds its level when it stops, rather than going quiet. Periods too short to hear are left
+// frozen too, since stepping them would only make a horrible noise.
+static inline void apu_run_triangle(APU *apu, uint64_t from, uint64_t to){
+	APU_TRIANGLE *triangle = &apu->state.triangle;
+	unsigned period = triangle->period + 1u;
+	bool running = triangle->length != 0 && triangle->linear != 0 && triangle->period >= 2;
+	apu_output(apu, 2, from, APU_TRIANGLE_WEIGHT * apu_triangle_steps[triangle->step & 31]);
+
+	if(!running || !apu_synthesising(apu)){
+		uint32_t steps = apu_run_timer(&triangle->timer, period, to - from);
+		triangle->step = (uint8_t)((triangle->step + (running ? steps : 0)) & 31);
+		return;
+	}
+
+	uint64_t time = from;
+	while(time + triangle->timer <= to){
+		time += triangle->timer;
+		triangle->timer = (uint16_t)period;
+		triangle->step = (triangle->step + 1) & 31;
+		apu_output(apu, 2, time, APU_TRIANGLE_WEIGHT * apu_triangle_steps[triangle->step]);
+	}
+	triangle->timer -= (uint16_t)(to - time);
+}
+
+// The shift register has to be stepped whether or not anyone's listening, so the noise is the same either way.
+static inline void apu_run_noise(APU *apu, uint64_t from, uint64_t to){
+	APU_NOISE *noise = &apu->state.noise;
+	unsigned period = apu->noise_periods[noise->reg[2] & 0x0F];
+	unsigned tap = noise->reg[2] & 0x80 ? 6 : 1;
+	unsigned volume = noise->length != 0 ? apu_envelope_volume(&noise->envelope, noise->reg[0]) : 0;
+	float level = APU_NOISE_WEIGHT * volume;
+	bool synthesising = volume != 0 && apu_synthesising(apu);
+
+	uint64_t time = from;
+	apu_output(apu, 3, time, noise->lfsr & 1 ? 0 : level);
+	while(time + noise->timer <= to){
+		time += noise->timer;
+		noise->timer = (uint16_t)period;
+		unsigned feedback = (noise->lfsr ^ noise->lfsr >> tap) & 1;
+		noise->lfsr = (uint16_t)(noise->lfsr >> 1 | feedback << 14);
+		if(synthesising){
+			apu_output(apu, 3, time, noise->lfsr & 1 ? 0 : level);
+		}
+	}
+	noise->timer -= (uint16_t)(to - time);
+}
+
+static inline void apu_dmc_restart(APU_DMC *dmc){
+	dmc->address = (uint16_t)(0xC000 + dmc->reg[2] * 64);
+	dmc->remaining = (uint16_t)(dmc->reg[3] * 16 + 1);
+}
+
+// Reads the next sample byte, if the buffer's empty and there is one.
+static inline void apu_dmc_fetch(APU *apu){
+	APU_DMC *dmc = &apu->state.dmc;
+	if(dmc->buffer_full || dmc->remaining == 0){
+		return;
+	}
+	dmc->buffer = cpu_read(dmc->address, apu->mmc);
+	dmc->buffer_full = 1;
+	dmc->address = (uint16_t)((dmc->address + 1) | 0x8000);
+	apu->stall += APU_DMC_STALL;
+	apu->dmc_reads++;
+	if(--dmc->remaining == 0){
+		if(dmc->reg[0] & 0x40){
+			apu_dmc_restart(dmc);
+		} else if(dmc->reg[0] & 0x80){
+			dmc->irq = 1;
+		}
+	}
+}
+
+static inline void apu_clock_dmc(APU *apu){
+	APU_DMC *dmc = &apu->state.dmc;
+	if(!dmc->silence){
+		if(dmc->shift & 1){
+			dmc->output += dmc->output <= 125 ? 2 : 0;
+		} else {
+			dmc->output -= dmc->output >= 2 ? 2 : 0;
+		}
+	}
+	dmc->shift >>= 1;
+	if(dmc->bits <= 1){
+		dmc->bits = 8;
+		dmc->silence = !dmc->buffer_full;
+		dmc->shift = dmc->buffer;
+		dmc->buffer_full = 0;
+		apu_dmc_fetch(apu);
+	} else {
+		dmc->bits--;
+	}
+}
+
+static inline void apu_run_dmc(APU *apu, uint64_t from, uint64_t to){
+	APU_DMC *dmc = &apu->state.dmc;
+	unsigned period = apu->dmc_periods[dmc->reg[0] & 0x0F];
+	apu_output(apu, 4, from, APU_DMC_WEIGHT * dmc->output);
+
+	// Idle, which is most of the time: the bit counter's the only thing that moves.
+	if(dmc->silence && !dmc->buffer_full && dmc->remaining == 0){
+		uint32_t clocks = apu_run_timer(&dmc->timer, period, to - from);
+		unsigned bits = dmc->bits != 0 ? dmc->bits : 1;
+		dmc->bits = (uint8_t)((bits + 7 - clocks % 8) % 8 + 1);
+		return;
+	}
+
+	uint64_t time = from;
+	while(time + dmc->timer <= to){
+		time += dmc->timer;
+		dmc->timer = (uint16_t)period;
+		apu_clock_dmc(apu);
+		apu_output(apu, 4, time, APU_DMC_WEIGHT * dmc->output);
+	}
+	dmc->timer -= (uint16_t)(to - time);
+}
+
+static inline void apu_clock_quarter(APU *apu){
+	APU_STATE *s = &apu->state;
+	apu_clock_envelope(&s->pulse[0].envelope, s->pulse[0].reg[0]);
+	apu_clock_envelope(&s->pulse[1].envelope, s->pulse[1].reg[0]);
+	apu_clock_envelope(&s->noise.envelope, s->noise.reg[0]);
+
+	APU_TRIANGLE *triangle = &s->triangle;
+	if(triangle->linear_reload){
+		triangle->linear = triangle->reg[0] & 0x7F;
+	} else if(triangle->linear != 0){
+		triangle->linear--;
+	}
+	if(!(triangle->reg[0] & 0x80)){
+		triangle->linear_reload = 0;
+	}
+}
+
+static inline void apu_clock_half(APU *apu){
+	APU_STATE *s = &apu->state;
+	for(unsigned i = 0; i < 2; i++){
+		APU_PULSE *pulse = &s->pulse[i];
+		if(!(pulse->reg[0] & 0x20) && pulse->length != 0){
+			pulse->length--;
+		}
+
+		int target = apu_sweep_target(pulse, i);
+		if(pulse->sweep_divider == 0 && (pulse->reg[1] & 0x80) && (pulse->reg[1] & 7) && pulse->period >= 8 && target >= 0
+			&& target <= 0x7FF){
+			pulse->period = (uint16_t)target;
+		}
+		if(pulse->sweep_divider == 0 || pulse->sweep_reload){
+			pulse->sweep_divider = pulse->reg[1] >> 4 & 7;
+			pulse->sweep_reload = 0;
+		} else {
+			pulse->sweep_divider--;
+		}
+	}
+	if(!(s->triangle.reg[0] & 0x80) && s->triangle.length != 0){
+		s->triangle.length--;
+	}
+	if(!(s->noise.reg[0] & 0x20) && s->noise.length != 0){
+		s->noise.length--;
+	}
+}
+
+// The frame counter's next step, as an index into its sequence.
+static inline unsigned apu_next_step(const APU *apu){
+	const uint32_t *steps = apu->steps[apu->state.mode & 1];
+	unsigned step = 0;
+	while(step < 4 && steps[step] <= apu->state.sequencer){
+		step++;
+	}
+	return step;
+}
+
+static inline void apu_run_channels(APU *apu, uint64_t from, uint64_t to){
+	apu_run_pulse(apu, 0, from, to);
+	apu_run_pulse(apu, 1, from, to);
+	apu_run_triangle(apu, from, to);
+	apu_run_noise(apu, from, to);
+	apu_run_dmc(apu, from, to);
+}
+
+// Brings the APU up to CPU cycle 'cycle'. Asking for a cycle it's already past does nothing.
+static inline void apu_catch_up(APU *apu, uint64_t cycle){
+	APU_STATE *s = &apu->state;
+	if(cycle <= s->cycles){
+		return;
+	}
+	apu->catch_ups++;
+
+	// The channels only change how they sound on a frame counter step (or a register write, which is where
+	// we've been caught up to), so they can each be run in one go from one step to the next.
+	while(s->cycles < cycle){
+		unsigned step = apu_next_step(apu);
+		uint32_t at = apu->steps[s->mode & 1][step];
+		uint64_t until = s->cycles + (at > s->sequencer ? at - s->sequencer : 0);
+		uint64_t to = until < cycle ? until : cycle;
+		apu_run_channels(apu, s->cycles, to);
+		s->sequencer += (uint32_t)(to - s->cycles);
+		s->cycles = to;
+		if(to != until){
+			break;
+		}
+
+		uint8_t actions = apu_step_actions[s->mode & 1][step];
+		if(actions & APU_QUARTER){
+			apu_clock_quarter(apu);
+		}
+		if(actions & APU_HALF){
+			apu_clock_half(apu);
+		}
+		if((actions & APU_IRQ) && !s->irq_inhibit){
+			s->frame_irq = 1;
+		}
+		if(actions & APU_END){
+			s->sequencer = 0;
+		}
+	}
+}
+
+// Whether the APU is holding the CPU's IRQ line up.
+static inline bool apu_irq(const APU *apu){
+	return apu->state.frame_irq | apu->state.dmc.irq;
+}
+
+// The CPU cycle of the DMC's 'n'th sample read from where it's got to, counting from 1, or UINT64_MAX if it
+// hasn't that many left. A byte is read every time the one being played runs out, which is every 8 of its
+// clocks, the first once the bits left in the current one have gone.
+static inline uint64_t apu_dmc_read_time(const APU *apu, unsigned n){
+	const APU_DMC *dmc = &apu->state.dmc;
+	if(n == 0 || n > dmc->remaining){
+		return UINT64_MAX;
+	}
+	uint64_t period = apu->dmc_periods[dmc->reg[0] & 0x0F], bits = dmc->bits != 0 ? dmc->bits : 1;
+	// A timer of 0 (only ever at power on) clocks on the cycle the APU's at, which the next catch up does.
+	unsigned timer = dmc->timer != 0 ? dmc->timer : 1;
+	return apu->state.cycles + timer + (bits - 1 + (n - 1) * 8ull) * period;
+}
+
+static inline uint64_t apu_next_dmc_read(const APU *apu){
+	return apu_dmc_read_time(apu, 1);
+}
+
+// The CPU cycle the IRQ line next goes up by itself, as things stand, or UINT64_MAX if nothing's going to raise
+// it: the end of the 4 step sequence unless the frame interrupt's inhibited, or the DMC reading its last byte
+// if it's set to interrupt then rather than loop.
+static inline uint64_t apu_next_irq(const APU *apu){
+	const APU_STATE *s = &apu->state;
+	uint64_t next = UINT64_MAX;
+	if(s->mode == 0 && !s->irq_inhibit){
+		const uint32_t *steps = apu->steps[0];
+		// Past the step that raises it, the sequence has to start again first.
+		uint32_t at = s->sequencer < steps[3] ? steps[3] - s->sequencer : steps[4] - s->sequencer + steps[3];
+		next = s->cycles + at;
+	}
+	if((s->dmc.reg[0] & 0xC0) == 0x80){
+		uint64_t dmc = apu_dmc_read_time(apu, s->dmc.remaining);
+		next = dmc < next ? dmc : next;
+	}
+	return next;
+}
+
+// Hands over the cycles the DMC's reads have taken since the last time, for the CPU to sit out.
+static inline unsigned apu_take_stall(APU *apu){
+	unsigned stall = apu->stall;
+	apu->stall = 0;
+	apu->stalled += stall;
+	return stall;
+}
+
+// $4015. Reading it acknowledges the frame interrupt.
+static inline uint8_t apu_read_status(APU *apu){
+	APU_STATE *s = &apu->state;
+	uint8_t status = (uint8_t)((s->pulse[0].length != 0) | (s->pulse[1].length != 0) << 1 | (s->triangle.length != 0) << 2
+		| (s->noise.length != 0) << 3);
+	status |= s->dmc.remaining != 0 ? APU_STATUS_DMC : 0;
+	status |= s->frame_irq ? APU_STATUS_FRAME_IRQ : 0;
+	status |= s->dmc.irq ? APU_STATUS_DMC_IRQ : 0;
+	s->frame_irq = 0;
+	return status;
+}
+
+// $4000-$4013, $4015 and $4017. The APU has to have been caught up to the write already.
+static inline void apu_write_register(APU *apu, uint16_t address, uint8_t value){
+	APU_STATE *s = &apu->state;
+	unsigned reg = address & 3;
+	if(address <= 0x4007){
+		APU_PULSE *pulse = &s->pulse[(address - 0x4000) >> 2];
+		pulse->reg[reg] = value;
+		switch(reg){
+			case 1:
+				pulse->sweep_reload = 1;
+				break;
+			case 2:
+				pulse->period = (uint16_t)((pulse->period & 0x700) | value);
+				break;
+			case 3:
+				pulse->period = (uint16_t)((pulse->period & 0xFF) | (value & 7) << 8);
+				if(s->enabled & (1 << ((address - 0x4000) >> 2))){
+					pulse->length = apu_lengths[value >> 3];
+				}
+				pulse->step = 0;
+				pulse->envelope.start = 1;
+				break;
+		}
+	} else if(address <= 0x400B){
+		APU_TRIANGLE *triangle = &s->triangle;
+		triangle->reg[reg] = value;
+		if(reg == 2){
+			triangle->period = (uint16_t)((triangle->period & 0x700) | value);
+		} else if(reg == 3){
+			triangle->period = (uint16_t)((triangle->period & 0xFF) | (value & 7) << 8);
+			if(s->enabled & 4){
+				triangle->length = apu_lengths[value >> 3];
+			}
+			triangle->linear_reload = 1;
+		}
+	} else if(address <= 0x400F){
+		APU_NOISE *noise = &s->noise;
+		noise->reg[reg] = value;
+		if(reg == 3){
+			if(s->enabled & 8){
+				noise->length = apu_lengths[value >> 3];
+			}
+			noise->envelope.start = 1;
+		}
+	} else if(address <= 0x4013){
+		APU_DMC *dmc = &s->dmc;
+		dmc->reg[reg] = value;
+		if(reg == 0 && !(value & 0x80)){
+			dmc->irq = 0;
+		} else if(reg == 1){
+			dmc->output = value & 0x7F;
+		}
+	} else if(address == 0x4015){
+		s->enabled = value & 0x0F;
+		s->pulse[0].length = value & 1 ? s->pulse[0].length : 0;
+		s->pulse[1].length = value & 2 ? s->pulse[1].length : 0;
+		s->triangle.length = value & 4 ? s->triangle.length : 0;
+		s->noise.length = value & 8 ? s->noise.length : 0;
+		s->dmc.irq = 0;
+		if(!(value & APU_STATUS_DMC)){
+			s->dmc.remaining = 0;
+		} else if(s->dmc.remaining == 0){
+			apu_dmc_restart(&s->dmc);
+			apu_dmc_fetch(apu);
+		}
+	} else if(address == 0x4017){
+		// The real one waits 3 or 4 cycles before restarting the sequence, which we don't bother with.
+		s->mode = value >> 7;
+		s->irq_inhibit = value >> 6 & 1;
+		s->frame_irq = s->irq_inhibit ? 0 : s->frame_irq;
+		s->sequencer = 0;
+		if(s->mode){
+			apu_clock_quarter(apu);
+			apu_clock_half(apu);
+		}
+	}
+}
+
+// Catches up to CPU cycle 'cycle' and finishes the frame's sound there, or wherever the APU's got to if
+// that's later. The frame's samples can then be read with apu_read_samples.
+static inline void apu_end_frame(APU *apu, uint64_t cycle){
+	apu_catch_up(apu, cycle);
+	if(apu_synthesising(apu)){
+		blip_end_frame(apu->blip, apu->state.cycles - apu->frame_start);
+	}
+	apu->frame_start = apu->state.cycles;
+}
+
+static inline unsigned apu_samples_available(const APU *apu){
+	return apu->blip != NULL ? apu->blip->available : 0;
+}
+
+// Takes up to 'count' samples (16 bit mono) of finished frames. Returns how many there were.
+static inline unsigned apu_read_samples(APU *apu, int16_t *out, unsigned count){
+	return apu->blip != NULL ? blip_read(apu->blip, out, count, apu->volume) : 0;
+}
+
+// Puts the APU in 'state', as loaded from a savestate. Anything out of range is brought back into it, so a
+// damaged state can't make the channels misbehave. What's been synthesised stays, and carries on from the
+// new state's levels as if they'd just changed.
+static inline void apu_load_state(APU *apu, const APU_STATE *state){
+	APU_STATE *s = &apu->state;
+	*s = *state;
+	s->mode &= 1;
+	s->enabled &= 0x0F;
+	for(unsigned i = 0; i < 2; i++){
+		s->pulse[i].period &= 0x7FF;
+		s->pulse[i].step &= 7;
+	}
+	s->triangle.period &= 0x7FF;
+	s->triangle.step &= 31;
+	s->noise.lfsr = s->noise.lfsr & 0x7FFF ? s->noise.lfsr & 0x7FFF : 1;
+	s->dmc.output &= 0x7F;
+	s->dmc.bits = s->dmc.bits >= 1 && s->dmc.bits <= 8 ? s->dmc.bits : 8;
+	s->sequencer = s->sequencer < apu->steps[s->mode][4] ? s->sequencer : 0;
+	apu->frame_start = s->cycles;
+	apu->stall = 0;
+}
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef audio_out_h
+#define audio_out_h
+
+// Where the APU's samples go once a frame's worth have been synthesised (see apu.h). There are two places:
+//	- The sound card, through SDL2. SDL calls us back on its own audio thread whenever it wants more, and the
+//	  callback takes whatever's in the ring. If the ring's run dry the rest is silence, and if it's full when
+//	  the emulator adds to it the new samples are dropped; both are counted. Nothing on the emulation thread
+//	  ever waits for the sound card. How full the ring is on average (the latency) is kept where it should be
+//	  by resampling slightly faster or slower, see rate_control.h, so neither should ever really happen.
+//	- A WAV file, which is what tests use, since it's the same samples every run. A thread of its own takes
+//	  samples from the ring and writes them out, the way the callback would. Here every sample matters, so if
+//	  the ring fills the emulator sleeps briefly and tries again (a stall) rather than dropping any.
+// Either way the two threads only share an AUDIO_RING (see audio_ring.h), so neither ever takes a lock.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifdef AGNT_SDL
+#include <SDL2/SDL.h>
+#endif
+
+#include "audio_ring.h"
+#include "log.h"
+#include "platform.h"
+
+#define AUDIO_DEFAULT_RATE 48000
+#define AUDIO_DEVICE_RING 8192 // Samples at least, a bit over 170ms at 48kHz...
+#define AUDIO_DEVICE_SLACK_MS 100 // ...or twice the latency and this much more, if that's longer.
+#define AUDIO_DEVICE_CALLBACK_MIN 64 // Samples SDL asks for at a time, a quarter of the latency or so.
+#define AUDIO_DEVICE_CALLBACK_MAX 1024
+#define AUDIO_WAV_RING 16384
+#define AUDIO_WAV_BLOCK 4096 // Most samples the writer takes for one write().
+#define AUDIO_WAIT_NS 250000 // How long each side sleeps when the other has to catch up.
+
+enum audio_sinks {
+	AUDIO_DEVICE,
+	AUDIO_WAV,
+};
+
+// 16 bit mono PCM. Written as it is in memory, so little endian everywhere we run.
+typedef struct {
+	char riff[4];
+	uint32_t riff_size; // Everything after this field.
+	char wave[4];
+	char fmt[4];
+	uint32_t fmt_size;
+	uint16_t format; // 1, PCM.
+	uint16_t channels;
+	uint32_t sample_rate;
+	uint32_t byte_rate;
+	uint16_t block_align;
+	uint16_t bits_per_sample;
+	char data[4];
+	uint32_t data_size;
+} WAV_HEADER;
+
+_Static_assert(sizeof(WAV_HEADER) == 44, "WAV_HEADER has padding in it");
+
+typedef struct {
+	enum audio_sinks sink;
+	AUDIO_RING *ring;
+	const LOGGER *logger;
+	unsigned sample_rate;
+
+	// AUDIO_WAV.
+	int fd;
+	pthread_t thread;
+	atomic_bool running; // Cleared to tell the writer to finish once the ring's empty.
+	atomic_bool failed;
+	int16_t *block; // The writer's.
+	uint64_t bytes_written; // Only touched by the writer until it's finished.
+	uint64_t writes;
+
+	// AUDIO_DEVICE.
+#ifdef AGNT_SDL
+	SDL_AudioDeviceID device;
+#endif
+	bool playing; // The callback's; not until the ring's up to the latency asked for, so it doesn't start on an underrun.
+	size_t start_fill;
+	atomic_ullong callbacks;
+	atomic_ullong underruns; // Samples of silence played because the ring was empty.
+
+	// Stats, the emulation thread's.
+	uint64_t samples_pushed;
+	uint64_t dropped; // Samples that didn't fit in the ring.
+	uint64_t stalls;
+} AUDIO_OUT;
+
+static inline void audio_sleep(long nanoseconds){
+	struct timespec ts = { 0, nanoseconds };
+	nanosleep(&ts, NULL);
+}
+
+static inline WAV_HEADER audio_wav_header(unsigned sample_rate, uint32_t data_size){
+	WAV_HEADER header;
+	memcpy(header.riff, "RIFF", 4);
+	header.riff_size = 36 + data_size;
+	memcpy(header.wave, "WAVE", 4);
+	memcpy(header.fmt, "fmt ", 4);
+	header.fmt_size = 16;
+	header.format = 1;
+	header.channels = 1;
+	header.sample_rate = sample_rate;
+	header.byte_rate = sample_rate * (uint32_t)sizeof(int16_t);
+	header.block_align = sizeof(int16_t);
+	header.bits_per_sample = 16;
+	memcpy(header.data, "data", 4);
+	header.data_size = data_size;
+	return header;
+}
+
+static inline bool audio_write_all(AUDIO_OUT *audio, const void *data, size_t length){
+	if(!platform_write_all(audio->fd, data, length, &audio->writes)){
+		log_message(audio->logger, LOG_ERROR, "Error: couldn't write audio. errno = %d\n", errno);
+		return false;
+	}
+	return true;
+}
+
+static inline void* audio_wav_writer(void *arg){
+	AUDIO_OUT *audio = (AUDIO_OUT*)arg;
+	for(;;){
+		// Looking at 'running' before the ring means nothing pushed before it was cleared can be missed.
+		bool running = atomic_load_explicit(&audio->running, memory_order_acquire);
+		size_t n = audio_ring_read(audio->ring, audio->block, AUDIO_WAV_BLOCK);
+		if(n != 0){
+			if(!audio_write_all(audio, audio->block, n * sizeof(int16_t))){
+				atomic_store(&audio->failed, true);
+				return NULL;
+			}
+			audio->bytes_written += n * sizeof(int16_t);
+		} else if(!running){
+			return NULL;
+		} else {
+			audio_sleep(AUDIO_WAIT_NS);
+		}
+	}
+}
+
+// Writes 'sample_rate' samples a second to a WAV file at 'path'. Returns NULL, having logged why, if it can't
+// be opened.
+static inline AUDIO_OUT* new_audio_wav(const char *path, unsigned sample_rate, const LOGGER *logger){
+	AUDIO_OUT *audio = (AUDIO_OUT*)calloc(1, sizeof(AUDIO_OUT));
+	if(audio == NULL){
+		return NULL;
+	}
+	audio->sink = AUDIO_WAV;
+	audio->logger = logger;
+	audio->sample_rate = sample_rate;
+	audio->ring = new_audio_ring(AUDIO_WAV_RING);
+	audio->block = (int16_t*)malloc(AUDIO_WAV_BLOCK * sizeof(int16_t));
+	audio->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	atomic_init(&audio->running, true);
+	atomic_init(&audio->failed, false);
+	atomic_init(&audio->callbacks, 0);
+	atomic_init(&audio->underruns, 0);
+	if(audio->fd < 0){
+		log_message(logger, LOG_ERROR, "Error: couldn't open %s for audio. errno = %d\n", path, errno);
+	}
+
+	// The sizes are filled in at the end, if the file can be seeked. If it can't (a FIFO) they're left at the
+	// most there could be, which is what anything reading a stream expects.
+	WAV_HEADER header = audio_wav_header(sample_rate, UINT32_MAX - 36);
+	if(audio->ring == NULL || audio->block == NULL || audio->fd < 0 || !audio_write_all(audio, &header, sizeof(header))
+		|| pthread_create(&audio->thread, NULL, audio_wav_writer, audio) != 0){
+		if(audio->fd >= 0){
+			close(audio->fd);
+		}
+		if(audio->ring != NULL){
+			destroy_audio_ring(audio->ring);
+		}
+		free(audio->block);
+		free(audio);
+		return NULL;
+	}
+	audio->writes = 0; // The header doesn't count.
+	return audio;
+}
+
+#ifdef AGNT_SDL
+
+// SDL's audio thread. Anything the ring doesn't have is silence, and so is everything until it first fills up
+// to the latency.
+static inline void audio_device_callback(void *user, Uint8 *stream, int length){
+	AUDIO_OUT *audio = (AUDIO_OUT*)user;
+	size_t wanted = (size_t)length / sizeof(int16_t);
+	atomic_fetch_add_explicit(&audio->callbacks, 1, memory_order_relaxed);
+	if(!audio->playing){
+		if(audio_ring_fill(audio->ring) < audio->start_fill){
+			memset(stream, 0, (size_t)length);
+			return;
+		}
+		audio->playing = true;
+	}
+	size_t n = audio_ring_read(audio->ring, (int16_t*)stream, wanted);
+	if(n != wanted){
+		memset((int16_t*)stream + n, 0, (wanted - n) * sizeof(int16_t));
+		atomic_fetch_add_explicit(&audio->underruns, wanted - n, memory_order_relaxed);
+	}
+}
+
+#endif
+
+// Plays 'sample_rate' samples a second on the default sound card, with about 'latency_ms' of them queued.
+// Returns NULL, having logged why, if there isn't one, or this was built without SDL2.
+static inline AUDIO_OUT* new_audio_device(unsigned sample_rate, double latency_ms, const LOGGER *logger){
+#ifdef AGNT_SDL
+	AUDIO_OUT *audio = (AUDIO_OUT*)calloc(1, sizeof(AUDIO_OUT));
+	if(audio == NULL){
+		return NULL;
+	}
+	audio->sink = AUDIO_DEVICE;
+	audio->logger = logger;
+	size_t room = (size_t)((latency_ms * 2 + AUDIO_DEVICE_SLACK_MS) * sample_rate / 1000.0);
+	audio->ring = new_audio_ring(room > AUDIO_DEVICE_RING ? room : AUDIO_DEVICE_RING);
+	atomic_init(&audio->running, true);
+	atomic_init(&audio->failed, false);
+	atomic_init(&audio->callbacks, 0);
+	atomic_init(&audio->underruns, 0);
+	if(audio->ring == NULL){
+		free(audio);
+		return NULL;
+	}
+	if(SDL_InitSubSystem(SDL_INIT_AUDIO) != 0){
+		log_message(logger, LOG_WARNING, "Warning: couldn't start SDL audio, so there's no sound: %s\n", SDL_GetError());
+		destroy_audio_ring(audio->ring);
+		free(audio);
+		return NULL;
+	}
+
+	SDL_AudioSpec want, have;
+	SDL_zero(want);
+	want.freq = (int)sample_rate;
+	want.format = AUDIO_S16SYS;
+	want.channels = 1;
+	// Small enough callbacks that the ring's fill doesn't swing by much more than the latency each time.
+	want.samples = AUDIO_DEVICE_CALLBACK_MAX;
+	while(want.samples > AUDIO_DEVICE_CALLBACK_MIN && want.samples * 4000.0 > latency_ms * sample_rate){
+		want.samples >>= 1;
+	}
+	want.callback = audio_device_callback;
+	want.userdata = audio;
+	// Only the rate's allowed to change, the APU can make samples at any rate.
+	audio->device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+	if(audio->device == 0){
+		log_message(logger, LOG_WARNING, "Warning: couldn't open a sound card, so there's no sound: %s\n", SDL_GetError());
+		SDL_QuitSubSystem(SDL_INIT_AUDIO);
+		destroy_audio_ring(audio->ring);
+		free(audio);
+		return NULL;
+	}
+	audio->sample_rate = (unsigned)have.freq;
+	audio->start_fill = (size_t)(latency_ms * audio->sample_rate / 1000.0);
+	log_message(logger, LOG_INFO, "Playing sound with SDL's %s driver at %uHz, %u sample(s) a callback.\n",
+		SDL_GetCurrentAudioDriver(), audio->sample_rate, (unsigned)have.samples);
+	// Started here, before there's any emulation, so the emulation thread never has to call into SDL.
+	SDL_PauseAudioDevice(audio->device, 0);
+	return audio;
+#else
+	(void)sample_rate;
+	(void)latency_ms;
+	log_message(logger, LOG_WARNING, "Warning: built without SDL2, so there's no sound.\n");
+	return NULL;
+#endif
+}
+
+// Emulation thread side: hands over 'count' samples. Returns false if the WAV file couldn't be written, in
+// which case they're thrown away.
+static inline bool audio_out_push(AUDIO_OUT *audio, const int16_t *samples, size_t count){
+	audio->samples_pushed += count;
+	if(audio->sink == AUDIO_DEVICE){
+		audio->dropped += count - audio_ring_write(audio->ring, samples, count);
+		return true;
+	}
+
+	size_t written = audio_ring_write(audio->ring, samples, count);
+	while(written != count){
+		if(atomic_load_explicit(&audio->failed, memory_order_relaxed)){
+			return false;
+		}
+		audio->stalls++;
+		audio_sleep(AUDIO_WAIT_NS);
+		written += audio_ring_write(audio->ring, samples + written, count - written);
+	}
+	return !atomic_load_explicit(&audio->failed, memory_order_relaxed);
+}
+
+// Stops playing, or writes out what's left and finishes the file. The stats are all still there after this.
+// Returns false if anything failed to be written.
+static inline bool audio_out_finish(AUDIO_OUT *audio){
+	if(audio->sink == AUDIO_DEVICE){
+#ifdef AGNT_SDL
+		SDL_CloseAudioDevice(audio->device);
+		SDL_QuitSubSystem(SDL_INIT_AUDIO);
+#endif
+		return true;
+	}
+
+	atomic_store_explicit(&audio->running, false, memory_order_release);
+	pthread_join(audio->thread, NULL);
+	bool ok = !atomic_load(&audio->failed);
+	if(ok && lseek(audio->fd, 0, SEEK_SET) == 0){
+		uint32_t size = audio->bytes_written < UINT32_MAX - 36 ? (uint32_t)audio->bytes_written : UINT32_MAX - 36;
+		WAV_HEADER header = audio_wav_header(audio->sample_rate, size);
+		ok = audio_write_all(audio, &header, sizeof(header));
+		audio->writes--;
+	}
+	ok = close(audio->fd) == 0 && ok;
+	return ok;
+}
+
+// Only once it's finished.
+static inline void destroy_audio_out(AUDIO_OUT *audio){
+	destroy_audio_ring(audio->ring);
+	free(audio->block);
+	free(audio);
+}
+
+// Once it's finished, see audio_out_finish.
+static inline void print_audio_stats(const LOGGER *logger, const AUDIO_OUT *audio){
+	if(audio->sink == AUDIO_WAV){
+		log_message(logger, LOG_INFO, "Audio: %llu sample(s) at %uHz written in %llu write(s), %.1fMiB; %llu stall(s) waiting "
+			"for room.\n", (unsigned long long)(audio->bytes_written / sizeof(int16_t)), audio->sample_rate,
+			(unsigned long long)audio->writes, audio->bytes_written / 1048576.0, (unsigned long long)audio->stalls);
+	} else {
+		log_message(logger, LOG_INFO, "Audio: %llu sample(s) played at %uHz over %llu callback(s), %llu dropped with the "
+			"buffer full, %llu of silence with it empty.\n", (unsigned long long)audio->samples_pushed, audio->sample_rate,
+			(unsigned long long)atomic_load(&audio->callbacks), (unsigned long long)audio->dropped,
+			(unsigned long long)atomic_load(&audio->underruns));
+	}
+}
+
+#endif
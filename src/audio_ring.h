@@ -0,0 +1,91 @@
+#ifndef audio_ring_h
+#define audio_ring_h
+
+// Hands samples from the emulation thread to whatever's playing them (SDL's audio callback, or the WAV writer,
+// see audio_out.h), without a lock. There's exactly one writer and one reader. Each owns one end of the ring
+// and only ever stores to its own index, so an atomic load of the other side's index is all the
+// synchronisation there is. Neither side ever waits: a write into a full ring writes what fits and a read from
+// an empty one reads what's there, and it's up to the caller what to do about the rest.
+//
+// The indices count samples since the start and are only wrapped when they're used, so full and empty
+// can't be mistaken for each other.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define AUDIO_RING_CACHE_LINE 64
+
+typedef struct {
+	int16_t *samples;
+	size_t capacity; // A power of two.
+
+	// Each side's index is on its own cache line, like the triple buffer's.
+	_Alignas(AUDIO_RING_CACHE_LINE) atomic_size_t head; // The writer's: samples written so far.
+	_Alignas(AUDIO_RING_CACHE_LINE) atomic_size_t tail; // The reader's: samples read so far.
+} AUDIO_RING;
+
+static inline void destroy_audio_ring(AUDIO_RING *ring){
+	free(ring->samples);
+	free(ring);
+}
+
+// Room for at least 'capacity' samples. Returns NULL if out of memory.
+static inline AUDIO_RING* new_audio_ring(size_t capacity){
+	AUDIO_RING *ring = (AUDIO_RING*)aligned_alloc(AUDIO_RING_CACHE_LINE, sizeof(AUDIO_RING));
+	if(ring == NULL){
+		return NULL;
+	}
+	memset(ring, 0, sizeof(AUDIO_RING));
+	ring->capacity = 1;
+	while(ring->capacity < capacity){
+		ring->capacity <<= 1;
+	}
+	ring->samples = (int16_t*)calloc(ring->capacity, sizeof(int16_t));
+	if(ring->samples == NULL){
+		free(ring);
+		return NULL;
+	}
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return ring;
+}
+
+// Samples waiting to be read. Either side can ask, though the answer's only exact on the writer's side if
+// it's about to write, or the reader's if it's about to read.
+static inline size_t audio_ring_fill(AUDIO_RING *ring){
+	return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+// Writer side. Copies in as many of 'count' samples as there's room for, and returns how many that was.
+static inline size_t audio_ring_write(AUDIO_RING *ring, const int16_t *samples, size_t count){
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t room = ring->capacity - (head - tail);
+	size_t n = count < room ? count : room;
+
+	size_t at = head & (ring->capacity - 1);
+	size_t first = n < ring->capacity - at ? n : ring->capacity - at;
+	memcpy(ring->samples + at, samples, first * sizeof(int16_t));
+	memcpy(ring->samples, samples + first, (n - first) * sizeof(int16_t));
+	atomic_store_explicit(&ring->head, head + n, memory_order_release);
+	return n;
+}
+
+// Reader side. Copies out up to 'count' samples, and returns how many there were.
+static inline size_t audio_ring_read(AUDIO_RING *ring, int16_t *samples, size_t count){
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t n = count < head - tail ? count : head - tail;
+
+	size_t at = tail & (ring->capacity - 1);
+	size_t first = n < ring->capacity - at ? n : ring->capacity - at;
+	memcpy(samples, ring->samples + at, first * sizeof(int16_t));
+	memcpy(samples + first, ring->samples, (n - first) * sizeof(int16_t));
+	atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+	return n;
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef battery_h
+#define battery_h
+
+// Saving battery backed RAM to its .sav file. Games use that RAM as ordinary work RAM as well, so it changes
+// nearly every frame, and a save (write a temporary file, fsync it, rename it over the real one, fsync the
+// directory) can easily take longer than a frame. So the emulation thread never does the writing while a game
+// runs: battery_queue compares the RAM against the last copy handed over, and if it's changed copies it into
+// 'saved' and wakes a thread of our own to write that out. It never waits. If the thread's still busy with the
+// last one it just tries again next time.
+//
+// battery_flush is the other way, for exit and when the program asks (agnt_flush_battery): it waits for the
+// thread and then writes whatever's changed itself, so when it returns the save is on disk.
+//
+// Errors are noticed by the thread but only reported on the emulation thread, at the next queue or flush, since
+// the logger isn't ours to call from anywhere else. A failed save is retried until one works.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "log.h"
+#include "platform.h"
+
+typedef struct {
+	char *path;
+	char *tmp_path; // path with ".tmp" on the end, written first and then renamed over it.
+	char *dir_path; // Where path is, which is fsynced after the rename so the rename itself is on disk.
+	size_t size;
+	uint8_t *saved; // The contents as of the last save handed over. The thread's while 'pending' is set.
+	const LOGGER *logger;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake; // Something to write, or time to stop.
+	pthread_cond_t idle; // Finished writing.
+	atomic_bool pending; // 'saved' is waiting to be written, or being written.
+	bool stop;
+	int error; // errno from the last save that failed, 0 if it worked. Under 'lock'.
+	bool retry; // The emulation thread's. The last save failed, so the next has to happen whatever's changed.
+} BATTERY;
+
+// Writes 'size' bytes of 'data' to battery->path, so that a crash at any point leaves either the old save or the
+// new one, never half of each. Returns 0 if it worked, or errno if not.
+static inline int battery_write(BATTERY *battery, const uint8_t *data, size_t size){
+	int error = 0;
+	uint64_t writes = 0;
+	int fd = open(battery->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0){
+		return errno;
+	}
+	if(!platform_write_all(fd, data, size, &writes) || fsync(fd) != 0){
+		error = errno;
+	}
+	if(close(fd) != 0 && error == 0){
+		error = errno;
+	}
+	if(error == 0 && rename(battery->tmp_path, battery->path) != 0){
+		error = errno;
+	}
+	if(error != 0){
+		remove(battery->tmp_path);
+		return error;
+	}
+
+	int dir = open(battery->dir_path, O_RDONLY | O_DIRECTORY);
+	if(dir < 0){
+		return errno;
+	}
+	if(fsync(dir) != 0){
+		error = errno;
+	}
+	close(dir);
+	return error;
+}
+
+static inline void* battery_writer(void *arg){
+	BATTERY *battery = (BATTERY*)arg;
+	pthread_mutex_lock(&battery->lock);
+	for(;;){
+		while(!atomic_load(&battery->pending) && !battery->stop){
+			pthread_cond_wait(&battery->wake, &battery->lock);
+		}
+		if(!atomic_load(&battery->pending)){
+			break;
+		}
+		pthread_mutex_unlock(&battery->lock);
+		int error = battery_write(battery, battery->saved, battery->size);
+		pthread_mutex_lock(&battery->lock);
+		battery->error = error;
+		atomic_store(&battery->pending, false);
+		pthread_cond_broadcast(&battery->idle);
+	}
+	pthread_mutex_unlock(&battery->lock);
+	return NULL;
+}
+
+// Saves 'size' bytes of battery backed RAM to 'path'. 'ram' is what's in the file now (after loading it, or all
+// zeroes if there wasn't one), and if 'write_now' is set that's saved straight away, so that a save that can't
+// be made is found out about now rather than the first time the game writes to it. Returns NULL, having logged
+// why, if the thread can't be started.
+static inline BATTERY* new_battery(const char *path, const uint8_t *ram, size_t size, bool write_now, const LOGGER *logger){
+	BATTERY *battery = (BATTERY*)calloc(1, sizeof(BATTERY));
+	if(battery == NULL){
+		return NULL;
+	}
+	size_t path_len = strlen(path);
+	battery->path = (char*)malloc(path_len + 1);
+	battery->tmp_path = (char*)malloc(path_len + 5);
+	battery->saved = (uint8_t*)malloc(size);
+	const char *slash = strrchr(path, '/');
+	size_t dir_len = slash == NULL ? 1 : (slash == path ? 1 : (size_t)(slash - path));
+	battery->dir_path = (char*)malloc(dir_len + 1);
+	if(battery->path == NULL || battery->tmp_path == NULL || battery->saved == NULL || battery->dir_path == NULL){
+		free(battery->path);
+		free(battery->tmp_path);
+		free(battery->saved);
+		free(battery->dir_path);
+		free(battery);
+		return NULL;
+	}
+	memcpy(battery->path, path, path_len + 1);
+	memcpy(battery->tmp_path, path, path_len);
+	memcpy(battery->tmp_path + path_len, ".tmp", 5);
+	memcpy(battery->dir_path, slash == NULL ? "." : path, dir_len);
+	battery->dir_path[dir_len] = '\0';
+	memcpy(battery->saved, ram, size);
+	battery->size = size;
+	battery->logger = logger;
+	pthread_mutex_init(&battery->lock, NULL);
+	pthread_cond_init(&battery->wake, NULL);
+	pthread_cond_init(&battery->idle, NULL);
+	atomic_init(&battery->pending, false);
+
+	if(write_now){
+		battery->error = battery_write(battery, battery->saved, size);
+		if(battery->error != 0){
+			log_message(logger, LOG_WARNING, "Warning: failed to save battery to %s. errno = %d\n", path, battery->error);
+			battery->error = 0;
+			battery->retry = true;
+		}
+	}
+
+	if(pthread_create(&battery->thread, NULL, battery_writer, battery) != 0){
+		log_message(logger, LOG_WARNING, "Warning: couldn't start the battery saver, so %s won't be saved.\n", path);
+		pthread_cond_destroy(&battery->idle);
+		pthread_cond_destroy(&battery->wake);
+		pthread_mutex_destroy(&battery->lock);
+		free(battery->path);
+		free(battery->tmp_path);
+		free(battery->saved);
+		free(battery->dir_path);
+		free(battery);
+		return NULL;
+	}
+	return battery;
+}
+
+// Reports the last background save if it failed, which means the next one has to happen regardless. Only while
+// the thread isn't writing.
+static inline void battery_check(BATTERY *battery){
+	pthread_mutex_lock(&battery->lock);
+	int error = battery->error;
+	battery->error = 0;
+	pthread_mutex_unlock(&battery->lock);
+	if(error != 0){
+		log_message(battery->logger, LOG_WARNING, "Warning: failed to save battery to %s. errno = %d\n", battery->path, error);
+		battery->retry = true;
+	}
+}
+
+// Emulation thread side: hands a copy of 'ram' to the thread to save if it's changed since the last one. Never
+// waits for the disk.
+static inline void battery_queue(BATTERY *battery, const uint8_t *ram){
+	if(atomic_load(&battery->pending)){
+		return;
+	}
+	battery_check(battery);
+	if(!battery->retry && memcmp(ram, battery->saved, battery->size) == 0){
+		return;
+	}
+	memcpy(battery->saved, ram, battery->size);
+	battery->retry = false;
+	pthread_mutex_lock(&battery->lock);
+	atomic_store(&battery->pending, true);
+	pthread_cond_signal(&battery->wake);
+	pthread_mutex_unlock(&battery->lock);
+}
+
+// Waits for any save in progress, then saves 'ram' here and now if it's changed. Returns false if either failed.
+static inline bool battery_flush(BATTERY *battery, const uint8_t *ram){
+	pthread_mutex_lock(&battery->lock);
+	while(atomic_load(&battery->pending)){
+		pthread_cond_wait(&battery->idle, &battery->lock);
+	}
+	pthread_mutex_unlock(&battery->lock);
+	battery_check(battery);
+	if(!battery->retry && memcmp(ram, battery->saved, battery->size) == 0){
+		return true;
+	}
+
+	memcpy(battery->saved, ram, battery->size);
+	int error = battery_write(battery, battery->saved, battery->size);
+	battery->retry = error != 0;
+	if(error != 0){
+		log_message(battery->logger, LOG_WARNING, "Warning: failed to save battery to %s. errno = %d\n", battery->path, error);
+	}
+	return error == 0;
+}
+
+// Doesn't save anything, battery_flush first if it should.
+static inline void destroy_battery(BATTERY *battery){
+	pthread_mutex_lock(&battery->lock);
+	battery->stop = true;
+	pthread_cond_signal(&battery->wake);
+	pthread_mutex_unlock(&battery->lock);
+	pthread_join(battery->thread, NULL);
+	pthread_cond_destroy(&battery->idle);
+	pthread_cond_destroy(&battery->wake);
+	pthread_mutex_destroy(&battery->lock);
+	free(battery->path);
+	free(battery->tmp_path);
+	free(battery->saved);
+	free(battery->dir_path);
+	free(battery);
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef blip_h
+#define blip_h
+
+// Band-limited synthesis, for turning the APU's square-edged waveforms into samples without the aliasing you'd
+// get from sampling them. Instead of producing a sample for every CPU cycle and filtering them down, each
+// channel only says when its output changes, and by how much. Each change is added into the sample buffer as a
+// band-limited step: a windowed sinc, precomputed for BLIP_PHASES positions between two samples, so a change
+// costs one vector multiply-add of BLIP_TAPS samples however fast the channel is running. The buffer holds the
+// differences between samples, which are summed back up when the samples are read out.
+//
+// Time is in clocks (CPU cycles, for the APU) from the start of the current frame. A frame can be any length,
+// as long as it fits in the buffer; ending it makes its samples available and starts the next one.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define BLIP_PHASE_BITS 5
+#define BLIP_PHASES (1 << BLIP_PHASE_BITS)
+#define BLIP_TAPS 16
+#define BLIP_FRACTION_BITS 32 // Sample positions are fixed point, with this many bits after the point.
+#define BLIP_CUTOFF 0.90 // Of the output's Nyquist frequency. Lower is duller but aliases less.
+#define BLIP_HIGHPASS_HZ 37.0 // The console's own output has a high-pass filter on it, roughly here, which stops DC building up.
+
+typedef float blip_taps __attribute__((vector_size(BLIP_TAPS * sizeof(float))));
+
+typedef struct {
+	blip_taps kernel[BLIP_PHASES];
+	float *buffer; // capacity + BLIP_TAPS differences.
+	unsigned capacity; // In samples.
+
+	double clock_rate;
+	double sample_rate;
+	uint64_t factor; // Samples per clock, fixed point.
+	uint64_t offset; // Where the current frame starts in the buffer, fixed point.
+	unsigned available; // Whole samples from finished frames, ready to read.
+
+	double sum; // Running total of the differences read so far, which is the unfiltered output.
+	double highpass; // The filter's idea of the DC level.
+	double highpass_k;
+} BLIP;
+
+static inline void blip_set_rates(BLIP *blip, double clock_rate, double sample_rate){
+	blip->clock_rate = clock_rate;
+	blip->sample_rate = sample_rate;
+	blip->factor = (uint64_t)(sample_rate / clock_rate * (double)(1ULL << BLIP_FRACTION_BITS) + 0.5);
+	blip->highpass_k = 1.0 - exp(-2.0 * M_PI * BLIP_HIGHPASS_HZ / sample_rate);
+}
+
+// Room for 'capacity' samples of finished frames, which is how many can be waiting to be read plus the
+// longest frame. Returns NULL if out of memory.
+static inline BLIP* new_blip(unsigned capacity, double clock_rate, double sample_rate){
+	BLIP *blip = (BLIP*)aligned_alloc(sizeof(blip_taps), sizeof(BLIP));
+	if(blip == NULL){
+		return NULL;
+	}
+	memset(blip, 0, sizeof(BLIP));
+	blip->buffer = (float*)calloc(capacity + BLIP_TAPS, sizeof(float));
+	if(blip->buffer == NULL){
+		free(blip);
+		return NULL;
+	}
+	blip->capacity = capacity;
+	blip_set_rates(blip, clock_rate, sample_rate);
+
+	// The step's derivative (an impulse) for each phase, with a Blackman window. Each phase is scaled to sum to
+	// exactly 1, so once the differences are summed back up a step of 'delta' really does move the output by
+	// 'delta', and nothing drifts.
+	for(unsigned phase = 0; phase < BLIP_PHASES; phase++){
+		float taps[BLIP_TAPS];
+		double total = 0;
+		for(unsigned i = 0; i < BLIP_TAPS; i++){
+			double x = (double)i - (BLIP_TAPS / 2 - 1) - (double)phase / BLIP_PHASES;
+			double window = 0.42 + 0.5 * cos(2 * M_PI * x / BLIP_TAPS) + 0.08 * cos(4 * M_PI * x / BLIP_TAPS);
+			double sinc = x == 0 ? 1.0 : sin(M_PI * BLIP_CUTOFF * x) / (M_PI * BLIP_CUTOFF * x);
+			taps[i] = (float)(sinc * window);
+			total += taps[i];
+		}
+		for(unsigned i = 0; i < BLIP_TAPS; i++){
+			taps[i] = (float)(taps[i] / total);
+		}
+		memcpy(&blip->kernel[phase], taps, sizeof(taps));
+	}
+	return blip;
+}
+
+static inline void destroy_blip(BLIP *blip){
+	free(blip->buffer);
+	free(blip);
+}
+
+// The longest a frame can be, in clocks, with the samples that are waiting to be read still in the buffer.
+static inline uint64_t blip_max_clocks(const BLIP *blip){
+	uint64_t room = ((uint64_t)blip->capacity << BLIP_FRACTION_BITS) - blip->offset;
+	return room / blip->factor;
+}
+
+// The output changes by 'delta' at clock 'time' of the current frame. Anything past the end of the buffer is
+// dropped, which only happens if a frame is far longer than it was sized for.
+static inline void blip_add_delta(BLIP *blip, uint64_t time, float delta){
+	uint64_t position = blip->offset + time * blip->factor;
+	uint64_t index = position >> BLIP_FRACTION_BITS;
+	if(index >= blip->capacity){
+		return;
+	}
+	unsigned phase = (unsigned)(position >> (BLIP_FRACTION_BITS - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1);
+	blip_taps samples;
+	memcpy(&samples, blip->buffer + index, sizeof(samples));
+	samples += blip->kernel[phase] * delta;
+	memcpy(blip->buffer + index, &samples, sizeof(samples));
+}
+
+// Ends the current frame 'clocks' clocks after it started. Its samples can then be read.
+static inline void blip_end_frame(BLIP *blip, uint64_t clocks){
+	blip->offset += clocks * blip->factor;
+	uint64_t limit = (uint64_t)blip->capacity << BLIP_FRACTION_BITS;
+	blip->offset = blip->offset < limit ? blip->offset : limit;
+	blip->available = (unsigned)(blip->offset >> BLIP_FRACTION_BITS);
+}
+
+// Reads up to 'count' finished samples into 'out', scaled by 'volume' and clipped to 16 bits. Returns how
+// many there were.
+static inline unsigned blip_read(BLIP *blip, int16_t *out, unsigned count, float volume){
+	count = count < blip->available ? count : blip->available;
+	double sum = blip->sum;
+	double highpass = blip->highpass;
+	for(unsigned i = 0; i < count; i++){
+		sum += blip->buffer[i];
+		highpass += (sum - highpass) * blip->highpass_k;
+		double sample = (sum - highpass) * volume * 32767.0;
+		out[i] = (int16_t)(sample > 32767.0 ? 32767 : sample < -32768.0 ? -32768 : lrint(sample));
+	}
+	blip->sum = sum;
+	blip->highpass = highpass;
+
+	// Move what's left (including the tails of steps near the end) down to the start.
+	unsigned remaining = blip->capacity + BLIP_TAPS - count;
+	memmove(blip->buffer, blip->buffer + count, remaining * sizeof(float));
+	memset(blip->buffer + remaining, 0, count * sizeof(float));
+	blip->offset -= (uint64_t)count << BLIP_FRACTION_BITS;
+	blip->available -= count;
+	return count;
+}
+
+#endif
@@ -6,8 +6,15 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 // FIXME platform-dependent file I/O
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "platform.h"
 
 enum ROM_types {
 	iNES,
@@ -31,11 +38,26 @@ enum timing_modes {
 	UA6538  // "Dendy"
 };
 
-// TODO support alternate mode of file read/writes instead of caching the entire ROM in memory for low RAM usage (at the cost of significant latency)
+// How the ROM image gets into memory.
+enum cart_load_modes {
+	// Mapped read-only, with every page read in up front (MAP_POPULATE where there is one, otherwise the kernel's
+	// asked to read it all ahead of time, which it may not). Every emulator instance running the same ROM shares
+	// the same page cache pages, and there's no copy at startup.
+	CART_LOAD_MMAP,
+	// Mapped read-only, but nothing is read until it's touched and the kernel is told to expect random access,
+	// so only the PRG/CHR banks the game actually uses are ever resident (and can be dropped again under
+	// memory pressure, since they're clean). For constrained hosts, at the cost of page faults on first use of a bank.
+	CART_LOAD_STREAMING,
+	// Copied into a heap buffer. Used when the file can't be mapped, e.g. if it's a pipe.
+	CART_LOAD_COPY
+};
+
 typedef struct {
 	uint8_t *ROM_contents;
 	enum ROM_types type;
 	size_t filesize;
+	enum cart_load_modes load_mode;
+	double load_time; // Seconds spent in new_cart, for reporting.
 	
 	// Info. Note that the two ROM_len values here are masked to 0xFF if we're using an iNES rom.	
 	uint16_t PRG_ROM_len; // *16,384 (16KiB units)
@@ -63,40 +85,107 @@ typedef struct {
 	bool bus_conflicts_specified;
 	bool PRG_RAM_present;
 	bool uncertain_type;
+
+	LOGGER logger; // Where warnings about this cart (and from the mapper/MMU running it) go.
 } CART;
 
-CART* new_cart(const char *ROM_image){
-	// Try to open and load the image into memory. We won't worry about flags just yet,
-	// we'll just load the entire file into memory and then work it out.
-	FILE *fp = fopen(ROM_image, "r");
+static void cart_release_contents(CART *cart){
+	if(cart->load_mode == CART_LOAD_COPY){
+		free(cart->ROM_contents);
+	} else {
+		munmap(cart->ROM_contents, cart->filesize);
+	}
+}
+
+// Reads the whole file into a heap buffer, for when mapping it isn't an option.
+static uint8_t* cart_read_contents(FILE *fp, size_t *filesize){
+	size_t capacity = 0x10000, len = 0;
+	uint8_t *contents = (uint8_t*)malloc(sizeof(uint8_t)*capacity); // Redundancy!
+	size_t read_len;
+	while((read_len = fread(contents + len, sizeof(uint8_t), capacity - len, fp)) != 0){
+		len += read_len;
+		if(len == capacity){
+			capacity *= 2;
+			contents = (uint8_t*)realloc(contents, capacity);
+		}
+	}
+
+	*filesize = len;
+	return contents;
+}
 
-	if(fp == NULL){
-		fprintf(stderr, "Fatal: failed to open file. errno = %d\n", errno);
+// Whether 'banks' of PRG ROM, which there has to be at least one of, fit in the file after the header (and
+// trainer). Every mapper works out PRG banks modulo how many there are and the reset vector's in the last one,
+// so a cart where they don't can't be run.
+static inline bool cart_prg_rom_fits(const CART *cart, uint16_t banks){
+	size_t start = cart->trainer_present ? 16 + 512 : 16;
+	return banks != 0 && start + (size_t)banks * 0x4000 <= cart->filesize;
+}
+
+// 'logger' can be NULL, in which case nothing is reported, not even why loading failed.
+static inline CART* new_cart_mode(const char *ROM_image, enum cart_load_modes mode, const LOGGER *logger){
+	// Try to get the image into memory. We won't worry about flags just yet, we'll just get at the
+	// entire file and then work it out.
+	double start = platform_now();
+	int fd = open(ROM_image, O_RDONLY);
+
+	if(fd == -1){
+		log_message(logger, LOG_ERROR, "Fatal: failed to open file. errno = %d\n", errno);
 		return NULL;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	size_t filesize = ftell(fp);
-	rewind(fp);
+	// calloc, since not every field is set for every ROM type.
+	CART* out = (CART*)calloc(1, sizeof(CART));
+	out->ROM_contents = NULL;
+	out->load_mode = mode;
+	if(logger != NULL){
+		out->logger = *logger;
+	}
+
+	struct stat st;
+	if(mode != CART_LOAD_COPY && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+		out->filesize = st.st_size;
+		int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+		if(mode == CART_LOAD_MMAP){
+			// Fault the whole thing in now rather than on the first access to each bank.
+			flags |= MAP_POPULATE;
+		}
+#endif
+		void *mapping = mmap(NULL, out->filesize, PROT_READ, flags, fd, 0);
+		if(mapping != MAP_FAILED){
+			out->ROM_contents = (uint8_t*)mapping;
+			if(mode == CART_LOAD_MMAP){
+				// Only a hint. Without MAP_POPULATE it's the best there is.
+				posix_madvise(mapping, out->filesize, POSIX_MADV_WILLNEED);
+			} else {
+				posix_madvise(mapping, out->filesize, POSIX_MADV_RANDOM);
+			}
+		}
+	}
 
-	CART* out = (CART*)malloc(sizeof(CART));
-	out->ROM_contents = (uint8_t*)malloc(sizeof(uint8_t)*filesize); // Redundancy!
-	out->filesize = filesize;
-	size_t read_len = fread(out->ROM_contents, sizeof(uint8_t), filesize, fp);
-	if(read_len == 0){
-		fprintf(stderr, "Fatal: failed to read file. errno = %d\n", errno);
+	if(out->ROM_contents == NULL){
+		out->load_mode = CART_LOAD_COPY;
+		FILE *fp = fdopen(fd, "rb");
+		out->ROM_contents = cart_read_contents(fp, &out->filesize);
 		fclose(fp);
-		free(out->ROM_contents);
+	} else {
+		close(fd);
+	}
+
+	if(out->filesize < 16){
+		log_message(logger, LOG_ERROR, "Fatal: failed to read file, or file is too short to be a ROM. errno = %d\n", errno);
+		cart_release_contents(out);
 		free(out);
 		return NULL;
 	}
 
-	fclose(fp);
+	size_t filesize = out->filesize;
 	// Now we get to read the ROM header! The first 4 bytes should be 0x4E 0x45 0x53 0x1A. If not,
 	// it's not a valid ROM.
 	if(*(uint32_t*)out->ROM_contents != 0x1A53454E){
-		fprintf(stderr, "Fatal: ROM is not valid: missing magic number.\n");
-		free(out->ROM_contents);
+		log_message(logger, LOG_ERROR, "Fatal: ROM is not valid: missing magic number.\n");
+		cart_release_contents(out);
 		free(out);
 		return NULL;
 	}
@@ -157,7 +246,7 @@ CART* new_cart(const char *ROM_image){
 	}
 
 	if(out->uncertain_type){
-		printf("Warning: Could not definitively determine ROM format. Errors may occur.\n");
+		log_message(logger, LOG_WARNING, "Warning: Could not definitively determine ROM format. Errors may occur.\n");
 	}
 
 	// Now we know the type of ROM we're dealing with, so we can proceed with the rest of the flags in the header.
@@ -194,9 +283,9 @@ CART* new_cart(const char *ROM_image){
 
 		if(filesize < filesize_pred){
 			// Error
-			printf("Fatal: NES2 override bit set, but stated ROM size exceeded filesize. ROM is likely corrupt.\n");
+			log_message(logger, LOG_ERROR, "Fatal: NES2 override bit set, but stated ROM size exceeded filesize. ROM is likely corrupt.\n");
 			
-			free(out->ROM_contents);
+			cart_release_contents(out);
 			free(out);
 			return NULL;
 		} else {
@@ -253,33 +342,85 @@ CART* new_cart(const char *ROM_image){
 		switch(out->ROM_contents[10] & 3){
 			case 0:
 				if(out->timing_type != RP2C02){
-					printf("Warning: 9th byte of ROM header specified PAL, but 10th byte specified NTSC. Defaulting to NTSC. Use the '--override-tv-format' flag if the ROM behaves strangely.\n");
+					log_message(logger, LOG_WARNING, "Warning: 9th byte of ROM header specified PAL, but 10th byte specified NTSC. Defaulting to NTSC. Use the '--override-tv-format' flag if the ROM behaves strangely.\n");
 					out->timing_type = RP2C02;
 				}
 				break;
 			case 2:
 				if(out->timing_type != RP2C07){
-					printf("Warning: 9th byte of ROM header specified NTSC, but 10th byte specified PAL. Defaulting to NTSC. Use the '--override-tv-format' flag if the ROM behaves strangely.\n");
+					log_message(logger, LOG_WARNING, "Warning: 9th byte of ROM header specified NTSC, but 10th byte specified PAL. Defaulting to NTSC. Use the '--override-tv-format' flag if the ROM behaves strangely.\n");
 				}
 				out->timing_type = RP2C07;
 				break;
 			default:
-				printf("Warning: NTSC/PAL cross-compatible ROM found, defaulting to NTSC. Use the '--override-tv-format' flag if the ROM behaves strangely.\n");
+				log_message(logger, LOG_WARNING, "Warning: NTSC/PAL cross-compatible ROM found, defaulting to NTSC. Use the '--override-tv-format' flag if the ROM behaves strangely.\n");
 				out->timing_type = RP2C02;
 		}
 
 		out->mapper &= 0xFF;
 	}
 
+	if(!cart_prg_rom_fits(out, out->PRG_ROM_len)){
+		size_t start = out->trainer_present ? 16 + 512 : 16;
+		log_message(logger, LOG_ERROR, "Fatal: ROM header states %u PRG ROM bank(s), but there must be at least one and "
+			"the file only has room for %zu.\n", (unsigned)out->PRG_ROM_len, out->filesize > start ? (out->filesize - start) / 0x4000 : 0);
+		cart_release_contents(out);
+		free(out);
+		return NULL;
+	}
+
+	out->load_time = platform_now() - start;
 	return out;
 }
 
-void destroy_cart(CART *cart){
-	free(cart->ROM_contents);
+// Loads quietly, see new_cart_mode if you want to know what went wrong.
+static inline CART* new_cart(const char *ROM_image){
+	return new_cart_mode(ROM_image, CART_LOAD_MMAP, NULL);
+}
+
+// How much of the ROM image is actually in memory right now, in bytes. For mapped images this only counts
+// pages that are resident, which for CART_LOAD_STREAMING is the banks that have been touched so far.
+static inline size_t cart_resident_size(CART *cart){
+	if(cart->load_mode == CART_LOAD_COPY){
+		return cart->filesize;
+	}
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t pages = (cart->filesize + page_size - 1) / page_size;
+	unsigned char *residency = (unsigned char*)malloc(pages);
+	size_t resident = 0;
+	if(mincore(cart->ROM_contents, cart->filesize, residency) == 0){
+		for(size_t i = 0; i < pages; i++){
+			resident += (residency[i] & 1) ? page_size : 0;
+		}
+	}
+
+	free(residency);
+	return resident < cart->filesize ? resident : cart->filesize;
+}
+
+// Total amount of PRG RAM (volatile and battery backed) on the cart, in bytes.
+static inline size_t cart_prg_ram_size(CART *cart){
+	if(cart->type == NES2){
+		size_t size = 0;
+		if(cart->PRG_RAM_size != 0){
+			size += (size_t)64 << cart->PRG_RAM_size;
+		}
+		if(cart->PRG_NVRAM_size != 0){
+			size += (size_t)64 << cart->PRG_NVRAM_size;
+		}
+		return size;
+	}
+
+	return (size_t)8192 * cart->PRG_RAM_size;
+}
+
+static inline void destroy_cart(CART *cart){
+	cart_release_contents(cart);
 	free(cart);
 }
 
-void print_cart_info(CART *cart){
+static inline void print_cart_info(CART *cart){
 	char *fmt_str = "N/A";
 	uint8_t fmt = cart->type;
 	fmt += cart->uncertain_type ? 4 : 0;
@@ -417,13 +558,19 @@ void print_cart_info(CART *cart){
 		"\tCHR RAM Size: %fKiB\n"
 		"\tCHR NVRAM Size: %fKiB\n"
 		"\tTiming mode: %s\n"
+		"Load info:\n"
+		"\tLoad mode: %s\n"
+		"\tLoad time: %fms\n"
+		"\tResident size: %fKiB\n"
 		"===  END ROM INFO  ===\n",
 		cart->filesize/1024.0F, fmt_str, cart->NES2_fmt_override ? "Yes" : "No",
 		cart->PRG_ROM_len*16, cart->CHR_ROM_len*8, cart->mapper, cart->submapper,
 		cart->mirroring ? "1 (Vertical)" : "0 (Horizontal)", cart->has_PRG_RAM ? "Yes" : "No",
 		cart->trainer_present ? "Yes" : "No", cart->ignore_mirroring_bit ? "Yes" : "No", sys_type_str,
 		prg_ram_len, (64 << cart->PRG_NVRAM_size) / 1024.0F, (64 << cart->CHR_RAM_size) / 1024.0F,
-		(64 << cart->CHR_NVRAM_size) / 1024.0F, timing_md
+		(64 << cart->CHR_NVRAM_size) / 1024.0F, timing_md,
+		cart->load_mode == CART_LOAD_MMAP ? "Mapped" : cart->load_mode == CART_LOAD_STREAMING ? "Streaming" : "Copied",
+		cart->load_time * 1000.0, cart_resident_size(cart) / 1024.0F
 	);
 }
 
@@ -13,22 +13,60 @@
 
 #include "mmu.h"
 
+// What idle.h knows about the loop the CPU is currently going round, if any.
+typedef struct {
+	uint16_t head; // Where the last short backward jump went to...
+	uint16_t tail; // ...and where it came from.
+	bool watching; // head/tail are valid.
+	bool rejected; // The loop at head/tail has side effects, so don't look at it again.
+	uint8_t A, X, Y, P, SP; // Registers the last time round.
+	uint64_t skipped_cycles; // Total cycles fast-forwarded over.
+	uint64_t skips;
+} IDLE_LOOP;
+
 typedef struct {
 	uint8_t A; // Accumulator
 	uint8_t X,Y; // Index registers
-	uint8_t F; // Flag register
+	uint8_t F; // Flag register. Only I, D and the unused bit live here, use cpu_get_flags() for the real thing.
 	uint8_t SP; // Stack pointer
 	uint16_t PC; // Program counter
-	
+
+	// Lazily evaluated flags. Rather than working out N, Z, C and V after every instruction, we just keep
+	// whatever they were derived from and only build the actual bits when something reads them.
+	uint8_t n_result; // N is bit 7 of this.
+	uint8_t z_result; // Z is set if this is zero.
+	uint8_t c_result; // C is bit 0 of this.
+	uint8_t v_result; // V is bit 7 of this.
+
 	MMU* mmu;
-	unsigned wait_cycles;
+	unsigned wait_cycles; // Cycles the last instruction took after its fetch. Already counted in "cycles", which is what the scheduler goes by.
+
+	// Running totals since power on, for timing and benchmarking.
+	uint64_t cycles;
+	uint64_t instructions;
+
+	// Scratch state for the instruction currently being executed. 'operand' is the raw (little endian)
+	// operand following the opcode, the other two are set by the addressing mode/opcode functions and
+	// added on to wait_cycles by tick_cpu.
+	uint16_t operand;
+	bool page_crossed;
+	uint8_t extra_cycles;
+
+	// Set by the illegal 'JAM' opcodes. The real CPU locks up until reset, so we do the same.
+	bool jammed;
+
+	IDLE_LOOP idle; // See idle.h.
 } CPU;
 
-CPU* new_cpu(MMU *mmu){
+static inline CPU* new_cpu(MMU *mmu){
 	CPU* cpu = (CPU*)malloc(sizeof(CPU));
 	// TODO is this the best way of doing this?
 	memset(cpu, 0, sizeof(CPU));
 	cpu->mmu = mmu;
+	mmu->cycles = &cpu->cycles;
+	cpu->SP = 0xFD;
+	cpu->F = 0x24;
+	cpu->z_result = 1;
 	return cpu;
 }
 
@@ -47,247 +85,756 @@ CPU* new_cpu(MMU *mmu){
  *	Z - Zero
  *	C - Carry
  */
+#define FLAG_N 0x80
+#define FLAG_V 0x40
+#define FLAG_U 0x20
+#define FLAG_B 0x10
+#define FLAG_D 0x08
+#define FLAG_I 0x04
+#define FLAG_Z 0x02
+#define FLAG_C 0x01
+
+// Flag helpers. Anything that needs the flag register as a byte (PHP, BRK, interrupts, savestates)
+// must go through cpu_get_flags()/cpu_set_flags(), since N, Z, C and V aren't kept in F.
+static inline uint8_t cpu_get_flags(CPU *cpu){
+	return (cpu->F & (FLAG_U | FLAG_B | FLAG_D | FLAG_I))
+		| (cpu->n_result & FLAG_N)
+		| ((cpu->v_result & 0x80) ? FLAG_V : 0)
+		| (cpu->z_result ? 0 : FLAG_Z)
+		| (cpu->c_result & FLAG_C);
+}
+
+static inline void cpu_set_flags(CPU *cpu, uint8_t flags){
+	cpu->F = flags & (FLAG_U | FLAG_B | FLAG_D | FLAG_I);
+	cpu->n_result = flags;
+	cpu->v_result = flags << 1;
+	cpu->z_result = ~flags & FLAG_Z;
+	cpu->c_result = flags & FLAG_C;
+}
+
+static inline void set_nz(CPU *cpu, uint8_t value){
+	cpu->n_result = value;
+	cpu->z_result = value;
+}
+
+static inline void set_carry(CPU *cpu, bool value){
+	cpu->c_result = value;
+}
+
+static inline void set_overflow(CPU *cpu, bool value){
+	cpu->v_result = value ? 0x80 : 0;
+}
+
+// Stack helpers. The stack lives in page 1 and grows downwards.
+static inline void push(CPU *cpu, uint8_t value){
+	mmu_write(0x100 | cpu->SP--, value, cpu->mmu);
+}
+
+static inline uint8_t pull(CPU *cpu){
+	return mmu_read(0x100 | ++cpu->SP, cpu->mmu);
+}
+
+static inline void push16(CPU *cpu, uint16_t value){
+	push(cpu, value >> 8);
+	push(cpu, value & 0xFF);
+}
+
+static inline uint16_t pull16(CPU *cpu){
+	uint16_t lo = pull(cpu);
+	return lo | ((uint16_t)pull(cpu) << 8);
+}
+
+static inline uint16_t read16(CPU *cpu, uint16_t address){
+	return mmu_read16(address, cpu->mmu);
+}
 
-// Helper functions for addressing
-uint8_t zpg_read(CPU *cpu){
-	uint16_t addr = mmu_read(cpu->PC++, cpu->mmu);
-	return mmu_read(addr, cpu->mmu);
+// BEGIN ADDRESSING MODES
+// Every addressing mode turns the operand fetched by tick_cpu into an effective address, which is
+// then handed to the opcode function. Immediate mode returns the address of the operand byte itself,
+// so opcode functions never have to care which mode they were called with.
+enum addressing_modes {
+	IMP, // Implied
+	ACC, // Accumulator
+	IMM, // Immediate
+	ZPG, // Zero page
+	ZPX, // Zero page, X
+	ZPY, // Zero page, Y
+	ABS, // Absolute
+	ABX, // Absolute, X
+	ABY, // Absolute, Y
+	IND, // Indirect (JMP only)
+	IZX, // (Indirect, X)
+	IZY, // (Indirect), Y
+	REL, // Relative (branches only)
+	ADDRESSING_MODE_COUNT
+};
+
+// Number of operand bytes following the opcode for each addressing mode.
+static const uint8_t operand_length[ADDRESSING_MODE_COUNT] = {
+	[IMP] = 0, [ACC] = 0, [IMM] = 1, [ZPG] = 1, [ZPX] = 1, [ZPY] = 1, [ABS] = 2,
+	[ABX] = 2, [ABY] = 2, [IND] = 2, [IZX] = 1, [IZY] = 1, [REL] = 1
+};
+
+static uint16_t addr_imp(CPU *cpu){
+	(void)cpu;
+	return 0;
 }
 
-uint8_t zpg_read_offset(CPU *cpu, uint8_t offset){
-	// Used for indexed zero page reads.
-	uint16_t addr = mmu_read(cpu->PC++, cpu->mmu);
-	addr += offset;
-	return mmu_read(addr, cpu->mmu);
+static uint16_t addr_imm(CPU *cpu){
+	return cpu->PC - 1;
 }
 
+static uint16_t addr_zpg(CPU *cpu){
+	return cpu->operand & 0xFF;
+}
+
+static uint16_t addr_zpx(CPU *cpu){
+	return (cpu->operand + cpu->X) & 0xFF;
+}
+
+static uint16_t addr_zpy(CPU *cpu){
+	return (cpu->operand + cpu->Y) & 0xFF;
+}
+
+static uint16_t addr_abs(CPU *cpu){
+	return cpu->operand;
+}
+
+static uint16_t addr_abx(CPU *cpu){
+	uint16_t addr = cpu->operand + cpu->X;
+	cpu->page_crossed = (addr & 0xFF00) != (cpu->operand & 0xFF00);
+	return addr;
+}
+
+static uint16_t addr_aby(CPU *cpu){
+	uint16_t addr = cpu->operand + cpu->Y;
+	cpu->page_crossed = (addr & 0xFF00) != (cpu->operand & 0xFF00);
+	return addr;
+}
+
+static uint16_t addr_ind(CPU *cpu){
+	// The original 6502 doesn't carry into the high byte when fetching the pointer, so JMP ($10FF)
+	// reads its high byte from $1000 rather than $1100. Games rely on this, so we replicate it.
+	uint16_t lo = mmu_read(cpu->operand, cpu->mmu);
+	uint16_t hi = mmu_read((cpu->operand & 0xFF00) | ((cpu->operand + 1) & 0xFF), cpu->mmu);
+	return lo | (hi << 8);
+}
+
+static uint16_t addr_izx(CPU *cpu){
+	uint8_t ptr = cpu->operand + cpu->X;
+	uint16_t lo = mmu_read(ptr, cpu->mmu);
+	uint16_t hi = mmu_read((uint8_t)(ptr + 1), cpu->mmu);
+	return lo | (hi << 8);
+}
+
+static uint16_t addr_izy(CPU *cpu){
+	uint8_t ptr = cpu->operand;
+	uint16_t base = mmu_read(ptr, cpu->mmu) | ((uint16_t)mmu_read((uint8_t)(ptr + 1), cpu->mmu) << 8);
+	uint16_t addr = base + cpu->Y;
+	cpu->page_crossed = (addr & 0xFF00) != (base & 0xFF00);
+	return addr;
+}
+
+static uint16_t addr_rel(CPU *cpu){
+	uint16_t addr = cpu->PC + (int8_t)cpu->operand;
+	cpu->page_crossed = (addr & 0xFF00) != (cpu->PC & 0xFF00);
+	return addr;
+}
+
+static uint16_t (*const addressing_modes[ADDRESSING_MODE_COUNT])(CPU*) = {
+	[IMP] = addr_imp, [ACC] = addr_imp, [IMM] = addr_imm, [ZPG] = addr_zpg, [ZPX] = addr_zpx,
+	[ZPY] = addr_zpy, [ABS] = addr_abs, [ABX] = addr_abx, [ABY] = addr_aby, [IND] = addr_ind,
+	[IZX] = addr_izx, [IZY] = addr_izy, [REL] = addr_rel
+};
+// END ADDRESSING MODES
+
 // BEGIN OPCODE DEFINITIONS
-// These are all opcode functions for the CPU, which may take inputs pending their type.
-// Since the inputs themselves determine the number of cycles it takes, we'll do that in
-// the switch statement and just generate them here.
+// These are all opcode functions for the CPU. Each one takes the effective address worked out by the
+// addressing mode, and the opcode table at the bottom of this section ties them together with their
+// mode and cycle counts.
 
 // Control flow functions
-void JMP(CPU *cpu, bool is_absolute){
-	// Jump to a location in memory, done weirdly depending on which mode.
-	union {
-		uint8_t bytes[2];
-		uint16_t addr;
-	} addr;
-
-	if(is_absolute){
-		// Two bytes following PC are the new PC.
-		addr.bytes[0] = mmu_read(cpu->PC++, cpu->mmu);
-		addr.bytes[1] = mmu_read(cpu->PC++, cpu->mmu);
-		cpu->PC = (uint16_t)addr.addr; // ah yes, endianess conversion.
-	} else {
-		// Two bytes following PC are the address of the LSB (first byte, since the 2A03 is LE)
-		// that we're jumping to.
-		addr.bytes[0] = mmu_read(cpu->PC++, cpu->mmu);
-		addr.bytes[1] = mmu_read(cpu->PC++, cpu->mmu);
-
-		uint16_t location = (uint16_t)addr.addr;
-
-		addr.bytes[0] = mmu_read(location++, cpu->mmu);
-		addr.bytes[1] = mmu_read(location++, cpu->mmu);
-
-		cpu->PC = (uint16_t)addr.addr;	
+static void JMP(CPU *cpu, uint16_t address){
+	cpu->PC = address;
+}
+
+static void JSR(CPU *cpu, uint16_t address){
+	// The 6502 pushes the address of the last byte of the JSR rather than the next instruction,
+	// which RTS then corrects for.
+	push16(cpu, cpu->PC - 1);
+	cpu->PC = address;
+}
+
+static void RTS(CPU *cpu, uint16_t address){
+	(void)address;
+	cpu->PC = pull16(cpu) + 1;
+}
+
+static void RTI(CPU *cpu, uint16_t address){
+	(void)address;
+	cpu_set_flags(cpu, (pull(cpu) & ~FLAG_B) | FLAG_U);
+	cpu->PC = pull16(cpu);
+}
+
+static void BRK(CPU *cpu, uint16_t address){
+	(void)address;
+	// BRK is a two byte instruction, with the second byte being padding that's skipped on return.
+	push16(cpu, cpu->PC + 1);
+	push(cpu, cpu_get_flags(cpu) | FLAG_B | FLAG_U);
+	cpu->F |= FLAG_I;
+	cpu->PC = read16(cpu, 0xFFFE);
+}
+
+// Branches. Taking one costs an extra cycle, and crossing a page while doing so costs another.
+static inline void branch(CPU *cpu, uint16_t address, bool condition){
+	if(condition){
+		cpu->extra_cycles += 1 + cpu->page_crossed;
+		cpu->PC = address;
 	}
 }
 
-// Miscellaneous Control Functions
+static void BPL(CPU *cpu, uint16_t address){ branch(cpu, address, !(cpu->n_result & 0x80)); }
+static void BMI(CPU *cpu, uint16_t address){ branch(cpu, address, cpu->n_result & 0x80); }
+static void BVC(CPU *cpu, uint16_t address){ branch(cpu, address, !(cpu->v_result & 0x80)); }
+static void BVS(CPU *cpu, uint16_t address){ branch(cpu, address, cpu->v_result & 0x80); }
+static void BCC(CPU *cpu, uint16_t address){ branch(cpu, address, !(cpu->c_result & 1)); }
+static void BCS(CPU *cpu, uint16_t address){ branch(cpu, address, cpu->c_result & 1); }
+static void BNE(CPU *cpu, uint16_t address){ branch(cpu, address, cpu->z_result != 0); }
+static void BEQ(CPU *cpu, uint16_t address){ branch(cpu, address, cpu->z_result == 0); }
 
-void SEI(CPU *cpu){
+// Miscellaneous Control Functions
+static void SEI(CPU *cpu, uint16_t address){
 	// Set interrupt disable - turns interrupts off.
-	cpu->F |= 4;
+	(void)address;
+	cpu->F |= FLAG_I;
 }
 
-void CLD(CPU *cpu){
+static void CLI(CPU *cpu, uint16_t address){
+	(void)address;
+	cpu->F &= ~FLAG_I;
+}
+
+static void CLD(CPU *cpu, uint16_t address){
 	// Clear the decimal flag. This does nothing, since the 2A03 doesn't support BCD mode.
-	cpu->F &= 0xF7;
+	(void)address;
+	cpu->F &= ~FLAG_D;
+}
+
+static void SED(CPU *cpu, uint16_t address){
+	// As above, the flag is still there, it just doesn't do anything.
+	(void)address;
+	cpu->F |= FLAG_D;
+}
+
+static void CLC(CPU *cpu, uint16_t address){
+	(void)address;
+	cpu->c_result = 0;
+}
+
+static void SEC(CPU *cpu, uint16_t address){
+	(void)address;
+	cpu->c_result = 1;
+}
+
+static void CLV(CPU *cpu, uint16_t address){
+	(void)address;
+	cpu->v_result = 0;
+}
+
+static void NOP(CPU *cpu, uint16_t address){
+	// Some of the illegal NOPs do a dummy read, which has no side effects on anything we emulate.
+	(void)cpu;
+	(void)address;
+}
+
+static void JAM(CPU *cpu, uint16_t address){
+	// Locks the CPU up. We rewind PC so we just keep hitting this until someone resets us.
+	(void)address;
+	cpu->jammed = true;
+	cpu->PC--;
+}
+
+// Stack functions
+static void PHA(CPU *cpu, uint16_t address){
+	(void)address;
+	push(cpu, cpu->A);
+}
+
+static void PHP(CPU *cpu, uint16_t address){
+	// B is always pushed as set by PHP.
+	(void)address;
+	push(cpu, cpu_get_flags(cpu) | FLAG_B | FLAG_U);
+}
+
+static void PLA(CPU *cpu, uint16_t address){
+	(void)address;
+	cpu->A = pull(cpu);
+	set_nz(cpu, cpu->A);
+}
+
+static void PLP(CPU *cpu, uint16_t address){
+	// B doesn't actually exist in the flag register, so it's dropped here.
+	(void)address;
+	cpu_set_flags(cpu, (pull(cpu) & ~FLAG_B) | FLAG_U);
 }
+
 // RMW functions
-void STA(CPU *cpu, uint16_t address){
+static void STA(CPU *cpu, uint16_t address){
 	// Store accumulator.
 	mmu_write(address, cpu->A, cpu->mmu);
 }
 
-void LDA(CPU *cpu, uint8_t value){
+static void STX(CPU *cpu, uint16_t address){
+	// Store X.
+	mmu_write(address, cpu->X, cpu->mmu);
+}
+
+static void STY(CPU *cpu, uint16_t address){
+	mmu_write(address, cpu->Y, cpu->mmu);
+}
+
+static void LDA(CPU *cpu, uint16_t address){
 	// Load into accumulator. Modifies negative and zero.
-	cpu->A = value;
-	cpu->F &= (0x7F | (cpu->A & 0x80));
-	cpu->F &= (0xFD | (cpu->A ? 0 : 0x2));
+	cpu->A = mmu_read(address, cpu->mmu);
+	set_nz(cpu, cpu->A);
 }
 
-void STX(CPU *cpu, uint16_t address){
-	// Store X.
-	mmu_write(address, cpu->X, cpu->mmu);
+static void LDX(CPU *cpu, uint16_t address){
+	cpu->X = mmu_read(address, cpu->mmu);
+	set_nz(cpu, cpu->X);
 }
 
-void LDX(CPU *cpu, uint8_t value){
-	cpu->X = value;
-	cpu->F &= (0x7F | (cpu->X & 0x80));
-	cpu->F &= (0xFD | (cpu->X ? 0 : 0x2));
+static void LDY(CPU *cpu, uint16_t address){
+	cpu->Y = mmu_read(address, cpu->mmu);
+	set_nz(cpu, cpu->Y);
 }
 
-void TXS(CPU *cpu){
-	// Transfer X into S (stack register).
+static void TAX(CPU *cpu, uint16_t address){ (void)address; cpu->X = cpu->A; set_nz(cpu, cpu->X); }
+static void TAY(CPU *cpu, uint16_t address){ (void)address; cpu->Y = cpu->A; set_nz(cpu, cpu->Y); }
+static void TXA(CPU *cpu, uint16_t address){ (void)address; cpu->A = cpu->X; set_nz(cpu, cpu->A); }
+static void TYA(CPU *cpu, uint16_t address){ (void)address; cpu->A = cpu->Y; set_nz(cpu, cpu->A); }
+static void TSX(CPU *cpu, uint16_t address){ (void)address; cpu->X = cpu->SP; set_nz(cpu, cpu->X); }
+
+static void TXS(CPU *cpu, uint16_t address){
+	// Transfer X into S (stack register). Unlike the other transfers, this doesn't touch the flags.
+	(void)address;
 	cpu->SP = cpu->X;
 }
 
+static void INX(CPU *cpu, uint16_t address){ (void)address; set_nz(cpu, ++cpu->X); }
+static void INY(CPU *cpu, uint16_t address){ (void)address; set_nz(cpu, ++cpu->Y); }
+static void DEX(CPU *cpu, uint16_t address){ (void)address; set_nz(cpu, --cpu->X); }
+static void DEY(CPU *cpu, uint16_t address){ (void)address; set_nz(cpu, --cpu->Y); }
+
+// The shifts and rotates have an accumulator form and a memory form, which share these helpers.
+static inline uint8_t do_asl(CPU *cpu, uint8_t value){
+	set_carry(cpu, value & 0x80);
+	value <<= 1;
+	set_nz(cpu, value);
+	return value;
+}
+
+static inline uint8_t do_lsr(CPU *cpu, uint8_t value){
+	set_carry(cpu, value & 1);
+	value >>= 1;
+	set_nz(cpu, value);
+	return value;
+}
+
+static inline uint8_t do_rol(CPU *cpu, uint8_t value){
+	uint8_t carry = cpu->c_result & 1;
+	set_carry(cpu, value & 0x80);
+	value = (value << 1) | carry;
+	set_nz(cpu, value);
+	return value;
+}
+
+static inline uint8_t do_ror(CPU *cpu, uint8_t value){
+	uint8_t carry = cpu->c_result & 1;
+	set_carry(cpu, value & 1);
+	value = (value >> 1) | (carry << 7);
+	set_nz(cpu, value);
+	return value;
+}
+
+static void ASL_A(CPU *cpu, uint16_t address){ (void)address; cpu->A = do_asl(cpu, cpu->A); }
+static void LSR_A(CPU *cpu, uint16_t address){ (void)address; cpu->A = do_lsr(cpu, cpu->A); }
+static void ROL_A(CPU *cpu, uint16_t address){ (void)address; cpu->A = do_rol(cpu, cpu->A); }
+static void ROR_A(CPU *cpu, uint16_t address){ (void)address; cpu->A = do_ror(cpu, cpu->A); }
+
+static void ASL(CPU *cpu, uint16_t address){
+	mmu_write(address, do_asl(cpu, mmu_read(address, cpu->mmu)), cpu->mmu);
+}
+
+static void LSR(CPU *cpu, uint16_t address){
+	mmu_write(address, do_lsr(cpu, mmu_read(address, cpu->mmu)), cpu->mmu);
+}
+
+static void ROL(CPU *cpu, uint16_t address){
+	mmu_write(address, do_rol(cpu, mmu_read(address, cpu->mmu)), cpu->mmu);
+}
+
+static void ROR(CPU *cpu, uint16_t address){
+	mmu_write(address, do_ror(cpu, mmu_read(address, cpu->mmu)), cpu->mmu);
+}
+
+static void INC(CPU *cpu, uint16_t address){
+	uint8_t value = mmu_read(address, cpu->mmu) + 1;
+	mmu_write(address, value, cpu->mmu);
+	set_nz(cpu, value);
+}
+
+static void DEC(CPU *cpu, uint16_t address){
+	uint8_t value = mmu_read(address, cpu->mmu) - 1;
+	mmu_write(address, value, cpu->mmu);
+	set_nz(cpu, value);
+}
+
 // ALU functions
-void EOR(CPU *cpu, uint8_t value){
+static inline void do_adc(CPU *cpu, uint8_t value){
+	// No decimal mode on the 2A03, so this is the whole thing.
+	uint16_t sum = cpu->A + value + (cpu->c_result & 1);
+	cpu->c_result = sum >> 8;
+	cpu->v_result = ~(cpu->A ^ value) & (cpu->A ^ sum);
+	cpu->A = sum;
+	set_nz(cpu, cpu->A);
+}
+
+static inline void do_compare(CPU *cpu, uint8_t reg, uint8_t value){
+	set_carry(cpu, reg >= value);
+	set_nz(cpu, reg - value);
+}
+
+static void ADC(CPU *cpu, uint16_t address){
+	do_adc(cpu, mmu_read(address, cpu->mmu));
+}
+
+static void SBC(CPU *cpu, uint16_t address){
+	// Subtraction is just addition of the one's complement, with carry acting as 'not borrow'.
+	do_adc(cpu, ~mmu_read(address, cpu->mmu));
+}
+
+static void AND(CPU *cpu, uint16_t address){
+	cpu->A &= mmu_read(address, cpu->mmu);
+	set_nz(cpu, cpu->A);
+}
+
+static void EOR(CPU *cpu, uint16_t address){
 	// E-xclusive OR with accumulator.
-	cpu->A ^= value;
-	cpu->F &= (0x7F | (cpu->A & 0x80));
-	cpu->F &= (0xFD | (cpu->A ? 0 : 0x2));
+	cpu->A ^= mmu_read(address, cpu->mmu);
+	set_nz(cpu, cpu->A);
 }
 
-void ORA(CPU *cpu, uint8_t value){
+static void ORA(CPU *cpu, uint16_t address){
 	// (inclusive) OR with accumulator.
+	cpu->A |= mmu_read(address, cpu->mmu);
+	set_nz(cpu, cpu->A);
+}
+
+static void BIT(CPU *cpu, uint16_t address){
+	uint8_t value = mmu_read(address, cpu->mmu);
+	cpu->n_result = value;
+	cpu->v_result = value << 1;
+	cpu->z_result = cpu->A & value;
+}
+
+static void CMP(CPU *cpu, uint16_t address){ do_compare(cpu, cpu->A, mmu_read(address, cpu->mmu)); }
+static void CPX(CPU *cpu, uint16_t address){ do_compare(cpu, cpu->X, mmu_read(address, cpu->mmu)); }
+static void CPY(CPU *cpu, uint16_t address){ do_compare(cpu, cpu->Y, mmu_read(address, cpu->mmu)); }
+
+// Unofficial opcodes. Most of these are an RMW instruction glued to an ALU instruction, since that's
+// what falls out of the 6502's decode logic when both bottom bits are set.
+static void SLO(CPU *cpu, uint16_t address){
+	uint8_t value = do_asl(cpu, mmu_read(address, cpu->mmu));
+	mmu_write(address, value, cpu->mmu);
 	cpu->A |= value;
-	cpu->F &= (0x7F | (cpu->A & 0x80));
-	cpu->F &= (0xFD | (cpu->A ? 0 : 0x2));
+	set_nz(cpu, cpu->A);
 }
-// END OPCODE DEFINITIONS
 
+static void RLA(CPU *cpu, uint16_t address){
+	uint8_t value = do_rol(cpu, mmu_read(address, cpu->mmu));
+	mmu_write(address, value, cpu->mmu);
+	cpu->A &= value;
+	set_nz(cpu, cpu->A);
+}
 
-void tick_cpu(CPU *cpu){
-	/* The NES' ISA separates instruction into 4 'groups' based on their two bottom bits:
-		- 0b00
-			- Control instructions
-		- 0b01
-			- ALU instructions
-		- 0b10
-			- RMW (read,modify,write) instructions
-		- 0b11
-			- Combination ALU/RMW, e.g. rotating a value at a 0-page memory address.
+static void SRE(CPU *cpu, uint16_t address){
+	uint8_t value = do_lsr(cpu, mmu_read(address, cpu->mmu));
+	mmu_write(address, value, cpu->mmu);
+	cpu->A ^= value;
+	set_nz(cpu, cpu->A);
+}
 
-	  Additionally, the CPU uses memory addresses 0x0000-0x00FF as the 'zero page' - allowing them
-	  to be addressed with an 8-bit input, and thereby being much faster then using a full 16-bit address.
+static void RRA(CPU *cpu, uint16_t address){
+	uint8_t value = do_ror(cpu, mmu_read(address, cpu->mmu));
+	mmu_write(address, value, cpu->mmu);
+	do_adc(cpu, value);
+}
 
-	  Finally, unlike other CPUs, illegal opcodes in the NES' CPU aren't HCF. Instead, they act similarly to their
-	  adjacent instructions, or are just NOPs. Since certain late games actually make use of these, we need to implement
-	  the entire table.
-	*/
+static void DCP(CPU *cpu, uint16_t address){
+	uint8_t value = mmu_read(address, cpu->mmu) - 1;
+	mmu_write(address, value, cpu->mmu);
+	do_compare(cpu, cpu->A, value);
+}
 
-	// Fetch
-	uint8_t inst = mmu_read(cpu->PC++, cpu->mmu);
+static void ISC(CPU *cpu, uint16_t address){
+	uint8_t value = mmu_read(address, cpu->mmu) + 1;
+	mmu_write(address, value, cpu->mmu);
+	do_adc(cpu, ~value);
+}
 
-	// Decode, then execute. The actual family of instructions we have to worry about is fairly small, so most of this is
-	// just delegating to functions.
-	switch(inst){
+static void SAX(CPU *cpu, uint16_t address){
+	mmu_write(address, cpu->A & cpu->X, cpu->mmu);
+}
 
-		case 0x05:
-			ORA(cpu, zpg_read(cpu));
-			cpu->wait_cycles = 2;
-			break;
+static void LAX(CPU *cpu, uint16_t address){
+	cpu->A = cpu->X = mmu_read(address, cpu->mmu);
+	set_nz(cpu, cpu->A);
+}
 
-		case 0x49:
-			EOR(cpu, mmu_read(cpu->PC++, cpu->mmu));
-			cpu->wait_cycles = 1;
-			break;
+static void ANC(CPU *cpu, uint16_t address){
+	cpu->A &= mmu_read(address, cpu->mmu);
+	set_nz(cpu, cpu->A);
+	set_carry(cpu, cpu->A & 0x80);
+}
 
-		case 0x4C:
-			JMP(cpu, true);
-			cpu->wait_cycles = 2;
-			break;
+static void ALR(CPU *cpu, uint16_t address){
+	cpu->A = do_lsr(cpu, cpu->A & mmu_read(address, cpu->mmu));
+}
 
-		case 0x78:
-			SEI(cpu);
-			cpu->wait_cycles = 1;
-			break;
+static void ARR(CPU *cpu, uint16_t address){
+	cpu->A = ((cpu->A & mmu_read(address, cpu->mmu)) >> 1) | ((cpu->c_result << 7));
+	set_nz(cpu, cpu->A);
+	set_carry(cpu, cpu->A & 0x40);
+	set_overflow(cpu, ((cpu->A >> 6) ^ (cpu->A >> 5)) & 1);
+}
 
-		case 0x85:
-			STA(cpu, zpg_read(cpu));
-			cpu->wait_cycles = 2;
-			break;
+static void AXS(CPU *cpu, uint16_t address){
+	uint8_t value = mmu_read(address, cpu->mmu);
+	uint8_t ax = cpu->A & cpu->X;
+	set_carry(cpu, ax >= value);
+	cpu->X = ax - value;
+	set_nz(cpu, cpu->X);
+}
 
-		case 0x8D:
-			STA(cpu, cpu_read16(cpu->PC++, cpu->mmu->mmc));
-			cpu->PC++;
-			break;
+static void LAS(CPU *cpu, uint16_t address){
+	cpu->A = cpu->X = cpu->SP = mmu_read(address, cpu->mmu) & cpu->SP;
+	set_nz(cpu, cpu->A);
+}
 
-		case 0x95:
-			STA(cpu, zpg_read_offset(cpu, cpu->X));
-			cpu->wait_cycles = 3;
-			break;
+// XAA and LXA are unstable on real hardware, as the result depends on analog effects. 0xEE is the
+// 'magic constant' most 2A03s settle on, and no licensed game depends on these anyway.
+static void XAA(CPU *cpu, uint16_t address){
+	cpu->A = (cpu->A | 0xEE) & cpu->X & mmu_read(address, cpu->mmu);
+	set_nz(cpu, cpu->A);
+}
 
-		case 0x99:
-			STA(cpu, cpu_read16(cpu->PC++, cpu->mmu->mmc) + cpu->Y);
-			cpu->PC++;
-			cpu->wait_cycles = 4;
-			break;
+static void LXA(CPU *cpu, uint16_t address){
+	cpu->A = cpu->X = (cpu->A | 0xEE) & mmu_read(address, cpu->mmu);
+	set_nz(cpu, cpu->A);
+}
 
-		case 0x9A:
-			TXS(cpu);
-			cpu->wait_cycles = 1;
-			break;
+// These store a register ANDed with the high byte of the (unindexed) target address plus one. If the
+// indexing crossed a page, the high byte of the address gets mangled in the same way.
+static inline void store_high_and(CPU *cpu, uint16_t address, uint8_t index, uint8_t value){
+	value &= ((uint16_t)(address - index) >> 8) + 1;
+	if(cpu->page_crossed){
+		address = (address & 0xFF) | ((uint16_t)value << 8);
+	}
+	mmu_write(address, value, cpu->mmu);
+}
 
-		case 0x9D:
-			STA(cpu, cpu_read16(cpu->PC++, cpu->mmu->mmc) + cpu->X);
-			cpu->PC++;
-			cpu->wait_cycles = 4;
-			break;
-		
-		case 0xA2:
-			LDX(cpu, cpu_read(cpu->PC++, cpu->mmu->mmc));
-			cpu->wait_cycles = 1;
-			break;
+static void SHA(CPU *cpu, uint16_t address){ store_high_and(cpu, address, cpu->Y, cpu->A & cpu->X); }
+static void SHX(CPU *cpu, uint16_t address){ store_high_and(cpu, address, cpu->Y, cpu->X); }
+static void SHY(CPU *cpu, uint16_t address){ store_high_and(cpu, address, cpu->X, cpu->Y); }
 
-		case 0xA5:
-			LDA(cpu, zpg_read(cpu));
-			cpu->wait_cycles = 2;
-			break;
+static void TAS(CPU *cpu, uint16_t address){
+	cpu->SP = cpu->A & cpu->X;
+	store_high_and(cpu, address, cpu->Y, cpu->SP);
+}
 
-		case 0xA6:
-			LDX(cpu, zpg_read(cpu));
-			cpu->wait_cycles = 2;
-			break;
+// The opcode table. This is the single description of the instruction set - everything tick_cpu
+// needs to run an opcode (mode, base cycles, whether crossing a page costs an extra cycle) lives here,
+// and the mnemonic is kept around for debugging output.
+typedef struct {
+	const char *mnemonic;
+	enum addressing_modes mode;
+	uint8_t cycles;
+	bool page_penalty;
+	void (*execute)(CPU*, uint16_t);
+} OPCODE;
+
+#define OP(fn, mode, cycles, penalty) { #fn, mode, cycles, penalty, fn }
+#define OPN(name, fn, mode, cycles, penalty) { name, mode, cycles, penalty, fn }
+
+static const OPCODE opcode_table[256] = {
+	/* 0x00 */ OP(BRK, IMP, 7, 0), OP(ORA, IZX, 6, 0), OP(JAM, IMP, 2, 0), OP(SLO, IZX, 8, 0),
+	/* 0x04 */ OP(NOP, ZPG, 3, 0), OP(ORA, ZPG, 3, 0), OP(ASL, ZPG, 5, 0), OP(SLO, ZPG, 5, 0),
+	/* 0x08 */ OP(PHP, IMP, 3, 0), OP(ORA, IMM, 2, 0), OPN("ASL", ASL_A, ACC, 2, 0), OP(ANC, IMM, 2, 0),
+	/* 0x0C */ OP(NOP, ABS, 4, 0), OP(ORA, ABS, 4, 0), OP(ASL, ABS, 6, 0), OP(SLO, ABS, 6, 0),
+	/* 0x10 */ OP(BPL, REL, 2, 0), OP(ORA, IZY, 5, 1), OP(JAM, IMP, 2, 0), OP(SLO, IZY, 8, 0),
+	/* 0x14 */ OP(NOP, ZPX, 4, 0), OP(ORA, ZPX, 4, 0), OP(ASL, ZPX, 6, 0), OP(SLO, ZPX, 6, 0),
+	/* 0x18 */ OP(CLC, IMP, 2, 0), OP(ORA, ABY, 4, 1), OP(NOP, IMP, 2, 0), OP(SLO, ABY, 7, 0),
+	/* 0x1C */ OP(NOP, ABX, 4, 1), OP(ORA, ABX, 4, 1), OP(ASL, ABX, 7, 0), OP(SLO, ABX, 7, 0),
+	/* 0x20 */ OP(JSR, ABS, 6, 0), OP(AND, IZX, 6, 0), OP(JAM, IMP, 2, 0), OP(RLA, IZX, 8, 0),
+	/* 0x24 */ OP(BIT, ZPG, 3, 0), OP(AND, ZPG, 3, 0), OP(ROL, ZPG, 5, 0), OP(RLA, ZPG, 5, 0),
+	/* 0x28 */ OP(PLP, IMP, 4, 0), OP(AND, IMM, 2, 0), OPN("ROL", ROL_A, ACC, 2, 0), OP(ANC, IMM, 2, 0),
+	/* 0x2C */ OP(BIT, ABS, 4, 0), OP(AND, ABS, 4, 0), OP(ROL, ABS, 6, 0), OP(RLA, ABS, 6, 0),
+	/* 0x30 */ OP(BMI, REL, 2, 0), OP(AND, IZY, 5, 1), OP(JAM, IMP, 2, 0), OP(RLA, IZY, 8, 0),
+	/* 0x34 */ OP(NOP, ZPX, 4, 0), OP(AND, ZPX, 4, 0), OP(ROL, ZPX, 6, 0), OP(RLA, ZPX, 6, 0),
+	/* 0x38 */ OP(SEC, IMP, 2, 0), OP(AND, ABY, 4, 1), OP(NOP, IMP, 2, 0), OP(RLA, ABY, 7, 0),
+	/* 0x3C */ OP(NOP, ABX, 4, 1), OP(AND, ABX, 4, 1), OP(ROL, ABX, 7, 0), OP(RLA, ABX, 7, 0),
+	/* 0x40 */ OP(RTI, IMP, 6, 0), OP(EOR, IZX, 6, 0), OP(JAM, IMP, 2, 0), OP(SRE, IZX, 8, 0),
+	/* 0x44 */ OP(NOP, ZPG, 3, 0), OP(EOR, ZPG, 3, 0), OP(LSR, ZPG, 5, 0), OP(SRE, ZPG, 5, 0),
+	/* 0x48 */ OP(PHA, IMP, 3, 0), OP(EOR, IMM, 2, 0), OPN("LSR", LSR_A, ACC, 2, 0), OP(ALR, IMM, 2, 0),
+	/* 0x4C */ OP(JMP, ABS, 3, 0), OP(EOR, ABS, 4, 0), OP(LSR, ABS, 6, 0), OP(SRE, ABS, 6, 0),
+	/* 0x50 */ OP(BVC, REL, 2, 0), OP(EOR, IZY, 5, 1), OP(JAM, IMP, 2, 0), OP(SRE, IZY, 8, 0),
+	/* 0x54 */ OP(NOP, ZPX, 4, 0), OP(EOR, ZPX, 4, 0), OP(LSR, ZPX, 6, 0), OP(SRE, ZPX, 6, 0),
+	/* 0x58 */ OP(CLI, IMP, 2, 0), OP(EOR, ABY, 4, 1), OP(NOP, IMP, 2, 0), OP(SRE, ABY, 7, 0),
+	/* 0x5C */ OP(NOP, ABX, 4, 1), OP(EOR, ABX, 4, 1), OP(LSR, ABX, 7, 0), OP(SRE, ABX, 7, 0),
+	/* 0x60 */ OP(RTS, IMP, 6, 0), OP(ADC, IZX, 6, 0), OP(JAM, IMP, 2, 0), OP(RRA, IZX, 8, 0),
+	/* 0x64 */ OP(NOP, ZPG, 3, 0), OP(ADC, ZPG, 3, 0), OP(ROR, ZPG, 5, 0), OP(RRA, ZPG, 5, 0),
+	/* 0x68 */ OP(PLA, IMP, 4, 0), OP(ADC, IMM, 2, 0), OPN("ROR", ROR_A, ACC, 2, 0), OP(ARR, IMM, 2, 0),
+	/* 0x6C */ OP(JMP, IND, 5, 0), OP(ADC, ABS, 4, 0), OP(ROR, ABS, 6, 0), OP(RRA, ABS, 6, 0),
+	/* 0x70 */ OP(BVS, REL, 2, 0), OP(ADC, IZY, 5, 1), OP(JAM, IMP, 2, 0), OP(RRA, IZY, 8, 0),
+	/* 0x74 */ OP(NOP, ZPX, 4, 0), OP(ADC, ZPX, 4, 0), OP(ROR, ZPX, 6, 0), OP(RRA, ZPX, 6, 0),
+	/* 0x78 */ OP(SEI, IMP, 2, 0), OP(ADC, ABY, 4, 1), OP(NOP, IMP, 2, 0), OP(RRA, ABY, 7, 0),
+	/* 0x7C */ OP(NOP, ABX, 4, 1), OP(ADC, ABX, 4, 1), OP(ROR, ABX, 7, 0), OP(RRA, ABX, 7, 0),
+	/* 0x80 */ OP(NOP, IMM, 2, 0), OP(STA, IZX, 6, 0), OP(NOP, IMM, 2, 0), OP(SAX, IZX, 6, 0),
+	/* 0x84 */ OP(STY, ZPG, 3, 0), OP(STA, ZPG, 3, 0), OP(STX, ZPG, 3, 0), OP(SAX, ZPG, 3, 0),
+	/* 0x88 */ OP(DEY, IMP, 2, 0), OP(NOP, IMM, 2, 0), OP(TXA, IMP, 2, 0), OP(XAA, IMM, 2, 0),
+	/* 0x8C */ OP(STY, ABS, 4, 0), OP(STA, ABS, 4, 0), OP(STX, ABS, 4, 0), OP(SAX, ABS, 4, 0),
+	/* 0x90 */ OP(BCC, REL, 2, 0), OP(STA, IZY, 6, 0), OP(JAM, IMP, 2, 0), OP(SHA, IZY, 6, 0),
+	/* 0x94 */ OP(STY, ZPX, 4, 0), OP(STA, ZPX, 4, 0), OP(STX, ZPY, 4, 0), OP(SAX, ZPY, 4, 0),
+	/* 0x98 */ OP(TYA, IMP, 2, 0), OP(STA, ABY, 5, 0), OP(TXS, IMP, 2, 0), OP(TAS, ABY, 5, 0),
+	/* 0x9C */ OP(SHY, ABX, 5, 0), OP(STA, ABX, 5, 0), OP(SHX, ABY, 5, 0), OP(SHA, ABY, 5, 0),
+	/* 0xA0 */ OP(LDY, IMM, 2, 0), OP(LDA, IZX, 6, 0), OP(LDX, IMM, 2, 0), OP(LAX, IZX, 6, 0),
+	/* 0xA4 */ OP(LDY, ZPG, 3, 0), OP(LDA, ZPG, 3, 0), OP(LDX, ZPG, 3, 0), OP(LAX, ZPG, 3, 0),
+	/* 0xA8 */ OP(TAY, IMP, 2, 0), OP(LDA, IMM, 2, 0), OP(TAX, IMP, 2, 0), OP(LXA, IMM, 2, 0),
+	/* 0xAC */ OP(LDY, ABS, 4, 0), OP(LDA, ABS, 4, 0), OP(LDX, ABS, 4, 0), OP(LAX, ABS, 4, 0),
+	/* 0xB0 */ OP(BCS, REL, 2, 0), OP(LDA, IZY, 5, 1), OP(JAM, IMP, 2, 0), OP(LAX, IZY, 5, 1),
+	/* 0xB4 */ OP(LDY, ZPX, 4, 0), OP(LDA, ZPX, 4, 0), OP(LDX, ZPY, 4, 0), OP(LAX, ZPY, 4, 0),
+	/* 0xB8 */ OP(CLV, IMP, 2, 0), OP(LDA, ABY, 4, 1), OP(TSX, IMP, 2, 0), OP(LAS, ABY, 4, 1),
+	/* 0xBC */ OP(LDY, ABX, 4, 1), OP(LDA, ABX, 4, 1), OP(LDX, ABY, 4, 1), OP(LAX, ABY, 4, 1),
+	/* 0xC0 */ OP(CPY, IMM, 2, 0), OP(CMP, IZX, 6, 0), OP(NOP, IMM, 2, 0), OP(DCP, IZX, 8, 0),
+	/* 0xC4 */ OP(CPY, ZPG, 3, 0), OP(CMP, ZPG, 3, 0), OP(DEC, ZPG, 5, 0), OP(DCP, ZPG, 5, 0),
+	/* 0xC8 */ OP(INY, IMP, 2, 0), OP(CMP, IMM, 2, 0), OP(DEX, IMP, 2, 0), OP(AXS, IMM, 2, 0),
+	/* 0xCC */ OP(CPY, ABS, 4, 0), OP(CMP, ABS, 4, 0), OP(DEC, ABS, 6, 0), OP(DCP, ABS, 6, 0),
+	/* 0xD0 */ OP(BNE, REL, 2, 0), OP(CMP, IZY, 5, 1), OP(JAM, IMP, 2, 0), OP(DCP, IZY, 8, 0),
+	/* 0xD4 */ OP(NOP, ZPX, 4, 0), OP(CMP, ZPX, 4, 0), OP(DEC, ZPX, 6, 0), OP(DCP, ZPX, 6, 0),
+	/* 0xD8 */ OP(CLD, IMP, 2, 0), OP(CMP, ABY, 4, 1), OP(NOP, IMP, 2, 0), OP(DCP, ABY, 7, 0),
+	/* 0xDC */ OP(NOP, ABX, 4, 1), OP(CMP, ABX, 4, 1), OP(DEC, ABX, 7, 0), OP(DCP, ABX, 7, 0),
+	/* 0xE0 */ OP(CPX, IMM, 2, 0), OP(SBC, IZX, 6, 0), OP(NOP, IMM, 2, 0), OP(ISC, IZX, 8, 0),
+	/* 0xE4 */ OP(CPX, ZPG, 3, 0), OP(SBC, ZPG, 3, 0), OP(INC, ZPG, 5, 0), OP(ISC, ZPG, 5, 0),
+	/* 0xE8 */ OP(INX, IMP, 2, 0), OP(SBC, IMM, 2, 0), OP(NOP, IMP, 2, 0), OP(SBC, IMM, 2, 0),
+	/* 0xEC */ OP(CPX, ABS, 4, 0), OP(SBC, ABS, 4, 0), OP(INC, ABS, 6, 0), OP(ISC, ABS, 6, 0),
+	/* 0xF0 */ OP(BEQ, REL, 2, 0), OP(SBC, IZY, 5, 1), OP(JAM, IMP, 2, 0), OP(ISC, IZY, 8, 0),
+	/* 0xF4 */ OP(NOP, ZPX, 4, 0), OP(SBC, ZPX, 4, 0), OP(INC, ZPX, 6, 0), OP(ISC, ZPX, 6, 0),
+	/* 0xF8 */ OP(SED, IMP, 2, 0), OP(SBC, ABY, 4, 1), OP(NOP, IMP, 2, 0), OP(ISC, ABY, 7, 0),
+	/* 0xFC */ OP(NOP, ABX, 4, 1), OP(SBC, ABX, 4, 1), OP(INC, ABX, 7, 0), OP(ISC, ABX, 7, 0)
+};
+
+#undef OP
+#undef OPN
+// END OPCODE DEFINITIONS
 
-		case 0xA9:
-			LDA(cpu, mmu_read(cpu->PC++, cpu->mmu));
-			cpu->wait_cycles = 1;
-			break;
 
-		case 0xAD:
-			LDA(cpu, mmu_read(cpu_read16(cpu->PC++, cpu->mmu->mmc), cpu->mmu));
-			cpu->PC++;
-			cpu->wait_cycles = 3;
-			break;
+// Fetch. Instructions in PRG ROM come out of the decode cache, so after the first time round only a single
+// lookup is needed, everything else is fetched byte by byte.
+static inline DECODED cpu_decode(MMU *mmu, uint16_t PC){
+	DECODED decoded;
+	DECODED *cached = decode_cache_lookup(mmu->decode, PC);
 
-		case 0xB5:
-			LDA(cpu, zpg_read_offset(cpu, cpu->X));
-			cpu->wait_cycles = 3;
-			break;
+	if(cached != NULL && cached->length != 0){
+		mmu->decode->hits++;
+		return *cached;
+	}
 
-		case 0xB6:
-			LDX(cpu, zpg_read_offset(cpu, cpu->Y));
-			cpu->wait_cycles = 3;
+	decoded.opcode = mmu_read(PC, mmu);
+	decoded.length = operand_length[opcode_table[decoded.opcode].mode] + 1;
+	switch(decoded.length){
+		case 3:
+			decoded.operand = mmu_read16(PC + 1, mmu);
 			break;
-
-		case 0xB9:
-			// TODO wait_cycles needs to be 4 if the read crosses a page
-			LDA(cpu, mmu_read(cpu_read16(cpu->PC++, cpu->mmu->mmc) + cpu->Y, cpu->mmu));
-			cpu->PC++;
-			cpu->wait_cycles = 3;
+		case 2:
+			decoded.operand = mmu_read(PC + 1, mmu);
 			break;
+		default:
+			decoded.operand = 0;
+	}
 
-		case 0xBD:
-			// TODO wait_cycles needs to be 4 if the read crosses a page
-			LDA(cpu, mmu_read(cpu_read16(cpu->PC++, cpu->mmu->mmc) + cpu->X, cpu->mmu));
-			cpu->PC++;
-			cpu->wait_cycles = 3;
-			break;
+	if(cached != NULL){
+		mmu->decode->misses++;
+		if(decode_cache_fits(PC, decoded.length)){
+			*cached = decoded;
+		}
+	}
+	return decoded;
+}
 
-		case 0xD8:
-			CLD(cpu);
-			cpu->wait_cycles = 1;
-			break;
+static inline void tick_cpu(CPU *cpu){
+	/* The NES' ISA separates instruction into 4 'groups' based on their two bottom bits:
+		- 0b00
+			- Control instructions
+		- 0b01
+			- ALU instructions
+		- 0b10
+			- RMW (read,modify,write) instructions
+		- 0b11
+			- Combination ALU/RMW, e.g. rotating a value at a 0-page memory address.
 
-		default:
-			printf("Unknown opcode encountered!\n\tAddress: 0x%04X\n\topcode: 0x%02X\n\ttwo bytes following opcode: 0x%02X 0x%02X\n", cpu->PC, inst, mmu_read(cpu->PC, cpu->mmu), mmu_read(cpu->PC+1, cpu->mmu));
-			abort();
+	  Additionally, the CPU uses memory addresses 0x0000-0x00FF as the 'zero page' - allowing them
+	  to be addressed with an 8-bit input, and thereby being much faster then using a full 16-bit address.
+
+	  Finally, unlike other CPUs, illegal opcodes in the NES' CPU aren't HCF. Instead, they act similarly to their
+	  adjacent instructions, or are just NOPs. Since certain late games actually make use of these, we need to implement
+	  the entire table, which is why everything goes through opcode_table rather than a switch.
+	*/
+
+	DECODED decoded = cpu_decode(cpu->mmu, cpu->PC);
+	const OPCODE *op = &opcode_table[decoded.opcode];
+	cpu->operand = decoded.operand;
+	cpu->PC += decoded.length;
+
+	// Decode, then execute. Every opcode costs the same here: one table lookup, one addressing mode
+	// call and one opcode call.
+	cpu->page_crossed = false;
+	cpu->extra_cycles = 0;
+	op->execute(cpu, addressing_modes[op->mode](cpu));
+
+	// The first cycle was spent on the fetch, hence the -1.
+	cpu->wait_cycles = op->cycles - 1 + cpu->extra_cycles + (op->page_penalty & cpu->page_crossed);
+	cpu->cycles += cpu->wait_cycles + 1;
+	cpu->instructions++;
+}
+
+// Takes an NMI, between instructions. Much like BRK, except B is clear in the pushed flags and the return address
+// is the next instruction. A jammed CPU doesn't respond to anything but reset.
+static inline void cpu_nmi(CPU *cpu){
+	if(cpu->jammed){
+		return;
+	}
+	push16(cpu, cpu->PC);
+	push(cpu, (cpu_get_flags(cpu) & ~FLAG_B) | FLAG_U);
+	cpu->F |= FLAG_I;
+	cpu->PC = read16(cpu, 0xFFFA);
+	cpu->cycles += 7;
+}
+
+// Takes an IRQ, between instructions, unless I is set. The same as an NMI but through BRK's vector. The line is
+// level triggered, so whoever runs the CPU checks it before every instruction (see cpu_run_until) and calls
+// this while it's up; setting I is what stops the handler being interrupted over and over until it
+// acknowledges whatever raised it. Returns whether it was taken.
+static inline bool cpu_irq(CPU *cpu){
+	if(cpu->jammed || (cpu->F & FLAG_I)){
+		return false;
 	}
+	push16(cpu, cpu->PC);
+	push(cpu, (cpu_get_flags(cpu) & ~FLAG_B) | FLAG_U);
+	cpu->F |= FLAG_I;
+	cpu->PC = read16(cpu, 0xFFFE);
+	cpu->cycles += 7;
+	return true;
 }
 
 
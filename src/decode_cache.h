@@ -0,0 +1,78 @@
+#ifndef decode_cache_h
+#define decode_cache_h
+
+// Cache of pre-decoded instructions for PRG ROM. Since PRG ROM can't change, an instruction only ever
+// needs to be decoded once per (PRG bank, offset into bank) pair, so we keep one record per byte of PRG ROM
+// and let the mapper tell us which 16KiB bank is visible in each half of 0x8000-0xFFFF. When the mapper
+// switches banks, the window for that half is pointed at a different set of records, which is the only
+// invalidation the cache ever needs.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+	uint8_t opcode;
+	uint8_t length; // Total instruction length in bytes, 0 if this record hasn't been decoded yet.
+	uint16_t operand;
+} DECODED;
+
+typedef struct {
+	DECODED *entries; // One record per byte of PRG ROM.
+	size_t bank_count; // Number of 16KiB banks.
+	DECODED *window[2]; // Records for the bank mapped at 0x8000 and 0xC000 respectively, NULL if unmapped.
+	int window_bank[2];
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t remaps; // Number of times a bank switch actually changed which bank a window points at.
+} DECODE_CACHE;
+
+static inline DECODE_CACHE* new_decode_cache(size_t bank_count){
+	DECODE_CACHE *cache = (DECODE_CACHE*)calloc(1, sizeof(DECODE_CACHE));
+	cache->entries = (DECODED*)calloc(bank_count * 0x4000, sizeof(DECODED));
+	cache->bank_count = bank_count;
+	cache->window_bank[0] = -1;
+	cache->window_bank[1] = -1;
+	return cache;
+}
+
+// Called by mappers whenever the 16KiB PRG bank visible in 'window' (0 = 0x8000, 1 = 0xC000) might
+// have changed. Passing a negative bank unmaps the window, which disables caching for it.
+static inline void decode_cache_map(DECODE_CACHE *cache, int window, int bank){
+	if(cache == NULL || cache->window_bank[window] == bank){
+		return;
+	}
+
+	if(bank < 0 || (size_t)bank >= cache->bank_count){
+		cache->window[window] = NULL;
+		cache->window_bank[window] = -1;
+	} else {
+		cache->window[window] = cache->entries + (size_t)bank * 0x4000;
+		cache->window_bank[window] = bank;
+	}
+	cache->remaps++;
+}
+
+// Returns the record for the instruction at 'address', or NULL if the address isn't cacheable.
+static inline DECODED* decode_cache_lookup(DECODE_CACHE *cache, uint16_t address){
+	if(address < 0x8000 || cache == NULL){
+		return NULL;
+	}
+
+	DECODED *window = cache->window[(address >> 14) & 1];
+	return window == NULL ? NULL : &window[address & 0x3FFF];
+}
+
+// Instructions that run off the end of a window can't be cached, since the next window may be switched
+// independently of this one.
+static inline bool decode_cache_fits(uint16_t address, uint8_t length){
+	return (address & 0x3FFF) + length <= 0x4000;
+}
+
+static inline void destroy_decode_cache(DECODE_CACHE *cache){
+	free(cache->entries);
+	free(cache);
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef hash_h
+#define hash_h
+
+// CRC32 and SHA-1, used to identify ROMs by their contents rather than their (often wrong) headers.
+// Both are the standard algorithms, so the results can be checked against other ROM databases.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// CRC32 (IEEE 802.3, reflected, polynomial 0xEDB88320). The table is built on first use.
+static uint32_t crc32_table[256];
+static int crc32_table_ready = 0;
+
+static void crc32_init_table(){
+	for(uint32_t i = 0; i < 256; i++){
+		uint32_t c = i;
+		for(int k = 0; k < 8; k++){
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		}
+		crc32_table[i] = c;
+	}
+	crc32_table_ready = 1;
+}
+
+// Call once before any threads start hashing, since building the table isn't thread safe.
+static inline void crc32_prepare(){
+	if(!crc32_table_ready){
+		crc32_init_table();
+	}
+}
+
+static inline uint32_t crc32(const uint8_t *data, size_t len){
+	crc32_prepare();
+
+	uint32_t c = 0xFFFFFFFF;
+	for(size_t i = 0; i < len; i++){
+		c = crc32_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+	}
+	return c ^ 0xFFFFFFFF;
+}
+
+// SHA-1 (FIPS 180-4).
+static inline uint32_t sha1_rol(uint32_t value, int bits){
+	return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1_block(uint32_t state[5], const uint8_t block[64]){
+	uint32_t w[80];
+	for(int i = 0; i < 16; i++){
+		w[i] = ((uint32_t)block[i*4] << 24) | ((uint32_t)block[i*4 + 1] << 16) | ((uint32_t)block[i*4 + 2] << 8) | block[i*4 + 3];
+	}
+	for(int i = 16; i < 80; i++){
+		w[i] = sha1_rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+	for(int i = 0; i < 80; i++){
+		uint32_t f, k;
+		if(i < 20){
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if(i < 40){
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if(i < 60){
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		uint32_t temp = sha1_rol(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = sha1_rol(b, 30);
+		b = a;
+		a = temp;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+static inline void sha1(const uint8_t *data, size_t len, uint8_t digest[20]){
+	uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+	size_t i = 0;
+	for(; i + 64 <= len; i += 64){
+		sha1_block(state, data + i);
+	}
+
+	// Pad with a 1 bit, zeroes, then the length in bits as a big endian 64-bit number.
+	uint8_t tail[128];
+	size_t remaining = len - i;
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, data + i, remaining);
+	tail[remaining] = 0x80;
+
+	size_t tail_len = remaining + 9 <= 64 ? 64 : 128;
+	uint64_t bits = (uint64_t)len * 8;
+	for(int j = 0; j < 8; j++){
+		tail[tail_len - 1 - j] = bits >> (j * 8);
+	}
+
+	sha1_block(state, tail);
+	if(tail_len == 128){
+		sha1_block(state, tail + 64);
+	}
+
+	for(int j = 0; j < 5; j++){
+		digest[j*4] = state[j] >> 24;
+		digest[j*4 + 1] = state[j] >> 16;
+		digest[j*4 + 2] = state[j] >> 8;
+		digest[j*4 + 3] = state[j];
+	}
+}
+
+#endif
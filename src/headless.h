@@ -0,0 +1,85 @@
+#ifndef headless_h
+#define headless_h
+
+// Headless benchmark runs: no output, no pacing, just run the CPU for a fixed number of emulated cycles as
+// fast as the host allows and report how fast that was. The report is JSON so it can be collected per commit
+// and compared across machines.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <signal.h>
+
+#include "cpu.h"
+#include "machine.h"
+#include "cart.h"
+#include "timing.h"
+#include "json.h"
+#include "platform.h"
+
+typedef struct {
+	uint64_t cycles;
+	uint64_t instructions;
+	double seconds;
+	double frames; // Emulated frames, worked out from the cycle count.
+	uint64_t idle_cycles; // Skipped over rather than run, see idle.h. Included in 'cycles'.
+	uint64_t ppu_catch_ups; // Times the PPU had to be brought up to date, see ppu.h.
+	const TIMING *timing;
+	bool interrupted; // Stopped early by *stop, so the numbers cover a shorter run than was asked for.
+} BENCH_RESULT;
+
+// Runs 'cpu' until it has executed at least 'cycles' cycles, or *stop becomes true.
+static inline BENCH_RESULT run_headless(CPU *cpu, const TIMING *timing, uint64_t cycles, volatile sig_atomic_t *stop){
+	BENCH_RESULT result;
+	result.timing = timing;
+
+	uint64_t start_cycles = cpu->cycles, start_instructions = cpu->instructions, start_idle = cpu->idle.skipped_cycles;
+	uint64_t start_catch_ups = cpu->mmu->ppu.catch_ups;
+	uint64_t target = start_cycles + cycles;
+
+	double start = platform_now();
+
+	// Checking *stop every instruction would cost more than the check itself, so only do it every so often.
+	while(cpu->cycles < target){
+		machine_run(cpu, target - cpu->cycles > 0x3000 ? cpu->cycles + 0x3000 : target);
+		if(*stop){
+			break;
+		}
+	}
+
+	double end = platform_now();
+
+	result.cycles = cpu->cycles - start_cycles;
+	result.instructions = cpu->instructions - start_instructions;
+	result.seconds = end - start;
+	result.frames = result.cycles / timing->cpu_cycles_per_frame;
+	result.idle_cycles = cpu->idle.skipped_cycles - start_idle;
+	result.ppu_catch_ups = cpu->mmu->ppu.catch_ups - start_catch_ups;
+	result.interrupted = cpu->cycles < target;
+	return result;
+}
+
+static inline void print_bench_json(FILE *fp, const BENCH_RESULT *result, const char *rom, const CART *cart, const DECODE_CACHE *decode,
+	const TILE_CACHE *tiles){
+	double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+	double cycles_per_second = result->cycles / seconds;
+
+	fprintf(fp, "{\"rom\": ");
+	json_string(fp, rom);
+	fprintf(fp, ", \"mapper\": %u, \"region\": \"%s\", \"cycles\": %llu, \"instructions\": %llu, \"frames\": %.2f, "
+		"\"seconds\": %.6f, \"instructions_per_second\": %.0f, \"cycles_per_second\": %.0f, \"frames_per_second\": %.2f, "
+		"\"realtime_speed\": %.3f, \"idle_cycles_skipped\": %llu, \"ppu_catch_ups\": %llu, \"decode_cache_hits\": %llu, \"decode_cache_misses\": %llu, "
+		"\"tile_cache_hits\": %llu, \"tile_cache_misses\": %llu, \"tile_cache_invalidations\": %llu, \"tile_cache_hit_rate\": %.4f, "
+		"\"tile_cache_bytes\": %zu, \"interrupted\": %s}\n",
+		cart->mapper, result->timing->name, (unsigned long long)result->cycles, (unsigned long long)result->instructions,
+		result->frames, result->seconds, result->instructions / seconds, cycles_per_second, result->frames / seconds,
+		cycles_per_second / timing_cpu_hz(result->timing), (unsigned long long)result->idle_cycles,
+		(unsigned long long)result->ppu_catch_ups, (unsigned long long)(decode != NULL ? decode->hits : 0),
+		(unsigned long long)(decode != NULL ? decode->misses : 0),
+		(unsigned long long)(tiles != NULL ? tiles->hits : 0), (unsigned long long)(tiles != NULL ? tiles->misses : 0),
+		(unsigned long long)(tiles != NULL ? tiles->invalidations : 0), tiles != NULL ? tile_cache_hit_rate(tiles) : 0.0,
+		tiles != NULL ? tile_cache_bytes(tiles) : (size_t)0, result->interrupted ? "true" : "false");
+}
+
+#endif
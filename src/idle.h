@@ -0,0 +1,202 @@
+#ifndef idle_h
+#define idle_h
+
+// Idle loop skipping. A lot of games finish their work for the frame and then sit in something like
+// 'wait: LDA $xx / BEQ wait' or 'JMP *' until the NMI handler changes something. Interpreting that is pure
+// waste, so cpu_run_until watches for short backward jumps, and if the CPU comes back to the top of the same
+// loop with exactly the same registers, having only read RAM or ROM and written nothing on the way round,
+// then nothing can change until something outside the CPU does, and every trip round the loop from then on
+// is identical. So it goes round once more to time it, then adds on as many whole trips' worth of cycles
+// (and instructions) as fit before the deadline. The machine ends up in exactly the state it would have been
+// in if every instruction had been run.
+//
+// "Only RAM or ROM" means pages mapped in the page table, since those are the ones with no side effects
+// (see page_table.h). A loop that polls a hardware register is never skipped.
+//
+// The deadline is the next scheduled event (see scheduler.h), or the end of whatever the caller is running
+// for if that's sooner. Until then, nothing can happen that the loop could see.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "mmu.h"
+
+#define IDLE_MAX_LOOP 16 // Longest loop looked at, in bytes.
+
+// Instructions that can't write to memory or touch the stack, as long as JMP is absolute. Shifts only count on
+// the accumulator, which have handlers of their own. Matched by handler, as lockstep_op_for does.
+static void (*const idle_safe_handlers[])(CPU*, uint16_t) = {
+	LDA, LDX, LDY, LAX, BIT, CMP, CPX, CPY, AND, ORA, EOR, ADC, SBC, NOP,
+	TAX, TAY, TXA, TYA, INX, INY, DEX, DEY, CLC, SEC, CLV, CLD, SED,
+	BCC, BCS, BEQ, BNE, BMI, BPL, BVC, BVS, JMP, ASL_A, LSR_A, ROL_A, ROR_A, JAM
+};
+
+static inline bool idle_instruction_safe(MMU *mmu, DECODED decoded){
+	const OPCODE *op = &opcode_table[decoded.opcode];
+	bool known = false;
+	for(size_t i = 0; i < sizeof(idle_safe_handlers) / sizeof(idle_safe_handlers[0]) && !known; i++){
+		known = op->execute == idle_safe_handlers[i];
+	}
+	if(!known || (op->execute == JMP && op->mode != ABS)){
+		return false;
+	}
+
+	// Whatever's left only ever reads, so it's down to where from.
+	uint8_t *const *pages = mmu->pages->read;
+	switch(op->mode){
+		case IMP:
+		case ACC:
+		case IMM:
+		case REL:
+			return true;
+		case ZPG:
+		case ZPX:
+		case ZPY:
+			return pages[0] != NULL;
+		case ABS:
+			return pages[decoded.operand >> 8] != NULL;
+		case ABX:
+		case ABY:
+			// X or Y could be anything by the time it runs, so everything it could reach has to be mapped.
+			return pages[decoded.operand >> 8] != NULL && pages[(uint16_t)(decoded.operand + 0xFF) >> 8] != NULL;
+		default:
+			// Indirect modes could point anywhere.
+			return false;
+	}
+}
+
+// Checks every instruction from 'head' up to and including the one at 'tail'. Jumps within the loop have to
+// land on one of those instructions rather than halfway through one; jumps out of it are fine, since they
+// just mean the loop isn't idle this time round. Returns the address just past the loop, or 'head' if it
+// isn't safe.
+static inline uint16_t idle_loop_end(MMU *mmu, uint16_t head, uint16_t tail){
+	uint16_t at[IDLE_MAX_LOOP];
+	DECODED body[IDLE_MAX_LOOP];
+	uint32_t starts = 0; // Bit n is set if an instruction starts at head + n.
+	unsigned count = 0, length = 0;
+
+	for(uint16_t pc = head;;){
+		// Fetching the code is a read too.
+		if(mmu->pages->read[pc >> 8] == NULL || mmu->pages->read[(uint16_t)(pc + 2) >> 8] == NULL){
+			return head;
+		}
+		DECODED decoded = cpu_decode(mmu, pc);
+		if(length + decoded.length > IDLE_MAX_LOOP || !idle_instruction_safe(mmu, decoded)){
+			return head;
+		}
+		starts |= 1u << length;
+		at[count] = pc;
+		body[count++] = decoded;
+		length += decoded.length;
+		if(pc == tail){
+			break;
+		} else if((uint16_t)(tail - pc) < decoded.length){
+			return head; // Stepped over the tail, so it isn't on an instruction boundary.
+		}
+		pc += decoded.length;
+	}
+
+	for(unsigned i = 0; i < count; i++){
+		const OPCODE *op = &opcode_table[body[i].opcode];
+		uint16_t target;
+		if(op->mode == REL){
+			target = at[i] + 2 + (int8_t)body[i].operand;
+		} else if(op->execute == JMP){
+			target = body[i].operand;
+		} else {
+			continue;
+		}
+		uint16_t offset = target - head;
+		if(offset < length && !(starts & (1u << offset))){
+			return head;
+		}
+	}
+	return head + length;
+}
+
+static inline void idle_remember(CPU *cpu, uint8_t P){
+	cpu->idle.A = cpu->A;
+	cpu->idle.X = cpu->X;
+	cpu->idle.Y = cpu->Y;
+	cpu->idle.P = P;
+	cpu->idle.SP = cpu->SP;
+}
+
+static inline bool idle_same(const CPU *cpu, uint8_t P){
+	return cpu->idle.A == cpu->A && cpu->idle.X == cpu->X && cpu->idle.Y == cpu->Y && cpu->idle.P == P && cpu->idle.SP == cpu->SP;
+}
+
+// Called when the instruction at 'tail' has just jumped back to cpu->PC, a short way behind it.
+static inline void idle_check(CPU *cpu, uint16_t tail, uint64_t deadline){
+	IDLE_LOOP *idle = &cpu->idle;
+	uint16_t head = cpu->PC;
+	uint8_t P = cpu_get_flags(cpu);
+	if(!idle->watching || idle->head != head || idle->tail != tail){
+		idle->watching = true;
+		idle->rejected = false;
+		idle->head = head;
+		idle->tail = tail;
+		idle_remember(cpu, P);
+		return;
+	}
+	if(idle->rejected){
+		return;
+	}
+	if(!idle_same(cpu, P)){
+		// Still doing something, like counting down.
+		idle_remember(cpu, P);
+		return;
+	}
+
+	uint16_t end = idle_loop_end(cpu->mmu, head, tail);
+	if(end == head){
+		idle->rejected = true;
+		return;
+	}
+
+	// Go round once more to see how long it takes, making sure it really does stay inside the loop and come
+	// back to the top. If the deadline comes first, that's fine, we're exactly where we would have been.
+	uint64_t start_cycles = cpu->cycles, start_instructions = cpu->instructions;
+	for(unsigned i = 0; cpu->PC != head || i == 0; i++){
+		if(cpu->cycles >= deadline || i == IDLE_MAX_LOOP){
+			return;
+		}
+		tick_cpu(cpu);
+		if((uint16_t)(cpu->PC - head) >= (uint16_t)(end - head)){
+			idle->watching = false; // Left the loop.
+			return;
+		}
+	}
+	P = cpu_get_flags(cpu);
+	if(!idle_same(cpu, P) || cpu->cycles >= deadline){
+		idle_remember(cpu, P);
+		return;
+	}
+
+	uint64_t period = cpu->cycles - start_cycles, instructions = cpu->instructions - start_instructions;
+	uint64_t trips = (deadline - cpu->cycles) / period;
+	cpu->cycles += trips * period;
+	cpu->instructions += trips * instructions;
+	idle->skipped_cycles += trips * period;
+	idle->skips += trips != 0;
+}
+
+// Runs until the CPU has executed at least up to cycle *deadline, skipping idle loops on the way. The deadline
+// is read again after every instruction, since a register write can bring it forward (see scheduler_push).
+// IRQ is polled before each instruction. Nothing raises it partway through a run without the scheduler
+// stopping the run there (see apu.h), so a loop that's skipped with I clear never had one to take.
+static inline void cpu_run_until(CPU *cpu, const uint64_t *deadline){
+	while(cpu->cycles < *deadline){
+		if(mmu_irq(cpu->mmu) && cpu_irq(cpu)){
+			continue;
+		}
+		uint16_t pc = cpu->PC;
+		tick_cpu(cpu);
+		if((uint16_t)(pc - cpu->PC) < IDLE_MAX_LOOP){
+			idle_check(cpu, pc, *deadline);
+		}
+	}
+}
+
+#endif
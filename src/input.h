@@ -0,0 +1,54 @@
+#ifndef input_h
+#define input_h
+
+// The two standard controller ports at 0x4016 and 0x4017. Writing 1 then 0 to bit 0 of 0x4016 (the strobe)
+// latches the buttons of both controllers into their shift registers, and each read of a port then returns the
+// next button in bit 0, in the order A, B, Select, Start, Up, Down, Left, Right. After 8 reads an official
+// controller returns 1s forever. While the strobe is held high, every read returns the current state of A.
+//
+// Which buttons are down is up to the frontend; the rest of this is machine state, see savestate.h.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum controller_buttons {
+	BUTTON_A      = 0x01,
+	BUTTON_B      = 0x02,
+	BUTTON_SELECT = 0x04,
+	BUTTON_START  = 0x08,
+	BUTTON_UP     = 0x10,
+	BUTTON_DOWN   = 0x20,
+	BUTTON_LEFT   = 0x40,
+	BUTTON_RIGHT  = 0x80
+};
+
+typedef struct {
+	uint8_t buttons[2]; // enum controller_buttons, set by the frontend.
+	uint8_t shift[2];
+	bool strobe;
+} CONTROLLERS;
+
+static inline CONTROLLERS new_controllers(){
+	CONTROLLERS controllers = { { 0, 0 }, { 0, 0 }, false };
+	return controllers;
+}
+
+static inline void controllers_write(CONTROLLERS *controllers, uint8_t value){
+	controllers->strobe = value & 1;
+	if(controllers->strobe){
+		controllers->shift[0] = controllers->buttons[0];
+		controllers->shift[1] = controllers->buttons[1];
+	}
+}
+
+// The upper bits are whatever was last on the data bus, which for the usual LDA $4016 is the 0x40 of the address.
+static inline uint8_t controllers_read(CONTROLLERS *controllers, unsigned port){
+	if(controllers->strobe){
+		return 0x40 | (controllers->buttons[port] & 1);
+	}
+	uint8_t bit = controllers->shift[port] & 1;
+	controllers->shift[port] = 0x80 | (controllers->shift[port] >> 1);
+	return 0x40 | bit;
+}
+
+#endif
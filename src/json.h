@@ -0,0 +1,23 @@
+#ifndef json_h
+#define json_h
+
+// The one bit of JSON writing the reports need that isn't just a printf: a string, quoted and escaped. Used
+// by the ROM index export (see scanner.h) and the --bench, runner, lockstep and run-ahead reports.
+
+#include <stdio.h>
+
+static inline void json_string(FILE *fp, const char *str){
+	fputc('"', fp);
+	for(; *str != '\0'; str++){
+		if(*str == '"' || *str == '\\'){
+			fprintf(fp, "\\%c", *str);
+		} else if((unsigned char)*str < 0x20){
+			fprintf(fp, "\\u%04x", (unsigned char)*str);
+		} else {
+			fputc(*str, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+#endif
@@ -0,0 +1,219 @@
+// agnt.c
+//
+//	- libagnt: the emulator core behind the opaque handle in agnt.h. Each machine owns its cart, mapper, MMU
+//	  and CPU outright, and messages from all of them go to the machine's own logger.
+#include "agnt.h"
+
+#include "../cpu.h"
+#include "../machine.h"
+#include "../cart.h"
+#include "../mmu.h"
+#include "../timing.h"
+#include "../savestate.h"
+#include "../rewind.h"
+#include "../mappers/delegator.h"
+
+struct AGNT_MACHINE {
+	agnt_log_callback callback;
+	void *user;
+
+	CART *cart;
+	MMC mmc;
+	MMU mmu;
+	CPU *cpu;
+	const TIMING *timing;
+
+	uint64_t target_cycles; // Where the last step was meant to stop, so overshoot is taken off the next one.
+
+	REWIND *rewind; // NULL unless enabled.
+};
+
+#define AGNT_REWIND_KEYFRAME_INTERVAL 60
+
+// Passes core messages on to the embedding program's callback, if it has one.
+static void agnt_forward_log(void *user, enum log_levels level, const char *message){
+	AGNT_MACHINE *machine = (AGNT_MACHINE*)user;
+	if(machine->callback != NULL){
+		machine->callback(machine->user, (enum agnt_log_levels)level, message);
+	}
+}
+
+AGNT_MACHINE* agnt_create(void){
+	return (AGNT_MACHINE*)calloc(1, sizeof(AGNT_MACHINE));
+}
+
+void agnt_set_logger(AGNT_MACHINE *machine, agnt_log_callback callback, void *user){
+	machine->callback = callback;
+	machine->user = user;
+}
+
+enum agnt_status agnt_load_rom(AGNT_MACHINE *machine, const char *path, unsigned flags){
+	if(machine->cart != NULL){
+		return AGNT_ERROR_LOADED;
+	}
+
+	LOGGER logger = { agnt_forward_log, machine };
+	CART *cart = new_cart_mode(path, (flags & AGNT_LOAD_LOW_MEMORY) ? CART_LOAD_STREAMING : CART_LOAD_MMAP, &logger);
+	if(cart == NULL){
+		return AGNT_ERROR_LOAD;
+	}
+
+	machine->mmc = new_MMC(cart, path);
+	if(machine->mmc.ctx == NULL){
+		destroy_cart(cart);
+		return AGNT_ERROR_UNSUPPORTED;
+	}
+
+	// The MMU points back at the MMC, which is why both live in the machine rather than on the stack.
+	machine->cart = cart;
+	machine->mmu = new_mmu(&machine->mmc);
+	machine->cpu = new_cpu(&machine->mmu);
+	machine->cpu->PC = cpu_read16(0xFFFC, &machine->mmc);
+	machine->timing = timing_for(cart->timing_type);
+	machine->target_cycles = 0;
+	machine->rewind = NULL;
+	return AGNT_OK;
+}
+
+uint64_t agnt_step_cycles(AGNT_MACHINE *machine, uint64_t cycles){
+	if(machine->cpu == NULL){
+		return 0;
+	}
+
+	CPU *cpu = machine->cpu;
+	uint64_t start = cpu->cycles;
+	machine->target_cycles += cycles;
+	machine_run(cpu, machine->target_cycles);
+	return cpu->cycles - start;
+}
+
+uint64_t agnt_step_frame(AGNT_MACHINE *machine){
+	if(machine->cpu == NULL){
+		return 0;
+	}
+
+	uint64_t end = machine_frame_end(machine->cpu);
+	uint64_t target = end > machine->target_cycles ? end - machine->target_cycles : 0;
+	uint64_t cycles = agnt_step_cycles(machine, target);
+	if(machine->rewind != NULL){
+		rewind_push(machine->rewind);
+	}
+	return cycles;
+}
+
+void agnt_set_buttons(AGNT_MACHINE *machine, unsigned port, uint8_t buttons){
+	if(port < 2){
+		machine->mmu.controllers.buttons[port] = buttons;
+	}
+}
+
+uint64_t agnt_cycles(const AGNT_MACHINE *machine){
+	return machine->cpu != NULL ? machine->cpu->cycles : 0;
+}
+
+uint64_t agnt_instructions(const AGNT_MACHINE *machine){
+	return machine->cpu != NULL ? machine->cpu->instructions : 0;
+}
+
+uint64_t agnt_idle_cycles(const AGNT_MACHINE *machine){
+	return machine->cpu != NULL ? machine->cpu->idle.skipped_cycles : 0;
+}
+
+uint64_t agnt_frames(const AGNT_MACHINE *machine){
+	// The scheduler counts them, since how long each is depends on whether it skipped its odd frame dot.
+	return machine->cpu != NULL ? machine->mmu.scheduler.frame : 0;
+}
+
+// After a savestate load or a rewind. The frame count comes back with the scheduler, so only where steps are
+// counted from needs moving.
+static void agnt_resync_frames(AGNT_MACHINE *machine){
+	machine->target_cycles = machine->cpu->cycles;
+}
+
+size_t agnt_state_size(void){
+	return sizeof(SAVESTATE);
+}
+
+static bool agnt_state_buffer_ok(const void *buffer, size_t size){
+	return buffer != NULL && size >= sizeof(SAVESTATE) && (uintptr_t)buffer % _Alignof(SAVESTATE) == 0;
+}
+
+enum agnt_status agnt_save_state(AGNT_MACHINE *machine, void *buffer, size_t size){
+	if(machine->cpu == NULL){
+		return AGNT_ERROR_NO_ROM;
+	}
+	if(!agnt_state_buffer_ok(buffer, size) || !savestate_save(machine->cpu, (SAVESTATE*)buffer)){
+		return AGNT_ERROR_STATE;
+	}
+	return AGNT_OK;
+}
+
+enum agnt_status agnt_load_state(AGNT_MACHINE *machine, const void *buffer, size_t size){
+	if(machine->cpu == NULL){
+		return AGNT_ERROR_NO_ROM;
+	}
+	if(!agnt_state_buffer_ok(buffer, size) || !savestate_load(machine->cpu, (const SAVESTATE*)buffer)){
+		return AGNT_ERROR_STATE;
+	}
+
+	agnt_resync_frames(machine);
+	if(machine->rewind != NULL){
+		rewind_reset(machine->rewind);
+	}
+	return AGNT_OK;
+}
+
+enum agnt_status agnt_rewind_enable(AGNT_MACHINE *machine, size_t budget, size_t max_frames){
+	if(machine->cpu == NULL){
+		return AGNT_ERROR_NO_ROM;
+	}
+
+	if(machine->rewind != NULL){
+		destroy_rewind(machine->rewind);
+		machine->rewind = NULL;
+	}
+	if(budget == 0){
+		return AGNT_OK;
+	}
+
+	machine->rewind = new_rewind(machine->cpu, budget, max_frames, AGNT_REWIND_KEYFRAME_INTERVAL);
+	if(machine->rewind == NULL){
+		return AGNT_ERROR_REWIND;
+	}
+	// Start with where we are now, so there's something to go back to after the first frame.
+	rewind_push(machine->rewind);
+	return AGNT_OK;
+}
+
+bool agnt_rewind_step_back(AGNT_MACHINE *machine){
+	if(machine->rewind == NULL || !rewind_step_back(machine->rewind)){
+		return false;
+	}
+	agnt_resync_frames(machine);
+	return true;
+}
+
+size_t agnt_rewind_frames(const AGNT_MACHINE *machine){
+	return machine->rewind != NULL ? rewind_frames(machine->rewind) : 0;
+}
+
+bool agnt_flush_battery(AGNT_MACHINE *machine){
+	return machine->cart == NULL || mmc_flush_battery(&machine->mmc);
+}
+
+void agnt_destroy(AGNT_MACHINE *machine){
+	if(machine == NULL){
+		return;
+	}
+
+	if(machine->cart != NULL){
+		if(machine->rewind != NULL){
+			destroy_rewind(machine->rewind);
+		}
+		free(machine->cpu);
+		destroy_mmu(&machine->mmu);
+		destroy_mmc(&machine->mmc);
+		destroy_cart(machine->cart);
+	}
+	free(machine);
+}
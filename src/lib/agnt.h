@@ -0,0 +1,110 @@
+// agnt.h
+//
+//	- Public interface for libagnt, the emulator core as a library. This is the only header an embedding program
+//	  needs; everything else is internal. Machines are completely independent of each other (no globals, no
+//	  output of their own), so any number of them can be run in one process, each from whichever thread is
+//	  driving it. A single machine must not be used from two threads at once.
+#ifndef agnt_h
+#define agnt_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AGNT_API __attribute__((visibility("default")))
+
+typedef struct AGNT_MACHINE AGNT_MACHINE;
+
+enum agnt_status {
+	AGNT_OK,
+	AGNT_ERROR_NO_ROM,      // The machine needs a ROM loaded first.
+	AGNT_ERROR_LOAD,        // The ROM couldn't be read, or isn't a valid iNES/NES 2.0 image.
+	AGNT_ERROR_UNSUPPORTED, // The ROM's mapper isn't implemented.
+	AGNT_ERROR_LOADED,      // A ROM is already loaded, make a new machine instead.
+	AGNT_ERROR_STATE,       // The savestate buffer is the wrong size or alignment, damaged, or for another ROM.
+	AGNT_ERROR_REWIND       // The rewind budget is too small to hold anything.
+};
+
+enum agnt_log_levels {
+	AGNT_LOG_INFO,
+	AGNT_LOG_WARNING,
+	AGNT_LOG_ERROR
+};
+
+// Receives every message the machine would otherwise have printed. 'message' is only valid during the call.
+typedef void (*agnt_log_callback)(void *user, enum agnt_log_levels level, const char *message);
+
+// Flags for agnt_load_rom.
+#define AGNT_LOAD_LOW_MEMORY 0x01 // Only page in the parts of the ROM that get used, see CART_LOAD_STREAMING.
+
+// Returns NULL if out of memory.
+AGNT_API AGNT_MACHINE* agnt_create(void);
+
+// Messages are dropped until this is called. Set it before loading a ROM to hear about problems with it.
+AGNT_API void agnt_set_logger(AGNT_MACHINE *machine, agnt_log_callback callback, void *user);
+
+// Loads a ROM and powers the machine on. Battery saves are read from and written to the same path as the ROM,
+// with a .sav extension.
+AGNT_API enum agnt_status agnt_load_rom(AGNT_MACHINE *machine, const char *path, unsigned flags);
+
+// Runs for at least 'cycles' CPU cycles. Instructions aren't split, so this can overshoot by a few cycles,
+// which is taken off the next call. Returns the number of cycles actually run.
+AGNT_API uint64_t agnt_step_cycles(AGNT_MACHINE *machine, uint64_t cycles);
+
+// Runs until the end of the current frame, going by the cart's region (NTSC frames are 29780.5 CPU cycles, so
+// every other one is a cycle longer). Returns the number of cycles run.
+AGNT_API uint64_t agnt_step_frame(AGNT_MACHINE *machine);
+
+// Controller buttons, for port 0 or 1, held until changed. Games read them once a frame at most, so set them
+// before agnt_step_frame.
+#define AGNT_BUTTON_A      0x01
+#define AGNT_BUTTON_B      0x02
+#define AGNT_BUTTON_SELECT 0x04
+#define AGNT_BUTTON_START  0x08
+#define AGNT_BUTTON_UP     0x10
+#define AGNT_BUTTON_DOWN   0x20
+#define AGNT_BUTTON_LEFT   0x40
+#define AGNT_BUTTON_RIGHT  0x80
+AGNT_API void agnt_set_buttons(AGNT_MACHINE *machine, unsigned port, uint8_t buttons);
+
+// Totals since the ROM was loaded.
+AGNT_API uint64_t agnt_cycles(const AGNT_MACHINE *machine);
+AGNT_API uint64_t agnt_instructions(const AGNT_MACHINE *machine);
+AGNT_API uint64_t agnt_frames(const AGNT_MACHINE *machine);
+
+// How many of agnt_cycles() were skipped rather than run, because the game was sitting in a loop that
+// couldn't do anything until an interrupt. The machine's state is exactly the same either way.
+AGNT_API uint64_t agnt_idle_cycles(const AGNT_MACHINE *machine);
+
+// Savestates. A state is agnt_state_size() bytes (the same for every ROM), and the buffer has to be 8 byte aligned,
+// which anything from malloc is. Neither call allocates. States can be written to disk as they are, and loaded back
+// into any machine running the same ROM with the same version of the library.
+AGNT_API size_t agnt_state_size(void);
+AGNT_API enum agnt_status agnt_save_state(AGNT_MACHINE *machine, void *buffer, size_t size);
+AGNT_API enum agnt_status agnt_load_state(AGNT_MACHINE *machine, const void *buffer, size_t size);
+
+// Rewind. Once enabled, every agnt_step_frame records the frame, keeping at most 'max_frames' of them in at most
+// 'budget' bytes. A frame is usually well under 1KiB, but the budget needs room for one uncompressed keyframe
+// (about 85KiB). Enabling it again starts over with the new limits, and a budget of 0 turns it off. Loading a
+// savestate forgets the history.
+AGNT_API enum agnt_status agnt_rewind_enable(AGNT_MACHINE *machine, size_t budget, size_t max_frames);
+
+// Goes back one frame. Cheap enough to call every frame while a rewind button is held. Returns false once
+// there's no more history.
+AGNT_API bool agnt_rewind_step_back(AGNT_MACHINE *machine);
+AGNT_API size_t agnt_rewind_frames(const AGNT_MACHINE *machine);
+
+// Writes battery backed RAM to disk if it has changed. Also done by agnt_destroy. Returns false on failure.
+AGNT_API bool agnt_flush_battery(AGNT_MACHINE *machine);
+
+AGNT_API void agnt_destroy(AGNT_MACHINE *machine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
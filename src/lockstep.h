@@ -0,0 +1,587 @@
+#ifndef lockstep_h
+#define lockstep_h
+
+// Lockstep interpreter for up to LOCKSTEP_LANES copies of the same cart, for workloads where lots of machines run
+// the same code and only differ in their input. The CPU registers and the 2KiB of RAM are kept as structures of
+// arrays, one entry per lane, with RAM interleaved so that any one address in every lane is one contiguous
+// vector. While the lanes agree on PC, each instruction is executed once for all of them with vector operations
+// (compiled for both AVX2 and plain SSE2, picked at load time, see lockstep_vector_step). When they disagree,
+// the group of lanes furthest behind in the code (lowest PC) goes first, which tends to bring them back together
+// at the end of an if/else, and lanes on their own go through the normal scalar interpreter.
+//
+// Each lane has its own mapper and MMU, so bank switching can differ between lanes (code is only run as a vector
+// while every lane has the same bank mapped under PC), and all of them share the one cart. Lanes also have their
+// own scheduler, and get their NMIs and DMAs one at a time between steps.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include "cpu.h"
+#include "mmu.h"
+#include "machine.h"
+#include "cart.h"
+#include "timing.h"
+#include "json.h"
+#include "platform.h"
+#include "mappers/delegator.h"
+
+#define LOCKSTEP_LANES 32 // One AVX2 register of bytes.
+#define LOCKSTEP_MAX_WAIT 64 // Steps a lane can be left behind for before it's run regardless, so loops can't starve it.
+
+typedef uint8_t lane_bytes __attribute__((vector_size(LOCKSTEP_LANES), aligned(LOCKSTEP_LANES), may_alias));
+typedef int8_t lane_mask __attribute__((vector_size(LOCKSTEP_LANES), aligned(LOCKSTEP_LANES), may_alias));
+
+// What each opcode does in vector form. Anything not listed is always run through the scalar interpreter.
+enum lockstep_ops {
+	LS_SCALAR,
+	LS_LDA, LS_LDX, LS_LDY, LS_STA, LS_STX, LS_STY,
+	LS_AND, LS_ORA, LS_EOR, LS_ADC, LS_SBC, LS_CMP, LS_CPX, LS_CPY, LS_BIT,
+	LS_TAX, LS_TAY, LS_TXA, LS_TYA, LS_INX, LS_INY, LS_DEX, LS_DEY,
+	LS_ASL_A, LS_LSR_A, LS_ROL_A, LS_ROR_A, LS_INC, LS_DEC,
+	LS_CLC, LS_SEC, LS_CLV, LS_NOP, LS_JMP,
+	LS_BPL, LS_BMI, LS_BVC, LS_BVS, LS_BCC, LS_BCS, LS_BNE, LS_BEQ
+};
+
+typedef struct {
+	// Registers, as in CPU, one entry per lane.
+	_Alignas(LOCKSTEP_LANES) uint8_t A[LOCKSTEP_LANES];
+	_Alignas(LOCKSTEP_LANES) uint8_t X[LOCKSTEP_LANES];
+	_Alignas(LOCKSTEP_LANES) uint8_t Y[LOCKSTEP_LANES];
+	_Alignas(LOCKSTEP_LANES) uint8_t F[LOCKSTEP_LANES];
+	_Alignas(LOCKSTEP_LANES) uint8_t SP[LOCKSTEP_LANES];
+	_Alignas(LOCKSTEP_LANES) uint8_t n_result[LOCKSTEP_LANES];
+	_Alignas(LOCKSTEP_LANES) uint8_t z_result[LOCKSTEP_LANES];
+	_Alignas(LOCKSTEP_LANES) uint8_t c_result[LOCKSTEP_LANES];
+	_Alignas(LOCKSTEP_LANES) uint8_t v_result[LOCKSTEP_LANES];
+	uint16_t PC[LOCKSTEP_LANES];
+	bool jammed[LOCKSTEP_LANES];
+	uint64_t cycles[LOCKSTEP_LANES];
+	uint64_t instructions[LOCKSTEP_LANES];
+	unsigned waiting[LOCKSTEP_LANES]; // Steps since the lane last ran.
+
+	// RAM, interleaved: ram[address][lane].
+	_Alignas(LOCKSTEP_LANES) uint8_t ram[0x800][LOCKSTEP_LANES];
+
+	unsigned lanes; // How many of the above are in use. The rest are ignored (but still computed on).
+	MMC mmc[LOCKSTEP_LANES];
+	MMU mmu[LOCKSTEP_LANES]; // Each points at its own column of 'ram'.
+	CPU scratch; // Lanes are copied in and out of this to go through tick_cpu.
+	const TIMING *timing;
+	uint8_t ops[256]; // enum lockstep_ops for each opcode.
+
+	// Stats.
+	uint64_t steps;
+	uint64_t divergent_steps; // Steps where the lanes still running weren't all at the same PC.
+	uint64_t lane_instructions;
+	uint64_t vector_lane_instructions; // Lane-instructions executed by lockstep_vector_step.
+	uint64_t reconvergences; // Times the lanes came back together after diverging.
+	bool diverged;
+	bool interrupted;
+	double seconds; // Wall time spent in lockstep_run_frames.
+} LOCKSTEP;
+
+// Works out which vector op (if any) an opcode table entry is, by looking at its handler.
+static inline enum lockstep_ops lockstep_op_for(const OPCODE *op){
+	static const struct {
+		void (*execute)(CPU*, uint16_t);
+		enum lockstep_ops vector;
+	} ops[] = {
+		{ LDA, LS_LDA }, { LDX, LS_LDX }, { LDY, LS_LDY }, { STA, LS_STA }, { STX, LS_STX }, { STY, LS_STY },
+		{ AND, LS_AND }, { ORA, LS_ORA }, { EOR, LS_EOR }, { ADC, LS_ADC }, { SBC, LS_SBC }, { CMP, LS_CMP },
+		{ CPX, LS_CPX }, { CPY, LS_CPY }, { BIT, LS_BIT }, { TAX, LS_TAX }, { TAY, LS_TAY }, { TXA, LS_TXA },
+		{ TYA, LS_TYA }, { INX, LS_INX }, { INY, LS_INY }, { DEX, LS_DEX }, { DEY, LS_DEY },
+		{ ASL_A, LS_ASL_A }, { LSR_A, LS_LSR_A }, { ROL_A, LS_ROL_A }, { ROR_A, LS_ROR_A },
+		{ INC, LS_INC }, { DEC, LS_DEC }, { CLC, LS_CLC }, { SEC, LS_SEC }, { CLV, LS_CLV }, { NOP, LS_NOP },
+		{ JMP, LS_JMP }, { BPL, LS_BPL }, { BMI, LS_BMI }, { BVC, LS_BVC }, { BVS, LS_BVS }, { BCC, LS_BCC },
+		{ BCS, LS_BCS }, { BNE, LS_BNE }, { BEQ, LS_BEQ }
+	};
+
+	// JMP ($xxxx) reads its pointer through the mapper, so it's left to the scalar interpreter.
+	if(op->mode == IND){
+		return LS_SCALAR;
+	}
+	for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++){
+		if(op->execute == ops[i].execute){
+			return ops[i].vector;
+		}
+	}
+	return LS_SCALAR;
+}
+
+static inline void destroy_lockstep(LOCKSTEP *ls){
+	for(unsigned lane = 0; lane < ls->lanes; lane++){
+		destroy_mmu(&ls->mmu[lane]);
+		destroy_mmc(&ls->mmc[lane]);
+	}
+	free(ls);
+}
+
+// Powers on 'lanes' (at most LOCKSTEP_LANES) copies of 'cart'. As with the runner, batteries are never saved and the
+// cart has to outlive the lockstep. Returns NULL if the cart's mapper isn't supported.
+static inline LOCKSTEP* new_lockstep(CART *cart, unsigned lanes){
+	if(lanes == 0 || lanes > LOCKSTEP_LANES){
+		return NULL;
+	}
+
+	LOCKSTEP *ls = (LOCKSTEP*)aligned_alloc(LOCKSTEP_LANES, (sizeof(LOCKSTEP) + LOCKSTEP_LANES - 1) / LOCKSTEP_LANES * LOCKSTEP_LANES);
+	memset(ls, 0, sizeof(LOCKSTEP));
+
+	for(unsigned lane = 0; lane < lanes; lane++){
+		ls->mmc[lane] = new_MMC(cart, NULL);
+		if(ls->mmc[lane].ctx == NULL){
+			destroy_lockstep(ls);
+			return NULL;
+		}
+		ls->lanes = lane + 1;
+		ls->mmu[lane] = new_mmu_strided(&ls->mmc[lane], &ls->ram[0][lane], LOCKSTEP_LANES);
+		ls->mmu[lane].cycles = &ls->cycles[lane];
+
+		// Same power on state as new_cpu.
+		ls->SP[lane] = 0xFD;
+		ls->F[lane] = 0x24;
+		ls->z_result[lane] = 1;
+		ls->PC[lane] = cpu_read16(0xFFFC, &ls->mmc[lane]);
+	}
+
+	for(int opcode = 0; opcode < 256; opcode++){
+		ls->ops[opcode] = lockstep_op_for(&opcode_table[opcode]);
+	}
+	ls->timing = timing_for(cart->timing_type);
+	return ls;
+}
+
+// For giving each lane different input.
+static inline void lockstep_poke(LOCKSTEP *ls, unsigned lane, uint16_t address, uint8_t value){
+	mmu_write(address, value, &ls->mmu[lane]);
+}
+
+static inline void lockstep_set_buttons(LOCKSTEP *ls, unsigned lane, unsigned port, uint8_t buttons){
+	ls->mmu[lane].controllers.buttons[port] = buttons;
+}
+
+// Copies a lane into the scratch CPU and back out again, for anything that needs a real CPU.
+static inline CPU* lockstep_lane_in(LOCKSTEP *ls, unsigned lane){
+	CPU *cpu = &ls->scratch;
+	cpu->mmu = &ls->mmu[lane];
+	cpu->A = ls->A[lane];
+	cpu->X = ls->X[lane];
+	cpu->Y = ls->Y[lane];
+	cpu->F = ls->F[lane];
+	cpu->SP = ls->SP[lane];
+	cpu->PC = ls->PC[lane];
+	cpu->n_result = ls->n_result[lane];
+	cpu->z_result = ls->z_result[lane];
+	cpu->c_result = ls->c_result[lane];
+	cpu->v_result = ls->v_result[lane];
+	cpu->jammed = ls->jammed[lane];
+	cpu->cycles = ls->cycles[lane];
+	cpu->instructions = ls->instructions[lane];
+	return cpu;
+}
+
+static inline void lockstep_lane_out(LOCKSTEP *ls, unsigned lane){
+	CPU *cpu = &ls->scratch;
+	ls->A[lane] = cpu->A;
+	ls->X[lane] = cpu->X;
+	ls->Y[lane] = cpu->Y;
+	ls->F[lane] = cpu->F;
+	ls->SP[lane] = cpu->SP;
+	ls->PC[lane] = cpu->PC;
+	ls->n_result[lane] = cpu->n_result;
+	ls->z_result[lane] = cpu->z_result;
+	ls->c_result[lane] = cpu->c_result;
+	ls->v_result[lane] = cpu->v_result;
+	ls->jammed[lane] = cpu->jammed;
+	ls->cycles[lane] = cpu->cycles;
+	ls->instructions[lane] = cpu->instructions;
+}
+
+// Runs a single lane through tick_cpu.
+static inline void lockstep_scalar_step(LOCKSTEP *ls, unsigned lane){
+	tick_cpu(lockstep_lane_in(ls, lane));
+	lockstep_lane_out(ls, lane);
+}
+
+// Handles a lane's scheduled events (see machine.h) once it has got to them, and IRQ, which cpu_run_until would
+// otherwise poll. Each lane has its own scheduler, as it has its own PPU and APU.
+static inline void lockstep_dispatch(LOCKSTEP *ls, unsigned lane){
+	SCHEDULER *s = &ls->mmu[lane].scheduler;
+	if(ls->cycles[lane] >= s->limit){
+		machine_dispatch(lockstep_lane_in(ls, lane));
+		lockstep_lane_out(ls, lane);
+		s->limit = scheduler_next_cycle(s);
+	}
+	if(mmu_irq(&ls->mmu[lane]) && !(ls->F[lane] & FLAG_I) && cpu_irq(lockstep_lane_in(ls, lane))){
+		lockstep_lane_out(ls, lane);
+	}
+}
+
+// Only the lanes in the group are changed.
+#define LOCKSTEP_BLEND(dst, value) ((dst) = (lane_bytes)(((lane_mask)(value) & group) | ((lane_mask)(dst) & ~group)))
+
+// Runs the instruction at the group's (shared) PC for every lane in the group at once. 'group' has 0xFF for each
+// lane in the group and 0 otherwise. Returns false without having changed anything if the instruction can't be
+// done as a vector, in which case it's up to the caller to run the lanes one at a time.
+//
+// target_clones has GCC build this twice, once with AVX2 (one instruction per operation for all 32 lanes) and once
+// for the baseline (SSE2, two), and pick whichever the CPU supports when the program is loaded.
+__attribute__((target_clones("avx2", "default")))
+static bool lockstep_vector_step(LOCKSTEP *ls, const uint8_t *group_lanes, unsigned leader){
+	const uint16_t PC = ls->PC[leader];
+
+	// The lanes only share code if they all have the same memory mapped under it. RAM is never the same memory,
+	// so code running from RAM is always scalar.
+	uint8_t *page = ls->mmu[leader].pages->read[PC >> 8];
+	uint8_t *next_page = ls->mmu[leader].pages->read[(uint16_t)(PC + 2) >> 8];
+	if(page == NULL || next_page == NULL){
+		return false;
+	}
+	for(unsigned lane = 0; lane < ls->lanes; lane++){
+		if(group_lanes[lane] && (ls->mmu[lane].pages->read[PC >> 8] != page
+			|| ls->mmu[lane].pages->read[(uint16_t)(PC + 2) >> 8] != next_page)){
+			return false;
+		}
+	}
+
+	DECODED decoded = cpu_decode(&ls->mmu[leader], PC);
+	const OPCODE *op = &opcode_table[decoded.opcode];
+	enum lockstep_ops kind = (enum lockstep_ops)ls->ops[decoded.opcode];
+	if(kind == LS_SCALAR){
+		return false;
+	}
+
+	const uint16_t next = PC + decoded.length;
+	const uint16_t operand = decoded.operand;
+
+	// Effective address for each lane, and whether it's the same for all of them.
+	uint16_t address[LOCKSTEP_LANES];
+	uint8_t crossed[LOCKSTEP_LANES];
+	bool uniform = true;
+	memset(crossed, 0, sizeof(crossed));
+	switch(op->mode){
+		case ZPG:
+		case ABS:
+			for(unsigned lane = 0; lane < LOCKSTEP_LANES; lane++){
+				address[lane] = op->mode == ZPG ? (operand & 0xFF) : operand;
+			}
+			break;
+		case ZPX:
+		case ZPY:
+		case ABX:
+		case ABY: {
+			const uint8_t *index = (op->mode == ZPX || op->mode == ABX) ? ls->X : ls->Y;
+			for(unsigned lane = 0; lane < LOCKSTEP_LANES; lane++){
+				uint16_t addr = operand + index[lane];
+				if(op->mode == ZPX || op->mode == ZPY){
+					addr &= 0xFF;
+				}
+				address[lane] = addr;
+				crossed[lane] = (op->mode == ABX || op->mode == ABY) && (addr & 0xFF00) != (operand & 0xFF00);
+			}
+			break;
+		}
+		case IZX:
+			for(unsigned lane = 0; lane < LOCKSTEP_LANES; lane++){
+				uint8_t ptr = operand + ls->X[lane];
+				address[lane] = ls->ram[ptr][lane] | ((uint16_t)ls->ram[(uint8_t)(ptr + 1)][lane] << 8);
+			}
+			break;
+		case IZY:
+			for(unsigned lane = 0; lane < LOCKSTEP_LANES; lane++){
+				uint16_t base = ls->ram[operand & 0xFF][lane] | ((uint16_t)ls->ram[(uint8_t)(operand + 1)][lane] << 8);
+				address[lane] = base + ls->Y[lane];
+				crossed[lane] = (address[lane] & 0xFF00) != (base & 0xFF00);
+			}
+			break;
+		default:
+			memset(address, 0, sizeof(address));
+			break;
+	}
+	for(unsigned lane = 0; lane < ls->lanes; lane++){
+		uniform = uniform && (!group_lanes[lane] || address[lane] == address[leader]);
+	}
+	const bool in_ram = uniform && address[leader] < 0x2000;
+	uint8_t *row = ls->ram[address[leader] & 0x7FF];
+
+	// Read-modify-writes are only done as vectors straight on RAM.
+	if((kind == LS_INC || kind == LS_DEC) && !in_ram){
+		return false;
+	}
+
+	// From here on, the instruction is going ahead.
+	const lane_mask group = *(const lane_mask*)group_lanes;
+	lane_bytes A = *(lane_bytes*)ls->A, X = *(lane_bytes*)ls->X, Y = *(lane_bytes*)ls->Y;
+	lane_bytes n = *(lane_bytes*)ls->n_result, z = *(lane_bytes*)ls->z_result;
+	lane_bytes c = *(lane_bytes*)ls->c_result, v = *(lane_bytes*)ls->v_result;
+
+	// The operand, for instructions that read one.
+	lane_bytes M = { 0 };
+	switch(kind){
+		case LS_LDA: case LS_LDX: case LS_LDY: case LS_AND: case LS_ORA: case LS_EOR: case LS_ADC:
+		case LS_SBC: case LS_CMP: case LS_CPX: case LS_CPY: case LS_BIT: case LS_INC: case LS_DEC:
+			if(op->mode == IMM){
+				M += (uint8_t)operand;
+			} else if(in_ram){
+				M = *(lane_bytes*)row;
+			} else {
+				uint8_t values[LOCKSTEP_LANES] = { 0 };
+				for(unsigned lane = 0; lane < ls->lanes; lane++){
+					if(group_lanes[lane]){
+						values[lane] = mmu_read(address[lane], &ls->mmu[lane]);
+					}
+				}
+				memcpy(&M, values, sizeof(M));
+			}
+			break;
+		default:
+			break;
+	}
+
+	lane_bytes taken = { 0 }; // For branches.
+	lane_bytes store; // For stores.
+	bool stores = false;
+	switch(kind){
+		case LS_LDA: LOCKSTEP_BLEND(A, M); LOCKSTEP_BLEND(n, M); LOCKSTEP_BLEND(z, M); break;
+		case LS_LDX: LOCKSTEP_BLEND(X, M); LOCKSTEP_BLEND(n, M); LOCKSTEP_BLEND(z, M); break;
+		case LS_LDY: LOCKSTEP_BLEND(Y, M); LOCKSTEP_BLEND(n, M); LOCKSTEP_BLEND(z, M); break;
+		case LS_STA: store = A; stores = true; break;
+		case LS_STX: store = X; stores = true; break;
+		case LS_STY: store = Y; stores = true; break;
+		case LS_AND: LOCKSTEP_BLEND(A, A & M); LOCKSTEP_BLEND(n, A); LOCKSTEP_BLEND(z, A); break;
+		case LS_ORA: LOCKSTEP_BLEND(A, A | M); LOCKSTEP_BLEND(n, A); LOCKSTEP_BLEND(z, A); break;
+		case LS_EOR: LOCKSTEP_BLEND(A, A ^ M); LOCKSTEP_BLEND(n, A); LOCKSTEP_BLEND(z, A); break;
+		case LS_SBC:
+			// SBC is ADC of the complement.
+			M = ~M;
+			// Fall through
+		case LS_ADC: {
+			// Carry out of the 8 bit sum is worked out from the two partial sums wrapping around.
+			lane_bytes carry_in = c & 1;
+			lane_bytes partial = A + M;
+			lane_bytes sum = partial + carry_in;
+			lane_bytes carry_out = (lane_bytes)((lane_mask)(partial < A) | (lane_mask)(sum < partial)) & 1;
+			LOCKSTEP_BLEND(v, ~(A ^ M) & (A ^ sum));
+			LOCKSTEP_BLEND(c, carry_out);
+			LOCKSTEP_BLEND(A, sum);
+			LOCKSTEP_BLEND(n, sum);
+			LOCKSTEP_BLEND(z, sum);
+			break;
+		}
+		case LS_CMP:
+		case LS_CPX:
+		case LS_CPY: {
+			lane_bytes reg = kind == LS_CMP ? A : (kind == LS_CPX ? X : Y);
+			LOCKSTEP_BLEND(c, (lane_bytes)(reg >= M) & 1);
+			LOCKSTEP_BLEND(n, reg - M);
+			LOCKSTEP_BLEND(z, reg - M);
+			break;
+		}
+		case LS_BIT: LOCKSTEP_BLEND(n, M); LOCKSTEP_BLEND(v, M << 1); LOCKSTEP_BLEND(z, A & M); break;
+		case LS_TAX: LOCKSTEP_BLEND(X, A); LOCKSTEP_BLEND(n, A); LOCKSTEP_BLEND(z, A); break;
+		case LS_TAY: LOCKSTEP_BLEND(Y, A); LOCKSTEP_BLEND(n, A); LOCKSTEP_BLEND(z, A); break;
+		case LS_TXA: LOCKSTEP_BLEND(A, X); LOCKSTEP_BLEND(n, X); LOCKSTEP_BLEND(z, X); break;
+		case LS_TYA: LOCKSTEP_BLEND(A, Y); LOCKSTEP_BLEND(n, Y); LOCKSTEP_BLEND(z, Y); break;
+		case LS_INX: LOCKSTEP_BLEND(X, X + 1); LOCKSTEP_BLEND(n, X); LOCKSTEP_BLEND(z, X); break;
+		case LS_INY: LOCKSTEP_BLEND(Y, Y + 1); LOCKSTEP_BLEND(n, Y); LOCKSTEP_BLEND(z, Y); break;
+		case LS_DEX: LOCKSTEP_BLEND(X, X - 1); LOCKSTEP_BLEND(n, X); LOCKSTEP_BLEND(z, X); break;
+		case LS_DEY: LOCKSTEP_BLEND(Y, Y - 1); LOCKSTEP_BLEND(n, Y); LOCKSTEP_BLEND(z, Y); break;
+		case LS_ASL_A: LOCKSTEP_BLEND(c, A >> 7); LOCKSTEP_BLEND(A, A << 1); LOCKSTEP_BLEND(n, A); LOCKSTEP_BLEND(z, A); break;
+		case LS_LSR_A: LOCKSTEP_BLEND(c, A & 1); LOCKSTEP_BLEND(A, A >> 1); LOCKSTEP_BLEND(n, A); LOCKSTEP_BLEND(z, A); break;
+		case LS_ROL_A: {
+			lane_bytes carry_in = c & 1;
+			LOCKSTEP_BLEND(c, A >> 7);
+			LOCKSTEP_BLEND(A, (A << 1) | carry_in);
+			LOCKSTEP_BLEND(n, A);
+			LOCKSTEP_BLEND(z, A);
+			break;
+		}
+		case LS_ROR_A: {
+			lane_bytes carry_in = c & 1;
+			LOCKSTEP_BLEND(c, A & 1);
+			LOCKSTEP_BLEND(A, (A >> 1) | (carry_in << 7));
+			LOCKSTEP_BLEND(n, A);
+			LOCKSTEP_BLEND(z, A);
+			break;
+		}
+		case LS_INC: store = M + 1; stores = true; LOCKSTEP_BLEND(n, store); LOCKSTEP_BLEND(z, store); break;
+		case LS_DEC: store = M - 1; stores = true; LOCKSTEP_BLEND(n, store); LOCKSTEP_BLEND(z, store); break;
+		case LS_CLC: LOCKSTEP_BLEND(c, c & 0); break;
+		case LS_SEC: LOCKSTEP_BLEND(c, (c & 0) + 1); break;
+		case LS_CLV: LOCKSTEP_BLEND(v, v & 0); break;
+		case LS_BPL: taken = (lane_bytes)((n & 0x80) == 0); break;
+		case LS_BMI: taken = (lane_bytes)((n & 0x80) != 0); break;
+		case LS_BVC: taken = (lane_bytes)((v & 0x80) == 0); break;
+		case LS_BVS: taken = (lane_bytes)((v & 0x80) != 0); break;
+		case LS_BCC: taken = (lane_bytes)((c & 1) == 0); break;
+		case LS_BCS: taken = (lane_bytes)((c & 1) != 0); break;
+		case LS_BNE: taken = (lane_bytes)(z != 0); break;
+		case LS_BEQ: taken = (lane_bytes)(z == 0); break;
+		default:
+			break;
+	}
+
+	*(lane_bytes*)ls->A = A;
+	*(lane_bytes*)ls->X = X;
+	*(lane_bytes*)ls->Y = Y;
+	*(lane_bytes*)ls->n_result = n;
+	*(lane_bytes*)ls->z_result = z;
+	*(lane_bytes*)ls->c_result = c;
+	*(lane_bytes*)ls->v_result = v;
+
+	if(stores){
+		if(in_ram){
+			// Straight into RAM skips mmu_write, so mark the page dirty the way it would have, for rewind.
+			LOCKSTEP_BLEND(*(lane_bytes*)row, store);
+			for(unsigned lane = 0; lane < ls->lanes; lane++){
+				if(group_lanes[lane]){
+					ls->mmu[lane].pages->dirty[address[leader] >> 8] = 1;
+				}
+			}
+		} else {
+			uint8_t values[LOCKSTEP_LANES];
+			memcpy(values, &store, sizeof(values));
+			for(unsigned lane = 0; lane < ls->lanes; lane++){
+				if(group_lanes[lane]){
+					mmu_write(address[lane], values[lane], &ls->mmu[lane]);
+				}
+			}
+		}
+	}
+
+	// Control flow and timing, lane by lane. Branch targets are the same for every lane, only whether they're
+	// taken differs.
+	uint8_t branch_taken[LOCKSTEP_LANES];
+	memcpy(branch_taken, &taken, sizeof(branch_taken));
+	uint16_t target = next;
+	uint8_t branch_crossed = 0;
+	if(op->mode == REL){
+		target = next + (int8_t)operand;
+		branch_crossed = (target & 0xFF00) != (next & 0xFF00);
+	} else if(kind == LS_JMP){
+		target = operand;
+	}
+
+	for(unsigned lane = 0; lane < ls->lanes; lane++){
+		if(!group_lanes[lane]){
+			continue;
+		}
+		unsigned cycles = op->cycles + (op->page_penalty & crossed[lane]);
+		if(op->mode == REL){
+			ls->PC[lane] = branch_taken[lane] ? target : next;
+			cycles += branch_taken[lane] ? 1 + branch_crossed : 0;
+		} else {
+			ls->PC[lane] = target;
+		}
+		ls->cycles[lane] += cycles;
+		ls->instructions[lane]++;
+		ls->vector_lane_instructions++;
+	}
+	return true;
+}
+
+// Runs one step: picks the group of lanes to go next out of those in 'running', and runs one instruction for
+// each lane in it.
+static inline void lockstep_step(LOCKSTEP *ls, const bool *running){
+	// Lowest PC first, unless someone's been waiting too long.
+	unsigned leader = LOCKSTEP_LANES;
+	for(unsigned lane = 0; lane < ls->lanes; lane++){
+		if(!running[lane]){
+			continue;
+		}
+		if(leader == LOCKSTEP_LANES || ls->PC[lane] < ls->PC[leader]){
+			leader = lane;
+		}
+	}
+	for(unsigned lane = 0; lane < ls->lanes; lane++){
+		if(running[lane] && ls->waiting[lane] > LOCKSTEP_MAX_WAIT){
+			leader = lane;
+			break;
+		}
+	}
+
+	_Alignas(LOCKSTEP_LANES) uint8_t group[LOCKSTEP_LANES] = { 0 };
+	unsigned in_group = 0, in_running = 0;
+	for(unsigned lane = 0; lane < ls->lanes; lane++){
+		in_running += running[lane];
+		if(running[lane] && ls->PC[lane] == ls->PC[leader]){
+			group[lane] = 0xFF;
+			in_group++;
+			ls->waiting[lane] = 0;
+		} else if(running[lane]){
+			ls->waiting[lane]++;
+		}
+	}
+
+	bool divergent = in_group != in_running;
+	ls->steps++;
+	ls->divergent_steps += divergent;
+	ls->lane_instructions += in_group;
+	if(ls->diverged && !divergent){
+		ls->reconvergences++;
+	}
+	ls->diverged = divergent;
+
+	if(in_group > 1 && lockstep_vector_step(ls, group, leader)){
+		return;
+	}
+	for(unsigned lane = 0; lane < ls->lanes; lane++){
+		if(group[lane]){
+			lockstep_scalar_step(ls, lane);
+		}
+	}
+}
+
+// Runs every lane until it has finished 'frames' more frames, or *stop becomes true.
+static inline void lockstep_run_frames(LOCKSTEP *ls, uint64_t frames, volatile sig_atomic_t *stop){
+	double start = platform_now();
+	uint64_t frame = 0;
+	for(; frame < frames && !*stop; frame++){
+		// Where each lane's frame ends, as in machine_frame_end. It's the same for every lane unless some skipped
+		// their odd frame dot and some didn't.
+		uint64_t end[LOCKSTEP_LANES];
+		for(unsigned lane = 0; lane < ls->lanes; lane++){
+			const SCHEDULER *s = &ls->mmu[lane].scheduler;
+			end[lane] = scheduler_cycle(s, scheduler_time(s, EVENT_FRAME_END));
+		}
+		bool running[LOCKSTEP_LANES];
+		for(;;){
+			bool any = false;
+			for(unsigned lane = 0; lane < ls->lanes; lane++){
+				lockstep_dispatch(ls, lane);
+				running[lane] = ls->cycles[lane] < end[lane];
+				any = any || running[lane];
+			}
+			if(!any){
+				break;
+			}
+			lockstep_step(ls, running);
+		}
+	}
+	ls->interrupted = frame != frames;
+	ls->seconds += platform_now() - start;
+}
+
+static inline void print_lockstep_json(FILE *fp, const LOCKSTEP *ls, const char *rom){
+	uint64_t cycles = 0;
+	for(unsigned lane = 0; lane < ls->lanes; lane++){
+		cycles += ls->cycles[lane];
+	}
+	double seconds = ls->seconds > 0 ? ls->seconds : 1e-9;
+
+	fprintf(fp, "{\"rom\": ");
+	json_string(fp, rom);
+	fprintf(fp, ", \"lanes\": %u, \"steps\": %llu, \"lane_instructions\": %llu, \"cycles\": %llu, \"seconds\": %.6f, "
+		"\"instructions_per_second\": %.0f, \"cycles_per_second\": %.0f, \"realtime_lanes\": %.2f, "
+		"\"divergence_rate\": %.4f, \"vector_rate\": %.4f, \"reconvergences\": %llu, \"interrupted\": %s}\n",
+		ls->lanes, (unsigned long long)ls->steps, (unsigned long long)ls->lane_instructions, (unsigned long long)cycles,
+		ls->seconds, ls->lane_instructions / seconds, cycles / seconds, cycles / seconds / timing_cpu_hz(ls->timing),
+		ls->steps ? (double)ls->divergent_steps / ls->steps : 0.0,
+		ls->lane_instructions ? (double)ls->vector_lane_instructions / ls->lane_instructions : 0.0,
+		(unsigned long long)ls->reconvergences, ls->interrupted ? "true" : "false");
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef log_h
+#define log_h
+
+// Warnings and status messages from the emulator core. The core never prints anything itself, everything goes
+// to whichever callback the cart was loaded with (see new_cart_mode), so a frontend can print it, a benchmark can
+// throw it away (some of these, unimplemented registers mostly, are on the hot path) and an embedding program
+// can do whatever it likes with it. No callback means no messages.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+
+enum log_levels {
+	LOG_INFO,
+	LOG_WARNING,
+	LOG_ERROR
+};
+
+typedef void (*log_callback)(void *user, enum log_levels level, const char *message);
+
+typedef struct {
+	log_callback callback;
+	void *user;
+} LOGGER;
+
+__attribute__((format(printf, 3, 4)))
+static inline void log_message(const LOGGER *logger, enum log_levels level, const char *format, ...){
+	if(logger == NULL || logger->callback == NULL){
+		return;
+	}
+
+	char message[512];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+	logger->callback(logger->user, level, message);
+}
+
+#endif
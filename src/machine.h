@@ -0,0 +1,86 @@
+#ifndef machine_h
+#define machine_h
+
+// Runs a whole machine - the CPU, plus whatever the scheduler has queued (see scheduler.h) - against the master
+// clock. The CPU goes flat out up to the next event, the event is handled, and so on. Everything that runs a
+// machine (main, the runner, run-ahead, libagnt) goes through here rather than calling tick_cpu itself.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "mmu.h"
+#include "ppu.h"
+#include "apu.h"
+#include "idle.h"
+#include "scheduler.h"
+
+// Handles every event that's due by the CPU's current cycle.
+static inline void machine_dispatch(CPU *cpu){
+	MMU *mmu = cpu->mmu;
+	SCHEDULER *s = &mmu->scheduler;
+
+	while(s->count != 0 && s->events[0].time <= cpu->cycles * s->timing->cpu_divider){
+		EVENT event = scheduler_pop(s);
+		s->dispatched[event.type]++;
+		switch(event.type){
+			case EVENT_VBLANK:
+				ppu_catch_up(&mmu->ppu, event.time);
+				if(mmu->ppu.ctrl & PPUCTRL_NMI){
+					cpu_nmi(cpu);
+				}
+				break;
+			case EVENT_FRAME_END:
+				// Finish the frame off, up to but not including the first dot of the next one.
+				ppu_catch_up(&mmu->ppu, event.time - 1);
+				apu_end_frame(&mmu->apu, scheduler_cycle(s, event.time));
+				// By now the PPU knows whether this frame skipped its odd frame dot, and so when the next starts.
+				s->frame++;
+				s->delay = ppu_frame_delay(&mmu->ppu, s->frame);
+				scheduler_push(s, scheduler_time(s, EVENT_VBLANK), EVENT_VBLANK);
+				scheduler_push(s, scheduler_time(s, EVENT_FRAME_END), EVENT_FRAME_END);
+				break;
+			case EVENT_NMI:
+				cpu_nmi(cpu);
+				break;
+			case EVENT_OAM_DMA:
+				// One cycle to get going, another if it started on an odd cycle, then 256 reads and writes.
+				cpu->cycles += 513 + (cpu->cycles & 1);
+				break;
+			case EVENT_APU_IRQ:
+			case EVENT_DMC_READ:
+				// Catching up does whatever it was, and the CPU takes the IRQ before its next instruction (see
+				// cpu_run_until) if it's let.
+				apu_catch_up(&mmu->apu, scheduler_cycle(s, event.time));
+				mmu_schedule_apu(mmu);
+				break;
+		}
+		// The CPU sits out the DMC's reads, whether they were done just now or by catching up before.
+		cpu->cycles += apu_take_stall(&mmu->apu);
+	}
+}
+
+// Runs until the CPU reaches cycle 'deadline', handling events on the way.
+static inline void machine_run(CPU *cpu, uint64_t deadline){
+	SCHEDULER *s = &cpu->mmu->scheduler;
+	while(cpu->cycles < deadline){
+		uint64_t next = scheduler_next_cycle(s);
+		s->limit = next < deadline ? next : deadline;
+		cpu_run_until(cpu, &s->limit);
+		machine_dispatch(cpu);
+	}
+}
+
+// The cycle the current frame ends on. Frames are a whole number of master clocks but not of CPU cycles, so
+// this is rounded up.
+static inline uint64_t machine_frame_end(const CPU *cpu){
+	const SCHEDULER *s = &cpu->mmu->scheduler;
+	return scheduler_cycle(s, scheduler_time(s, EVENT_FRAME_END));
+}
+
+// Runs to the end of the current frame.
+static inline void machine_run_frame(CPU *cpu){
+	machine_run(cpu, machine_frame_end(cpu));
+}
+
+#endif
@@ -2,6 +2,17 @@
 #include "cart.h"
 #include "mappers/delegator.h"
 #include "mmu.h"
+#include "scanner.h"
+#include "headless.h"
+#include "runner.h"
+#include "lockstep.h"
+#include "savestate.h"
+#include "runahead.h"
+#include "present.h"
+#include "video_out.h"
+#include "audio_out.h"
+#include "rate_control.h"
+#include "log.h"
 
 #include <stdio.h>
 #include <stdint.h>
@@ -9,13 +20,57 @@
 #include <string.h>
 #include <stdbool.h>
 
-bool should_stop = false;
+volatile sig_atomic_t should_stop = false;
 
 void handle(int signum){
 	(void)signum;
 	should_stop = true;
 }
 
+// Everything the emulator core has to say ends up here. 'user' is where anything but errors goes, stdout if NULL.
+void print_log(void *user, enum log_levels level, const char *message){
+	fputs(message, level == LOG_ERROR ? stderr : user != NULL ? (FILE*)user : stdout);
+}
+
+// Savestate files, for --load-state and --save-state. These go to stderr rather than the log, so they're still
+// seen in --bench mode. Both return false on failure.
+bool load_state_file(CPU *cpu, const char *path){
+	SAVESTATE *state = (SAVESTATE*)malloc(sizeof(SAVESTATE));
+	bool ok = savestate_read(state, path) && savestate_load(cpu, state);
+	if(!ok){
+		fprintf(stderr, "Fatal: couldn't load savestate %s.\n", path);
+	}
+	free(state);
+	return ok;
+}
+
+bool save_state_file(CPU *cpu, const char *path){
+	SAVESTATE *state = (SAVESTATE*)malloc(sizeof(SAVESTATE));
+	bool ok = savestate_save(cpu, state) && savestate_write(state, path);
+	if(!ok){
+		fprintf(stderr, "Error: couldn't write savestate %s. errno = %d\n", path, errno);
+	}
+	free(state);
+	return ok;
+}
+
+// Hands the frame's samples to whichever of the sound card and the WAV file there are. Returns false if the WAV
+// file couldn't be written.
+bool play_samples(APU *apu, AUDIO_OUT *device, AUDIO_OUT *wav){
+	int16_t samples[1024];
+	unsigned count;
+	bool ok = true;
+	while((count = apu_read_samples(apu, samples, sizeof(samples) / sizeof(samples[0]))) != 0){
+		if(device != NULL){
+			audio_out_push(device, samples, count);
+		}
+		if(wav != NULL){
+			ok = audio_out_push(wav, samples, count) && ok;
+		}
+	}
+	return ok;
+}
+
 void print_help_text(){
 	printf(
 		"Usage:\n"
@@ -23,19 +78,79 @@ void print_help_text(){
 		"Arguments:\n"
 		"\t-i, --info\n"
 		"\t\tDumps info about the input ROM file and exits.\n"
-		"\t--override-tv-format {one of NTSC or PAL}\n"
-		"\t\tOverrides the output TV format, between NTSC and PAL. Currently not implemented.\n"
+		"\t--override-tv-format {one of NTSC, PAL or Dendy}\n"
+		"\t\tRuns the ROM with the clock rates and frame timing of this region, whatever its header says.\n"
 		"\t-f, --force\n"
 		"\t\tForces AGNT-NES-Emulator to run the given ROM, regardless of if it supports it or not. This will cause problems!\n"
+		"\t--scan\n"
+		"\t\tScans the given directory (instead of a ROM file) for ROMs and writes an index of them. Files that haven't\n"
+		"\t\tchanged since the last scan are taken from the existing index rather than being reread.\n"
+		"\t--index {file}\n"
+		"\t\tThe ROM index to read/write. Defaults to 'library.agntidx'. When running a ROM, the index is used to correct\n"
+		"\t\tits header if it couldn't be parsed.\n"
+		"\t--export-json {file}, --export-csv {file}\n"
+		"\t\tWith --scan, also writes the index out as JSON or CSV.\n"
+		"\t--jobs {count}\n"
+		"\t\tWith --scan or --instances, the number of threads to use. Defaults to the number of cores.\n"
+		"\t--bench\n"
+		"\t\tRuns the ROM headless as fast as possible, then prints instructions/sec, cycles/sec and speed relative to\n"
+		"\t\tthe real console as JSON. Warnings are switched off while it runs.\n"
+		"\t--frames {count}, --cycles {count}\n"
+		"\t\tWith --bench, how long to run for, in emulated frames or CPU cycles. Defaults to 600 frames. Without --bench,\n"
+		"\t\t--frames stops after that many frames, which with SDL_VIDEODRIVER=dummy is a test of the window's code.\n"
+		"\t--instances {count}\n"
+		"\t\tWith --bench, runs this many copies of the ROM at once, spread over --jobs threads, and reports throughput\n"
+		"\t\tfor each thread. Only --frames is used to set the length. Batteries aren't saved.\n"
+		"\t--lockstep {count}\n"
+		"\t\tWith --bench, runs this many copies of the ROM (at most 32) in lockstep on one thread, executing each\n"
+		"\t\tinstruction once for every copy that's at the same place in the code, and reports how often they diverged.\n"
+		"\t\tOnly --frames is used to set the length. Batteries aren't saved.\n"
+		"\t--load-state {file}\n"
+		"\t\tStarts from a savestate instead of powering on. Also works with --bench.\n"
+		"\t--save-state {file}\n"
+		"\t\tSaves the state of the machine to this file on exit. Also works with --bench.\n"
+		"\t--run-ahead {frames}\n"
+		"\t\tHides up to this many frames of the game's own input lag by running ahead of what's shown and throwing\n"
+		"\t\tthe extra frames away. Costs this many extra frames of emulation per frame. With --bench, reports the\n"
+		"\t\textra cost instead of the usual numbers; only --frames is used to set the length.\n"
+	);
+	// Split in two, it's longer than C99 promises a string literal can be.
+	printf(
+		"\t--video-out {file}\n"
+		"\t\tWrites every frame to this file, FIFO or '-' for stdout, for an encoder or for regression tests. Messages\n"
+		"\t\tgo to stderr if it's stdout. Combine with --no-window to run as fast as the output can take it.\n"
+		"\t--video-format {one of rgb, indexed or y4m}\n"
+		"\t\tWith --video-out: raw 24 bit RGB or raw NES colour numbers, each after a short header (see src/video_out.h),\n"
+		"\t\tor YUV4MPEG2. Defaults to rgb.\n"
+		"\t--video-queue {frames}\n"
+		"\t\tWith --video-out, how many frames can be waiting to be written before the emulator waits. Defaults to %d.\n"
+		"\t--wav-out {file}\n"
+		"\t\tWrites the sound to this WAV file (16 bit mono), every sample of it. Combine with --no-window and --frames\n"
+		"\t\tfor a quick test of the sound.\n"
+		"\t--sample-rate {hz}\n"
+		"\t\tThe rate sound is made at. Defaults to %d.\n"
+		"\t--audio-latency {ms}\n"
+		"\t\tHow much sound to keep queued for the sound card, on average, from 5 to 100. Much under a frame's worth\n"
+		"\t\t(17ms) and there'll be gaps. Defaults to %.0f.\n"
+		"\t--audio-telemetry\n"
+		"\t\tLogs how much sound is queued and how it's being resampled to keep it there, once a second.\n"
+		"\t--no-audio\n"
+		"\t\tDoesn't play any sound. There's only ever sound along with the window, and only if built with SDL2.\n"
+		"\t--no-window\n"
+		"\t\tRuns without showing the picture, as fast as possible. This is also what happens if built without SDL2.\n"
+		"\t\tWith the window, the keyboard's the first controller: arrow keys, X is A, Z is B, right shift is Select\n"
+		"\t\tand return is Start.\n"
+		"\t--low-memory\n"
+		"\t\tOnly loads the parts of the ROM file that are actually used, on demand. For hosts with very little RAM.\n"
 		"Help:\n"
 		"\tAGNT-NES-Emulator will look for battery files with the same name as the input ROM file.\n"
 		"\tIf you rename your ROM file, you must rename your battery files to the same name\n"
-		"\t(before the file extension) for AGNT-NES-Emulator to find them.\n"
+		"\t(before the file extension) for AGNT-NES-Emulator to find them.\n",
+		VIDEO_DEFAULT_QUEUE, AUDIO_DEFAULT_RATE, RATE_DEFAULT_LATENCY_MS
 	);
 }
 
 int main(int argc, const char *argv[]){
-	printf("AGNT NES Emulator v0.1. Programmed by Matt598, 2023.\n");
 	if(argc < 2){
 		printf("Fatal: No input ROM provided. Use '-h' for help.\n");
 		return 1;
@@ -47,6 +162,31 @@ int main(int argc, const char *argv[]){
 	
 	bool cart_info = false;
 	bool force_flag = false;
+	enum cart_load_modes load_mode = CART_LOAD_MMAP;
+	bool scan = false;
+	const char *index_file = NULL;
+	const char *export_json = NULL;
+	const char *export_csv = NULL;
+	unsigned jobs = 0;
+	bool bench = false;
+	double bench_frames = 600;
+	bool frames_given = false;
+	bool window = true;
+	const char *video_path = NULL;
+	const char *video_format = "rgb";
+	unsigned video_queue = 0;
+	const char *wav_path = NULL;
+	unsigned sample_rate = AUDIO_DEFAULT_RATE;
+	double audio_latency = RATE_DEFAULT_LATENCY_MS;
+	bool audio_telemetry = false;
+	bool sound = true;
+	uint64_t bench_cycles = 0;
+	size_t instances = 0;
+	unsigned lanes = 0;
+	const char *load_state = NULL;
+	const char *save_state = NULL;
+	unsigned run_ahead = 0;
+	const char *tv_format = NULL;
 
 	for(int i = 0; i < argc; i++){
 		if(strncmp(argv[i], "-h", 2) == 0 || strncmp(argv[i], "--help", 6) == 0){
@@ -56,15 +196,106 @@ int main(int argc, const char *argv[]){
 			cart_info = true;	
 		} else if(strncmp(argv[i], "-f", 2) == 0 || strncmp(argv[i], "--force", 7) == 0){
 			force_flag = true;	
+		} else if(strncmp(argv[i], "--video-out", 11) == 0 && i + 1 < argc){
+			video_path = argv[++i];
+		} else if(strncmp(argv[i], "--video-format", 14) == 0 && i + 1 < argc){
+			video_format = argv[++i];
+		} else if(strncmp(argv[i], "--video-queue", 13) == 0 && i + 1 < argc){
+			video_queue = (unsigned)strtoul(argv[++i], NULL, 10);
+		} else if(strncmp(argv[i], "--wav-out", 9) == 0 && i + 1 < argc){
+			wav_path = argv[++i];
+		} else if(strncmp(argv[i], "--sample-rate", 13) == 0 && i + 1 < argc){
+			sample_rate = (unsigned)strtoul(argv[++i], NULL, 10);
+		} else if(strncmp(argv[i], "--audio-latency", 15) == 0 && i + 1 < argc){
+			audio_latency = strtod(argv[++i], NULL);
+		} else if(strncmp(argv[i], "--audio-telemetry", 17) == 0){
+			audio_telemetry = true;
+		} else if(strncmp(argv[i], "--no-audio", 10) == 0){
+			sound = false;
+		} else if(strncmp(argv[i], "--no-window", 11) == 0){
+			window = false;
+		} else if(strncmp(argv[i], "--low-memory", 12) == 0){
+			load_mode = CART_LOAD_STREAMING;
+		} else if(strncmp(argv[i], "--scan", 6) == 0){
+			scan = true;
+		} else if(strncmp(argv[i], "--index", 7) == 0 && i + 1 < argc){
+			index_file = argv[++i];
+		} else if(strncmp(argv[i], "--export-json", 13) == 0 && i + 1 < argc){
+			export_json = argv[++i];
+		} else if(strncmp(argv[i], "--export-csv", 12) == 0 && i + 1 < argc){
+			export_csv = argv[++i];
+		} else if(strncmp(argv[i], "--jobs", 6) == 0 && i + 1 < argc){
+			jobs = (unsigned)strtoul(argv[++i], NULL, 10);
+		} else if(strncmp(argv[i], "--bench", 7) == 0){
+			bench = true;
+		} else if(strncmp(argv[i], "--frames", 8) == 0 && i + 1 < argc){
+			bench_frames = strtod(argv[++i], NULL);
+			frames_given = true;
+		} else if(strncmp(argv[i], "--cycles", 8) == 0 && i + 1 < argc){
+			bench_cycles = strtoull(argv[++i], NULL, 10);
+		} else if(strncmp(argv[i], "--instances", 11) == 0 && i + 1 < argc){
+			instances = (size_t)strtoull(argv[++i], NULL, 10);
+		} else if(strncmp(argv[i], "--lockstep", 10) == 0 && i + 1 < argc){
+			lanes = (unsigned)strtoul(argv[++i], NULL, 10);
+		} else if(strncmp(argv[i], "--load-state", 12) == 0 && i + 1 < argc){
+			load_state = argv[++i];
+		} else if(strncmp(argv[i], "--save-state", 12) == 0 && i + 1 < argc){
+			save_state = argv[++i];
+		} else if(strncmp(argv[i], "--override-tv-format", 20) == 0 && i + 1 < argc){
+			tv_format = argv[++i];
+		} else if(strncmp(argv[i], "--run-ahead", 11) == 0 && i + 1 < argc){
+			run_ahead = (unsigned)strtoul(argv[++i], NULL, 10);
 		}
 	}
 
+	// Benchmark output has to be machine readable, so nothing else goes to stdout.
+	// So does the video, if it's going there.
+	bool video_stdout = video_path != NULL && strcmp(video_path, "-") == 0;
+	LOGGER logger = { bench ? NULL : print_log, video_stdout ? stderr : NULL };
+	log_message(&logger, LOG_INFO, "AGNT NES Emulator v0.1. Programmed by Matt598, 2023.\n");
+
+	// Library scan. This doesn't run anything, so it's done before we try to load a ROM.
+	if(scan){
+		const char *index_path = index_file != NULL ? index_file : "library.agntidx";
+		ROM_INDEX *previous = rom_index_load(index_path);
+
+		SCAN_STATS stats;
+		ROM_INDEX *index = rom_library_scan(argv[argc-1], previous, jobs, &stats);
+		printf("Scanned %zu ROM(s) in %fs with %u worker(s): %zu read, %zu unchanged, %zu failed, %zu header(s) corrected.\n",
+			stats.found, stats.seconds, stats.workers, stats.scanned, stats.reused, stats.failed, stats.corrected);
+
+		bool ok = rom_index_save(index, index_path);
+		if(export_json != NULL){
+			ok = rom_index_export_json(index, export_json) && ok;
+		}
+		if(export_csv != NULL){
+			ok = rom_index_export_csv(index, export_csv) && ok;
+		}
+
+		if(previous != NULL){
+			destroy_rom_index(previous);
+		}
+		destroy_rom_index(index);
+		return ok ? 0 : 1;
+	}
+
 	// Try to load cart.
-	CART *cart = new_cart(argv[argc-1]);
+	CART *cart = new_cart_mode(argv[argc-1], load_mode, &logger);
 	if(cart == NULL){
 		return 1;
 	}
 
+	// If we've been given an index, it might know better than the header.
+	if(index_file != NULL){
+		ROM_INDEX *index = rom_index_load(index_file);
+		if(index != NULL){
+			if(rom_index_apply(index, cart)){
+				log_message(&logger, LOG_INFO, "ROM header corrected from index %s.\n", index_file);
+			}
+			destroy_rom_index(index);
+		}
+	}
+
 	// If info run, print and return.
 	if(cart_info){
 		print_cart_info(cart);
@@ -72,6 +303,18 @@ int main(int argc, const char *argv[]){
 		return 0;
 	}
 
+	// Everything downstream (the scheduler, benchmarks, frame pacing) takes its timing from the cart.
+	if(tv_format != NULL){
+		enum timing_modes mode;
+		if(!timing_parse(tv_format, &mode)){
+			fprintf(stderr, "Fatal: unknown TV format '%s', expected NTSC, PAL or Dendy.\n", tv_format);
+			destroy_cart(cart);
+			return 1;
+		}
+		cart->timing_type = mode;
+		log_message(&logger, LOG_INFO, "TV format overridden to %s.\n", timing_for(mode)->name);
+	}
+
 	// This is (or rather presently, will be) a bunch of checks to stop us from running ROMs we don't support yet. Eventually these will all be removed,
 	// but for now we need to enforce this.
 	if(!force_flag){
@@ -79,10 +322,51 @@ int main(int argc, const char *argv[]){
 			printf("AGNT-NES-Emulator only supports ROMs for the NES/Famicom.\n");
 		}
 	} else {
-		printf("Warning: force flag specified, not running compatibility checks. Here be dragons!\n");
+		log_message(&logger, LOG_WARNING, "Warning: force flag specified, not running compatibility checks. Here be dragons!\n");
+	}
+
+	// Lots of copies of the same ROM, all sharing the one cart.
+	if(bench && instances != 0){
+		RUNNER *runner = new_runner(cart, instances, jobs);
+		if(runner == NULL){
+			destroy_cart(cart);
+			return 1;
+		}
+
+		runner_run(runner, (uint64_t)bench_frames, &should_stop);
+		print_runner_json(stdout, runner, argv[argc-1]);
+
+		destroy_runner(runner);
+		destroy_cart(cart);
+		return 0;
+	}
+
+	// Or all running the same code at once.
+	if(bench && lanes != 0){
+		if(lanes > LOCKSTEP_LANES){
+			fprintf(stderr, "Fatal: --lockstep can run at most %d copies.\n", LOCKSTEP_LANES);
+			destroy_cart(cart);
+			return 1;
+		}
+		LOCKSTEP *ls = new_lockstep(cart, lanes);
+		if(ls == NULL){
+			destroy_cart(cart);
+			return 1;
+		}
+
+		lockstep_run_frames(ls, (uint64_t)bench_frames, &should_stop);
+		print_lockstep_json(stdout, ls, argv[argc-1]);
+
+		destroy_lockstep(ls);
+		destroy_cart(cart);
+		return 0;
 	}
 
 	MMC mmc = new_MMC(cart, argv[argc-1]);
+	if(mmc.ctx == NULL){
+		destroy_cart(cart);
+		return 1;
+	}
 	
 
 	// The NES doesn't actually have a proper MMU - this is here to work out which function to
@@ -94,22 +378,183 @@ int main(int argc, const char *argv[]){
 	// and stick it in the program counter. This tells us where to begin running code from.
 	
 	uint16_t start = cpu_read16(0xFFFC, &mmc);
-	printf("Reset vector (0xFFFC): 0x%04X\n", start);
+	log_message(&logger, LOG_INFO, "Reset vector (0xFFFC): 0x%04X\n", start);
+	log_message(&logger, LOG_INFO, "ROM loaded in %fms, %fKiB of %fKiB resident.\n", cart->load_time * 1000.0, cart_resident_size(cart) / 1024.0F, cart->filesize / 1024.0F);
 
 	CPU *cpu = new_cpu(&mmu);
 	cpu->PC = start;
 
-	// Enter fetch-decode-execute cycle.
-	// For reference, the NES' PPU is clocked at 3 times the speed of the CPU,
-	// so for every CPU clock we'll need to clock the PPU 3 times.
-	while(!should_stop){
-		// Tick CPU.	
-		tick_cpu(cpu);
-	
+	const TIMING *timing = timing_for(cart->timing_type);
+	RUNAHEAD *runahead = new_runahead(run_ahead, timing);
+	if(runahead == NULL){
+		fprintf(stderr, "Fatal: out of memory.\n");
+		free(cpu);
+		destroy_mmu(&mmu);
+		destroy_mmc(&mmc);
+		destroy_cart(cart);
+		return 1;
+	}
+
+	int status = 0;
+	if(load_state != NULL && !load_state_file(cpu, load_state)){
+		status = 1;
+		should_stop = true;
+		bench = false;
+	}
+
+	if(bench && run_ahead != 0){
+		runahead_run(runahead, cpu, (uint64_t)bench_frames, &should_stop);
+		if(!should_stop){
+			runahead_measure(runahead, cpu);
+		}
+		print_runahead_json(stdout, runahead, argv[argc-1]);
+		should_stop = true;
+	} else if(bench){
+		uint64_t cycles = bench_cycles != 0 ? bench_cycles : (uint64_t)(bench_frames * timing->cpu_cycles_per_frame);
+
+		BENCH_RESULT result = run_headless(cpu, timing, cycles, &should_stop);
+		print_bench_json(stdout, &result, argv[argc-1], cart, mmu.decode, mmu.ppu.tiles);
+		should_stop = true;
+	}
+
+	// The window, if there's going to be one. It runs on its own thread, see present.h.
+	PRESENTER *presenter = NULL;
+	if(!should_stop && window){
+		presenter = new_presenter(&logger, &should_stop);
+	}
+	PACER pacer = new_pacer(timing);
+	if(presenter != NULL){
+		presenter_lock_pacer(&pacer, presenter, &logger);
+	}
+
+	// And the video stream, likewise.
+	VIDEO_OUT *video = NULL;
+	if(!should_stop && video_path != NULL){
+		enum video_formats format;
+		if(!video_parse_format(video_format, &format)){
+			fprintf(stderr, "Fatal: unknown video format '%s', expected rgb, indexed or y4m.\n", video_format);
+			status = 1;
+			should_stop = true;
+		} else {
+			// A reader going away should be a write error, not the end of the process.
+			signal(SIGPIPE, SIG_IGN);
+			video = new_video_out(video_path, format, video_queue, timing, &logger);
+			if(video == NULL){
+				status = 1;
+				should_stop = true;
+			}
+		}
+	}
+
+	// And the sound. The sound card only makes sense alongside the window, since without it nothing keeps the
+	// emulator to time; the WAV file takes whatever it's given. Either way the APU only synthesises anything if
+	// someone's listening.
+	AUDIO_OUT *device = NULL;
+	AUDIO_OUT *wav = NULL;
+	if(!should_stop && ((presenter != NULL && sound) || wav_path != NULL)){
+		if(sample_rate < 8000 || sample_rate > 192000){
+			fprintf(stderr, "Fatal: --sample-rate has to be between 8000 and 192000.\n");
+			status = 1;
+			should_stop = true;
+		}
+		if(!(audio_latency >= 5 && audio_latency <= 100)){
+			fprintf(stderr, "Fatal: --audio-latency has to be between 5 and 100.\n");
+			status = 1;
+			should_stop = true;
+		}
+		if(!should_stop && presenter != NULL && sound){
+			device = new_audio_device(sample_rate, audio_latency, &logger);
+			sample_rate = device != NULL ? device->sample_rate : sample_rate;
+		}
+		if(!should_stop && wav_path != NULL){
+			signal(SIGPIPE, SIG_IGN); // As with the video, this could be a FIFO.
+			wav = new_audio_wav(wav_path, sample_rate, &logger);
+			if(wav == NULL){
+				status = 1;
+				should_stop = true;
+			}
+		}
+		if(!should_stop && (device != NULL || wav != NULL) && !apu_start_output(&mmu.apu, sample_rate)){
+			fprintf(stderr, "Fatal: out of memory.\n");
+			status = 1;
+			should_stop = true;
+		}
+	}
+	// The sound card's clock and the one the emulator's paced by drift apart, see rate_control.h.
+	RATE_CONTROL rate = new_rate_control(timing, pacer.period, sample_rate, audio_latency);
+
+	// Enter fetch-decode-execute cycle, a frame at a time. Everything other than the CPU runs off the scheduler,
+	// see machine.h.
+	uint64_t frames = 0;
+	while(!should_stop && !(frames_given && frames >= (uint64_t)bench_frames)){
+		// The keyboard's the first controller, if there's a window to type into. Nothing's the second yet.
+		mmu.controllers.buttons[0] = presenter != NULL ? presenter_buttons(presenter) : 0;
+		mmu.controllers.buttons[1] = 0;
+		runahead_frame(runahead, cpu);
+		if(!play_samples(&mmu.apu, device, wav)){
+			status = 1;
+			break;
+		}
+		if(device != NULL){
+			apu_set_ratio(&mmu.apu, rate_control_update(&rate, audio_ring_fill(device->ring)));
+			if(audio_telemetry && rate.frames % 60 == 0){
+				print_rate_control_telemetry(&logger, &rate, atomic_load(&device->underruns));
+			}
+		}
+		if(video != NULL && !video_out_frame(video, mmu.ppu.picture)){
+			status = 1;
+			break;
+		}
+		if(presenter != NULL){
+			presenter_submit(presenter, mmu.ppu.picture);
+			presenter_pace(&pacer);
+		}
+
+		// Every 60 frames (about a second of game time), save the battery if the game has written to it. That
+		// happens on a thread of its own, so a slow disk can't hold up a frame. It's also saved on exit, this is
+		// just so a crash doesn't lose everything.
+		if(++frames % 60 == 0){
+			mmc_queue_battery(&mmc);
+		}
+	}
+
+	if(wav != NULL){
+		if(!audio_out_finish(wav)){
+			status = 1;
+		}
+		print_audio_stats(&logger, wav);
+		destroy_audio_out(wav);
+	}
+	if(device != NULL){
+		audio_out_finish(device);
+		print_audio_stats(&logger, device);
+		destroy_audio_out(device);
+	}
+	if(video != NULL){
+		if(!video_out_finish(video)){
+			status = 1;
+		}
+		print_video_stats(&logger, video);
+		destroy_video_out(video);
+	}
+	if(presenter != NULL){
+		print_presenter_stats(&logger, presenter, &pacer);
+		destroy_presenter(presenter);
+	}
+
+	if(run_ahead != 0 && runahead->presented_frames != 0){
+		log_message(&logger, LOG_INFO, "Ran %u frame(s) ahead for %llu frame(s), at %.2fx the CPU time of running normally.\n",
+			runahead->frames, (unsigned long long)runahead->presented_frames, 1.0 + runahead_cost(runahead));
+	}
+	destroy_runahead(runahead);
+
+	if(status == 0 && save_state != NULL && !save_state_file(cpu, save_state)){
+		status = 1;
 	}
 
+	free(cpu);
 	destroy_mmu(&mmu);
 	destroy_mmc(&mmc);
 	destroy_cart(cart);
-	return 0;
+	return status;
 }
@@ -2,22 +2,79 @@
 #define MMC1_h
 
 #include "../cart.h"
+#include "../decode_cache.h"
+#include "../tile_cache.h"
+#include "../page_table.h"
+#include "../log.h"
+#include "../battery.h"
 #include <stdint.h>
 #include <stdio.h>
-#include <assert.h>
 #include <string.h>
+#include <stdbool.h>
 
 typedef struct {
 	CART *cart;
-	FILE *fp; // Battery file. RAM is stored in the following sequence: PRG RAM, PRG NVRAM, CHR RAM, CHR NVRAM
 	uint8_t shift_register;
 
 	uint8_t control;
 	uint8_t chr_bank_0;
 	uint8_t chr_bank_1;
 	uint8_t prg_bank;
+
+	// Host pointers to the start of the bank visible in each PRG (16KiB) and CHR (4KiB) window. These are
+	// only recomputed when a register is written, see MMC1_update_banks.
+	size_t prg_start; // Offset of PRG ROM in ROM_contents.
+	uint8_t *prg_base[2];
+	uint8_t *chr_base[2];
+	uint8_t *chr_memory; // Either CHR ROM inside ROM_contents, or chr_ram.
+	uint8_t *chr_ram; // NULL if the cart has CHR ROM.
+	size_t chr_bank_count; // In 4KiB units.
+
+	// PRG RAM lives in memory and is mapped straight into the page table. If the cart has a battery, it's
+	// written back to the .sav file by 'battery', which compares against the contents as of the last save so
+	// that nothing on the write path has to track dirtiness.
+	uint8_t *prg_ram; // NULL if the cart has none.
+	size_t prg_ram_size;
+	BATTERY *battery; // NULL if the cart has no battery, or it isn't being saved.
+
+	DECODE_CACHE *decode_cache; // Optional, told about PRG bank switches if not NULL.
+	TILE_CACHE *tile_cache; // Optional, told about CHR bank switches and CHR RAM writes if not NULL.
+	PAGE_TABLE *pages; // Optional, PRG ROM pages are mapped into this if not NULL.
 } MMC1_ctx;
 
+// Everything about an MMC1 that can change while it runs, as it's laid out in a savestate (see savestate.h).
+// The layout is fixed, so PRG RAM always gets the largest amount an MMC1 board can address, used or not.
+#define MMC1_STATE_PRG_RAM 0x8000
+
+typedef struct {
+	uint32_t prg_ram_size; // How much of prg_ram is in use. Has to match the cart on load.
+	uint8_t shift_register;
+	uint8_t control;
+	uint8_t chr_bank_0;
+	uint8_t chr_bank_1;
+	uint8_t prg_bank;
+	uint8_t has_chr_ram;
+	uint8_t reserved[6];
+	uint8_t prg_ram[MMC1_STATE_PRG_RAM];
+	uint8_t chr_ram[0x2000]; // Unused if the cart has CHR ROM.
+} MMC1_STATE;
+
+static void MMC1_update_banks(MMC1_ctx *ctx);
+
+// Writes PRG RAM back to the .sav file if it has changed since the last save, and waits until it's on disk.
+// Returns false if the save failed, true otherwise (including if there was nothing to do).
+static inline bool MMC1_flush_battery(MMC1_ctx *ctx){
+	return ctx->battery == NULL || battery_flush(ctx->battery, ctx->prg_ram);
+}
+
+// Has PRG RAM saved in the background if it's changed since the last save. Never waits for the disk, so this is
+// the one to call while the game's running.
+static inline void MMC1_queue_battery(MMC1_ctx *ctx){
+	if(ctx->battery != NULL){
+		battery_queue(ctx->battery, ctx->prg_ram);
+	}
+}
+
 
 // Returns a heap-allocated string consisting of all characters from 'subj' that appear
 // after the last appearance of char 'tgt', or NULL if 'tgt' was not found or was the last character.
@@ -43,27 +100,39 @@ static char* strip_before(const char *subj, char tgt){
 
 	size_t new_len = old_len - index_of;
 	char *out = (char*)malloc(sizeof(char) * new_len);
-	for(size_t i = 0; i < new_len; i++){
-		out[i] = subj[index_of + i];
-	}
-	out[new_len - 1] = '\0'; 
+	// new_len includes subj's null terminator, so this copies that too.
+	memcpy(out, subj + index_of, new_len);
 
 	return out;
 }
 
-MMC1_ctx *MMC1_new_ctx(CART *cart, const char *filename){
+static inline MMC1_ctx *MMC1_new_ctx(CART *cart, const char *filename){
 	MMC1_ctx *ctx = (MMC1_ctx*)malloc(sizeof(MMC1_ctx));
 	ctx->cart = cart;
 	
-	// Check for PRG RAM. If size != 0 AND has_PRG_RAM then open a .sav file.
-	if(cart->has_PRG_RAM && cart->PRG_RAM_size != 0){
+	// Allocate PRG RAM. The MMC1 only has an 8KiB window for it, so anything smaller is mirrored (which we
+	// get for free by never allocating less than 8KiB), and anything larger is only reachable through the
+	// first 8KiB for now, though all of it is saved.
+	ctx->prg_ram_size = cart_prg_ram_size(cart);
+	ctx->prg_ram = NULL;
+	ctx->battery = NULL;
+	if(ctx->prg_ram_size != 0){
+		if(ctx->prg_ram_size < 0x2000){
+			ctx->prg_ram_size = 0x2000;
+		}
+		ctx->prg_ram = (uint8_t*)calloc(ctx->prg_ram_size, sizeof(uint8_t));
+	}
+
+	// If it's battery backed, work out where the .sav file goes and load it. No filename means the battery is
+	// never saved, for when several machines are running the same cart.
+	if(cart->has_PRG_RAM && ctx->prg_ram != NULL && filename != NULL){
 
 		char *fn = strip_before(filename, '/');
 		if(fn == NULL){
 			fn = (char*)malloc((strlen(filename) + 1)  * sizeof(char));
-			strncpy(fn, filename, strlen(filename) + 1);
+			memcpy(fn, filename, strlen(filename) + 1);
 		} else {
-			printf("Stripped last slash from string, is now %s.\n", fn);
+			log_message(&cart->logger, LOG_INFO, "Stripped last slash from string, is now %s.\n", fn);
 		}
 
 		size_t len = strlen(fn) + 1;
@@ -91,182 +160,283 @@ MMC1_ctx *MMC1_new_ctx(CART *cart, const char *filename){
 			fn[len - 4 + i] = new_extn[i];
 		}
 
-		printf("Will save battery to %s\n", fn);
-		ctx->fp = fopen(fn, "r+");
+		log_message(&cart->logger, LOG_INFO, "Will save battery to %s\n", fn);
+
+		FILE *fp = fopen(fn, "rb");
+		bool found = fp != NULL;
+		if(found){
+			size_t read_len = fread(ctx->prg_ram, sizeof(uint8_t), ctx->prg_ram_size, fp);
+			if(read_len != ctx->prg_ram_size){
+				log_message(&cart->logger, LOG_WARNING, "Warning: battery file %s is shorter than the cart's PRG RAM (%zu of %zu bytes), the rest will be zeroed.\n", fn, read_len, ctx->prg_ram_size);
+			}
+			fclose(fp);
+		}
+		// No save yet, so make one now rather than finding out we can't when it's time to save.
+		ctx->battery = new_battery(fn, ctx->prg_ram, ctx->prg_ram_size, !found, &cart->logger);
 		free(fn);
-	} else {
-		ctx->fp = NULL;
 	}
 
-	ctx->shift_register = 0;
-	ctx->control = 0;
+	// MMC1s power up with the last PRG bank locked to 0xC000, so the reset vector is always reachable.
+	ctx->shift_register = 0x10;
+	ctx->control = 0x0C;
 	ctx->chr_bank_0 = 0;
 	ctx->chr_bank_1 = 0;
 	ctx->prg_bank = 0;
+	ctx->decode_cache = NULL;
+	ctx->tile_cache = NULL;
+	ctx->pages = NULL;
+
+	ctx->prg_start = cart->trainer_present ? 16 + 512 : 16;
+	size_t chr_start = ctx->prg_start + (size_t)cart->PRG_ROM_len * 0x4000;
+	if(cart->CHR_ROM_len != 0 && chr_start + (size_t)cart->CHR_ROM_len * 0x2000 <= cart->filesize){
+		ctx->chr_ram = NULL;
+		ctx->chr_memory = cart->ROM_contents + chr_start;
+		ctx->chr_bank_count = (size_t)cart->CHR_ROM_len * 2;
+	} else {
+		// No CHR ROM (or a truncated one), so the cart has 8KiB of CHR RAM instead.
+		ctx->chr_ram = (uint8_t*)calloc(0x2000, sizeof(uint8_t));
+		ctx->chr_memory = ctx->chr_ram;
+		ctx->chr_bank_count = 2;
+	}
+	MMC1_update_banks(ctx);
 
 	return ctx;
 }
 
+// Works out which 16KiB PRG ROM bank is visible in the given window (0 = 0x8000-0xBFFF, 1 = 0xC000-0xFFFF).
+// Which bank ends up where depends on the PRG banking mode, which bits 2 and 3 of control tell us:
+// (The below values are the result of evaluating (control >> 2) & 3).
+// 0,1 - 32KiB bank is mapped to both windows. 32KiB bank number is {PRG bank reg} >> 1.
+// 2   - First bank locked to 0x8000, bank number switches bank starting at 0xC000.
+// 3   - Last bank locked to 0xC000, bank number switches bank starting at 0x8000.
+static inline int MMC1_prg_window_bank(MMC1_ctx *ctx, int window){
+	int bank = 0;
+	switch((ctx->control >> 2) & 0x3){
+		case 0:
+		case 1:
+			bank = (ctx->prg_bank & 0xE) | window;
+			break;
+		case 2:
+			bank = window ? (ctx->prg_bank & 0xF) : 0;
+			break;
+		case 3:
+			bank = window ? ctx->cart->PRG_ROM_len - 1 : (ctx->prg_bank & 0xF);
+			break;
+	}
+
+	return bank % ctx->cart->PRG_ROM_len;
+}
+
+// As above, but for the 4KiB CHR windows (0 = 0x0000-0x0FFF, 1 = 0x1000-0x1FFF). Bit 4 of control selects
+// between one 8KiB bank (chr_bank_0 >> 1, chr_bank_1 ignored) and two independent 4KiB banks.
+static inline int MMC1_chr_window_bank(MMC1_ctx *ctx, int window){
+	int bank;
+	if(ctx->control & 0x10){
+		bank = window ? ctx->chr_bank_1 : ctx->chr_bank_0;
+	} else {
+		bank = (ctx->chr_bank_0 & 0x1E) | window;
+	}
+
+	return bank % ctx->chr_bank_count;
+}
+
+// Recomputes the bank base pointers (and tells the decode cache, tile cache and page table about them). This is
+// the only place any bank arithmetic happens, and must be called whenever a register commit changes control, a
+// CHR bank or the PRG bank.
+static void MMC1_update_banks(MMC1_ctx *ctx){
+	for(int window = 0; window < 2; window++){
+		int bank = MMC1_prg_window_bank(ctx, window);
+		decode_cache_map(ctx->decode_cache, window, bank);
+
+		// If the ROM is shorter than its header claims, leave the window unmapped rather than
+		// pointing off the end of it.
+		size_t offset = ctx->prg_start + (size_t)bank * 0x4000;
+		ctx->prg_base[window] = offset + 0x4000 <= ctx->cart->filesize ? ctx->cart->ROM_contents + offset : NULL;
+		page_table_map(ctx->pages, 0x80 + window * 0x40, 0x40, ctx->prg_base[window], false);
+
+		int chr_bank = MMC1_chr_window_bank(ctx, window);
+		ctx->chr_base[window] = ctx->chr_memory + (size_t)chr_bank * 0x1000;
+		tile_cache_map(ctx->tile_cache, window, chr_bank, ctx->chr_base[window]);
+	}
+}
+
+static inline void MMC1_attach_decode_cache(MMC1_ctx *ctx, DECODE_CACHE *cache){
+	ctx->decode_cache = cache;
+	MMC1_update_banks(ctx);
+}
+
+static inline void MMC1_attach_tile_cache(MMC1_ctx *ctx, TILE_CACHE *cache){
+	ctx->tile_cache = cache;
+	MMC1_update_banks(ctx);
+}
+
+static inline void MMC1_attach_page_table(MMC1_ctx *ctx, PAGE_TABLE *pages){
+	ctx->pages = pages;
+	// PRG RAM isn't banked, so it only needs mapping once. Carts without any leave it to the slow path.
+	page_table_map(ctx->pages, 0x60, 0x20, ctx->prg_ram, true);
+	MMC1_update_banks(ctx);
+}
+
 // PRG
-void MMC1_cart_cpu_write(uint16_t address, uint8_t value, MMC1_ctx *ctx){
+static inline void MMC1_cart_cpu_write(uint16_t address, uint8_t value, MMC1_ctx *ctx){
 	if(0x6000 <= address && address <= 0x7FFF){
-		// PRG RAM. If this is present in the cart (aka our file pointer isn't null), mod it by the size if NES2, then work out which bank it's using and write to the appropriate address.
-		if(ctx->fp != NULL){
-			fseek(ctx->fp, address-0x6000, SEEK_SET);
-			fputc(value, ctx->fp);
-			rewind(ctx->fp); // TODO unnecessary, as fseek seeks from beginning/SEEK_SET.
+		// PRG RAM, if the cart has any. This is normally mapped in the page table, so we only end up here if
+		// the MMU hasn't been set up with one.
+		if(ctx->prg_ram != NULL){
+			ctx->prg_ram[address - 0x6000] = value;
 		}
 	} else if(0x8000 <= address){
-		// ...oh boy. This is a write to the 'shift' register, which the NES needs to use to control banking. It basically writes
-		// individual bits into our shift register before writing a final one with a particular address and a set 7th bit, selecting the destination // internal register to write to. 
-		
-		// Additionally since this register is a serial port, it doesn't *actually* read a high bit, rather a rising edge on bit zero. That means that if the serial port is written to consecutively with bit 0 set, it will be ignored due to the lack of rising edge. The reset bit however is a on/off signal, or something else that is not ignored consecutively.
+		// ...oh boy. This is a write to the 'shift' register, which the NES needs to use to control banking. Bit 0 of each write
+		// is shifted in (LSB first), and on the fifth write the whole 5 bit value is committed to the internal register picked
+		// by the address of that write. Writing anything with bit 7 set resets the shift register instead, and also locks the last
+		// PRG bank to 0xC000.
+
+		// shift_register is reset to 0x10, so that once that 1 has been shifted down to bit 0 we know this is the fifth write.
 		if((value & 0x80) == 0x80){
-			// Reset. Depending on the address, we now write the shift register to the desired internal register and reset it.
-			if(0x8000 <= address && address <= 0x9FFF){
-				// Control, write 5 bits.
-				ctx->control = (ctx->shift_register & 0x1F);
-			} else if(0xA000 <= address && address <= 0xBFFF){
-				// CHR bank 0
-				ctx->chr_bank_0 = (ctx->shift_register & 0x1F);
-			} else if(0xC000 <= address && address <= 0xDFFF){
-				// CHR bank 1
-				ctx->chr_bank_1 = (ctx->shift_register & 0x1F);
-			} else if(0xE000 <= address){
-				// PRG bank
-				ctx->prg_bank = (ctx->shift_register & 0x1F);
-			}
-			ctx->shift_register = 0;
-		} else {
-			ctx->shift_register <<= 1;
-			ctx->shift_register |= (value & 1);
+			ctx->shift_register = 0x10;
+			ctx->control |= 0x0C;
+			MMC1_update_banks(ctx);
+			return;
 		}
 
+		bool complete = ctx->shift_register & 1;
+		ctx->shift_register = (ctx->shift_register >> 1) | ((value & 1) << 4);
+		if(!complete){
+			return;
+		}
+
+		if(address <= 0x9FFF){
+			// Control
+			ctx->control = ctx->shift_register;
+		} else if(address <= 0xBFFF){
+			// CHR bank 0
+			ctx->chr_bank_0 = ctx->shift_register;
+		} else if(address <= 0xDFFF){
+			// CHR bank 1
+			ctx->chr_bank_1 = ctx->shift_register;
+		} else {
+			// PRG bank
+			ctx->prg_bank = ctx->shift_register;
+		}
+		ctx->shift_register = 0x10;
+		MMC1_update_banks(ctx);
 	}
 }
 
-uint8_t MMC1_cart_cpu_read(uint16_t address, MMC1_ctx *ctx){
+static inline uint8_t MMC1_cart_cpu_read(uint16_t address, MMC1_ctx *ctx){
 	// Depending on the address, this has to go to different parts of the cartridge.
 	if(address < 0x6000){
-		printf("Warning: Attempted read from MMC1 cart from unmapped address 0x%04X. Returning 0xFF.\n", address);
+		log_message(&ctx->cart->logger, LOG_WARNING, "Warning: Attempted read from MMC1 cart from unmapped address 0x%04X. Returning 0xFF.\n", address);
 		return 0xFF;
 	} else if(0x6000 <= address && address <= 0x7FFF){
 		// Read to PRG RAM. If it's not NULL, read from it, else return 0xFF. TODO what does the actual NES return here?
-		if(ctx->fp != NULL){
-			fseek(ctx->fp, address-0x6000, SEEK_SET);
-			return fgetc(ctx->fp);
+		if(ctx->prg_ram != NULL){
+			return ctx->prg_ram[address - 0x6000];
 		} else {
 			return 0xFF;
 		}
-	} else if(0x8000 <= address && address <= 0xBFFF){
-		// First PRG ROM bank. Each ROM bank is 16KiB in size, and on some MMC1s the first bank is switchable.
-		// To work that out, we need to know which banking mode we're in, which bits 2 and 3 of control tell us:
-		// (The below values are the result of evaluating (control >> 2) & 3).
-		// 0,1 - 32KiB bank is mapped to both this bank and the next bank. 32KiB offset determined by {PRG bank reg} & 0xFE.
-		// 2   - First bank locked to this address range, bank number switches bank starting at 0xC000
-		// 3   - Last bank locked to next address range, bank number switches bank starting at 0x8000.
-
-		size_t prg_address = 16;
-		if(ctx->cart->trainer_present){
-			prg_address += 512;
-		}
+	} else {
+		// PRG ROM. All the banking was worked out when the registers were last written, see MMC1_update_banks.
+		uint8_t *bank = ctx->prg_base[(address >> 14) & 1];
+		return bank != NULL ? bank[address & 0x3FFF] : 0xFF;
+	}
+}
 
-		switch((ctx->control >> 2) & 0x3){
-			case 0:
-			case 1:
-				// 32KiB mode, so add {PRG bank} & 0xFE * 0x8000 to {address - 0x8000} and return whatever byte is there in the cart.
-				{
-					size_t new_address = (ctx->prg_bank & 0xE) * 0x8000;
-					new_address += address - 0x8000;
-					new_address %= ctx->cart->PRG_ROM_len * 0x4000;
-
-					prg_address += new_address;
-				}
-				break;
-			case 2:
-				// We're locked to the first bank.
-				prg_address += address - 0x8000;
-				break;
-			case 3:
-				// Last bank is locked, we're using the PRG number.
-				{
-					size_t new_address = (ctx->prg_bank & 0xF) * 0x4000;
-					new_address += address - 0x8000;
-					new_address %= ctx->cart->PRG_ROM_len * 0x4000;
-					prg_address += new_address;
-				}
-				break;
-		}
+// CHR
+static inline void MMC1_cart_gpu_write(uint16_t address, uint8_t value, MMC1_ctx *ctx){
+	// Only does anything if the cart has CHR RAM rather than ROM.
+	if(ctx->chr_ram != NULL){
+		int window = (address >> 12) & 1;
+		ctx->chr_base[window][address & 0xFFF] = value;
+		tile_cache_invalidate(ctx->tile_cache, MMC1_chr_window_bank(ctx, window), (address >> 4) & 0xFF);
+	}
+}
 
-		// TODO remove
-		assert(prg_address < ctx->cart->filesize);
-		return ctx->cart->ROM_contents[prg_address];
-	} else if(0xC000 <= address){
-		// Second PRG ROM bank. This is as above, though cases 2 and 3 are swapped, the 'lock' case has different behaviour
-		// (locks to last 0x4000 bytes instead of first) and we won't modify cases 0 and 1 since the extra 0x4000 will
-		// serve as the 16KiB 'offset'.
-
-		size_t prg_address = 16;
-		if(ctx->cart->trainer_present){
-			prg_address += 512;
-		}
+static inline uint8_t MMC1_cart_gpu_read(uint16_t address, MMC1_ctx *ctx){
+	return ctx->chr_base[(address >> 12) & 1][address & 0xFFF];
+}
 
-		switch((ctx->control >> 2) & 0x3){
-			case 0:
-			case 1:
-				{
-					size_t new_address = (ctx->prg_bank & 0xE) * 0x8000;
-					new_address += address - 0x8000;
-					new_address %= ctx->cart->PRG_ROM_len * 0x4000;
+// Nametables. Bits 0 and 1 of control pick the mirroring: 0 and 1 are one screen (the lower or upper 1KiB of
+// the console's nametable RAM everywhere), 2 is vertical and 3 horizontal. Returns where 'address' lands in
+// that 2KiB.
+static inline uint16_t MMC1_nametable_address(uint16_t address, MMC1_ctx *ctx){
+	switch(ctx->control & 0x3){
+		case 0:
+			return address & 0x3FF;
+		case 1:
+			return 0x400 | (address & 0x3FF);
+		case 2:
+			return address & 0x7FF;
+		default:
+			return ((address >> 1) & 0x400) | (address & 0x3FF);
+	}
+}
 
-					prg_address += new_address;
-				}
-				break;
-			case 2:
-				{
-					size_t new_address = (ctx->prg_bank & 0xF) * 0x4000;
-					new_address += address - 0xC000;
-					new_address %= ctx->cart->PRG_ROM_len * 0x4000;
-
-					prg_address += new_address;
-				}
-				break;
-			case 3:
-				{
-					prg_address += (address - 0xC000) + ((ctx->cart->PRG_ROM_len-1) * 0x4000);
-				}
-				break;
-		}
-		
-		// TODO remove
-		assert(prg_address < ctx->cart->filesize);
-		return ctx->cart->ROM_contents[prg_address];
+// Returns false if the cart has more PRG RAM than fits in a savestate.
+static inline bool MMC1_save_state(MMC1_ctx *ctx, MMC1_STATE *state){
+	if(ctx->prg_ram_size > MMC1_STATE_PRG_RAM){
+		return false;
 	}
 
-	// Satiate compiler.
-	return 0;
+	state->prg_ram_size = (uint32_t)ctx->prg_ram_size;
+	state->shift_register = ctx->shift_register;
+	state->control = ctx->control;
+	state->chr_bank_0 = ctx->chr_bank_0;
+	state->chr_bank_1 = ctx->chr_bank_1;
+	state->prg_bank = ctx->prg_bank;
+	state->has_chr_ram = ctx->chr_ram != NULL;
+	memset(state->reserved, 0, sizeof(state->reserved));
+	// Whatever isn't in use is zeroed, so the same machine always gives the same bytes (and rewind's deltas
+	// don't pick up whatever was left in the buffer).
+	size_t prg_ram_used = ctx->prg_ram != NULL ? ctx->prg_ram_size : 0;
+	if(prg_ram_used != 0){
+		memcpy(state->prg_ram, ctx->prg_ram, prg_ram_used);
+	}
+	memset(state->prg_ram + prg_ram_used, 0, MMC1_STATE_PRG_RAM - prg_ram_used);
+	if(ctx->chr_ram != NULL){
+		memcpy(state->chr_ram, ctx->chr_ram, 0x2000);
+	} else {
+		memset(state->chr_ram, 0, sizeof(state->chr_ram));
+	}
+	return true;
 }
 
-// CHR TODO
-void MMC1_cart_gpu_write(uint16_t address, uint8_t value, MMC1_ctx *ctx){
-	(void)address;
-	(void)value;
-	(void)ctx;
-	return;
-}
+// Returns false, having changed nothing, if the state is from a board with a different amount of RAM.
+static inline bool MMC1_load_state(MMC1_ctx *ctx, const MMC1_STATE *state){
+	if(state->prg_ram_size != ctx->prg_ram_size || state->has_chr_ram != (ctx->chr_ram != NULL)){
+		return false;
+	}
 
-uint8_t MMC1_cart_gpu_read(uint16_t address, MMC1_ctx *ctx){
-	(void)address;
-	(void)ctx;
-	return 0xFF;
+	ctx->shift_register = state->shift_register;
+	ctx->control = state->control;
+	ctx->chr_bank_0 = state->chr_bank_0;
+	ctx->chr_bank_1 = state->chr_bank_1;
+	ctx->prg_bank = state->prg_bank;
+	if(ctx->prg_ram != NULL){
+		memcpy(ctx->prg_ram, state->prg_ram, ctx->prg_ram_size);
+	}
+	if(ctx->chr_ram != NULL){
+		// Loading CHR RAM is as good as writing all of it, but only the tiles that actually change need
+		// decoding again, which with run-ahead loading every frame is usually none of them.
+		for(size_t tile = 0; tile < 0x2000 / 16; tile++){
+			if(memcmp(ctx->chr_ram + tile * 16, state->chr_ram + tile * 16, 16) != 0){
+				tile_cache_invalidate(ctx->tile_cache, tile / TILE_CACHE_TILES, tile % TILE_CACHE_TILES);
+			}
+		}
+		memcpy(ctx->chr_ram, state->chr_ram, 0x2000);
+	}
+	MMC1_update_banks(ctx);
+	return true;
 }
 
 // This will destroy the MMC1 struct, but won't destroy the cartridge, which must be destroyed separately.
-void MMC1_destroy(MMC1_ctx *ctx){
-	if(ctx->fp != NULL){
-		fclose(ctx->fp);
+static inline void MMC1_destroy(MMC1_ctx *ctx){
+	if(ctx->battery != NULL){
+		battery_flush(ctx->battery, ctx->prg_ram);
+		destroy_battery(ctx->battery);
 	}
-
+	free(ctx->prg_ram);
+	free(ctx->chr_ram);
 	free(ctx);
 }
 
@@ -2,8 +2,10 @@
 #define delegator_h
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 #include "MMC1.h"
 
@@ -15,12 +17,15 @@ enum MMC_TYPES {
 };
 
 typedef struct {
-	void *ctx; // MMC context struct.
+	void *ctx; // MMC context struct, NULL if the cart's mapper isn't supported.
 	enum MMC_TYPES type;
+	CART *cart;
 } MMC;
 
-MMC new_MMC(CART* cart, const char *filename){
+// 'filename' is the ROM's path, which battery saves are named after. Pass NULL to never save the battery.
+static inline MMC new_MMC(CART* cart, const char *filename){
 	MMC mmc;
+	mmc.cart = cart;
 	// Switch on the mapper number to return the correct struct.
 	switch(cart->mapper){
 		case 1:
@@ -29,14 +34,20 @@ MMC new_MMC(CART* cart, const char *filename){
 			mmc.type = MMC1;
 			break;
 		default:
-			fprintf(stderr, "Fatal: unsupported mapper found (number 0x%04X). Exiting to prevent erroneous behaviour.\n", cart->mapper);
-			abort();
+			// It's up to the caller to check for this and stop, rather than carrying on with no mapper.
+			log_message(&cart->logger, LOG_ERROR, "Fatal: unsupported mapper found (number 0x%04X). Exiting to prevent erroneous behaviour.\n", cart->mapper);
+			mmc.ctx = NULL;
+			mmc.type = MMC1;
 	}
 
 	return mmc;
 }
 
-void destroy_mmc(MMC *mmc){
+static inline void destroy_mmc(MMC *mmc){
+	if(mmc->ctx == NULL){
+		return;
+	}
+
 	switch(mmc->type){
 		case MMC1:
 			MMC1_destroy((MMC1_ctx*)mmc->ctx);
@@ -44,7 +55,122 @@ void destroy_mmc(MMC *mmc){
 	}
 }
 
-uint8_t cpu_read(uint16_t address, MMC *mmc){
+// Number of 16KiB PRG ROM banks on the cartridge.
+static inline size_t mmc_prg_bank_count(MMC *mmc){
+	size_t ret = 0;
+	switch(mmc->type){
+		case MMC1:
+			ret = ((MMC1_ctx*)mmc->ctx)->cart->PRG_ROM_len;
+			break;
+	}
+
+	return ret;
+}
+
+// Number of 4KiB CHR banks on the cartridge, ROM or RAM.
+static inline size_t mmc_chr_bank_count(MMC *mmc){
+	size_t ret = 0;
+	switch(mmc->type){
+		case MMC1:
+			ret = ((MMC1_ctx*)mmc->ctx)->chr_bank_count;
+			break;
+	}
+
+	return ret;
+}
+
+// Hooks the decode cache up to the mapper, so that it can be told about PRG bank switches.
+static inline void mmc_attach_decode_cache(MMC *mmc, DECODE_CACHE *cache){
+	switch(mmc->type){
+		case MMC1:
+			MMC1_attach_decode_cache((MMC1_ctx*)mmc->ctx, cache);
+			break;
+	}
+}
+
+// Hooks the tile cache up to the mapper, so that it can be told about CHR bank switches and CHR RAM writes.
+static inline void mmc_attach_tile_cache(MMC *mmc, TILE_CACHE *cache){
+	switch(mmc->type){
+		case MMC1:
+			MMC1_attach_tile_cache((MMC1_ctx*)mmc->ctx, cache);
+			break;
+	}
+}
+
+// Hands the CPU page table to the mapper, which maps its ROM (and RAM) into it and keeps it up to date
+// across bank switches.
+static inline void mmc_attach_page_table(MMC *mmc, PAGE_TABLE *pages){
+	switch(mmc->type){
+		case MMC1:
+			MMC1_attach_page_table((MMC1_ctx*)mmc->ctx, pages);
+			break;
+	}
+}
+
+// Writes battery backed RAM back to disk if it has changed, and waits until it's there. For exit, and whenever
+// a save has to be on disk before carrying on.
+static inline bool mmc_flush_battery(MMC *mmc){
+	bool ret = true;
+	switch(mmc->type){
+		case MMC1:
+			ret = MMC1_flush_battery((MMC1_ctx*)mmc->ctx);
+			break;
+	}
+
+	return ret;
+}
+
+// Has battery backed RAM written back to disk in the background if it has changed. Never waits for the disk, and
+// cheap to call if nothing has changed, so it's what the main loop uses every so often.
+static inline void mmc_queue_battery(MMC *mmc){
+	switch(mmc->type){
+		case MMC1:
+			MMC1_queue_battery((MMC1_ctx*)mmc->ctx);
+			break;
+	}
+}
+
+// Mapper state as it's stored in savestates. Every mapper's state is in here, so it's always the same size.
+typedef union {
+	MMC1_STATE mmc1;
+} MMC_STATE;
+
+// Where PRG RAM is kept inside an MMC_STATE, so writes to it can be tracked by page. The 8KiB at 0x6000-0x7FFF
+// is the first 8KiB of it, and the rest only changes on a savestate load.
+static inline void mmc_state_prg_ram(MMC *mmc, size_t *offset, size_t *length){
+	switch(mmc->type){
+		case MMC1:
+			*offset = offsetof(MMC_STATE, mmc1.prg_ram);
+			*length = MMC1_STATE_PRG_RAM;
+			break;
+	}
+}
+
+// Returns false if the mapper's state doesn't fit in an MMC_STATE.
+static inline bool mmc_save_state(MMC *mmc, MMC_STATE *state){
+	bool ret = false;
+	switch(mmc->type){
+		case MMC1:
+			ret = MMC1_save_state((MMC1_ctx*)mmc->ctx, &state->mmc1);
+			break;
+	}
+
+	return ret;
+}
+
+// Returns false, having changed nothing, if the state doesn't fit this cart.
+static inline bool mmc_load_state(MMC *mmc, const MMC_STATE *state){
+	bool ret = false;
+	switch(mmc->type){
+		case MMC1:
+			ret = MMC1_load_state((MMC1_ctx*)mmc->ctx, &state->mmc1);
+			break;
+	}
+
+	return ret;
+}
+
+static inline uint8_t cpu_read(uint16_t address, MMC *mmc){
 	// Apparently returning out of a switch case is "bad practice".
 
 	uint8_t ret = 0;
@@ -57,7 +183,7 @@ uint8_t cpu_read(uint16_t address, MMC *mmc){
 	return ret;
 }
 
-void cpu_write(uint16_t address, uint8_t value, MMC *mmc){
+static inline void cpu_write(uint16_t address, uint8_t value, MMC *mmc){
 	switch(mmc->type){
 		case MMC1:
 			MMC1_cart_cpu_write(address, value, (MMC1_ctx*)mmc->ctx);
@@ -66,9 +192,42 @@ void cpu_write(uint16_t address, uint8_t value, MMC *mmc){
 	return;
 }
 
+// The PPU's side of the cart: pattern tables (0x0000-0x1FFF), which are CHR ROM or RAM.
+static inline uint8_t gpu_read(uint16_t address, MMC *mmc){
+	uint8_t ret = 0;
+	switch(mmc->type){
+		case MMC1:
+			ret = MMC1_cart_gpu_read(address, (MMC1_ctx*)mmc->ctx);
+			break;
+	}
+
+	return ret;
+}
+
+static inline void gpu_write(uint16_t address, uint8_t value, MMC *mmc){
+	switch(mmc->type){
+		case MMC1:
+			MMC1_cart_gpu_write(address, value, (MMC1_ctx*)mmc->ctx);
+			break;
+	}
+}
+
+// Where a nametable address (0x2000-0x3EFF) ends up in the console's 2KiB of nametable RAM. The cart decides
+// that, either with a solder pad or, as with the MMC1, a register.
+static inline uint16_t nametable_address(uint16_t address, MMC *mmc){
+	uint16_t ret = 0;
+	switch(mmc->type){
+		case MMC1:
+			ret = MMC1_nametable_address(address, (MMC1_ctx*)mmc->ctx);
+			break;
+	}
+
+	return ret;
+}
+
 // This is used in 2 places exactly: either to read the reset vector when resetting/starting
 // or when reading the address for an indirectly-addressed JMP.
-uint16_t cpu_read16(uint16_t address, MMC *mmc){
+static inline uint16_t cpu_read16(uint16_t address, MMC *mmc){
 	union {
 		uint16_t val;
 		uint8_t components[2];
@@ -9,41 +9,120 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "mappers/delegator.h"
 #include "cart.h"
+#include "decode_cache.h"
+#include "page_table.h"
+#include "input.h"
+#include "ppu.h"
+#include "apu.h"
+#include "scheduler.h"
+#include "log.h"
 
 typedef struct {
 	uint8_t *ram;
+	unsigned ram_stride; // Distance between consecutive RAM bytes, see new_mmu_strided. Normally 1.
+	bool owns_ram;
 	MMC *mmc;
+	DECODE_CACHE *decode; // Decoded instructions for PRG ROM, see decode_cache.h.
+	PAGE_TABLE *pages; // Direct host pointers for every page that doesn't need special handling, see page_table.h.
+	const LOGGER *logger; // The cart's.
+	CONTROLLERS controllers;
+	PPU ppu;
+	APU apu;
+	SCHEDULER scheduler; // See machine.h.
+	const uint64_t *cycles; // The CPU's cycle count, for catching the PPU up to it. Set by new_cpu.
 } MMU;
 
-MMU new_mmu(MMC* mmc){
+// Which cycle of an instruction a register access is taken to happen on, counting from 0. PPU registers are
+// nearly always accessed with absolute addressing (LDA/STA/BIT $2002 and so on), which touches the register on
+// its last cycle, the 4th.
+#define MMU_ACCESS_CYCLE 3
+
+// Puts the APU's events (see apu.h) on the queue where it now says they should be. After anything that might
+// have moved them: register writes, the events themselves, power on and loading a savestate.
+static inline void mmu_schedule_apu(MMU *mmu){
+	SCHEDULER *s = &mmu->scheduler;
+	uint64_t irq = apu_next_irq(&mmu->apu), read = apu_next_dmc_read(&mmu->apu);
+	scheduler_reschedule(s, irq != UINT64_MAX ? irq * s->timing->cpu_divider : UINT64_MAX, EVENT_APU_IRQ);
+	scheduler_reschedule(s, read != UINT64_MAX ? read * s->timing->cpu_divider : UINT64_MAX, EVENT_DMC_READ);
+}
+
+// Whether anything's holding the CPU's IRQ line up. Only the APU can, since MMC1 has no IRQ.
+static inline bool mmu_irq(const MMU *mmu){
+	return apu_irq(&mmu->apu);
+}
+
+// Like new_mmu, but with RAM that belongs to someone else and is spread out, with 'stride' bytes between one
+// byte of RAM and the next. This is for interleaving the RAM of several machines (see lockstep.h). Strided RAM
+// can't go in the page table, so every RAM access takes the slow path.
+static inline MMU new_mmu_strided(MMC* mmc, uint8_t *ram, unsigned stride){
 	MMU mmu;
-	mmu.ram = (uint8_t*)malloc(sizeof(uint8_t)*0x800); // Yes, the sizeof() is redundant, but it makes it consistent with the rest of the malloc() calls in this program.
+	mmu.ram = ram;
+	mmu.ram_stride = stride;
+	mmu.owns_ram = false;
 	mmu.mmc = mmc;
+	mmu.logger = &mmc->cart->logger;
+	mmu.controllers = new_controllers();
+	mmu.ppu = new_ppu(mmc, timing_for(mmc->cart->timing_type));
+	mmu.apu = new_apu(mmc, timing_for(mmc->cart->timing_type));
+	mmu.scheduler = new_scheduler(timing_for(mmc->cart->timing_type));
+	mmu_schedule_apu(&mmu);
+	mmu.cycles = NULL;
+	mmu.decode = new_decode_cache(mmc_prg_bank_count(mmc));
+	mmc_attach_decode_cache(mmc, mmu.decode);
+
+	// RAM and its three mirrors are the same 8 pages mapped 4 times over.
+	mmu.pages = new_page_table();
+	for(unsigned mirror = 0; mirror < 4 && stride == 1; mirror++){
+		page_table_map(mmu.pages, mirror * 8, 8, mmu.ram, true);
+	}
+	mmc_attach_page_table(mmc, mmu.pages);
+	return mmu;
+}
+
+static inline MMU new_mmu(MMC* mmc){
+	MMU mmu = new_mmu_strided(mmc, (uint8_t*)malloc(sizeof(uint8_t)*0x800), 1); // Yes, the sizeof() is redundant, but it makes it consistent with the rest of the malloc() calls in this program.
+	mmu.owns_ram = true;
 	return mmu;
 }
 
-uint8_t mmu_read(uint16_t address, MMU *mmu){
+// Brings the PPU up to the access the CPU's making right now (see ppu.h).
+static inline void mmu_catch_up_ppu(MMU *mmu){
+	ppu_catch_up(&mmu->ppu, (*mmu->cycles + MMU_ACCESS_CYCLE) * mmu->scheduler.timing->cpu_divider);
+}
+
+// Likewise the APU.
+static inline void mmu_catch_up_apu(MMU *mmu){
+	apu_catch_up(&mmu->apu, *mmu->cycles + MMU_ACCESS_CYCLE);
+}
+
+// Slow path for anything that isn't mapped in the page table, which is to say anything with side effects.
+static inline uint8_t mmu_read_unmapped(uint16_t address, MMU *mmu){
 	// RAM echoes itself in memory three times after its actual 2KiB block.
 	// Again, I am aware that half of these conditions (the left side) are useless,
 	// since they are already false given the previous condition's failure. They're
 	// kept here for code clarity so one can tell where the read/write is going without having
 	// to parse the simplified conditions.
 	if(address <= 0x1FFF){
-		return mmu->ram[address % 0x800];
+		return mmu->ram[(address % 0x800) * mmu->ram_stride];
 	} else if(0x2000 <= address && address <= 0x3FFF){
-		// Not implemented TODO
 		// These are the 8 PPU registers. Why Nintendo decided to occupy 8KiB for 8 byte-sized registers is beyond me, but it's easy to implement.
-		printf("Warning: read attempted at address 0x%04X, PPU registers are not implemented yet! Returning 0xFF.\n", address);
-		return 0xFF;
+		mmu_catch_up_ppu(mmu);
+		return ppu_read_register(&mmu->ppu, address);
+	} else if(address == 0x4016 || address == 0x4017){
+		return controllers_read(&mmu->controllers, address - 0x4016);
+	} else if(address == 0x4015){
+		mmu_catch_up_apu(mmu);
+		return apu_read_status(&mmu->apu);
 	} else if(0x4000 <= address && address <= 0x4017){
-		// Not implemented TODO
-		printf("Warning: read attempted at address 0x%04X, APU/IO registers are not implemented yet! Returning 0xFF.\n", address);
+		// The rest of the APU's registers are write only. Reading them gets whatever was last on the bus, which
+		// we don't keep track of.
 		return 0xFF;
 	} else if(0x4018 <= address && address <= 0x401F){
-		printf("Warning: read attempted at address 0x%04X, CPU Test Mode not supported. Returning 0xFF.\n", address);
+		log_message(mmu->logger, LOG_WARNING, "Warning: read attempted at address 0x%04X, CPU Test Mode not supported. Returning 0xFF.\n", address);
 		return 0xFF;
 	} else {
 		// Cartridge space.
@@ -51,31 +130,88 @@ uint8_t mmu_read(uint16_t address, MMU *mmu){
 	}
 }
 
-void mmu_write(uint16_t address, uint8_t value, MMU *mmu){
+static inline void mmu_write_unmapped(uint16_t address, uint8_t value, MMU *mmu){
 	if(address <= 0x1FFF){
-		mmu->ram[address % 0x800] = value;
+		mmu->ram[(address % 0x800) * mmu->ram_stride] = value;
 		return;
 	} else if(0x2000 <= address && address <= 0x3FFF){
-		// Not implemented TODO
-		printf("Warning: write attempted at address 0x%04X, PPU registers are not implemented yet! Returning 0xFF.\n", address);
+		mmu_catch_up_ppu(mmu);
+		if(ppu_write_register(&mmu->ppu, address, value)){
+			scheduler_push(&mmu->scheduler, 0, EVENT_NMI);
+		}
+		return;
+	} else if(address == 0x4014){
+		// OAM DMA. The copy is done here, the CPU's share of it (sitting idle while it happens) once this
+		// instruction is finished. It goes through OAMDATA, so starts wherever OAMADDR is.
+		for(unsigned i = 0; i < sizeof(mmu->ppu.oam); i++){
+			mmu->ppu.oam[(uint8_t)(mmu->ppu.oam_addr + i)] = mmu_read_unmapped((uint16_t)(value << 8 | i), mmu);
+		}
+		scheduler_push(&mmu->scheduler, 0, EVENT_OAM_DMA);
+		return;
+	} else if(address == 0x4016){
+		controllers_write(&mmu->controllers, value);
 		return;
 	} else if(0x4000 <= address && address <= 0x4017){
-		// Not implemented TODO
-		printf("Warning: write attempted at address 0x%04X, APU/IO registers are not implemented yet! Returning 0xFF.\n", address);
+		mmu_catch_up_apu(mmu);
+		apu_write_register(&mmu->apu, address, value);
+		if(address >= 0x4010){
+			// The DMC's registers, $4015 or $4017, which can all move the APU's events.
+			mmu_schedule_apu(mmu);
+		}
 		return;
 	} else if(0x4018 <= address && address <= 0x401F){
-		printf("Warning: write attempted at address 0x%04X, CPU Test Mode not supported. Returning 0xFF.\n", address);
+		log_message(mmu->logger, LOG_WARNING, "Warning: write attempted at address 0x%04X, CPU Test Mode not supported. Returning 0xFF.\n", address);
 		return;
 	} else {
-		// Cartridge space.
-		cpu_write(address, value, mmu->mmc->ctx);
+		// Cartridge space. This might be a mapper switching CHR banks, so the PPU has to be done with the old ones,
+		// or PRG banks, which the DMC might have been reading samples from.
+		mmu_catch_up_ppu(mmu);
+		mmu_catch_up_apu(mmu);
+		cpu_write(address, value, mmu->mmc);
+		return;
+	}
+}
+
+static inline uint8_t mmu_read(uint16_t address, MMU *mmu){
+	uint8_t *page = mmu->pages->read[address >> 8];
+	if(page != NULL){
+		return page[address & 0xFF];
+	}
+
+	return mmu_read_unmapped(address, mmu);
+}
+
+static inline void mmu_write(uint16_t address, uint8_t value, MMU *mmu){
+	mmu->pages->dirty[address >> 8] = 1;
+	uint8_t *page = mmu->pages->write[address >> 8];
+	if(page != NULL){
+		page[address & 0xFF] = value;
 		return;
 	}
+
+	mmu_write_unmapped(address, value, mmu);
+}
+
+// Little endian 16-bit read. If both bytes are in the same mapped page (which is nearly always the case
+// for operands), this is just two loads from the same pointer.
+static inline uint16_t mmu_read16(uint16_t address, MMU *mmu){
+	uint8_t *page = mmu->pages->read[address >> 8];
+	if(page != NULL && (address & 0xFF) != 0xFF){
+		return page[address & 0xFF] | ((uint16_t)page[(address & 0xFF) + 1] << 8);
+	}
+
+	return mmu_read(address, mmu) | ((uint16_t)mmu_read(address + 1, mmu) << 8);
 }
 
 // Does not destroy/free MMC.
-void destroy_mmu(MMU *mmu){
-	free(mmu->ram);
+static inline void destroy_mmu(MMU *mmu){
+	if(mmu->owns_ram){
+		free(mmu->ram);
+	}
+	destroy_decode_cache(mmu->decode);
+	destroy_page_table(mmu->pages);
+	destroy_ppu(&mmu->ppu);
+	destroy_apu(&mmu->apu);
 }
 
 
@@ -0,0 +1,47 @@
+#ifndef page_table_h
+#define page_table_h
+
+// The CPU's address space split into 256 pages of 256 bytes, each either pointing straight at the host
+// memory backing it or NULL, in which case the access is sent to the slow path in mmu.h (I/O registers,
+// mapper registers, anything else with side effects). RAM and ROM end up as a single indexed load.
+//
+// Mappers are handed the table and are responsible for keeping the cartridge pages up to date whenever
+// they switch banks.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+	uint8_t *read[256];
+	uint8_t *write[256];
+
+	// Set to 1 by every mmu_write to the page, mapped or not. Never cleared here - whoever wants to know what's
+	// been written (see rewind.h) clears the entries it's looked at.
+	uint8_t dirty[256];
+} PAGE_TABLE;
+
+static inline PAGE_TABLE* new_page_table(){
+	// Everything starts unmapped, so it all goes through the slow path until someone says otherwise.
+	return (PAGE_TABLE*)calloc(1, sizeof(PAGE_TABLE));
+}
+
+// Maps 'count' pages starting at 'first_page' to consecutive 256 byte blocks of 'host'. Passing NULL as 'host'
+// unmaps them instead. Read-only mappings leave writes going to the slow path.
+static inline void page_table_map(PAGE_TABLE *table, uint8_t first_page, unsigned count, uint8_t *host, bool writable){
+	if(table == NULL){
+		return;
+	}
+
+	for(unsigned i = 0; i < count && first_page + i < 256; i++){
+		uint8_t *page = host == NULL ? NULL : host + i * 0x100;
+		table->read[first_page + i] = page;
+		table->write[first_page + i] = writable ? page : NULL;
+	}
+}
+
+static inline void destroy_page_table(PAGE_TABLE *table){
+	free(table);
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef platform_h
+#define platform_h
+
+// The bits of talking to the OS that more than one part of the emulator needs: a clock for timing things, and
+// getting a whole buffer into a file. Everything that times itself or writes a stream out (the runner, the
+// presenter, the audio and video writers, the benchmarks) goes through these, so there's one of each.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+// Seconds on the monotonic clock, which only means anything compared to another reading of it.
+static inline double platform_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes all of it to 'fd', however many write()s that takes, adding how many it was to *writes. Returns false
+// on error, with errno saying why, for the caller to report.
+static inline bool platform_write_all(int fd, const void *data, size_t length, uint64_t *writes){
+	const uint8_t *bytes = (const uint8_t*)data;
+	while(length != 0){
+		ssize_t written = write(fd, bytes, length);
+		if(written < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		(*writes)++;
+		bytes += written;
+		length -= (size_t)written;
+	}
+	return true;
+}
+
+#endif
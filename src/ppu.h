@@ -0,0 +1,632 @@
+#ifndef ppu_h
+#define ppu_h
+
+// The PPU: the registers, VRAM, the scroll registers ticking along as the picture is drawn, the vblank, sprite 0
+// and sprite overflow flags, and the picture itself.
+//
+// It isn't stepped alongside the CPU, 3 dots per cycle. Instead it's left alone until something needs it to be
+// up to date, and then it's caught up (ppu_catch_up) in one go, which is cheap since almost every dot on a line
+// is the same as the one before as far as the registers go. Things that need it up to date:
+//	- The CPU touching a PPU register, since what it reads or writes depends on where the PPU has got to.
+//	- A write to the cart's registers, which might switch CHR banks, so everything before it has to be done with
+//	  the old ones.
+//	- Events the CPU has to find out about without asking, which is only NMI. The scheduler knows when vblank
+//	  starts (see scheduler.h), and catches the PPU up to then to raise it. Sprite 0 hit only shows up in
+//	  PPUSTATUS, so it doesn't need an event - reading PPUSTATUS catches the PPU up anyway.
+// Anything else, which is most instructions, never gets here. Since catching up is deterministic, the PPU ends
+// up in the same state however many pieces its time is caught up in.
+//
+// Drawing works the same way. A line that's caught up in one go, which is nearly all of them, is drawn in one
+// go too, 16 pixels at a time (see render.h). If something stops the catch up partway through a line - say a
+// write to PPUSCROLL for a split screen - the pixels so far are drawn with the registers as they were, and the
+// rest with them as they are after the write. Background tiles are fetched on the dot the real PPU fetches them
+// on, so scroll changes take effect on the same tile they would on a real one. Patterns come ready decoded from
+// the tile cache (see tile_cache.h), so fetching a tile is a copy of 8 pixels.
+//
+// Where it knowingly isn't what the real PPU does. Most of it is something the real one does a dot at a time
+// being done here in one go, as of one dot, so it only shows if the registers, OAM or CHR change in between:
+//	- Sprite 0 hit is worked out at dot 0 of the line (ppu_find_sprite0), from everything as it is then, and
+//	  the flag goes up later on the dot that said. A scroll write, bank switch or PPUMASK write partway along
+//	  the line before the hit isn't seen by it, though it is by the picture.
+//	- A line's sprites are worked out when it's first drawn (ppu_evaluate_sprites), which is dot 0 or 1 unless
+//	  rendering was off then, not found during dots 65-256 of the line before and fetched during its hblank.
+//	  So a change to OAM, the sprite size or table, or CHR late in the line before is seen a line early, and
+//	  turning rendering on partway along a line gives it sprites it shouldn't have.
+//	- Sprite overflow is worked out at dot 65 (ppu_find_overflow), from OAM and the sprite size as they are
+//	  then, rather than as the real one reads them over the next 180 or so dots. Turning rendering off partway
+//	  doesn't pause the search, it just stops the flag going up if it's off on the dot.
+//	- Sprite evaluation always starts from sprite 0. The real one starts from OAMADDR, which is only not 0 if
+//	  it's written during rendering.
+//	- Background tiles are fetched whole on the last dot of the 8 it takes, so a write landing between the
+//	  real PPU's 4 reads for a tile is seen by all of them or none.
+//	- PPUDATA and OAMDATA accesses during rendering do what they do in vblank. On the real one PPUDATA moves 'v'
+//	  on by a coarse X and Y increment, OAMDATA writes are dropped and only bump OAMADDR, and OAMDATA reads get
+//	  whatever sprite evaluation is looking at.
+//	- Reading PPUSTATUS just as vblank starts doesn't suppress the flag or that frame's NMI.
+//	- PPUMASK's colour emphasis bits are ignored, and the data bus ('bus') never decays.
+// bench/ppu.c checks all of the rest against a model that does everything a dot at a time.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mappers/delegator.h"
+#include "timing.h"
+#include "render.h"
+#include "tile_cache.h"
+
+#define PPUCTRL_NMI 0x80
+#define PPUCTRL_SPRITE_16 0x20 // 8x16 sprites.
+#define PPUCTRL_BACKGROUND_TABLE 0x10
+#define PPUCTRL_SPRITE_TABLE 0x08
+#define PPUCTRL_INCREMENT_32 0x04
+
+#define PPUMASK_GREYSCALE 0x01
+#define PPUMASK_BACKGROUND_LEFT 0x02 // Background in the leftmost 8 pixels.
+#define PPUMASK_SPRITES_LEFT 0x04
+#define PPUMASK_BACKGROUND 0x08
+#define PPUMASK_SPRITES 0x10
+#define PPUMASK_RENDERING (PPUMASK_BACKGROUND | PPUMASK_SPRITES)
+
+#define PPUSTATUS_OVERFLOW 0x20
+#define PPUSTATUS_SPRITE0 0x40
+#define PPUSTATUS_VBLANK 0x80
+
+#define PPU_DOTS_PER_LINE 341
+#define PPU_VISIBLE_LINES RENDER_HEIGHT
+#define PPU_LINE_TILES 34 // Tiles fetched for each line: 2 at the end of the line before, then 32.
+
+// A background tile the way the PPU fetches it: one row of its pattern as two bitplanes, and its palette from
+// the attribute table. Only savestates keep tiles like this, see ppu_pack_tile.
+typedef struct {
+	uint8_t low;
+	uint8_t high;
+	uint8_t palette;
+} PPU_TILE;
+
+typedef struct {
+	MMC *mmc; // For CHR and nametable mirroring.
+	TILE_CACHE *tiles; // CHR, decoded.
+	const TIMING *timing;
+
+	// Where the PPU has got to. 'time' is the master clock of the next dot to run, the rest follows from it
+	// and 'delay' (see ppu_seek).
+	uint64_t time;
+	uint64_t frame;
+	unsigned frame_dots; // How long this frame is, since odd NTSC frames are a dot short while rendering.
+	// How much later this frame started than timing_frame_start says, which assumes every odd NTSC frame is a
+	// dot short. Each one that wasn't, because rendering was off, puts the PPU another dot behind.
+	uint64_t delay;
+	unsigned scanline;
+	unsigned dot;
+	unsigned sprite0_dot; // The dot sprite 0 hits on this scanline, or 0 if it doesn't.
+	unsigned overflow_dot; // The dot the sprite overflow flag goes up on this scanline, or 0 if it doesn't.
+
+	uint8_t ctrl; // PPUCTRL (0x2000), write only.
+	uint8_t mask; // PPUMASK (0x2001), write only.
+	uint8_t status; // PPUSTATUS (0x2002). Only the top three bits are real.
+	uint8_t oam_addr; // OAMADDR (0x2003).
+	uint8_t bus; // The last value on the PPU's data bus, which is what reading a write only register gets.
+	uint8_t read_buffer; // PPUDATA reads come from here, and then refill it, so they're one behind.
+
+	// The scroll and address registers, by the names everyone uses for them: 'v' is the VRAM address, 't' the
+	// one that PPUSCROLL and PPUADDR build up and that gets copied into 'v', 'x' is the fine X scroll and 'w'
+	// says which write of a pair is next.
+	uint16_t v;
+	uint16_t t;
+	uint8_t x;
+	bool w;
+
+	uint8_t oam[0x100]; // Sprite memory.
+	uint8_t palette[0x20];
+	uint8_t vram[0x800]; // Nametables. Which 1KiB goes where is up to the cart, see nametable_address.
+
+	// Drawing. 'picture' is the frame, RENDER_WIDTH x RENDER_HEIGHT NES colours (0-63), which is complete
+	// once the frame's last visible line has been caught up. It's only written to while 'render' is set,
+	// which callers can clear for frames nobody will see; nothing else depends on it.
+	uint8_t *picture;
+	bool render;
+	uint8_t background[PPU_LINE_TILES * 8]; // This line's tiles as they're fetched. Any not fetched are transparent.
+	uint8_t prefetched[2 * 8]; // The first two tiles of the next line. These are fetched even while 'render' is off.
+	unsigned fetched_count; // Tiles in 'background' past this are left over from the line before, or blank.
+	bool sprites_ready; // 'sprites' is set up for this line.
+	uint8_t sprites[RENDER_WIDTH];
+
+	// Stats.
+	uint64_t catch_ups;
+	uint64_t caught_up_dots;
+} PPU;
+
+// How long frame 'frame' is if it skips its odd frame dot (if it has one).
+static inline unsigned ppu_frame_dots(const TIMING *timing, uint64_t frame){
+	return (unsigned)((timing_frame_start(timing, frame + 1) - timing_frame_start(timing, frame)) / timing->ppu_divider);
+}
+
+// The frame's 'delay' (see PPU), for the frame the PPU is in or the one after it.
+static inline uint64_t ppu_frame_delay(const PPU *ppu, uint64_t frame){
+	if(frame == ppu->frame){
+		return ppu->delay;
+	}
+	return ppu->delay + (ppu->frame_dots - ppu_frame_dots(ppu->timing, ppu->frame)) * ppu->timing->ppu_divider;
+}
+
+// Puts the PPU at master clock 'time', which must be on a dot, in a frame that started 'delay' late. If
+// 'long_frame', the frame is one that didn't skip its odd frame dot. Only the position changes.
+static inline void ppu_seek(PPU *ppu, uint64_t time, uint64_t delay, bool long_frame){
+	uint64_t nominal = time - delay;
+	uint64_t frame = nominal / timing_master_per_frame(ppu->timing);
+	while(frame != 0 && timing_frame_start(ppu->timing, frame) > nominal){
+		frame--;
+	}
+	while(timing_frame_start(ppu->timing, frame + 1) <= nominal){
+		frame++;
+	}
+	unsigned dot = (unsigned)((nominal - timing_frame_start(ppu->timing, frame)) / ppu->timing->ppu_divider);
+	if(long_frame && dot == 0 && frame != 0){
+		// The dot that wasn't skipped, on the end of the frame before.
+		frame--;
+		dot = ppu_frame_dots(ppu->timing, frame);
+	}
+
+	ppu->time = time;
+	ppu->frame = frame;
+	ppu->delay = delay;
+	ppu->frame_dots = ppu_frame_dots(ppu->timing, frame) + long_frame;
+	ppu->scanline = dot / PPU_DOTS_PER_LINE;
+	ppu->dot = dot % PPU_DOTS_PER_LINE;
+}
+
+static inline PPU new_ppu(MMC *mmc, const TIMING *timing){
+	PPU ppu;
+	memset(&ppu, 0, sizeof(ppu));
+	ppu.mmc = mmc;
+	ppu.timing = timing;
+	ppu.tiles = new_tile_cache(mmc_chr_bank_count(mmc));
+	mmc_attach_tile_cache(mmc, ppu.tiles);
+	ppu.picture = (uint8_t*)calloc(RENDER_WIDTH * RENDER_HEIGHT, sizeof(uint8_t));
+	ppu.render = ppu.picture != NULL;
+	ppu_seek(&ppu, 0, 0, false);
+	return ppu;
+}
+
+static inline void destroy_ppu(PPU *ppu){
+	destroy_tile_cache(ppu->tiles);
+	free(ppu->picture);
+}
+
+// The PPU's own address space: pattern tables on the cart, then nametables, then the palette.
+static inline uint16_t ppu_palette_index(uint16_t address){
+	uint16_t index = address & 0x1F;
+	// The sprite palettes' backdrop entries are the background ones.
+	return (index & 0x13) == 0x10 ? index & 0x0F : index;
+}
+
+static inline uint8_t ppu_bus_read(PPU *ppu, uint16_t address){
+	address &= 0x3FFF;
+	if(address < 0x2000){
+		return gpu_read(address, ppu->mmc);
+	} else if(address < 0x3F00){
+		return ppu->vram[nametable_address(address, ppu->mmc)];
+	} else {
+		return ppu->palette[ppu_palette_index(address)];
+	}
+}
+
+static inline void ppu_bus_write(PPU *ppu, uint16_t address, uint8_t value){
+	address &= 0x3FFF;
+	if(address < 0x2000){
+		gpu_write(address, value, ppu->mmc);
+	} else if(address < 0x3F00){
+		ppu->vram[nametable_address(address, ppu->mmc)] = value;
+	} else {
+		ppu->palette[ppu_palette_index(address)] = value & 0x3F;
+	}
+}
+
+// 'v' is laid out as yyy NN YYYYY XXXXX: fine Y, nametable, coarse Y, coarse X. These move it on a tile
+// across or a line down, wrapping into the next nametable along.
+static inline void ppu_increment_x(PPU *ppu){
+	if((ppu->v & 0x1F) == 31){
+		ppu->v = (ppu->v & ~0x1F) ^ 0x0400;
+	} else {
+		ppu->v++;
+	}
+}
+
+static inline void ppu_increment_y(PPU *ppu){
+	if((ppu->v & 0x7000) != 0x7000){
+		ppu->v += 0x1000;
+		return;
+	}
+	ppu->v &= ~0x7000;
+	unsigned coarse_y = (ppu->v >> 5) & 0x1F;
+	if(coarse_y == 29){
+		coarse_y = 0;
+		ppu->v ^= 0x0800;
+	} else if(coarse_y == 31){
+		// Rows 30 and 31 are the attribute table, which you can scroll into but which doesn't switch nametables.
+		coarse_y = 0;
+	} else {
+		coarse_y++;
+	}
+	ppu->v = (ppu->v & ~0x03E0) | (coarse_y << 5);
+}
+
+// Whether the background is opaque at pixel 'x' of the line that's starting. By dot 0 the first two tiles
+// of the line have already been fetched, so 'v' is two tiles ahead of the left edge.
+static inline bool ppu_background_opaque(PPU *ppu, unsigned x){
+	unsigned fine = x + ppu->x;
+	unsigned column = (((ppu->v >> 5) & 0x20) | (ppu->v & 0x1F)) + 62 + fine / 8; // Across both nametables, -2.
+	uint16_t tile_address = 0x2000 | (ppu->v & 0x0BE0) | ((column & 0x20) << 5) | (column & 0x1F);
+	uint8_t tile = ppu_bus_read(ppu, tile_address);
+	uint16_t pattern = ((ppu->ctrl & PPUCTRL_BACKGROUND_TABLE) ? 0x1000 : 0) + tile * 16 + ((ppu->v >> 12) & 7);
+	uint8_t bit = 0x80 >> (fine & 7);
+	return ((ppu_bus_read(ppu, pattern) | ppu_bus_read(ppu, pattern + 8)) & bit) != 0;
+}
+
+// Works out which dot sprite 0 hits on for the line that's starting, if it does: the first pixel where it and
+// the background are both opaque, other than the last one on the line or anything clipped on the left. The flag
+// goes up as that pixel is output, which is on dot x + 1.
+static inline unsigned ppu_find_sprite0(PPU *ppu, unsigned line){
+	if((ppu->mask & PPUMASK_RENDERING) != PPUMASK_RENDERING){
+		return 0;
+	}
+	unsigned height = (ppu->ctrl & PPUCTRL_SPRITE_16) ? 16 : 8;
+	unsigned row = line - (ppu->oam[0] + 1u);
+	if(row >= height){
+		return 0;
+	}
+
+	uint8_t tile = ppu->oam[1], attributes = ppu->oam[2], left = ppu->oam[3];
+	if(attributes & 0x80){
+		row = height - 1 - row;
+	}
+	uint16_t pattern;
+	if(height == 16){
+		pattern = ((tile & 1) ? 0x1000 : 0) + (tile & 0xFE) * 16 + (row & 8) * 2 + (row & 7);
+	} else {
+		pattern = ((ppu->ctrl & PPUCTRL_SPRITE_TABLE) ? 0x1000 : 0) + tile * 16 + row;
+	}
+	uint8_t sprite = ppu_bus_read(ppu, pattern) | ppu_bus_read(ppu, pattern + 8);
+
+	bool clipped = (ppu->mask & (PPUMASK_BACKGROUND_LEFT | PPUMASK_SPRITES_LEFT)) != (PPUMASK_BACKGROUND_LEFT | PPUMASK_SPRITES_LEFT);
+	for(unsigned i = 0; i < 8 && left + i < 255; i++){
+		unsigned x = left + i;
+		uint8_t bit = (attributes & 0x40) ? 1 << i : 0x80 >> i;
+		if((sprite & bit) && !(clipped && x < 8) && ppu_background_opaque(ppu, x)){
+			return x + 1;
+		}
+	}
+	return 0;
+}
+
+// Works out which dot the sprite overflow flag goes up on for this line, if it does, by going through OAM the
+// way the real PPU does during dots 65-256, looking for the next line's sprites. Each sprite takes 2 dots to
+// look at, or 8 if it's on the line and gets copied. Once 8 have been found it carries on looking for a 9th,
+// but wrongly: each time it doesn't find one it moves on to the next sprite and to the next byte within it as
+// well, so it reads tile numbers, attributes and X positions as if they were Y. That can find a 9th that isn't
+// there and miss one that is, and the flag goes up on the dot whatever it found was read.
+static inline unsigned ppu_find_overflow(PPU *ppu, unsigned line){
+	unsigned height = (ppu->ctrl & PPUCTRL_SPRITE_16) ? 16 : 8;
+	unsigned dot = 65, found = 0, n = 0;
+	for(; n < 64 && found < 8; n++){
+		bool here = line - ppu->oam[n * 4] < height;
+		found += here;
+		dot += here ? 8 : 2;
+	}
+	for(unsigned m = 0; n < 64; n++, m = (m + 1) & 3, dot += 2){
+		if(line - ppu->oam[n * 4 + m] < height){
+			return dot;
+		}
+	}
+	return 0;
+}
+
+// Fetches the background tile 'v' points at into 'out', 8 pixels.
+static inline void ppu_fetch_tile(PPU *ppu, uint16_t v, uint8_t *out){
+	uint8_t tile = ppu_bus_read(ppu, 0x2000 | (v & 0x0FFF));
+	uint8_t attribute = ppu_bus_read(ppu, 0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+	uint8_t palette = (attribute >> (((v >> 4) & 4) | (v & 2))) & 3;
+	uint16_t pattern = ((ppu->ctrl & PPUCTRL_BACKGROUND_TABLE) ? 0x1000 : 0) + tile * 16 + ((v >> 12) & 7);
+	render_colour_row(out, tile_cache_row(ppu->tiles, pattern), palette << 2);
+}
+
+// Fetched tiles to and from the form they're fetched in, for savestates. Transparent pixels don't keep their
+// palette, but then they don't need it either.
+static inline PPU_TILE ppu_pack_tile(const uint8_t *pixels){
+	PPU_TILE tile = { 0, 0, 0 };
+	for(unsigned i = 0; i < 8; i++){
+		tile.low |= (pixels[i] & 1) << (7 - i);
+		tile.high |= ((pixels[i] >> 1) & 1) << (7 - i);
+		tile.palette |= (pixels[i] >> 2) & 3;
+	}
+	return tile;
+}
+
+static inline void ppu_unpack_tile(uint8_t *pixels, PPU_TILE tile){
+	uint8_t both[16];
+	render_decode_tiles(both, tile.low, tile.high, tile.palette & 3, 0, 0, 0);
+	memcpy(pixels, both, 8);
+}
+
+// Finds the sprites on 'line' and draws them into 'sprites'. The first 8 in OAM are the ones drawn, and where
+// they overlap the lowest numbered one wins, even if it's behind the background.
+static inline void ppu_evaluate_sprites(PPU *ppu, unsigned line){
+	memset(ppu->sprites, 0, sizeof(ppu->sprites));
+	unsigned height = (ppu->ctrl & PPUCTRL_SPRITE_16) ? 16 : 8;
+	unsigned found = 0;
+	for(unsigned i = 0; i < 64 && found < 8; i++){
+		const uint8_t *sprite = &ppu->oam[i * 4];
+		unsigned row = line - (sprite[0] + 1u);
+		if(row >= height){
+			continue;
+		}
+		found++;
+
+		uint8_t tile = sprite[1], attributes = sprite[2], left = sprite[3];
+		if(attributes & 0x80){
+			row = height - 1 - row;
+		}
+		uint16_t pattern;
+		if(height == 16){
+			pattern = ((tile & 1) ? 0x1000 : 0) + (tile & 0xFE) * 16 + (row & 8) * 2 + (row & 7);
+		} else {
+			pattern = ((ppu->ctrl & PPUCTRL_SPRITE_TABLE) ? 0x1000 : 0) + tile * 16 + row;
+		}
+		uint8_t pixels[8];
+		render_colour_row(pixels, tile_cache_row(ppu->tiles, pattern), (4 | (attributes & 3)) << 2);
+		uint8_t behind = (attributes & 0x20) ? RENDER_BEHIND : 0;
+		unsigned flip = (attributes & 0x40) ? 7 : 0;
+		for(unsigned x = 0; x < 8 && left + x < RENDER_WIDTH; x++){
+			uint8_t pixel = pixels[x ^ flip];
+			if(pixel != 0 && ppu->sprites[left + x] == 0){
+				ppu->sprites[left + x] = pixel | behind;
+			}
+		}
+	}
+	ppu->sprites_ready = true;
+}
+
+// Draws pixels 'from' up to (not including) 'to' of the current line, with the registers as they are now.
+static inline void ppu_draw(PPU *ppu, unsigned from, unsigned to){
+	uint8_t *row = ppu->picture + ppu->scanline * RENDER_WIDTH;
+	uint8_t colour_mask = (ppu->mask & PPUMASK_GREYSCALE) ? 0x30 : 0x3F;
+	if(!(ppu->mask & PPUMASK_RENDERING)){
+		// With rendering off it's the backdrop colour, unless 'v' points into the palette, in which case it's
+		// whatever that points at.
+		uint8_t backdrop = ppu->palette[(ppu->v & 0x3F00) == 0x3F00 ? ppu_palette_index(ppu->v) : 0] & colour_mask;
+		memset(row + from, backdrop, to - from);
+		return;
+	}
+
+	if(!ppu->sprites_ready){
+		ppu_evaluate_sprites(ppu, ppu->scanline);
+	}
+
+	render_pixels none = render_fill(0), all = render_fill(0xFF), left_edge = render_split(0, 0xFF);
+	render_pixels show_background = (ppu->mask & PPUMASK_BACKGROUND) ? all : none;
+	render_pixels show_sprites = (ppu->mask & PPUMASK_SPRITES) ? all : none;
+	for(unsigned x = from & ~15u; x < to; x += 16){
+		render_pixels background_here = show_background, sprites_here = show_sprites;
+		if(x == 0){
+			background_here &= (ppu->mask & PPUMASK_BACKGROUND_LEFT) ? all : left_edge;
+			sprites_here &= (ppu->mask & PPUMASK_SPRITES_LEFT) ? all : left_edge;
+		}
+		if(x >= from && x + 16 <= to){
+			render_compose(row + x, ppu->background + x + ppu->x, ppu->sprites + x, ppu->palette, background_here, sprites_here, colour_mask);
+		} else {
+			// The ends of a partly drawn line.
+			uint8_t pixels[16];
+			render_compose(pixels, ppu->background + x + ppu->x, ppu->sprites + x, ppu->palette, background_here, sprites_here, colour_mask);
+			unsigned start = x < from ? from : x, end = x + 16 < to ? x + 16 : to;
+			memcpy(row + start, pixels + (start - x), end - start);
+		}
+	}
+}
+
+// The parts of ppu_run_dots that only happen while rendering is turned on.
+static inline void ppu_run_rendering_dots(PPU *ppu, unsigned from, unsigned to){
+	unsigned line = ppu->scanline;
+	unsigned pre_render = ppu->timing->scanlines - 1;
+	if(line < PPU_VISIBLE_LINES){
+		if(from == 0){
+			ppu->sprite0_dot = ppu_find_sprite0(ppu, line);
+		}
+		if(ppu->sprite0_dot != 0 && from <= ppu->sprite0_dot && ppu->sprite0_dot < to
+			&& (ppu->mask & PPUMASK_RENDERING) == PPUMASK_RENDERING){
+			ppu->status |= PPUSTATUS_SPRITE0;
+		}
+		// Sprites for the next line are looked for from dot 65, and that's as it stands then.
+		if(from <= 65 && 65 < to){
+			ppu->overflow_dot = ppu_find_overflow(ppu, line);
+		}
+		if(ppu->overflow_dot != 0 && from <= ppu->overflow_dot && ppu->overflow_dot < to){
+			ppu->status |= PPUSTATUS_OVERFLOW;
+		}
+	}
+
+	// The scroll registers. Coarse X goes up every 8 dots while this line's tiles are fetched (8-256) and twice
+	// more for the next line's first two (328 and 336), each time just after a tile has been fetched from where
+	// it was pointing. At 256 it goes down a line, at 257 back to the left edge, and during 280-304 of the
+	// pre-render line back to the top.
+	unsigned last = to - 1;
+	unsigned end = last > 256 ? 256 : last;
+	for(unsigned dot = from < 8 ? 8 : (from + 7) & ~7u; dot <= end; dot += 8){
+		if(ppu->render && line != pre_render){
+			ppu_fetch_tile(ppu, ppu->v, ppu->background + (dot / 8 + 1) * 8);
+			ppu->fetched_count = dot / 8 + 2;
+		}
+		ppu_increment_x(ppu);
+	}
+	if(from <= 256 && 256 <= last){
+		ppu_increment_y(ppu);
+	}
+	if(from <= 257 && 257 <= last){
+		ppu->v = (ppu->v & ~0x041F) | (ppu->t & 0x041F);
+	}
+	// OAMADDR is reset on every dot of 257-320, while the next line's sprites are fetched.
+	if(from <= 320 && 257 <= last){
+		ppu->oam_addr = 0;
+	}
+	if(line == pre_render && from <= 304 && 280 <= last){
+		ppu->v = (ppu->v & ~0x7BE0) | (ppu->t & 0x7BE0);
+	}
+	if(from <= 328 && 328 <= last){
+		ppu_fetch_tile(ppu, ppu->v, ppu->prefetched);
+		ppu_increment_x(ppu);
+	}
+	if(from <= 336 && 336 <= last){
+		ppu_fetch_tile(ppu, ppu->v, ppu->prefetched + 8);
+		ppu_increment_x(ppu);
+	}
+}
+
+// Runs dots 'from' up to (not including) 'to' of the current scanline.
+static inline void ppu_run_dots(PPU *ppu, unsigned from, unsigned to){
+	unsigned line = ppu->scanline;
+	unsigned pre_render = ppu->timing->scanlines - 1;
+	if(line == ppu->timing->vblank_scanline && from <= 1 && 1 < to){
+		ppu->status |= PPUSTATUS_VBLANK;
+	} else if(line == pre_render && from <= 1 && 1 < to){
+		ppu->status &= ~(PPUSTATUS_VBLANK | PPUSTATUS_SPRITE0 | PPUSTATUS_OVERFLOW);
+	}
+
+	if((ppu->mask & PPUMASK_RENDERING) && (line < PPU_VISIBLE_LINES || line == pre_render)){
+		ppu_run_rendering_dots(ppu, from, to);
+	}
+
+	// Dots 1-256 output pixels 0-255.
+	if(line < PPU_VISIBLE_LINES && ppu->render && from < 257){
+		unsigned first = from == 0 ? 0 : from - 1;
+		unsigned end = to - 1 < RENDER_WIDTH ? to - 1 : RENDER_WIDTH;
+		if(first < end){
+			ppu_draw(ppu, first, end);
+		}
+	}
+}
+
+// Runs every dot up to and including the one at master clock 'time'. Going backwards does nothing.
+static inline void ppu_catch_up(PPU *ppu, uint64_t time){
+	if(time < ppu->time){
+		return;
+	}
+	uint64_t dots = (time - ppu->time) / ppu->timing->ppu_divider + 1;
+	ppu->time += dots * ppu->timing->ppu_divider;
+	ppu->catch_ups++;
+	ppu->caught_up_dots += dots;
+
+	while(dots != 0){
+		unsigned line_start = ppu->scanline * PPU_DOTS_PER_LINE;
+		unsigned line_end = ppu->frame_dots - line_start < PPU_DOTS_PER_LINE ? ppu->frame_dots - line_start : PPU_DOTS_PER_LINE;
+		if(line_end < PPU_DOTS_PER_LINE && dots >= line_end - ppu->dot && !(ppu->mask & PPUMASK_RENDERING)){
+			// An odd frame's pre-render line, about to get to dot 339. The real PPU only skips the dot after it
+			// while rendering, so with rendering off the frame is a dot longer than timing_frame_start has it.
+			ppu->frame_dots++;
+			line_end++;
+		}
+		unsigned to = dots < line_end - ppu->dot ? ppu->dot + (unsigned)dots : line_end;
+		ppu_run_dots(ppu, ppu->dot, to);
+		dots -= to - ppu->dot;
+		ppu->dot = to;
+
+		if(ppu->dot == line_end){
+			ppu->dot = 0;
+			ppu->sprite0_dot = 0;
+			ppu->overflow_dot = 0;
+			memcpy(ppu->background, ppu->prefetched, sizeof(ppu->prefetched));
+			memset(ppu->background + sizeof(ppu->prefetched), 0, sizeof(ppu->background) - sizeof(ppu->prefetched));
+			ppu->fetched_count = 2;
+			ppu->sprites_ready = false;
+			if(++ppu->scanline == ppu->timing->scanlines){
+				ppu->delay = ppu_frame_delay(ppu, ppu->frame + 1);
+				ppu->scanline = 0;
+				ppu->frame++;
+				ppu->frame_dots = ppu_frame_dots(ppu->timing, ppu->frame);
+			}
+		}
+	}
+}
+
+// PPUDATA moves 'v' on by 1 or 32 after each access.
+static inline void ppu_increment_address(PPU *ppu){
+	ppu->v = (ppu->v + ((ppu->ctrl & PPUCTRL_INCREMENT_32) ? 32 : 1)) & 0x7FFF;
+}
+
+// Register accesses. The PPU has to have been caught up to the access first.
+static inline uint8_t ppu_read_register(PPU *ppu, uint16_t address){
+	uint8_t value;
+	switch(address & 7){
+		case 2:
+			value = (ppu->status & 0xE0) | (ppu->bus & 0x1F);
+			ppu->status &= ~PPUSTATUS_VBLANK;
+			ppu->w = false;
+			break;
+		case 4:
+			value = ppu->oam[ppu->oam_addr];
+			break;
+		case 7:
+			if((ppu->v & 0x3FFF) >= 0x3F00){
+				// Palette reads skip the buffer, but it still gets refilled with the nametable underneath.
+				value = (ppu_bus_read(ppu, ppu->v) & 0x3F) | (ppu->bus & 0xC0);
+				ppu->read_buffer = ppu_bus_read(ppu, ppu->v - 0x1000);
+			} else {
+				value = ppu->read_buffer;
+				ppu->read_buffer = ppu_bus_read(ppu, ppu->v);
+			}
+			ppu_increment_address(ppu);
+			break;
+		default:
+			value = ppu->bus;
+	}
+	ppu->bus = value;
+	return value;
+}
+
+// Returns true if this write should cause an NMI straight away, which happens when NMIs are turned on partway
+// through vblank.
+static inline bool ppu_write_register(PPU *ppu, uint16_t address, uint8_t value){
+	ppu->bus = value;
+	switch(address & 7){
+		case 0: {
+			bool was_enabled = ppu->ctrl & PPUCTRL_NMI;
+			ppu->ctrl = value;
+			ppu->t = (ppu->t & ~0x0C00) | ((value & 0x03) << 10);
+			return !was_enabled && (value & PPUCTRL_NMI) && (ppu->status & PPUSTATUS_VBLANK);
+		}
+		case 1:
+			ppu->mask = value;
+			break;
+		case 3:
+			ppu->oam_addr = value;
+			break;
+		case 4:
+			ppu->oam[ppu->oam_addr++] = value;
+			break;
+		case 5:
+			if(!ppu->w){
+				ppu->t = (ppu->t & ~0x001F) | (value >> 3);
+				ppu->x = value & 7;
+			} else {
+				ppu->t = (ppu->t & ~0x73E0) | ((value & 0x07) << 12) | ((value & 0xF8) << 2);
+			}
+			ppu->w = !ppu->w;
+			break;
+		case 6:
+			if(!ppu->w){
+				ppu->t = (ppu->t & 0x00FF) | ((value & 0x3F) << 8);
+			} else {
+				ppu->t = (ppu->t & 0xFF00) | value;
+				ppu->v = ppu->t;
+			}
+			ppu->w = !ppu->w;
+			break;
+		case 7:
+			ppu_bus_write(ppu, ppu->v, value);
+			ppu_increment_address(ppu);
+			break;
+	}
+	return false;
+}
+
+#endif
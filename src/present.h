@@ -0,0 +1,380 @@
+#ifndef present_h
+#define present_h
+
+// Showing the picture in a window, with SDL2. The emulator and the window each get their own thread, which
+// pass frames through a triple buffer (see triple_buffer.h): the emulation thread copies out each finished frame
+// and goes straight on to the next, and the presentation thread shows whatever's newest once per refresh. Handing
+// a frame over never waits, so a slow vsync or compositor only holds up the presentation thread.
+// If the display's vsynced and its refresh rate is close to the console's frame rate (an NTSC game on a 60Hz
+// screen) the emulator runs one frame per refresh, a fraction of a percent fast or slow, and nothing's ever
+// dropped or shown twice (see presenter_lock_pacer; the sound makes up the difference, see rate_control.h). Then
+// the emulation thread does wait on the presentation thread: between frames it sleeps on a condition variable
+// until the next present (see presenter_wait_refresh), or a frame and a bit if none comes, which it then counts
+// as a missed refresh. Otherwise the emulator keeps time with its own clock (see presenter_pace), and when the
+// two drift apart a frame is dropped or shown twice, and those are counted.
+//
+// All of the SDL calls happen on the presentation thread, which is fine everywhere but macOS. SDL's dummy and
+// offscreen video drivers (SDL_VIDEODRIVER=dummy) work too, so this can be run on a box with no display.
+//
+// The keyboard is the first controller: the arrow keys, X for A, Z for B, right shift for Select and return for
+// Start. The window's thread keeps track of what's held and the emulation thread picks it up once a frame (see
+// presenter_buttons).
+//
+// SDL2 is only used if the build found it (AGNT_SDL, see the makefile). Otherwise new_presenter says so and
+// returns NULL, and the emulator runs without a window.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+
+#ifdef AGNT_SDL
+#include <SDL2/SDL.h>
+#endif
+
+#include "render.h"
+#include "input.h"
+#include "triple_buffer.h"
+#include "timing.h"
+#include "log.h"
+#include "platform.h"
+
+#define PRESENT_SCALE 3 // Starting size of the window, in screen pixels per NES pixel.
+#define PRESENT_DEFAULT_HZ 60.0 // If the display won't say what its refresh rate is.
+#define PRESENT_LOCK_RANGE 0.01 // How far off the console's frame rate the display can be and still be locked to.
+
+typedef struct {
+	TRIPLE_BUFFER *frames;
+	const LOGGER *logger;
+	volatile sig_atomic_t *stop; // Set when the window is closed.
+
+	pthread_t thread;
+	atomic_bool running; // Cleared to tell the thread to finish.
+
+	// Startup: the thread reports whether it got a window before new_presenter returns.
+	pthread_mutex_t lock;
+	pthread_cond_t started;
+	int status; // 0 while starting, 1 once running, -1 if it failed.
+	pthread_cond_t refreshed; // Signalled after every present, on the monotonic clock.
+
+	// Set by the thread once it's running, read-only after that.
+	double refresh_hz;
+	bool vsync;
+
+	// Refreshes shown so far. Drops and duplicates are counted in 'frames'.
+	atomic_ullong presents;
+
+	atomic_uchar buttons; // Held on the keyboard, enum controller_buttons.
+} PRESENTER;
+
+// Wall clock pacing for the emulation thread, which runs frames at the console's own rate, or the display's if
+// it's been locked to it.
+typedef struct {
+	double period; // Seconds per frame.
+	double next; // When the next frame is due to start.
+	uint64_t late_frames; // Frames that started so late we gave up catching up, see presenter_pace.
+
+	PRESENTER *display; // If locked to its refreshes, see presenter_lock_pacer.
+	uint64_t presents; // Its refreshes as of the last frame.
+	uint64_t missed_refreshes; // Times it didn't refresh when it should have, so the clock was used instead.
+} PACER;
+
+static inline struct timespec present_timespec(double when){
+	struct timespec ts;
+	ts.tv_sec = (time_t)when;
+	ts.tv_nsec = (long)((when - (double)ts.tv_sec) * 1e9);
+	return ts;
+}
+
+static inline void present_sleep_until(double when){
+	struct timespec ts = present_timespec(when);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+	}
+}
+
+static inline PACER new_pacer(const TIMING *timing){
+	PACER pacer;
+	pacer.period = timing->cpu_cycles_per_frame / timing_cpu_hz(timing);
+	pacer.next = platform_now();
+	pacer.late_frames = 0;
+	pacer.display = NULL;
+	pacer.presents = 0;
+	pacer.missed_refreshes = 0;
+	return pacer;
+}
+
+// Runs a frame per refresh of 'presenter' from now on, if it's vsynced and near enough the console's frame rate
+// to pass for it. Returns whether it was; if not the pacer's left keeping time itself.
+static inline bool presenter_lock_pacer(PACER *pacer, PRESENTER *presenter, const LOGGER *logger){
+	double speed = presenter->refresh_hz * pacer->period;
+	if(!presenter->vsync || speed < 1.0 - PRESENT_LOCK_RANGE || speed > 1.0 + PRESENT_LOCK_RANGE){
+		return false;
+	}
+	pacer->display = presenter;
+	pacer->period = 1.0 / presenter->refresh_hz;
+	pacer->presents = atomic_load(&presenter->presents);
+	log_message(logger, LOG_INFO, "Running a frame per refresh, at %.2f%% of the console's speed.\n", speed * 100);
+	return true;
+}
+
+// Waits for the display to refresh again, or until 'deadline' if it doesn't. Returns whether it did.
+static inline bool presenter_wait_refresh(PACER *pacer, double deadline){
+	PRESENTER *presenter = pacer->display;
+	struct timespec ts = present_timespec(deadline);
+	uint64_t presents;
+	pthread_mutex_lock(&presenter->lock);
+	while((presents = atomic_load(&presenter->presents)) == pacer->presents){
+		if(pthread_cond_timedwait(&presenter->refreshed, &presenter->lock, &ts) == ETIMEDOUT){
+			break;
+		}
+	}
+	pthread_mutex_unlock(&presenter->lock);
+	bool refreshed = presents != pacer->presents;
+	pacer->presents = presents;
+	return refreshed;
+}
+
+// Waits until it's time for the next frame: the next refresh if it's locked to the display, otherwise by the
+// clock. If we've fallen more than a few frames behind (the machine was suspended, say) there's no point running
+// them all back to back to catch up, so the clock starts again from now.
+static inline void presenter_pace(PACER *pacer){
+	pacer->next += pacer->period;
+	if(pacer->display != NULL){
+		// A minimised window often stops refreshing, so give it a frame's grace and then go by the clock.
+		if(presenter_wait_refresh(pacer, pacer->next + pacer->period)){
+			pacer->next = platform_now();
+			return;
+		}
+		pacer->missed_refreshes++;
+	}
+	double now = platform_now();
+	if(now > pacer->next + pacer->period * 4){
+		pacer->next = now;
+		pacer->late_frames++;
+	} else if(now < pacer->next){
+		present_sleep_until(pacer->next);
+	}
+}
+
+// Emulation thread side: hands over a finished picture (RENDER_WIDTH x RENDER_HEIGHT NES colours).
+static inline void presenter_submit(PRESENTER *presenter, const uint8_t *picture){
+	memcpy(triple_buffer_back(presenter->frames), picture, presenter->frames->frame_size);
+	triple_buffer_publish(presenter->frames);
+}
+
+// Emulation thread side: the buttons held on the keyboard right now, for the first controller.
+static inline uint8_t presenter_buttons(PRESENTER *presenter){
+	return atomic_load_explicit(&presenter->buttons, memory_order_relaxed);
+}
+
+static inline void presenter_set_status(PRESENTER *presenter, int status){
+	pthread_mutex_lock(&presenter->lock);
+	presenter->status = status;
+	pthread_cond_signal(&presenter->started);
+	pthread_mutex_unlock(&presenter->lock);
+}
+
+#ifdef AGNT_SDL
+
+static inline uint8_t presenter_key_button(SDL_Scancode key){
+	switch(key){
+		case SDL_SCANCODE_X: return BUTTON_A;
+		case SDL_SCANCODE_Z: return BUTTON_B;
+		case SDL_SCANCODE_RSHIFT: return BUTTON_SELECT;
+		case SDL_SCANCODE_RETURN: return BUTTON_START;
+		case SDL_SCANCODE_UP: return BUTTON_UP;
+		case SDL_SCANCODE_DOWN: return BUTTON_DOWN;
+		case SDL_SCANCODE_LEFT: return BUTTON_LEFT;
+		case SDL_SCANCODE_RIGHT: return BUTTON_RIGHT;
+		default: return 0;
+	}
+}
+
+static inline void* presenter_thread(void *arg){
+	PRESENTER *presenter = (PRESENTER*)arg;
+
+	SDL_Window *window = NULL;
+	SDL_Renderer *renderer = NULL;
+	SDL_Texture *texture = NULL;
+	if(SDL_InitSubSystem(SDL_INIT_VIDEO) != 0){
+		log_message(presenter->logger, LOG_ERROR, "Error: couldn't start SDL video: %s\n", SDL_GetError());
+		presenter_set_status(presenter, -1);
+		return NULL;
+	}
+	window = SDL_CreateWindow("AGNT NES Emulator", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+		RENDER_WIDTH * PRESENT_SCALE, RENDER_HEIGHT * PRESENT_SCALE, SDL_WINDOW_RESIZABLE);
+	if(window != NULL){
+		// Not every driver can do vsync (the dummy one can't), so fall back to a renderer without it.
+		renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+		if(renderer == NULL){
+			renderer = SDL_CreateRenderer(window, -1, 0);
+		}
+	}
+	if(renderer != NULL){
+		SDL_RenderSetLogicalSize(renderer, RENDER_WIDTH, RENDER_HEIGHT);
+		texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, RENDER_WIDTH, RENDER_HEIGHT);
+	}
+	if(texture == NULL){
+		log_message(presenter->logger, LOG_ERROR, "Error: couldn't open a window: %s\n", SDL_GetError());
+		if(renderer != NULL){
+			SDL_DestroyRenderer(renderer);
+		}
+		if(window != NULL){
+			SDL_DestroyWindow(window);
+		}
+		SDL_QuitSubSystem(SDL_INIT_VIDEO);
+		presenter_set_status(presenter, -1);
+		return NULL;
+	}
+
+	SDL_RendererInfo info;
+	presenter->vsync = SDL_GetRendererInfo(renderer, &info) == 0 && (info.flags & SDL_RENDERER_PRESENTVSYNC);
+	SDL_DisplayMode mode;
+	int display = SDL_GetWindowDisplayIndex(window);
+	presenter->refresh_hz = display >= 0 && SDL_GetCurrentDisplayMode(display, &mode) == 0 && mode.refresh_rate > 0
+		? mode.refresh_rate : PRESENT_DEFAULT_HZ;
+	log_message(presenter->logger, LOG_INFO, "Presenting with SDL's %s driver at %.0fHz, %s.\n", SDL_GetCurrentVideoDriver(),
+		presenter->refresh_hz, presenter->vsync ? "vsynced" : "timed by us");
+	presenter_set_status(presenter, 1);
+
+	double next_refresh = platform_now();
+	while(atomic_load_explicit(&presenter->running, memory_order_relaxed)){
+		SDL_Event event;
+		while(SDL_PollEvent(&event)){
+			if(event.type == SDL_QUIT){
+				*presenter->stop = true;
+			} else if((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && !event.key.repeat){
+				uint8_t button = presenter_key_button(event.key.keysym.scancode);
+				if(event.type == SDL_KEYDOWN){
+					atomic_fetch_or_explicit(&presenter->buttons, button, memory_order_relaxed);
+				} else {
+					atomic_fetch_and_explicit(&presenter->buttons, (uint8_t)~button, memory_order_relaxed);
+				}
+			}
+		}
+
+		// Only a new frame needs converting and uploading, an old one is still in the texture.
+		if(triple_buffer_take(presenter->frames)){
+			void *pixels;
+			int pitch;
+			if(SDL_LockTexture(texture, NULL, &pixels, &pitch) == 0){
+				const uint8_t *picture = triple_buffer_front(presenter->frames);
+				for(unsigned y = 0; y < RENDER_HEIGHT; y++){
+					uint32_t *row = (uint32_t*)((uint8_t*)pixels + (size_t)y * pitch);
+					for(unsigned x = 0; x < RENDER_WIDTH; x++){
+						row[x] = 0xFF000000 | render_rgb[picture[y * RENDER_WIDTH + x] & 0x3F];
+					}
+				}
+				SDL_UnlockTexture(texture);
+			}
+		}
+		SDL_RenderClear(renderer);
+		SDL_RenderCopy(renderer, texture, NULL, NULL);
+		SDL_RenderPresent(renderer);
+		pthread_mutex_lock(&presenter->lock);
+		atomic_fetch_add_explicit(&presenter->presents, 1, memory_order_relaxed);
+		pthread_cond_broadcast(&presenter->refreshed);
+		pthread_mutex_unlock(&presenter->lock);
+
+		// With vsync, presenting is what waits for the next refresh. Without it, we do.
+		if(!presenter->vsync){
+			next_refresh += 1.0 / presenter->refresh_hz;
+			double now = platform_now();
+			if(next_refresh < now){
+				next_refresh = now;
+			} else {
+				present_sleep_until(next_refresh);
+			}
+		}
+	}
+
+	SDL_DestroyTexture(texture);
+	SDL_DestroyRenderer(renderer);
+	SDL_DestroyWindow(window);
+	SDL_QuitSubSystem(SDL_INIT_VIDEO);
+	return NULL;
+}
+
+#endif
+
+// Opens the window and starts showing frames in it. 'stop' is set if the window's closed. Returns NULL if there's
+// no window to be had, having logged why.
+static inline PRESENTER* new_presenter(const LOGGER *logger, volatile sig_atomic_t *stop){
+#ifdef AGNT_SDL
+	PRESENTER *presenter = (PRESENTER*)calloc(1, sizeof(PRESENTER));
+	if(presenter == NULL){
+		return NULL;
+	}
+	presenter->frames = new_triple_buffer(RENDER_WIDTH * RENDER_HEIGHT);
+	if(presenter->frames == NULL){
+		free(presenter);
+		return NULL;
+	}
+	presenter->logger = logger;
+	presenter->stop = stop;
+	atomic_init(&presenter->running, true);
+	atomic_init(&presenter->presents, 0);
+	atomic_init(&presenter->buttons, 0);
+	pthread_mutex_init(&presenter->lock, NULL);
+	pthread_cond_init(&presenter->started, NULL);
+	pthread_condattr_t attributes;
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&presenter->refreshed, &attributes);
+	pthread_condattr_destroy(&attributes);
+
+	int status = -1;
+	if(pthread_create(&presenter->thread, NULL, presenter_thread, presenter) == 0){
+		pthread_mutex_lock(&presenter->lock);
+		while(presenter->status == 0){
+			pthread_cond_wait(&presenter->started, &presenter->lock);
+		}
+		status = presenter->status;
+		pthread_mutex_unlock(&presenter->lock);
+		if(status != 1){
+			pthread_join(presenter->thread, NULL);
+		}
+	}
+	if(status != 1){
+		pthread_mutex_destroy(&presenter->lock);
+		pthread_cond_destroy(&presenter->started);
+		pthread_cond_destroy(&presenter->refreshed);
+		destroy_triple_buffer(presenter->frames);
+		free(presenter);
+		return NULL;
+	}
+	return presenter;
+#else
+	(void)stop;
+	log_message(logger, LOG_WARNING, "Warning: built without SDL2, so there's no window.\n");
+	return NULL;
+#endif
+}
+
+// Closes the window.
+static inline void destroy_presenter(PRESENTER *presenter){
+	atomic_store(&presenter->running, false);
+	pthread_join(presenter->thread, NULL);
+	pthread_mutex_destroy(&presenter->lock);
+	pthread_cond_destroy(&presenter->started);
+	pthread_cond_destroy(&presenter->refreshed);
+	destroy_triple_buffer(presenter->frames);
+	free(presenter);
+}
+
+static inline void print_presenter_stats(const LOGGER *logger, const PRESENTER *presenter, const PACER *pacer){
+	TRIPLE_BUFFER *frames = presenter->frames;
+	log_message(logger, LOG_INFO, "Presented %llu refresh(es) at %.0fHz: %llu new frame(s) of %llu, %llu duplicated, %llu dropped, "
+		"%llu late, %llu refresh(es) missed.\n", (unsigned long long)atomic_load(&presenter->presents), presenter->refresh_hz,
+		(unsigned long long)atomic_load(&frames->taken), (unsigned long long)atomic_load(&frames->published),
+		(unsigned long long)atomic_load(&frames->duplicated), (unsigned long long)atomic_load(&frames->dropped),
+		(unsigned long long)pacer->late_frames, (unsigned long long)pacer->missed_refreshes);
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef rate_control_h
+#define rate_control_h
+
+// Dynamic rate control, for keeping sound and picture in step. The emulator's paced to the display (see
+// presenter_pace), and the sound card plays at its own rate on its own clock, and the two never quite agree:
+// with nothing done about it the audio ring either slowly runs dry (a click every so often) or slowly fills
+// up (the sound falls further and further behind). So the sound is resampled very slightly faster or slower
+// than it should be, by at most RATE_MAX_ADJUST (half a percent, which is far too little to hear), to keep
+// the ring at the target latency. It's a PI controller on how full the ring is: the proportional part reacts
+// to the ring wandering off, and the integral part settles on whatever the two clocks' real difference is,
+// so the ring ends up sat on the target rather than somewhere near it.
+//
+// The ratio is relative to the console's own rate, which comes from the cart's region (see timing.h). If the
+// emulator's running a little fast or slow to match the display - say an NTSC game at 60Hz rather than its own
+// 60.0988Hz - 'base' takes care of that, so the controller only has the clocks' drift to deal with.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "timing.h"
+#include "log.h"
+
+#define RATE_DEFAULT_LATENCY_MS 25.0 // Sound queued, on average.
+#define RATE_MAX_ADJUST 0.005
+#define RATE_GAIN 0.01 // Ratio change for a ring that's off by a whole target's worth, proportionally...
+#define RATE_INTEGRAL_GAIN 0.0001 // ...and added up per frame.
+#define RATE_SMOOTHING 0.1 // How much of each frame's fill goes into the average the controller works on.
+
+typedef struct {
+	double base; // The ratio with the clocks in step: how much longer each frame's shown for than it should be.
+	double sample_rate;
+	double target; // Samples queued.
+	double frame_samples; // About how many samples a frame makes, before adjusting.
+
+	double average; // The ring's fill, smoothed over a few frames.
+	double integral;
+	double ratio; // The resampling ratio to use, see apu_set_ratio.
+
+	// Telemetry. 'fill' is the last frame's, the rest are since the last rate_control_reset_window.
+	double fill;
+	double window_min_fill;
+	double window_max_fill;
+	double window_min_ratio;
+	double window_max_ratio;
+	uint64_t frames;
+} RATE_CONTROL;
+
+static inline void rate_control_reset_window(RATE_CONTROL *rc){
+	rc->window_min_fill = rc->window_max_fill = rc->fill;
+	rc->window_min_ratio = rc->window_max_ratio = rc->ratio;
+}
+
+// For the console 'timing' says, run one frame every 'frame_seconds' of real time, playing 'sample_rate' samples a
+// second with 'latency_ms' of them queued.
+static inline RATE_CONTROL new_rate_control(const TIMING *timing, double frame_seconds, double sample_rate, double latency_ms){
+	RATE_CONTROL rc;
+	double console_seconds = timing->cpu_cycles_per_frame / timing_cpu_hz(timing);
+	rc.base = frame_seconds / console_seconds;
+	rc.sample_rate = sample_rate;
+	rc.target = latency_ms * sample_rate / 1000.0;
+	rc.frame_samples = sample_rate * frame_seconds;
+	rc.average = rc.target;
+	rc.integral = 0;
+	rc.ratio = rc.base;
+	rc.fill = rc.target;
+	rc.frames = 0;
+	rate_control_reset_window(&rc);
+	return rc;
+}
+
+static inline double rate_control_clamp(double value, double limit){
+	return value > limit ? limit : value < -limit ? -limit : value;
+}
+
+// Once a frame, with 'queued' samples in the ring straight after the frame's were added. Returns the ratio to
+// make the next frame's at.
+static inline double rate_control_update(RATE_CONTROL *rc, size_t queued){
+	// The ring's fullest just after a frame's added, and it's drained by about a frame's worth by the time the
+	// next one is, so what's queued on average is half a frame less.
+	rc->fill = (double)queued - rc->frame_samples / 2;
+	rc->average += (rc->fill - rc->average) * RATE_SMOOTHING;
+
+	double error = (rc->target - rc->average) / rc->target;
+	rc->integral = rate_control_clamp(rc->integral + error * RATE_INTEGRAL_GAIN, RATE_MAX_ADJUST);
+	double adjust = rate_control_clamp(error * RATE_GAIN + rc->integral, RATE_MAX_ADJUST);
+	rc->ratio = rc->base * (1.0 + adjust);
+
+	rc->frames++;
+	rc->window_min_fill = rc->fill < rc->window_min_fill ? rc->fill : rc->window_min_fill;
+	rc->window_max_fill = rc->fill > rc->window_max_fill ? rc->fill : rc->window_max_fill;
+	rc->window_min_ratio = rc->ratio < rc->window_min_ratio ? rc->ratio : rc->window_min_ratio;
+	rc->window_max_ratio = rc->ratio > rc->window_max_ratio ? rc->ratio : rc->window_max_ratio;
+	return rc->ratio;
+}
+
+static inline double rate_control_ms(const RATE_CONTROL *rc, double samples){
+	return samples * 1000.0 / rc->sample_rate;
+}
+
+// The live numbers, for --audio-telemetry: how much sound's queued and how it's being resampled, since the
+// last call.
+static inline void print_rate_control_telemetry(const LOGGER *logger, RATE_CONTROL *rc, uint64_t underruns){
+	log_message(logger, LOG_INFO, "Audio: %5.1fms queued (%5.1f-%5.1f, target %.1f), ratio %.5f (%.5f-%.5f, base %.5f), "
+		"%llu sample(s) of silence so far.\n", rate_control_ms(rc, rc->average), rate_control_ms(rc, rc->window_min_fill),
+		rate_control_ms(rc, rc->window_max_fill), rate_control_ms(rc, rc->target), rc->ratio, rc->window_min_ratio,
+		rc->window_max_ratio, rc->base, (unsigned long long)underruns);
+	rate_control_reset_window(rc);
+}
+
+#endif
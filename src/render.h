@@ -0,0 +1,99 @@
+#ifndef render_h
+#define render_h
+
+// The renderer's inner loops, which work on 16 pixels at once using GCC's vector extensions (like lockstep.h),
+// so they turn into SSE2 or NEON without anything platform specific in here. The PPU (see ppu.h) decides what
+// goes where and calls these with the line it's drawing.
+//
+// Pixels in the line buffers are palette indices: bits 0-1 are the colour from the pattern, 0 being
+// transparent, bits 2-3 the palette, bit 4 set for the sprite palettes. Sprite pixels also have
+// RENDER_BEHIND set if they go behind the background.
+
+#include <stdint.h>
+#include <string.h>
+
+#define RENDER_WIDTH 256
+#define RENDER_HEIGHT 240
+#define RENDER_BEHIND 0x20
+
+typedef uint8_t render_pixels __attribute__((vector_size(16)));
+typedef uint8_t render_row __attribute__((vector_size(8)));
+
+static const render_pixels render_bits = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01, 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+
+// NES colours as 0xRRGGBB, for anything that wants the picture in RGB. The PPU puts out composite video rather
+// than RGB, so there's no one right answer for these; they're the usual ones for a 2C02.
+static const uint32_t render_rgb[64] = {
+	0x666666, 0x002A88, 0x1412A7, 0x3B00A4, 0x5C007E, 0x6E0040, 0x6C0600, 0x561D00, 0x333500, 0x0B4800, 0x005200, 0x004F08, 0x00404D, 0x000000, 0x000000, 0x000000,
+	0xADADAD, 0x155FD9, 0x4240FF, 0x7527FE, 0xA01ACC, 0xB71E7B, 0xB53120, 0x994E00, 0x6B6D00, 0x388700, 0x0C9300, 0x008F32, 0x007C8D, 0x000000, 0x000000, 0x000000,
+	0xFFFEFF, 0x64B0FF, 0x9290FF, 0xC676FF, 0xF36AFF, 0xFE6ECC, 0xFE8170, 0xEA9E22, 0xBCBE00, 0x88D800, 0x5CE430, 0x45E082, 0x48CDDE, 0x4F4F4F, 0x000000, 0x000000,
+	0xFFFEFF, 0xC0DFFF, 0xD3D2FF, 0xE8C8FF, 0xFBC2FF, 0xFEC4EA, 0xFECCC5, 0xF7D8A5, 0xE4E594, 0xCFEF96, 0xBDF4AB, 0xB3F3CC, 0xB5EBF2, 0xB8B8B8, 0x000000, 0x000000
+};
+
+// 'a' in the first 8 pixels, 'b' in the last 8.
+static inline render_pixels render_split(uint8_t a, uint8_t b){
+	return (render_pixels){ a, a, a, a, a, a, a, a, b, b, b, b, b, b, b, b };
+}
+
+static inline render_pixels render_fill(uint8_t value){
+	return render_split(value, value);
+}
+
+// Two tiles' worth of a pattern row (a low and a high bitplane byte each, leftmost pixel in bit 7) to 16
+// pixels, with each tile's palette added to the pixels that aren't transparent.
+static inline void render_decode_tiles(uint8_t *out, uint8_t low_0, uint8_t high_0, uint8_t palette_0,
+	uint8_t low_1, uint8_t high_1, uint8_t palette_1){
+	render_pixels low = (render_pixels)((render_split(low_0, low_1) & render_bits) != 0) & 1;
+	render_pixels high = (render_pixels)((render_split(high_0, high_1) & render_bits) != 0) & 2;
+	render_pixels colour = low | high;
+	render_pixels palette = render_split(palette_0 << 2, palette_1 << 2);
+	colour |= palette & (render_pixels)(colour != 0);
+	memcpy(out, &colour, sizeof(colour));
+}
+
+// 8 pixels of a decoded pattern (colours 0-3, see tile_cache.h) with 'palette' (already shifted into bits 2-4)
+// added to the ones that aren't transparent.
+static inline void render_colour_row(uint8_t *out, const uint8_t *pattern, uint8_t palette){
+	render_row colour;
+	memcpy(&colour, pattern, sizeof(colour));
+	colour |= (render_row)(colour != 0) & palette;
+	memcpy(out, &colour, sizeof(colour));
+}
+
+// Puts 16 pixels of background and sprites together and looks up their colours. Anything cleared in 'show_background'
+// or 'show_sprites' is left out, which is how PPUMASK's enable and left edge bits are done. 'colour_mask' is 0x30
+// in greyscale mode and 0x3F otherwise.
+static inline void render_compose(uint8_t *out, const uint8_t *background, const uint8_t *sprites, const uint8_t *palette,
+	render_pixels show_background, render_pixels show_sprites, uint8_t colour_mask){
+	render_pixels bg, sprite, low, high;
+	memcpy(&bg, background, sizeof(bg));
+	memcpy(&sprite, sprites, sizeof(sprite));
+	memcpy(&low, palette, sizeof(low));
+	memcpy(&high, palette + 16, sizeof(high));
+	bg &= show_background;
+	sprite &= show_sprites;
+
+	// Sprites win unless they're transparent, or behind a background pixel that isn't.
+	render_pixels sprite_shown = (render_pixels)((sprite & 3) != 0)
+		& ((render_pixels)((sprite & RENDER_BEHIND) == 0) | (render_pixels)((bg & 3) == 0));
+	render_pixels index = ((sprite & 0x1F) & sprite_shown) | (bg & ~sprite_shown);
+
+	// Palette lookup. With a byte shuffle instruction (SSSE3 or NEON) that's 16 entries at a time; without one
+	// the compiler makes a mess of emulating it, so it's done a pixel at a time.
+#if defined(__SSSE3__) || defined(__ARM_NEON)
+	render_pixels upper = (render_pixels)((index & 0x10) != 0);
+	render_pixels colour = (__builtin_shuffle(low, index & 0x0F) & ~upper) | (__builtin_shuffle(high, index & 0x0F) & upper);
+	colour &= render_fill(colour_mask);
+	memcpy(out, &colour, sizeof(colour));
+#else
+	(void)low;
+	(void)high;
+	uint8_t indices[16];
+	memcpy(indices, &index, sizeof(indices));
+	for(unsigned i = 0; i < 16; i++){
+		out[i] = palette[indices[i]] & colour_mask;
+	}
+#endif
+}
+
+#endif
@@ -0,0 +1,350 @@
+#ifndef rewind_h
+#define rewind_h
+
+// Rewind. Once a frame, the machine is saved (see savestate.h) and stored as the difference from the last
+// keyframe, which is a full state taken every 'keyframe_interval' frames. Differences are XORs, so anything
+// that hasn't changed is a run of zeros, and they're run length encoded, so a typical frame takes tens to
+// hundreds of bytes. Everything goes in one fixed-size ring, and the oldest frames are dropped to make room.
+//
+// Because every frame is relative to its keyframe rather than to the frame before, going back to any frame
+// costs one keyframe decode (usually already done) plus one delta, however far back it is.
+//
+// Most of a savestate is RAM and PRG RAM, and most of that doesn't change from frame to frame, so rather than
+// comparing all of it every frame the state is split into 256 byte chunks and only the chunks that have been
+// written since the keyframe are compared. Writes are tracked by the page table (one store per mmu_write,
+// see page_table.h), and the parts of the state that aren't RAM - registers and the like - are always compared.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "mmu.h"
+#include "savestate.h"
+#include "mappers/delegator.h"
+
+#define REWIND_CHUNK 0x100
+#define REWIND_CHUNKS ((sizeof(SAVESTATE) + REWIND_CHUNK - 1) / REWIND_CHUNK)
+
+// Worst case encoded size of one chunk: its number, then a control byte for every data byte, and the data.
+#define REWIND_CHUNK_BOUND (2 + 2 * REWIND_CHUNK)
+
+typedef struct {
+	size_t offset; // Into the ring's data.
+	size_t length;
+	uint64_t keyframe; // Sequence number of the keyframe this is relative to, which is itself if it is one.
+} REWIND_ENTRY;
+
+typedef struct {
+	CPU *cpu; // The machine being recorded.
+
+	// Encoded frames, oldest at 'head'. Entries are never split, so if one doesn't fit at the end it goes at
+	// the start and the end is left unused until the ring wraps past it.
+	uint8_t *data;
+	size_t capacity;
+	size_t head;
+	size_t tail;
+
+	// Entry 'seq' lives at entries[seq % max_entries]. first_seq is the oldest still in the ring.
+	REWIND_ENTRY *entries;
+	size_t max_entries;
+	uint64_t first_seq;
+	size_t count;
+
+	unsigned keyframe_interval;
+	uint64_t keyframe_seq; // The keyframe new frames are encoded against, decoded into 'key'.
+	SAVESTATE *key;
+	SAVESTATE *current;
+	uint8_t *scratch; // Encoding space, big enough for the worst case.
+
+	uint8_t tracked[REWIND_CHUNKS]; // Chunks that are all RAM or PRG RAM, which only need comparing if written.
+	size_t prg_ram_start; // Offset of PRG RAM in a SAVESTATE.
+	uint8_t changed[REWIND_CHUNKS]; // Tracked chunks written since the keyframe.
+
+	// Stats.
+	uint64_t frames_pushed;
+	uint64_t bytes_pushed;
+} REWIND;
+
+// Marks the chunks covering [offset, offset + length) of a SAVESTATE in 'chunks'.
+static inline void rewind_mark(uint8_t *chunks, size_t offset, size_t length){
+	for(size_t chunk = offset / REWIND_CHUNK; chunk < REWIND_CHUNKS && chunk * REWIND_CHUNK < offset + length; chunk++){
+		chunks[chunk] = 1;
+	}
+}
+
+// Keeps up to 'max_frames' frames of history, in at most 'budget' bytes of encoded data. Returns NULL if the
+// numbers are too small to hold even a single keyframe.
+static inline REWIND* new_rewind(CPU *cpu, size_t budget, size_t max_frames, unsigned keyframe_interval){
+	if(budget < REWIND_CHUNKS * REWIND_CHUNK_BOUND || max_frames < 2 || keyframe_interval == 0){
+		return NULL;
+	}
+
+	REWIND *rw = (REWIND*)calloc(1, sizeof(REWIND));
+	rw->cpu = cpu;
+	rw->data = (uint8_t*)malloc(budget);
+	rw->capacity = budget;
+	rw->entries = (REWIND_ENTRY*)malloc(max_frames * sizeof(REWIND_ENTRY));
+	rw->max_entries = max_frames;
+	rw->keyframe_interval = keyframe_interval;
+	rw->key = (SAVESTATE*)malloc(sizeof(SAVESTATE));
+	rw->current = (SAVESTATE*)malloc(sizeof(SAVESTATE));
+	rw->scratch = (uint8_t*)malloc(REWIND_CHUNKS * REWIND_CHUNK_BOUND);
+
+	// A chunk is only tracked if every byte of it is RAM or PRG RAM. The bits of the state where the two meet
+	// the rest are small enough that comparing them every frame doesn't matter.
+	size_t ram_start = offsetof(SAVESTATE, ram);
+	size_t prg_ram_start, prg_ram_length;
+	mmc_state_prg_ram(cpu->mmu->mmc, &prg_ram_start, &prg_ram_length);
+	prg_ram_start += offsetof(SAVESTATE, mmc);
+	rw->prg_ram_start = prg_ram_start;
+	for(size_t chunk = 0; chunk < REWIND_CHUNKS; chunk++){
+		size_t start = chunk * REWIND_CHUNK, end = start + REWIND_CHUNK;
+		rw->tracked[chunk] = (start >= ram_start && end <= ram_start + 0x800)
+			|| (start >= prg_ram_start && end <= prg_ram_start + prg_ram_length);
+	}
+
+	// Nothing's been recorded yet, so forget anything written before now.
+	memset(cpu->mmu->pages->dirty, 0, sizeof(cpu->mmu->pages->dirty));
+	return rw;
+}
+
+static inline void destroy_rewind(REWIND *rw){
+	free(rw->data);
+	free(rw->entries);
+	free(rw->key);
+	free(rw->current);
+	free(rw->scratch);
+	free(rw);
+}
+
+// Encodes the chunks of 'state' picked by 'chunks' (or all of them if NULL) as their XOR with 'base' (or as
+// they are if NULL), into 'out'. Each chunk that differs is its number (16 bits, little endian) followed by
+// control bytes: 0x00-0x7F for a run of that many + 1 unchanged bytes, 0x80-0xFF for that many - 0x7F
+// changed bytes, whose XORs follow. Returns the encoded length.
+static inline size_t rewind_encode(const SAVESTATE *state, const SAVESTATE *base, const uint8_t *chunks, uint8_t *out){
+	const uint8_t *now = (const uint8_t*)state, *then = (const uint8_t*)base;
+	size_t length = 0;
+
+	for(size_t chunk = 0; chunk < REWIND_CHUNKS; chunk++){
+		if(chunks != NULL && !chunks[chunk]){
+			continue;
+		}
+		size_t start = chunk * REWIND_CHUNK;
+		size_t end = start + REWIND_CHUNK < sizeof(SAVESTATE) ? start + REWIND_CHUNK : sizeof(SAVESTATE);
+
+		// Most chunks that could have changed haven't, so check that before encoding anything.
+		if(then != NULL && memcmp(now + start, then + start, end - start) == 0){
+			continue;
+		}
+
+		out[length++] = chunk & 0xFF;
+		out[length++] = chunk >> 8;
+		size_t i = start;
+		while(i < end){
+			size_t run = 0;
+			if((now[i] ^ (then != NULL ? then[i] : 0)) == 0){
+				while(i + run < end && run < 0x80 && (now[i + run] ^ (then != NULL ? then[i + run] : 0)) == 0){
+					run++;
+				}
+				out[length++] = (uint8_t)(run - 1);
+			} else {
+				size_t control = length++;
+				while(i + run < end && run < 0x80 && (now[i + run] ^ (then != NULL ? then[i + run] : 0)) != 0){
+					out[length++] = now[i + run] ^ (then != NULL ? then[i + run] : 0);
+					run++;
+				}
+				out[control] = (uint8_t)(0x7F + run);
+			}
+			i += run;
+		}
+	}
+	return length;
+}
+
+// XORs an encoded frame into 'state'.
+static inline void rewind_decode(SAVESTATE *state, const uint8_t *data, size_t length){
+	uint8_t *bytes = (uint8_t*)state;
+	size_t i = 0;
+	while(i < length){
+		size_t chunk = data[i] | ((size_t)data[i + 1] << 8);
+		i += 2;
+		size_t at = chunk * REWIND_CHUNK;
+		size_t end = at + REWIND_CHUNK < sizeof(SAVESTATE) ? at + REWIND_CHUNK : sizeof(SAVESTATE);
+		while(at < end){
+			uint8_t control = data[i++];
+			if(control < 0x80){
+				at += control + 1;
+			} else {
+				for(size_t n = control - 0x7F; n > 0; n--){
+					bytes[at++] ^= data[i++];
+				}
+			}
+		}
+	}
+}
+
+static inline REWIND_ENTRY* rewind_entry(REWIND *rw, uint64_t seq){
+	return &rw->entries[seq % rw->max_entries];
+}
+
+// Drops the oldest frame, along with any after it that were relative to it.
+static inline void rewind_drop_oldest(REWIND *rw){
+	do {
+		rw->first_seq++;
+		rw->count--;
+	} while(rw->count != 0 && rewind_entry(rw, rw->first_seq)->keyframe != rw->first_seq);
+
+	if(rw->count == 0){
+		rw->head = rw->tail = 0;
+	} else {
+		rw->head = rewind_entry(rw, rw->first_seq)->offset;
+	}
+}
+
+// Finds room for 'length' bytes, dropping old frames until there is some. Returns false if it would never fit.
+static inline bool rewind_reserve(REWIND *rw, size_t length, size_t *offset){
+	if(length > rw->capacity){
+		return false;
+	}
+
+	for(;;){
+		if(rw->count == 0){
+			*offset = 0;
+			return true;
+		}
+		if(rw->tail > rw->head){
+			// Not wrapped: free space is after the tail, then before the head.
+			if(rw->capacity - rw->tail >= length){
+				*offset = rw->tail;
+				return true;
+			}
+			if(rw->head >= length){
+				*offset = 0;
+				return true;
+			}
+		} else if(rw->head - rw->tail >= length){
+			// Wrapped: free space is between the tail and the head.
+			*offset = rw->tail;
+			return true;
+		}
+		rewind_drop_oldest(rw);
+	}
+}
+
+// Records the machine as it is now. Call once a frame. Returns false if the frame couldn't be recorded.
+static inline bool rewind_push(REWIND *rw){
+	if(!savestate_save(rw->cpu, rw->current)){
+		return false;
+	}
+
+	// Fold the pages written since last time into the chunks changed since the keyframe. RAM is mirrored four
+	// times over, so its 8 pages can be written through any of 32.
+	uint8_t *dirty = rw->cpu->mmu->pages->dirty;
+	for(unsigned page = 0x00; page < 0x20; page++){
+		if(dirty[page]){
+			rewind_mark(rw->changed, offsetof(SAVESTATE, ram) + (page & 7) * 0x100, 0x100);
+		}
+	}
+	for(unsigned page = 0x60; page < 0x80; page++){
+		if(dirty[page]){
+			rewind_mark(rw->changed, rw->prg_ram_start + (page - 0x60) * 0x100, 0x100);
+		}
+	}
+	memset(dirty, 0, 0x80);
+
+	uint64_t seq = rw->first_seq + rw->count;
+	bool keyframe = rw->count == 0 || seq - rw->keyframe_seq >= rw->keyframe_interval
+		|| rewind_entry(rw, seq - 1)->keyframe != rw->keyframe_seq;
+	size_t length;
+	if(keyframe){
+		length = rewind_encode(rw->current, NULL, NULL, rw->scratch);
+	} else {
+		uint8_t chunks[REWIND_CHUNKS];
+		for(size_t chunk = 0; chunk < REWIND_CHUNKS; chunk++){
+			chunks[chunk] = !rw->tracked[chunk] || rw->changed[chunk];
+		}
+		length = rewind_encode(rw->current, rw->key, chunks, rw->scratch);
+	}
+
+	// Never overwrite the oldest entry's descriptor while it's still in the ring.
+	if(rw->count == rw->max_entries){
+		rewind_drop_oldest(rw);
+	}
+	size_t offset;
+	if(!rewind_reserve(rw, length, &offset)){
+		return false;
+	}
+	if(!keyframe && rw->count == 0){
+		// Making room dropped our keyframe, so this frame has nothing to be relative to. Go again as a keyframe.
+		return rewind_push(rw);
+	}
+
+	memcpy(rw->data + offset, rw->scratch, length);
+	if(rw->count == 0){
+		rw->first_seq = seq;
+		rw->head = offset;
+	}
+	rw->tail = offset + length;
+	*rewind_entry(rw, seq) = (REWIND_ENTRY){ offset, length, keyframe ? seq : rw->keyframe_seq };
+	rw->count++;
+
+	if(keyframe){
+		memcpy(rw->key, rw->current, sizeof(SAVESTATE));
+		rw->keyframe_seq = seq;
+		memset(rw->changed, 0, sizeof(rw->changed));
+	}
+
+	rw->frames_pushed++;
+	rw->bytes_pushed += length;
+	return true;
+}
+
+// Goes back one frame: forgets the most recent one, and puts the machine back how it was in the one before.
+// Returns false if there's no more history.
+static inline bool rewind_step_back(REWIND *rw){
+	if(rw->count < 2){
+		return false;
+	}
+
+	rw->count--;
+	uint64_t seq = rw->first_seq + rw->count - 1;
+	REWIND_ENTRY *entry = rewind_entry(rw, seq);
+	rw->tail = entry->offset + entry->length;
+
+	// Going back past a keyframe means decoding the one before it.
+	if(entry->keyframe != rw->keyframe_seq){
+		REWIND_ENTRY *keyframe = rewind_entry(rw, entry->keyframe);
+		memset(rw->key, 0, sizeof(SAVESTATE));
+		rewind_decode(rw->key, rw->data + keyframe->offset, keyframe->length);
+		rw->keyframe_seq = entry->keyframe;
+	}
+
+	memcpy(rw->current, rw->key, sizeof(SAVESTATE));
+	if(entry->keyframe != seq){
+		rewind_decode(rw->current, rw->data + entry->offset, entry->length);
+	}
+	savestate_load(rw->cpu, rw->current);
+
+	// Nothing's been written since, but which chunks differ from the keyframe isn't kept, so compare them all
+	// until the next one.
+	memset(rw->changed, 1, sizeof(rw->changed));
+	memset(rw->cpu->mmu->pages->dirty, 0, sizeof(rw->cpu->mmu->pages->dirty));
+	return true;
+}
+
+// Forgets all history, for when the machine has been changed behind the rewind's back (e.g. a savestate load).
+static inline void rewind_reset(REWIND *rw){
+	rw->count = 0;
+	rw->head = rw->tail = 0;
+	memset(rw->cpu->mmu->pages->dirty, 0, sizeof(rw->cpu->mmu->pages->dirty));
+}
+
+// Frames of history currently held.
+static inline size_t rewind_frames(const REWIND *rw){
+	return rw->count;
+}
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef runahead_h
+#define runahead_h
+
+// Run-ahead. Most games take a frame or two between reading the controller and showing the result, on top
+// of whatever the display adds. With run-ahead set to N, each frame is run for real with the current input,
+// then the machine is saved (to memory, see savestate.h), run N more frames with the same input, and that
+// last frame is the one presented. Then the state is put back, so the extra frames never happened as far as
+// the game is concerned. The game's own lag is hidden, as long as it's no more than N frames, at the cost of
+// emulating N + 1 frames for every one shown.
+//
+// Only the presented frame needs drawing, so the PPU is told not to bother with the rest. Only the real frame
+// is heard, so the APU is kept quiet for all of the others.
+//
+// How much lag that actually takes off depends on the game, so runahead_measure finds out: it presses a button
+// and counts the frames until the picture changes, once without running ahead and once with.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "cpu.h"
+#include "machine.h"
+#include "cart.h"
+#include "timing.h"
+#include "savestate.h"
+#include "input.h"
+#include "hash.h"
+#include "json.h"
+#include "platform.h"
+
+typedef struct {
+	unsigned frames; // How far ahead to run. 0 is off.
+	const TIMING *timing;
+	SAVESTATE *state; // Where the real frame is kept while running ahead.
+
+	// Stats.
+	uint64_t presented_frames;
+	uint64_t speculative_frames; // Frames run ahead and thrown away.
+	uint64_t real_cycles;
+	uint64_t speculative_cycles;
+	double real_seconds;
+	double speculative_seconds; // Including saving and loading the state.
+	bool interrupted; // The last runahead_run was stopped early by *stop.
+
+	// From runahead_measure: frames from pressing 'lag_button' to the picture showing it, without and with
+	// running ahead. Only if 'lag_measured'.
+	bool lag_measured;
+	uint8_t lag_button;
+	unsigned lag_frames;
+	unsigned lag_frames_ahead;
+} RUNAHEAD;
+
+#define RUNAHEAD_PROBE_FRAMES 30 // How long to wait for a button press to show before trying another.
+
+// Whatever the game's doing, one of these probably does something.
+static const uint8_t runahead_probe_buttons[] = { BUTTON_START, BUTTON_A, BUTTON_RIGHT, BUTTON_B, BUTTON_DOWN, BUTTON_SELECT };
+static const char *runahead_button_names[8] = { "A", "B", "Select", "Start", "Up", "Down", "Left", "Right" };
+
+// Runs until the end of the frame the CPU is in. If 'render' is false, the frame's picture isn't needed.
+static inline void run_frame(CPU *cpu, bool render){
+	PPU *ppu = &cpu->mmu->ppu;
+	ppu->render = render && ppu->picture != NULL;
+	machine_run_frame(cpu);
+}
+
+// Returns NULL if out of memory.
+static inline RUNAHEAD* new_runahead(unsigned frames, const TIMING *timing){
+	RUNAHEAD *ra = (RUNAHEAD*)calloc(1, sizeof(RUNAHEAD));
+	if(ra == NULL){
+		return NULL;
+	}
+	ra->state = (SAVESTATE*)malloc(sizeof(SAVESTATE));
+	if(ra->state == NULL){
+		free(ra);
+		return NULL;
+	}
+	ra->frames = frames;
+	ra->timing = timing;
+	return ra;
+}
+
+static inline void destroy_runahead(RUNAHEAD *ra){
+	free(ra->state);
+	free(ra);
+}
+
+// Presents one frame, with whatever buttons are set in the machine's controllers.
+static inline void runahead_frame(RUNAHEAD *ra, CPU *cpu){
+	double start = platform_now();
+	uint64_t start_cycles = cpu->cycles;
+	run_frame(cpu, ra->frames == 0);
+	ra->real_cycles += cpu->cycles - start_cycles;
+	ra->presented_frames++;
+
+	if(ra->frames != 0){
+		double middle = platform_now();
+		ra->real_seconds += middle - start;
+
+		// If the state can't be saved it can't be put back either, so give up on running ahead rather than
+		// desync the game. This only happens with a mapper savestates don't know about yet.
+		if(!savestate_save(cpu, ra->state)){
+			log_message(cpu->mmu->logger, LOG_WARNING, "Warning: can't run ahead on this cart, turning run-ahead off.\n");
+			ra->frames = 0;
+			return;
+		}
+
+		uint64_t real_end = cpu->cycles;
+		APU *apu = &cpu->mmu->apu;
+		apu->quiet = true;
+		for(unsigned frame = 1; frame <= ra->frames; frame++){
+			run_frame(cpu, frame == ra->frames);
+		}
+		ra->speculative_cycles += cpu->cycles - real_end;
+		ra->speculative_frames += ra->frames;
+		savestate_load(cpu, ra->state);
+		apu->quiet = false;
+		ra->speculative_seconds += platform_now() - middle;
+	} else {
+		ra->real_seconds += platform_now() - start;
+	}
+}
+
+// Presents 'frames' frames back to back, or stops early if *stop becomes true.
+static inline void runahead_run(RUNAHEAD *ra, CPU *cpu, uint64_t frames, volatile sig_atomic_t *stop){
+	uint64_t frame = 0;
+	for(; frame < frames && !*stop; frame++){
+		runahead_frame(ra, cpu);
+	}
+	ra->interrupted = frame != frames;
+}
+
+// From 'start', presents RUNAHEAD_PROBE_FRAMES frames running 'frames' ahead with 'buttons' held on the first
+// controller, and puts a CRC of each picture in 'crcs'. The stats are a copy's, so the real ones aren't touched.
+static inline void runahead_probe(const RUNAHEAD *ra, CPU *cpu, const SAVESTATE *start, unsigned frames, uint8_t buttons,
+	uint32_t *crcs){
+	RUNAHEAD probe = *ra;
+	probe.frames = frames;
+	savestate_load(cpu, start);
+	// The picture isn't part of a savestate, and the odd pixel at the top left can be left over from whatever
+	// was last drawn (the instruction a frame ends on can run a dot or two into the next one before 'render'
+	// is turned on for it), so start every probe from the same blank one.
+	memset(cpu->mmu->ppu.picture, 0, RENDER_WIDTH * RENDER_HEIGHT);
+	for(unsigned i = 0; i < RUNAHEAD_PROBE_FRAMES; i++){
+		cpu->mmu->controllers.buttons[0] = buttons;
+		runahead_frame(&probe, cpu);
+		crcs[i] = crc32(cpu->mmu->ppu.picture, RENDER_WIDTH * RENDER_HEIGHT);
+	}
+}
+
+// Frames from holding 'button' down to the first presented picture that's different for it, running 'frames'
+// ahead. Returns -1 if it never is.
+static inline int runahead_lag(const RUNAHEAD *ra, CPU *cpu, const SAVESTATE *start, unsigned frames, uint8_t button){
+	uint32_t released[RUNAHEAD_PROBE_FRAMES], pressed[RUNAHEAD_PROBE_FRAMES];
+	runahead_probe(ra, cpu, start, frames, 0, released);
+	runahead_probe(ra, cpu, start, frames, button, pressed);
+	for(int i = 0; i < RUNAHEAD_PROBE_FRAMES; i++){
+		if(released[i] != pressed[i]){
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Measures the lag run-ahead takes off, from wherever the game is now, and puts the machine back as it was.
+// Returns false if no button made any difference (a game that isn't reading the controller right now), or the
+// machine can't be saved.
+static inline bool runahead_measure(RUNAHEAD *ra, CPU *cpu){
+	ra->lag_measured = false;
+	SAVESTATE *start = (SAVESTATE*)malloc(sizeof(SAVESTATE));
+	if(start == NULL || cpu->mmu->ppu.picture == NULL || !savestate_save(cpu, start)){
+		free(start);
+		return false;
+	}
+	uint8_t buttons = cpu->mmu->controllers.buttons[0];
+	for(unsigned i = 0; i < sizeof(runahead_probe_buttons) && !ra->lag_measured; i++){
+		int without = runahead_lag(ra, cpu, start, 0, runahead_probe_buttons[i]);
+		if(without >= 0){
+			int with = runahead_lag(ra, cpu, start, ra->frames, runahead_probe_buttons[i]);
+			ra->lag_measured = with >= 0;
+			ra->lag_button = runahead_probe_buttons[i];
+			ra->lag_frames = (unsigned)without;
+			ra->lag_frames_ahead = (unsigned)with;
+		}
+	}
+	savestate_load(cpu, start);
+	cpu->mmu->controllers.buttons[0] = buttons;
+	free(start);
+	return ra->lag_measured;
+}
+
+// Extra CPU time spent per presented frame, as a multiple of what the frame would cost without run-ahead.
+static inline double runahead_cost(const RUNAHEAD *ra){
+	return ra->real_seconds > 0 ? ra->speculative_seconds / ra->real_seconds : 0.0;
+}
+
+static inline void print_runahead_json(FILE *fp, const RUNAHEAD *ra, const char *rom){
+	double seconds = ra->real_seconds + ra->speculative_seconds;
+	seconds = seconds > 0 ? seconds : 1e-9;
+
+	fprintf(fp, "{\"rom\": ");
+	json_string(fp, rom);
+	fprintf(fp, ", \"region\": \"%s\", \"run_ahead\": %u, ", ra->timing->name, ra->frames);
+	if(ra->lag_measured){
+		unsigned button = 0;
+		while(!(ra->lag_button & (1 << button))){
+			button++;
+		}
+		fprintf(fp, "\"lag_probe_button\": \"%s\", \"lag_frames\": %u, \"lag_frames_with_run_ahead\": %u, "
+			"\"latency_removed_frames\": %d, ", runahead_button_names[button], ra->lag_frames, ra->lag_frames_ahead,
+			(int)ra->lag_frames - (int)ra->lag_frames_ahead);
+	} else {
+		fprintf(fp, "\"lag_probe_button\": null, \"lag_frames\": null, \"lag_frames_with_run_ahead\": null, "
+			"\"latency_removed_frames\": null, ");
+	}
+	fprintf(fp, "\"presented_frames\": %llu, "
+		"\"speculative_frames\": %llu, \"real_cycles\": %llu, \"speculative_cycles\": %llu, \"seconds\": %.6f, "
+		"\"speculative_seconds\": %.6f, \"extra_cpu_cost\": %.3f, \"frames_per_second\": %.2f, \"realtime_speed\": %.3f, "
+		"\"interrupted\": %s}\n",
+		(unsigned long long)ra->presented_frames,
+		(unsigned long long)ra->speculative_frames, (unsigned long long)ra->real_cycles,
+		(unsigned long long)ra->speculative_cycles, seconds, ra->speculative_seconds, runahead_cost(ra),
+		ra->presented_frames / seconds, ra->real_cycles / seconds / timing_cpu_hz(ra->timing),
+		ra->interrupted ? "true" : "false");
+}
+
+#endif
@@ -0,0 +1,347 @@
+#ifndef runner_h
+#define runner_h
+
+// Runs lots of headless machines in one process. Every instance gets its own mapper, MMU and CPU, but instances
+// of the same ROM share the one CART (and so the one read-only image of the file), and never save their battery.
+//
+// Work is handed out a frame at a time. Each worker thread has its own deque of instances waiting to run a frame:
+// it takes work from the back of its own deque, puts the instance back there once the frame's done (so an
+// instance tends to stay on the same core, with its state in that core's cache), and when its deque runs dry
+// steals from the front of someone else's. The deques are locked, but a lock per frame is nothing next to the
+// ~30000 cycles of emulation in between. A worker that finds nothing to steal sleeps until there's something
+// worth stealing (a deque with more in it than its owner's about to take) rather than spinning, which matters
+// at the end of a batch when most of the workers have nothing left to do.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "cpu.h"
+#include "machine.h"
+#include "mmu.h"
+#include "cart.h"
+#include "timing.h"
+#include "json.h"
+#include "platform.h"
+#include "mappers/delegator.h"
+
+// Everything a worker writes per frame is kept on its own cache line, so workers don't slow each other down.
+#define RUNNER_CACHE_LINE 64
+#define RUNNER_PARK_NS 10000000 // Longest an idle worker sleeps before looking at *stop again.
+
+typedef struct {
+	_Alignas(RUNNER_CACHE_LINE) MMC mmc;
+	MMU mmu; // Points at mmc above, so instances never move once created.
+	CPU *cpu;
+	const TIMING *timing;
+	uint64_t frames_left;
+} RUNNER_INSTANCE;
+
+typedef struct {
+	_Alignas(RUNNER_CACHE_LINE) pthread_mutex_t lock;
+	unsigned *units; // Ring buffer of instance numbers, 'head' is the stealing end and 'tail' the owner's end.
+	size_t capacity;
+	size_t head;
+	size_t tail;
+} RUNNER_DEQUE;
+
+typedef struct {
+	_Alignas(RUNNER_CACHE_LINE) uint64_t frames;
+	uint64_t cycles;
+	uint64_t instructions;
+	uint64_t steals; // Frames taken from another worker's deque.
+	uint64_t parks; // Times there was nothing to steal, so the worker slept.
+	double busy_seconds; // Time spent emulating, as opposed to looking for work.
+} RUNNER_WORKER_STATS;
+
+typedef struct {
+	RUNNER_INSTANCE *instances;
+	size_t count;
+
+	unsigned workers;
+	RUNNER_DEQUE *deques;
+	RUNNER_WORKER_STATS *stats;
+
+	atomic_size_t remaining; // Instances with frames left to run.
+	volatile sig_atomic_t *stop;
+
+	// For idle workers to sleep on, see runner_park.
+	pthread_mutex_t idle_lock;
+	pthread_cond_t work;
+	atomic_uint work_posted; // Goes up whenever there's newly something to steal.
+	atomic_uint sleepers;
+	double seconds; // Wall time of the last runner_run.
+} RUNNER;
+
+typedef struct {
+	RUNNER *runner;
+	unsigned worker;
+} RUNNER_WORKER;
+
+// Zeroed, cache line aligned array.
+static inline void* runner_alloc(size_t count, size_t size){
+	size_t bytes = (count ? count : 1) * size; // size is a multiple of the alignment, thanks to _Alignas.
+	void *memory = aligned_alloc(RUNNER_CACHE_LINE, bytes);
+	memset(memory, 0, bytes);
+	return memory;
+}
+
+static inline void destroy_runner(RUNNER *runner){
+	for(size_t i = 0; i < runner->count; i++){
+		free(runner->instances[i].cpu);
+		destroy_mmu(&runner->instances[i].mmu);
+		destroy_mmc(&runner->instances[i].mmc);
+	}
+	for(unsigned i = 0; i < runner->workers; i++){
+		pthread_mutex_destroy(&runner->deques[i].lock);
+		free(runner->deques[i].units);
+	}
+	pthread_mutex_destroy(&runner->idle_lock);
+	pthread_cond_destroy(&runner->work);
+	free(runner->instances);
+	free(runner->deques);
+	free(runner->stats);
+	free(runner);
+}
+
+// Sets up 'count' instances of 'cart', spread over 'workers' threads (0 for one per core). The cart has to
+// outlive the runner. Returns NULL if the cart's mapper isn't supported.
+static inline RUNNER* new_runner(CART *cart, size_t count, unsigned workers){
+	if(workers == 0){
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cores > 0 ? (unsigned)cores : 1;
+	}
+
+	RUNNER *runner = (RUNNER*)calloc(1, sizeof(RUNNER));
+	runner->instances = (RUNNER_INSTANCE*)runner_alloc(count, sizeof(RUNNER_INSTANCE));
+	runner->workers = workers;
+	runner->deques = (RUNNER_DEQUE*)runner_alloc(workers, sizeof(RUNNER_DEQUE));
+	runner->stats = (RUNNER_WORKER_STATS*)runner_alloc(workers, sizeof(RUNNER_WORKER_STATS));
+	pthread_mutex_init(&runner->idle_lock, NULL);
+	pthread_condattr_t attributes;
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&runner->work, &attributes);
+	pthread_condattr_destroy(&attributes);
+	atomic_init(&runner->work_posted, 0);
+	atomic_init(&runner->sleepers, 0);
+
+	for(unsigned i = 0; i < workers; i++){
+		pthread_mutex_init(&runner->deques[i].lock, NULL);
+		// Every instance is in at most one deque at a time, so none of them can ever need more room than this.
+		runner->deques[i].capacity = count ? count : 1;
+		runner->deques[i].units = (unsigned*)malloc(runner->deques[i].capacity * sizeof(unsigned));
+	}
+
+	for(size_t i = 0; i < count; i++){
+		RUNNER_INSTANCE *instance = &runner->instances[i];
+		instance->mmc = new_MMC(cart, NULL);
+		if(instance->mmc.ctx == NULL){
+			destroy_runner(runner);
+			return NULL;
+		}
+		runner->count = i + 1;
+		instance->mmu = new_mmu(&instance->mmc);
+		memset(instance->mmu.ram, 0, 0x800);
+		instance->cpu = new_cpu(&instance->mmu);
+		instance->cpu->PC = cpu_read16(0xFFFC, &instance->mmc);
+		instance->timing = timing_for(cart->timing_type);
+	}
+	return runner;
+}
+
+// Returns how many units the deque has now.
+static inline size_t runner_push(RUNNER_DEQUE *deque, unsigned unit){
+	pthread_mutex_lock(&deque->lock);
+	deque->units[deque->tail % deque->capacity] = unit;
+	deque->tail++;
+	size_t length = deque->tail - deque->head;
+	pthread_mutex_unlock(&deque->lock);
+	return length;
+}
+
+// Wakes one sleeping worker, if there are any, because there's something to steal.
+static inline void runner_post_work(RUNNER *runner){
+	atomic_fetch_add(&runner->work_posted, 1);
+	if(atomic_load(&runner->sleepers) != 0){
+		pthread_mutex_lock(&runner->idle_lock);
+		pthread_cond_signal(&runner->work);
+		pthread_mutex_unlock(&runner->idle_lock);
+	}
+}
+
+// Sleeps until work's been posted since 'seen' (a value of work_posted from before the worker last looked for
+// any), everything's finished, or for RUNNER_PARK_NS so *stop gets noticed, since a signal handler can't wake us.
+// The poster bumps work_posted before looking at sleepers, and we count ourselves a sleeper before looking at
+// work_posted, so one of us always sees the other.
+static inline void runner_park(RUNNER *runner, unsigned seen){
+	struct timespec until;
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	until.tv_nsec += RUNNER_PARK_NS;
+	if(until.tv_nsec >= 1000000000){
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&runner->idle_lock);
+	atomic_fetch_add(&runner->sleepers, 1);
+	while(atomic_load(&runner->work_posted) == seen && atomic_load(&runner->remaining) != 0 && !*runner->stop){
+		if(pthread_cond_timedwait(&runner->work, &runner->idle_lock, &until) == ETIMEDOUT){
+			break;
+		}
+	}
+	atomic_fetch_sub(&runner->sleepers, 1);
+	pthread_mutex_unlock(&runner->idle_lock);
+}
+
+// Takes from the owner's end. Returns false if the deque is empty.
+static inline bool runner_pop(RUNNER_DEQUE *deque, unsigned *unit){
+	pthread_mutex_lock(&deque->lock);
+	bool found = deque->tail != deque->head;
+	if(found){
+		deque->tail--;
+		*unit = deque->units[deque->tail % deque->capacity];
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+// Takes from the other end, so the owner and a thief only fight over the last unit.
+static inline bool runner_steal(RUNNER_DEQUE *deque, unsigned *unit){
+	pthread_mutex_lock(&deque->lock);
+	bool found = deque->tail != deque->head;
+	if(found){
+		*unit = deque->units[deque->head % deque->capacity];
+		deque->head++;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+// Runs one instance to the end of its current frame.
+static inline void runner_step_frame(RUNNER_INSTANCE *instance){
+	machine_run_frame(instance->cpu);
+}
+
+static void* runner_worker(void *arg){
+	RUNNER_WORKER *worker = (RUNNER_WORKER*)arg;
+	RUNNER *runner = worker->runner;
+	RUNNER_DEQUE *own = &runner->deques[worker->worker];
+	RUNNER_WORKER_STATS *stats = &runner->stats[worker->worker];
+
+	while(atomic_load(&runner->remaining) != 0 && !*runner->stop){
+		unsigned unit = 0;
+		if(!runner_pop(own, &unit)){
+			// Out of work, so go looking, starting with the next worker along so everyone isn't robbing the same one.
+			unsigned seen = atomic_load(&runner->work_posted);
+			bool found = false;
+			for(unsigned i = 1; i < runner->workers && !found; i++){
+				found = runner_steal(&runner->deques[(worker->worker + i) % runner->workers], &unit);
+			}
+			if(!found){
+				runner_park(runner, seen);
+				stats->parks++;
+				continue;
+			}
+			stats->steals++;
+		}
+
+		RUNNER_INSTANCE *instance = &runner->instances[unit];
+		uint64_t cycles = instance->cpu->cycles, instructions = instance->cpu->instructions;
+		double start = platform_now();
+		runner_step_frame(instance);
+		stats->busy_seconds += platform_now() - start;
+		stats->frames++;
+		stats->cycles += instance->cpu->cycles - cycles;
+		stats->instructions += instance->cpu->instructions - instructions;
+
+		// Only worth waking anyone if there's more here than we're about to take straight back.
+		if(--instance->frames_left != 0){
+			if(runner_push(own, unit) > 1){
+				runner_post_work(runner);
+			}
+		} else if(atomic_fetch_sub(&runner->remaining, 1) == 1){
+			pthread_mutex_lock(&runner->idle_lock);
+			pthread_cond_broadcast(&runner->work);
+			pthread_mutex_unlock(&runner->idle_lock);
+		}
+	}
+	return NULL;
+}
+
+// Runs every instance for 'frames' more frames, or until *stop becomes true. Stats are for this call only.
+static inline void runner_run(RUNNER *runner, uint64_t frames, volatile sig_atomic_t *stop){
+	runner->stop = stop;
+	memset(runner->stats, 0, runner->workers * sizeof(RUNNER_WORKER_STATS));
+	for(unsigned i = 0; i < runner->workers; i++){
+		runner->deques[i].head = runner->deques[i].tail = 0;
+	}
+
+	// Deal the instances out round robin to start with, stealing evens out whatever that gets wrong.
+	size_t active = 0;
+	for(size_t i = 0; i < runner->count && frames != 0; i++){
+		runner->instances[i].frames_left = frames;
+		runner_push(&runner->deques[i % runner->workers], (unsigned)i);
+		active++;
+	}
+	atomic_store(&runner->remaining, active);
+
+	RUNNER_WORKER *workers = (RUNNER_WORKER*)malloc(runner->workers * sizeof(RUNNER_WORKER));
+	pthread_t *threads = (pthread_t*)malloc(runner->workers * sizeof(pthread_t));
+	double start = platform_now();
+	for(unsigned i = 0; i < runner->workers; i++){
+		workers[i].runner = runner;
+		workers[i].worker = i;
+		pthread_create(&threads[i], NULL, runner_worker, &workers[i]);
+	}
+	for(unsigned i = 0; i < runner->workers; i++){
+		pthread_join(threads[i], NULL);
+	}
+	runner->seconds = platform_now() - start;
+
+	free(threads);
+	free(workers);
+}
+
+static inline void print_runner_json(FILE *fp, const RUNNER *runner, const char *rom){
+	uint64_t frames = 0, cycles = 0, instructions = 0;
+	for(unsigned i = 0; i < runner->workers; i++){
+		frames += runner->stats[i].frames;
+		cycles += runner->stats[i].cycles;
+		instructions += runner->stats[i].instructions;
+	}
+	uint64_t idle_cycles = 0;
+	for(size_t i = 0; i < runner->count; i++){
+		idle_cycles += runner->instances[i].cpu->idle.skipped_cycles;
+	}
+
+	double seconds = runner->seconds > 0 ? runner->seconds : 1e-9;
+	double realtime_hz = runner->count != 0 ? timing_cpu_hz(runner->instances[0].timing) : 1;
+
+	fprintf(fp, "{\"rom\": ");
+	json_string(fp, rom);
+	fprintf(fp, ", \"instances\": %zu, \"workers\": %u, \"frames\": %llu, \"cycles\": %llu, \"instructions\": %llu, "
+		"\"seconds\": %.6f, \"instructions_per_second\": %.0f, \"cycles_per_second\": %.0f, \"frames_per_second\": %.2f, "
+		"\"realtime_instances\": %.2f, \"idle_cycles_skipped\": %llu, \"interrupted\": %s, \"per_worker\": [",
+		runner->count, runner->workers, (unsigned long long)frames, (unsigned long long)cycles,
+		(unsigned long long)instructions, runner->seconds, instructions / seconds, cycles / seconds, frames / seconds,
+		cycles / seconds / realtime_hz, (unsigned long long)idle_cycles, atomic_load(&runner->remaining) != 0 ? "true" : "false");
+
+	for(unsigned i = 0; i < runner->workers; i++){
+		const RUNNER_WORKER_STATS *stats = &runner->stats[i];
+		double busy = stats->busy_seconds > 0 ? stats->busy_seconds : 1e-9;
+		fprintf(fp, "%s{\"frames\": %llu, \"steals\": %llu, \"parks\": %llu, \"busy_seconds\": %.6f, \"utilisation\": %.3f, "
+			"\"instructions_per_second\": %.0f, \"cycles_per_second\": %.0f}",
+			i == 0 ? "" : ", ", (unsigned long long)stats->frames, (unsigned long long)stats->steals, (unsigned long long)stats->parks,
+			stats->busy_seconds, stats->busy_seconds / seconds, stats->instructions / busy, stats->cycles / busy);
+	}
+	fprintf(fp, "]}\n");
+}
+
+#endif
@@ -0,0 +1,273 @@
+#ifndef savestate_h
+#define savestate_h
+
+// Savestates. The whole machine goes into one fixed-layout struct - CPU registers, RAM, mapper registers and
+// on-cart RAM - so saving and loading are a handful of memcpy()s with nothing to allocate, and the struct's bytes
+// are the on-disk format as they are. Every field has an explicit size and the struct has no padding (checked
+// below), so the layout only changes when SAVESTATE_VERSION does. Multi-byte fields are in host byte order,
+// which is little endian everywhere we run; a state from a big endian host fails the version check.
+//
+// The APU's section is its APU_STATE as it is (see apu.h), which has a fixed layout for just this reason.
+// Scheduled events aren't saved, since they all follow from the cycle count and the scheduler's frame (see
+// scheduler_resync), or from the APU (see mmu_schedule_apu).
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "mmu.h"
+#include "cart.h"
+#include "log.h"
+#include "mappers/delegator.h"
+
+#define SAVESTATE_MAGIC "AGNTSTAT"
+#define SAVESTATE_VERSION 8
+
+typedef struct {
+	char magic[8]; // SAVESTATE_MAGIC, without a terminator.
+	uint32_t version;
+	uint32_t size; // sizeof(SAVESTATE), so a truncated or padded file is caught even if the version matches.
+
+	// Which ROM this is for. Hashing the whole ROM would take far longer than the rest of the save, so it's the
+	// header and the file size.
+	uint64_t rom_size;
+	uint8_t rom_header[16];
+
+	// CPU. Flags are stored as the real P register, see cpu_get_flags.
+	uint64_t cycles;
+	uint64_t instructions;
+	uint32_t wait_cycles;
+	uint16_t PC;
+	uint8_t A;
+	uint8_t X;
+	uint8_t Y;
+	uint8_t P;
+	uint8_t SP;
+	uint8_t jammed;
+
+	uint8_t mapper; // enum MMC_TYPES.
+
+	// Controller shift registers. Which buttons are held isn't saved, that belongs to whoever's holding them.
+	uint8_t controller_strobe;
+	uint8_t controller_shift[2];
+
+	uint8_t ram[0x800];
+	MMC_STATE mmc;
+
+	// The scheduler's frame and how late it started. The PPU can be a few dots into the next frame already.
+	uint64_t frame;
+	uint64_t frame_delay;
+
+	// PPU. 'ppu_time' is how far it had been caught up to, which along with 'ppu_delay' and 'ppu_long_frame'
+	// says where it is in the frame (see ppu_seek).
+	uint64_t ppu_time;
+	uint64_t ppu_delay;
+	uint16_t ppu_v;
+	uint16_t ppu_t;
+	uint16_t ppu_sprite0_dot;
+	uint16_t ppu_overflow_dot;
+	uint8_t ppu_ctrl;
+	uint8_t ppu_mask;
+	uint8_t ppu_status;
+	uint8_t ppu_oam_addr;
+	uint8_t ppu_x;
+	uint8_t ppu_w;
+	uint8_t ppu_bus;
+	uint8_t ppu_read_buffer;
+	uint8_t ppu_fetched_count;
+	uint8_t ppu_tiles[(PPU_LINE_TILES + 2) * 3]; // This line's background tiles then the next line's first two, see PPU_TILE.
+	uint8_t ppu_long_frame; // This frame isn't skipping its odd frame dot.
+	uint8_t ppu_reserved[2];
+	uint8_t palette[0x20];
+	uint8_t vram[0x800];
+	uint8_t oam[0x100];
+
+	// APU, including how far it had been caught up to.
+	APU_STATE apu;
+} SAVESTATE;
+
+_Static_assert(offsetof(SAVESTATE, ram) == 72, "SAVESTATE has padding in it");
+_Static_assert(sizeof(SAVESTATE) == 72 + 0x800 + sizeof(MMC_STATE) + 160 + 0x20 + 0x800 + 0x100 + sizeof(APU_STATE),
+	"SAVESTATE has padding in it");
+
+// Captures the machine 'cpu' is part of. Returns false if the mapper's state is too big to fit.
+static inline bool savestate_save(CPU *cpu, SAVESTATE *state){
+	MMU *mmu = cpu->mmu;
+	MMC *mmc = mmu->mmc;
+	if(!mmc_save_state(mmc, &state->mmc)){
+		log_message(mmu->logger, LOG_WARNING, "Warning: this cart's mapper state doesn't fit in a savestate.\n");
+		return false;
+	}
+
+	memcpy(state->magic, SAVESTATE_MAGIC, sizeof(state->magic));
+	state->version = SAVESTATE_VERSION;
+	state->size = sizeof(SAVESTATE);
+	state->rom_size = mmc->cart->filesize;
+	memcpy(state->rom_header, mmc->cart->ROM_contents, sizeof(state->rom_header));
+
+	state->cycles = cpu->cycles;
+	state->instructions = cpu->instructions;
+	state->wait_cycles = cpu->wait_cycles;
+	state->PC = cpu->PC;
+	state->A = cpu->A;
+	state->X = cpu->X;
+	state->Y = cpu->Y;
+	state->P = cpu_get_flags(cpu);
+	state->SP = cpu->SP;
+	state->jammed = cpu->jammed;
+	state->mapper = (uint8_t)mmc->type;
+	state->controller_strobe = mmu->controllers.strobe;
+	state->controller_shift[0] = mmu->controllers.shift[0];
+	state->controller_shift[1] = mmu->controllers.shift[1];
+	PPU *ppu = &mmu->ppu;
+	state->frame = mmu->scheduler.frame;
+	state->frame_delay = mmu->scheduler.delay;
+	state->ppu_time = ppu->time;
+	state->ppu_delay = ppu->delay;
+	state->ppu_long_frame = ppu->frame_dots != ppu_frame_dots(ppu->timing, ppu->frame);
+	state->ppu_v = ppu->v;
+	state->ppu_t = ppu->t;
+	state->ppu_sprite0_dot = (uint16_t)ppu->sprite0_dot;
+	state->ppu_overflow_dot = (uint16_t)ppu->overflow_dot;
+	state->ppu_ctrl = ppu->ctrl;
+	state->ppu_mask = ppu->mask;
+	state->ppu_status = ppu->status;
+	state->ppu_oam_addr = ppu->oam_addr;
+	state->ppu_x = ppu->x;
+	state->ppu_w = ppu->w;
+	state->ppu_bus = ppu->bus;
+	state->ppu_read_buffer = ppu->read_buffer;
+	state->ppu_fetched_count = (uint8_t)ppu->fetched_count;
+	memset(state->ppu_tiles, 0, sizeof(state->ppu_tiles));
+	for(unsigned i = 0; i < PPU_LINE_TILES + 2; i++){
+		const uint8_t *pixels = i < PPU_LINE_TILES ? ppu->background + i * 8 : ppu->prefetched + (i - PPU_LINE_TILES) * 8;
+		if(i < ppu->fetched_count || i >= PPU_LINE_TILES){ // Anything past fetched_count is left over from an earlier line.
+			PPU_TILE tile = ppu_pack_tile(pixels);
+			state->ppu_tiles[i * 3] = tile.low;
+			state->ppu_tiles[i * 3 + 1] = tile.high;
+			state->ppu_tiles[i * 3 + 2] = tile.palette;
+		}
+	}
+	memset(state->ppu_reserved, 0, sizeof(state->ppu_reserved));
+	memcpy(state->palette, ppu->palette, sizeof(state->palette));
+	memcpy(state->vram, ppu->vram, sizeof(state->vram));
+	memcpy(state->oam, ppu->oam, sizeof(state->oam));
+	state->apu = mmu->apu.state;
+
+	if(mmu->ram_stride == 1){
+		memcpy(state->ram, mmu->ram, sizeof(state->ram));
+	} else {
+		for(size_t i = 0; i < sizeof(state->ram); i++){
+			state->ram[i] = mmu->ram[i * mmu->ram_stride];
+		}
+	}
+	return true;
+}
+
+// Puts the machine 'cpu' is part of back how it was when 'state' was saved. Returns false, having changed
+// nothing, if the state is damaged or from a different ROM.
+static inline bool savestate_load(CPU *cpu, const SAVESTATE *state){
+	MMU *mmu = cpu->mmu;
+	MMC *mmc = mmu->mmc;
+	if(memcmp(state->magic, SAVESTATE_MAGIC, sizeof(state->magic)) != 0 || state->version != SAVESTATE_VERSION
+		|| state->size != sizeof(SAVESTATE)){
+		log_message(mmu->logger, LOG_WARNING, "Warning: not a savestate, or one from another version of the emulator.\n");
+		return false;
+	}
+	if(state->rom_size != mmc->cart->filesize || memcmp(state->rom_header, mmc->cart->ROM_contents, sizeof(state->rom_header)) != 0
+		|| state->mapper != (uint8_t)mmc->type || !mmc_load_state(mmc, &state->mmc)){
+		log_message(mmu->logger, LOG_WARNING, "Warning: savestate is for a different ROM.\n");
+		return false;
+	}
+
+	cpu->cycles = state->cycles;
+	cpu->instructions = state->instructions;
+	cpu->wait_cycles = state->wait_cycles;
+	cpu->PC = state->PC;
+	cpu->A = state->A;
+	cpu->X = state->X;
+	cpu->Y = state->Y;
+	cpu_set_flags(cpu, state->P);
+	cpu->SP = state->SP;
+	cpu->jammed = state->jammed;
+	cpu->idle.watching = false; // What it saw was in a different timeline.
+	mmu->controllers.strobe = state->controller_strobe & 1;
+	mmu->controllers.shift[0] = state->controller_shift[0];
+	mmu->controllers.shift[1] = state->controller_shift[1];
+	PPU *ppu = &mmu->ppu;
+	ppu_seek(ppu, state->ppu_time, state->ppu_delay, state->ppu_long_frame & 1);
+	ppu->v = state->ppu_v & 0x7FFF;
+	ppu->t = state->ppu_t & 0x7FFF;
+	ppu->sprite0_dot = state->ppu_sprite0_dot;
+	ppu->overflow_dot = state->ppu_overflow_dot;
+	ppu->ctrl = state->ppu_ctrl;
+	ppu->mask = state->ppu_mask;
+	ppu->status = state->ppu_status;
+	ppu->oam_addr = state->ppu_oam_addr;
+	ppu->x = state->ppu_x & 7;
+	ppu->w = state->ppu_w & 1;
+	ppu->bus = state->ppu_bus;
+	ppu->read_buffer = state->ppu_read_buffer;
+	ppu->fetched_count = state->ppu_fetched_count <= PPU_LINE_TILES ? state->ppu_fetched_count : PPU_LINE_TILES;
+	for(unsigned i = 0; i < PPU_LINE_TILES + 2; i++){
+		PPU_TILE tile = { state->ppu_tiles[i * 3], state->ppu_tiles[i * 3 + 1], state->ppu_tiles[i * 3 + 2] };
+		ppu_unpack_tile(i < PPU_LINE_TILES ? ppu->background + i * 8 : ppu->prefetched + (i - PPU_LINE_TILES) * 8, tile);
+	}
+	// The line's sprites aren't saved, they're worked out again if the line isn't finished.
+	ppu->sprites_ready = false;
+	memcpy(ppu->palette, state->palette, sizeof(ppu->palette));
+	memcpy(ppu->vram, state->vram, sizeof(ppu->vram));
+	memcpy(ppu->oam, state->oam, sizeof(ppu->oam));
+	apu_load_state(&mmu->apu, &state->apu);
+	scheduler_resync(&mmu->scheduler, cpu->cycles, state->frame, state->frame_delay);
+	mmu_schedule_apu(mmu);
+
+	if(mmu->ram_stride == 1){
+		memcpy(mmu->ram, state->ram, sizeof(state->ram));
+	} else {
+		for(size_t i = 0; i < sizeof(state->ram); i++){
+			mmu->ram[i * mmu->ram_stride] = state->ram[i];
+		}
+	}
+	return true;
+}
+
+// On disk, a savestate is just the struct. As with batteries, it goes to a temporary file first so a crash
+// can't leave half a state behind. Returns false on failure.
+static inline bool savestate_write(const SAVESTATE *state, const char *path){
+	char tmp_path[4096];
+	if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)){
+		return false;
+	}
+
+	FILE *fp = fopen(tmp_path, "wb");
+	if(fp == NULL){
+		return false;
+	}
+	bool ok = fwrite(state, sizeof(SAVESTATE), 1, fp) == 1;
+	ok = fflush(fp) == 0 && ok;
+	ok = fsync(fileno(fp)) == 0 && ok;
+	ok = fclose(fp) == 0 && ok;
+	ok = ok && rename(tmp_path, path) == 0;
+	if(!ok){
+		remove(tmp_path);
+	}
+	return ok;
+}
+
+// Only checks that there's a whole state's worth of file, savestate_load does the rest.
+static inline bool savestate_read(SAVESTATE *state, const char *path){
+	FILE *fp = fopen(path, "rb");
+	if(fp == NULL){
+		return false;
+	}
+	bool ok = fread(state, sizeof(SAVESTATE), 1, fp) == 1;
+	fclose(fp);
+	return ok;
+}
+
+#endif
@@ -0,0 +1,685 @@
+#ifndef scanner_h
+#define scanner_h
+
+// ROM library scanning. Walks a directory tree, parses every ROM's header with new_cart, hashes its PRG and CHR,
+// and builds an index keyed by content hash. The index is saved in a compact binary format (and can be exported
+// to JSON or CSV), so later scans only have to look at files that changed, and later runs can use it to fix up
+// ROMs whose headers new_cart couldn't make sense of (see rom_index_apply).
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cart.h"
+#include "hash.h"
+#include "json.h"
+#include "platform.h"
+
+#define ROM_INDEX_MAGIC "AGNTIDX"
+#define ROM_INDEX_VERSION 1
+#define ROM_INDEX_ENTRY_SIZE 102 // On disk, see rom_index_save.
+
+// Bits for ROM_INDEX_ENTRY::flags.
+#define ROM_INDEX_MIRRORING 0x01
+#define ROM_INDEX_BATTERY   0x02
+#define ROM_INDEX_TRAINER   0x04
+#define ROM_INDEX_UNCERTAIN 0x08 // new_cart couldn't work out the header format.
+#define ROM_INDEX_CORRECTED 0x10 // The header fields in this entry have been corrected, and differ from the file's.
+
+typedef struct {
+	uint8_t key[20]; // SHA-1 of everything after the header and trainer, which is what the index is keyed on.
+	uint8_t prg_sha1[20];
+	uint8_t chr_sha1[20];
+	uint32_t prg_crc32;
+	uint32_t chr_crc32;
+	uint64_t filesize;
+	int64_t mtime; // Used with filesize to tell if a file needs rescanning.
+
+	// Header fields, after correction if ROM_INDEX_CORRECTED is set.
+	uint16_t mapper;
+	uint16_t PRG_ROM_len;
+	uint16_t CHR_ROM_len;
+	uint8_t submapper;
+	uint8_t type; // enum ROM_types
+	uint8_t timing_type; // enum timing_modes
+	uint8_t flags;
+
+	char *path;
+} ROM_INDEX_ENTRY;
+
+typedef struct {
+	ROM_INDEX_ENTRY *entries; // Sorted by key.
+	size_t count;
+} ROM_INDEX;
+
+typedef struct {
+	size_t found; // ROM files found in the tree.
+	size_t scanned; // Parsed and hashed this time round.
+	size_t reused; // Unchanged since the previous index, so copied from it.
+	size_t failed; // Couldn't be parsed.
+	size_t corrected;
+	unsigned workers;
+	double seconds;
+} SCAN_STATS;
+
+static int rom_index_compare_keys(const void *a, const void *b){
+	return memcmp(((const ROM_INDEX_ENTRY*)a)->key, ((const ROM_INDEX_ENTRY*)b)->key, 20);
+}
+
+static void rom_index_sort(ROM_INDEX *index){
+	qsort(index->entries, index->count, sizeof(ROM_INDEX_ENTRY), rom_index_compare_keys);
+}
+
+// Works out the offsets and lengths of PRG and CHR ROM, clamped to what's actually in the file.
+static void rom_index_regions(CART *cart, size_t *prg_start, size_t *prg_len, size_t *chr_start, size_t *chr_len){
+	*prg_start = cart->trainer_present ? 16 + 512 : 16;
+	if(*prg_start > cart->filesize){
+		*prg_start = cart->filesize;
+	}
+
+	*prg_len = (size_t)cart->PRG_ROM_len * 0x4000;
+	if(*prg_len > cart->filesize - *prg_start){
+		*prg_len = cart->filesize - *prg_start;
+	}
+
+	*chr_start = *prg_start + *prg_len;
+	*chr_len = (size_t)cart->CHR_ROM_len * 0x2000;
+	if(*chr_len > cart->filesize - *chr_start){
+		*chr_len = cart->filesize - *chr_start;
+	}
+}
+
+// The content hash an index entry is keyed on.
+static inline void rom_index_key(CART *cart, uint8_t key[20]){
+	size_t start = cart->trainer_present ? 16 + 512 : 16;
+	if(start > cart->filesize){
+		start = cart->filesize;
+	}
+	sha1(cart->ROM_contents + start, cart->filesize - start, key);
+}
+
+// Fills in an index entry from a loaded cart. If new_cart couldn't work out the header, or it's an archaic iNES
+// header with something in byte 7, this is where it gets corrected: the usual cause is junk (e.g. "DiskDude!")
+// written over bytes 7-15 by old tools, so we only trust the original iNES fields in bytes 4-6.
+static inline void rom_index_entry_from_cart(CART *cart, ROM_INDEX_ENTRY *entry){
+	rom_index_key(cart, entry->key);
+
+	entry->mapper = cart->mapper;
+	entry->submapper = cart->submapper;
+	entry->type = cart->type;
+	entry->timing_type = cart->timing_type;
+	entry->PRG_ROM_len = cart->PRG_ROM_len;
+	entry->CHR_ROM_len = cart->CHR_ROM_len;
+	entry->flags = (cart->mirroring ? ROM_INDEX_MIRRORING : 0)
+		| (cart->has_PRG_RAM ? ROM_INDEX_BATTERY : 0)
+		| (cart->trainer_present ? ROM_INDEX_TRAINER : 0)
+		| (cart->uncertain_type ? ROM_INDEX_UNCERTAIN : 0);
+
+	if(cart->uncertain_type || (cart->type == oldiNES && (cart->ROM_contents[7] & 0xF0) != 0)){
+		entry->mapper = cart->ROM_contents[6] >> 4;
+		entry->submapper = 0;
+		entry->type = iNES;
+		entry->timing_type = RP2C02;
+		entry->PRG_ROM_len = cart->ROM_contents[4];
+		entry->CHR_ROM_len = cart->ROM_contents[5];
+		entry->flags |= ROM_INDEX_CORRECTED;
+	}
+
+	// Hash PRG and CHR with the (possibly corrected) sizes.
+	uint16_t PRG_ROM_len = cart->PRG_ROM_len, CHR_ROM_len = cart->CHR_ROM_len;
+	cart->PRG_ROM_len = entry->PRG_ROM_len;
+	cart->CHR_ROM_len = entry->CHR_ROM_len;
+
+	size_t prg_start, prg_len, chr_start, chr_len;
+	rom_index_regions(cart, &prg_start, &prg_len, &chr_start, &chr_len);
+	entry->prg_crc32 = crc32(cart->ROM_contents + prg_start, prg_len);
+	entry->chr_crc32 = crc32(cart->ROM_contents + chr_start, chr_len);
+	sha1(cart->ROM_contents + prg_start, prg_len, entry->prg_sha1);
+	sha1(cart->ROM_contents + chr_start, chr_len, entry->chr_sha1);
+
+	cart->PRG_ROM_len = PRG_ROM_len;
+	cart->CHR_ROM_len = CHR_ROM_len;
+	entry->filesize = cart->filesize;
+}
+
+static inline const ROM_INDEX_ENTRY* rom_index_find(ROM_INDEX *index, const uint8_t key[20]){
+	ROM_INDEX_ENTRY probe;
+	memcpy(probe.key, key, 20);
+	return (const ROM_INDEX_ENTRY*)bsearch(&probe, index->entries, index->count, sizeof(ROM_INDEX_ENTRY), rom_index_compare_keys);
+}
+
+// An entry whose header was parsed cleanly, as opposed to guessed at or corrected.
+static bool rom_index_trustworthy(const ROM_INDEX_ENTRY *entry){
+	return !(entry->flags & (ROM_INDEX_UNCERTAIN | ROM_INDEX_CORRECTED)) && entry->type != oldiNES;
+}
+
+// Looks the cart up in the index by content. If the same contents are in the index with a clean header (say, a
+// good dump of the same game), that header is used, otherwise if the index has corrected this cart's header that's
+// used instead. Carts with clean headers of their own are left alone. Returns true if the cart was changed.
+static inline bool rom_index_apply(ROM_INDEX *index, CART *cart){
+	if(!cart->uncertain_type && cart->type != oldiNES){
+		return false;
+	}
+
+	uint8_t key[20];
+	rom_index_key(cart, key);
+
+	const ROM_INDEX_ENTRY *found = rom_index_find(index, key);
+	if(found == NULL){
+		return false;
+	}
+
+	// There may be several files with the same contents, so look through all of them.
+	const ROM_INDEX_ENTRY *first = found, *last = found, *end = index->entries + index->count;
+	while(first > index->entries && memcmp((first - 1)->key, key, 20) == 0){
+		first--;
+	}
+	while(last + 1 < end && memcmp((last + 1)->key, key, 20) == 0){
+		last++;
+	}
+
+	const ROM_INDEX_ENTRY *entry = NULL;
+	for(const ROM_INDEX_ENTRY *candidate = first; candidate <= last; candidate++){
+		if(rom_index_trustworthy(candidate)){
+			entry = candidate;
+			break;
+		} else if(entry == NULL && (candidate->flags & ROM_INDEX_CORRECTED)){
+			entry = candidate;
+		}
+	}
+
+	// The index is just a file, so it gets the same check the header did.
+	if(entry == NULL || !cart_prg_rom_fits(cart, entry->PRG_ROM_len)){
+		return false;
+	}
+
+	cart->mapper = entry->mapper;
+	cart->submapper = entry->submapper;
+	cart->type = entry->type;
+	cart->timing_type = entry->timing_type;
+	cart->PRG_ROM_len = entry->PRG_ROM_len;
+	cart->CHR_ROM_len = entry->CHR_ROM_len;
+	cart->uncertain_type = false;
+	return true;
+}
+
+static inline void destroy_rom_index(ROM_INDEX *index){
+	for(size_t i = 0; i < index->count; i++){
+		free(index->entries[i].path);
+	}
+	free(index->entries);
+	free(index);
+}
+
+// BEGIN ON-DISK FORMAT
+// All little endian:
+//	magic ("AGNTIDX\0", 8 bytes), version (u32), entry count (u32), string table length (u32)
+//	entries (ROM_INDEX_ENTRY_SIZE bytes each, in key order):
+//		key, prg_sha1, chr_sha1 (20 bytes each), prg_crc32, chr_crc32 (u32), filesize (u64), mtime (i64),
+//		mapper, PRG_ROM_len, CHR_ROM_len (u16), submapper, type, timing_type, flags (u8),
+//		path offset into the string table (u32), path length (u32)
+//	string table (paths, not null terminated)
+static uint8_t* rom_index_put(uint8_t *out, uint64_t value, int bytes){
+	for(int i = 0; i < bytes; i++){
+		*out++ = value >> (i * 8);
+	}
+	return out;
+}
+
+static uint64_t rom_index_get(const uint8_t **in, int bytes){
+	uint64_t value = 0;
+	for(int i = 0; i < bytes; i++){
+		value |= (uint64_t)(*in)[i] << (i * 8);
+	}
+	*in += bytes;
+	return value;
+}
+
+static inline bool rom_index_save(ROM_INDEX *index, const char *filename){
+	size_t strings_len = 0;
+	for(size_t i = 0; i < index->count; i++){
+		strings_len += strlen(index->entries[i].path);
+	}
+
+	size_t len = 20 + index->count * ROM_INDEX_ENTRY_SIZE + strings_len;
+	uint8_t *buffer = (uint8_t*)malloc(len);
+	if(buffer == NULL){
+		fprintf(stderr, "Failed to write ROM index to %s: out of memory.\n", filename);
+		return false;
+	}
+	uint8_t *out = buffer;
+
+	memcpy(out, ROM_INDEX_MAGIC, 8);
+	out += 8;
+	out = rom_index_put(out, ROM_INDEX_VERSION, 4);
+	out = rom_index_put(out, index->count, 4);
+	out = rom_index_put(out, strings_len, 4);
+
+	uint8_t *strings = buffer + 20 + index->count * ROM_INDEX_ENTRY_SIZE;
+	size_t string_offset = 0;
+	for(size_t i = 0; i < index->count; i++){
+		ROM_INDEX_ENTRY *entry = &index->entries[i];
+		memcpy(out, entry->key, 20);
+		memcpy(out + 20, entry->prg_sha1, 20);
+		memcpy(out + 40, entry->chr_sha1, 20);
+		out += 60;
+		out = rom_index_put(out, entry->prg_crc32, 4);
+		out = rom_index_put(out, entry->chr_crc32, 4);
+		out = rom_index_put(out, entry->filesize, 8);
+		out = rom_index_put(out, (uint64_t)entry->mtime, 8);
+		out = rom_index_put(out, entry->mapper, 2);
+		out = rom_index_put(out, entry->PRG_ROM_len, 2);
+		out = rom_index_put(out, entry->CHR_ROM_len, 2);
+		out = rom_index_put(out, entry->submapper, 1);
+		out = rom_index_put(out, entry->type, 1);
+		out = rom_index_put(out, entry->timing_type, 1);
+		out = rom_index_put(out, entry->flags, 1);
+
+		size_t path_len = strlen(entry->path);
+		out = rom_index_put(out, string_offset, 4);
+		out = rom_index_put(out, path_len, 4);
+		memcpy(strings + string_offset, entry->path, path_len);
+		string_offset += path_len;
+	}
+
+	FILE *fp = fopen(filename, "wb");
+	bool ok = fp != NULL && fwrite(buffer, 1, len, fp) == len;
+	if(fp != NULL){
+		ok = fclose(fp) == 0 && ok;
+	}
+	if(!ok){
+		fprintf(stderr, "Failed to write ROM index to %s. errno = %d\n", filename, errno);
+	}
+
+	free(buffer);
+	return ok;
+}
+
+// Returns NULL if the file doesn't exist or isn't a valid index.
+static inline ROM_INDEX* rom_index_load(const char *filename){
+	FILE *fp = fopen(filename, "rb");
+	if(fp == NULL){
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long filesize = ftell(fp);
+	rewind(fp);
+	if(filesize < 20){
+		fclose(fp);
+		return NULL;
+	}
+
+	uint8_t *buffer = (uint8_t*)malloc(filesize);
+	if(buffer == NULL){
+		fprintf(stderr, "Warning: not enough memory to load the ROM index %s, ignoring it.\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+	size_t read_len = fread(buffer, 1, filesize, fp);
+	fclose(fp);
+
+	const uint8_t *in = buffer + 8;
+	uint64_t version = rom_index_get(&in, 4);
+	uint64_t count = rom_index_get(&in, 4);
+	uint64_t strings_len = rom_index_get(&in, 4);
+	if(read_len != (size_t)filesize || memcmp(buffer, ROM_INDEX_MAGIC, 8) != 0 || version != ROM_INDEX_VERSION
+		|| 20 + count * ROM_INDEX_ENTRY_SIZE + strings_len != (uint64_t)filesize){
+		fprintf(stderr, "Warning: %s is not a valid ROM index (or is from a different version), ignoring it.\n", filename);
+		free(buffer);
+		return NULL;
+	}
+
+	// Everything's zeroed, so if an allocation fails partway through, destroy_rom_index can still clean up.
+	ROM_INDEX *index = (ROM_INDEX*)malloc(sizeof(ROM_INDEX));
+	ROM_INDEX_ENTRY *entries = (ROM_INDEX_ENTRY*)calloc(count ? count : 1, sizeof(ROM_INDEX_ENTRY));
+	if(index == NULL || entries == NULL){
+		fprintf(stderr, "Warning: not enough memory to load the ROM index %s, ignoring it.\n", filename);
+		free(index);
+		free(entries);
+		free(buffer);
+		return NULL;
+	}
+	index->count = count;
+	index->entries = entries;
+
+	const uint8_t *strings = buffer + 20 + count * ROM_INDEX_ENTRY_SIZE;
+	for(size_t i = 0; i < count; i++){
+		ROM_INDEX_ENTRY *entry = &index->entries[i];
+		memcpy(entry->key, in, 20);
+		memcpy(entry->prg_sha1, in + 20, 20);
+		memcpy(entry->chr_sha1, in + 40, 20);
+		in += 60;
+		entry->prg_crc32 = rom_index_get(&in, 4);
+		entry->chr_crc32 = rom_index_get(&in, 4);
+		entry->filesize = rom_index_get(&in, 8);
+		entry->mtime = (int64_t)rom_index_get(&in, 8);
+		entry->mapper = rom_index_get(&in, 2);
+		entry->PRG_ROM_len = rom_index_get(&in, 2);
+		entry->CHR_ROM_len = rom_index_get(&in, 2);
+		entry->submapper = rom_index_get(&in, 1);
+		entry->type = rom_index_get(&in, 1);
+		entry->timing_type = rom_index_get(&in, 1);
+		entry->flags = rom_index_get(&in, 1);
+
+		uint64_t offset = rom_index_get(&in, 4);
+		uint64_t path_len = rom_index_get(&in, 4);
+		if(offset + path_len > strings_len){
+			path_len = 0;
+			offset = 0;
+		}
+		entry->path = (char*)malloc(path_len + 1);
+		if(entry->path == NULL){
+			fprintf(stderr, "Warning: not enough memory to load the ROM index %s, ignoring it.\n", filename);
+			destroy_rom_index(index);
+			free(buffer);
+			return NULL;
+		}
+		memcpy(entry->path, strings + offset, path_len);
+		entry->path[path_len] = '\0';
+	}
+
+	free(buffer);
+	return index;
+}
+// END ON-DISK FORMAT
+
+// BEGIN EXPORT
+static void rom_index_hex(FILE *fp, const uint8_t *bytes, size_t len){
+	for(size_t i = 0; i < len; i++){
+		fprintf(fp, "%02x", bytes[i]);
+	}
+}
+
+static inline bool rom_index_export_json(ROM_INDEX *index, const char *filename){
+	FILE *fp = fopen(filename, "w");
+	if(fp == NULL){
+		fprintf(stderr, "Failed to open %s for writing. errno = %d\n", filename, errno);
+		return false;
+	}
+
+	fprintf(fp, "[\n");
+	for(size_t i = 0; i < index->count; i++){
+		ROM_INDEX_ENTRY *entry = &index->entries[i];
+		fprintf(fp, "\t{\"sha1\": \"");
+		rom_index_hex(fp, entry->key, 20);
+		fprintf(fp, "\", \"prg_sha1\": \"");
+		rom_index_hex(fp, entry->prg_sha1, 20);
+		fprintf(fp, "\", \"chr_sha1\": \"");
+		rom_index_hex(fp, entry->chr_sha1, 20);
+		fprintf(fp, "\", \"prg_crc32\": \"%08x\", \"chr_crc32\": \"%08x\", \"path\": ", entry->prg_crc32, entry->chr_crc32);
+		json_string(fp, entry->path);
+		fprintf(fp, ", \"filesize\": %llu, \"mapper\": %u, \"submapper\": %u, \"prg_rom_kib\": %u, \"chr_rom_kib\": %u, "
+			"\"format\": %u, \"timing\": %u, \"vertical_mirroring\": %s, \"battery\": %s, \"trainer\": %s, "
+			"\"uncertain\": %s, \"corrected\": %s}%s\n",
+			(unsigned long long)entry->filesize, entry->mapper, entry->submapper, entry->PRG_ROM_len * 16u, entry->CHR_ROM_len * 8u,
+			entry->type, entry->timing_type,
+			(entry->flags & ROM_INDEX_MIRRORING) ? "true" : "false", (entry->flags & ROM_INDEX_BATTERY) ? "true" : "false",
+			(entry->flags & ROM_INDEX_TRAINER) ? "true" : "false", (entry->flags & ROM_INDEX_UNCERTAIN) ? "true" : "false",
+			(entry->flags & ROM_INDEX_CORRECTED) ? "true" : "false", i + 1 == index->count ? "" : ",");
+	}
+	fprintf(fp, "]\n");
+
+	return fclose(fp) == 0;
+}
+
+static inline bool rom_index_export_csv(ROM_INDEX *index, const char *filename){
+	FILE *fp = fopen(filename, "w");
+	if(fp == NULL){
+		fprintf(stderr, "Failed to open %s for writing. errno = %d\n", filename, errno);
+		return false;
+	}
+
+	fprintf(fp, "sha1,prg_sha1,chr_sha1,prg_crc32,chr_crc32,filesize,mapper,submapper,prg_rom_kib,chr_rom_kib,format,timing,flags,path\n");
+	for(size_t i = 0; i < index->count; i++){
+		ROM_INDEX_ENTRY *entry = &index->entries[i];
+		rom_index_hex(fp, entry->key, 20);
+		fputc(',', fp);
+		rom_index_hex(fp, entry->prg_sha1, 20);
+		fputc(',', fp);
+		rom_index_hex(fp, entry->chr_sha1, 20);
+		fprintf(fp, ",%08x,%08x,%llu,%u,%u,%u,%u,%u,%u,%u,\"", entry->prg_crc32, entry->chr_crc32, (unsigned long long)entry->filesize,
+			entry->mapper, entry->submapper, entry->PRG_ROM_len * 16u, entry->CHR_ROM_len * 8u, entry->type, entry->timing_type, entry->flags);
+		// CSV escapes quotes by doubling them.
+		for(const char *c = entry->path; *c != '\0'; c++){
+			if(*c == '"'){
+				fputc('"', fp);
+			}
+			fputc(*c, fp);
+		}
+		fprintf(fp, "\"\n");
+	}
+
+	return fclose(fp) == 0;
+}
+// END EXPORT
+
+// BEGIN SCANNING
+typedef struct {
+	dev_t device;
+	ino_t inode;
+} SCAN_DIR;
+
+typedef struct {
+	char **paths;
+	size_t count;
+	size_t capacity;
+
+	// Every directory walked so far. Symlinks are followed, so this is what stops a link back up the tree (or two
+	// links to the same place) from being walked more than once.
+	SCAN_DIR *dirs;
+	size_t dir_count;
+	size_t dir_capacity;
+} SCAN_PATHS;
+
+static bool scanner_is_rom(const char *name){
+	size_t len = strlen(name);
+	return len > 4 && strcasecmp(name + len - 4, ".nes") == 0;
+}
+
+// Returns false if the directory's already been walked, otherwise remembers it.
+static bool scanner_first_visit(SCAN_PATHS *out, const struct stat *st){
+	for(size_t i = 0; i < out->dir_count; i++){
+		if(out->dirs[i].device == st->st_dev && out->dirs[i].inode == st->st_ino){
+			return false;
+		}
+	}
+	if(out->dir_count == out->dir_capacity){
+		size_t capacity = out->dir_capacity ? out->dir_capacity * 2 : 64;
+		SCAN_DIR *dirs = (SCAN_DIR*)realloc(out->dirs, capacity * sizeof(SCAN_DIR));
+		if(dirs == NULL){
+			return false;
+		}
+		out->dirs = dirs;
+		out->dir_capacity = capacity;
+	}
+	out->dirs[out->dir_count].device = st->st_dev;
+	out->dirs[out->dir_count].inode = st->st_ino;
+	out->dir_count++;
+	return true;
+}
+
+static void scanner_walk(const char *dir, SCAN_PATHS *out){
+	struct stat dir_st;
+	if(stat(dir, &dir_st) == 0 && !scanner_first_visit(out, &dir_st)){
+		return;
+	}
+
+	DIR *d = opendir(dir);
+	if(d == NULL){
+		fprintf(stderr, "Warning: couldn't open directory %s. errno = %d\n", dir, errno);
+		return;
+	}
+
+	struct dirent *ent;
+	while((ent = readdir(d)) != NULL){
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0){
+			continue;
+		}
+
+		size_t len = strlen(dir) + strlen(ent->d_name) + 2;
+		char *path = (char*)malloc(len);
+		snprintf(path, len, "%s/%s", dir, ent->d_name);
+
+		struct stat st;
+		bool exists = stat(path, &st) == 0;
+		if(exists && S_ISDIR(st.st_mode)){
+			scanner_walk(path, out);
+			free(path);
+		} else if(exists && S_ISREG(st.st_mode) && scanner_is_rom(ent->d_name)){
+			if(out->count == out->capacity){
+				out->capacity = out->capacity ? out->capacity * 2 : 256;
+				out->paths = (char**)realloc(out->paths, out->capacity * sizeof(char*));
+			}
+			out->paths[out->count++] = path;
+		} else {
+			free(path);
+		}
+	}
+
+	closedir(d);
+}
+
+typedef struct {
+	SCAN_PATHS *paths;
+	ROM_INDEX_ENTRY *results;
+	bool *ok;
+	ROM_INDEX_ENTRY **previous_by_path; // Sorted by path, for finding unchanged files.
+	size_t previous_count;
+	atomic_size_t next;
+	atomic_size_t reused;
+} SCAN_JOB;
+
+static int scanner_compare_paths(const void *a, const void *b){
+	return strcmp((*(ROM_INDEX_ENTRY* const*)a)->path, (*(ROM_INDEX_ENTRY* const*)b)->path);
+}
+
+static void* scanner_worker(void *arg){
+	SCAN_JOB *job = (SCAN_JOB*)arg;
+	size_t i;
+	// Each worker just keeps taking the next unclaimed file until there are none left.
+	while((i = atomic_fetch_add(&job->next, 1)) < job->paths->count){
+		const char *path = job->paths->paths[i];
+		ROM_INDEX_ENTRY *entry = &job->results[i];
+
+		struct stat st;
+		if(stat(path, &st) != 0){
+			continue;
+		}
+
+		// If the previous index has this file at the same size and modification time, don't bother reading it.
+		if(job->previous_by_path != NULL){
+			ROM_INDEX_ENTRY probe, *probe_ptr = &probe;
+			probe.path = (char*)path;
+			ROM_INDEX_ENTRY **found = (ROM_INDEX_ENTRY**)bsearch(&probe_ptr, job->previous_by_path, job->previous_count, sizeof(ROM_INDEX_ENTRY*), scanner_compare_paths);
+			if(found != NULL && (*found)->filesize == (uint64_t)st.st_size && (*found)->mtime == (int64_t)st.st_mtime){
+				*entry = **found;
+				entry->path = strdup(path);
+				job->ok[i] = true;
+				atomic_fetch_add(&job->reused, 1);
+				continue;
+			}
+		}
+
+		CART *cart = new_cart(path);
+		if(cart == NULL){
+			continue;
+		}
+
+		rom_index_entry_from_cart(cart, entry);
+		entry->mtime = st.st_mtime;
+		entry->path = strdup(path);
+		job->ok[i] = true;
+		destroy_cart(cart);
+	}
+
+	return NULL;
+}
+
+// Scans every .nes file under 'dir' with 'workers' threads. Files that haven't changed since 'previous' (which
+// may be NULL) are copied from it rather than reread. The result only contains files that parsed successfully.
+static inline ROM_INDEX* rom_library_scan(const char *dir, ROM_INDEX *previous, unsigned workers, SCAN_STATS *stats){
+	double start = platform_now();
+
+	SCAN_PATHS paths = { NULL, 0, 0, NULL, 0, 0 };
+	scanner_walk(dir, &paths);
+	free(paths.dirs);
+
+	if(workers == 0){
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cores > 0 ? (unsigned)cores : 1;
+	}
+
+	SCAN_JOB job;
+	job.paths = &paths;
+	job.results = (ROM_INDEX_ENTRY*)calloc(paths.count ? paths.count : 1, sizeof(ROM_INDEX_ENTRY));
+	job.ok = (bool*)calloc(paths.count ? paths.count : 1, sizeof(bool));
+	job.previous_by_path = NULL;
+	job.previous_count = 0;
+	atomic_init(&job.next, 0);
+	atomic_init(&job.reused, 0);
+
+	if(previous != NULL && previous->count != 0){
+		job.previous_count = previous->count;
+		job.previous_by_path = (ROM_INDEX_ENTRY**)malloc(previous->count * sizeof(ROM_INDEX_ENTRY*));
+		for(size_t i = 0; i < previous->count; i++){
+			job.previous_by_path[i] = &previous->entries[i];
+		}
+		qsort(job.previous_by_path, job.previous_count, sizeof(ROM_INDEX_ENTRY*), scanner_compare_paths);
+	}
+
+	// The CRC table has to exist before the workers start, as building it isn't thread safe.
+	crc32_prepare();
+
+	pthread_t *threads = (pthread_t*)malloc(workers * sizeof(pthread_t));
+	for(unsigned i = 0; i < workers; i++){
+		pthread_create(&threads[i], NULL, scanner_worker, &job);
+	}
+	for(unsigned i = 0; i < workers; i++){
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	// Compact the successful results into the index.
+	ROM_INDEX *index = (ROM_INDEX*)malloc(sizeof(ROM_INDEX));
+	index->entries = job.results;
+	index->count = 0;
+	size_t corrected = 0;
+	for(size_t i = 0; i < paths.count; i++){
+		if(job.ok[i]){
+			corrected += (job.results[i].flags & ROM_INDEX_CORRECTED) ? 1 : 0;
+			index->entries[index->count++] = job.results[i];
+		}
+		free(paths.paths[i]);
+	}
+	rom_index_sort(index);
+
+	double end = platform_now();
+	if(stats != NULL){
+		stats->found = paths.count;
+		stats->reused = atomic_load(&job.reused);
+		stats->scanned = index->count - stats->reused;
+		stats->failed = paths.count - index->count;
+		stats->corrected = corrected;
+		stats->workers = workers;
+		stats->seconds = end - start;
+	}
+
+	free(job.ok);
+	free(job.previous_by_path);
+	free(paths.paths);
+	return index;
+}
+// END SCANNING
+
+#endif
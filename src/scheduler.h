@@ -0,0 +1,165 @@
+#ifndef scheduler_h
+#define scheduler_h
+
+// Timed events, on the master clock. Rather than stepping every component every cycle, the CPU runs flat out
+// until the next thing that needs doing - the start of vblank, the end of the frame, an NMI, a DMA, the APU
+// raising IRQ or the DMC reading a sample - and then that thing is done and the CPU carries on. Events are kept
+// in a small binary heap ordered by time. The PPU isn't an event, it catches itself up when it's needed (see
+// ppu.h). Neither is the end of vblank: nothing has to happen then that the PPU can't work out for itself.
+//
+// Everything that happens once a frame is worked out from the frame number and how late that frame started
+// (see scheduler_resync), so the queue itself never needs saving. One-off events (NMIs caused by register
+// writes, DMA) are queued for time 0, which means "after the current instruction", and never outlive the
+// instruction that caused them. The APU's events move whenever its registers are written, so they're taken off
+// the queue and put back where they now belong (scheduler_reschedule); they aren't saved either, but worked out
+// again from the APU (see mmu_schedule_apu).
+//
+// Running the CPU against the queue lives in machine.h, since it needs the CPU; this only needs the clock.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "timing.h"
+
+enum event_types {
+	EVENT_VBLANK,     // Vblank starts, which raises NMI if PPUCTRL allows it.
+	EVENT_FRAME_END,  // The PPU and APU finish the frame off, and the next frame's events are queued.
+	EVENT_NMI,        // NMI right now, from turning NMIs on during vblank.
+	EVENT_OAM_DMA,    // The CPU stops for 513 or 514 cycles while sprite memory is copied.
+	EVENT_APU_IRQ,    // The frame counter or the DMC raises IRQ, see apu_next_irq.
+	EVENT_DMC_READ,   // The DMC reads a sample byte, which stops the CPU for a few cycles.
+	EVENT_TYPE_COUNT
+};
+
+typedef struct {
+	uint64_t time; // Master clocks since power on.
+	uint8_t type; // enum event_types.
+} EVENT;
+
+#define SCHEDULER_MAX_EVENTS 8
+
+typedef struct {
+	const TIMING *timing;
+	EVENT events[SCHEDULER_MAX_EVENTS]; // Heap, soonest first.
+	unsigned count;
+
+	// The CPU cycle it's safe to run up to. Queueing an event that's sooner pulls this in, which is how a write
+	// to a register can stop the CPU partway through a run.
+	uint64_t limit;
+	uint64_t frame; // Frames finished since power on.
+	uint64_t delay; // How much later 'frame' started than timing_frame_start says, see ppu.h.
+
+	// Stats.
+	uint64_t dispatched[EVENT_TYPE_COUNT];
+} SCHEDULER;
+
+// The first CPU cycle at or after master clock 'time'.
+static inline uint64_t scheduler_cycle(const SCHEDULER *s, uint64_t time){
+	return (time + s->timing->cpu_divider - 1) / s->timing->cpu_divider;
+}
+
+static inline uint64_t scheduler_next_cycle(const SCHEDULER *s){
+	return s->count != 0 ? scheduler_cycle(s, s->events[0].time) : UINT64_MAX;
+}
+
+static inline void scheduler_push(SCHEDULER *s, uint64_t time, enum event_types type){
+	// There's only ever one of each periodic event plus the odd one-off, so this can't fill up unless
+	// something is very wrong.
+	if(s->count == SCHEDULER_MAX_EVENTS){
+		return;
+	}
+	unsigned i = s->count++;
+	while(i > 0 && s->events[(i - 1) / 2].time > time){
+		s->events[i] = s->events[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	s->events[i].time = time;
+	s->events[i].type = (uint8_t)type;
+
+	uint64_t cycle = scheduler_cycle(s, time);
+	if(cycle < s->limit){
+		s->limit = cycle;
+	}
+}
+
+static inline EVENT scheduler_pop(SCHEDULER *s){
+	EVENT top = s->events[0];
+	EVENT last = s->events[--s->count];
+	unsigned i = 0;
+	for(;;){
+		unsigned child = i * 2 + 1;
+		if(child >= s->count){
+			break;
+		}
+		if(child + 1 < s->count && s->events[child + 1].time < s->events[child].time){
+			child++;
+		}
+		if(s->events[child].time >= last.time){
+			break;
+		}
+		s->events[i] = s->events[child];
+		i = child;
+	}
+	s->events[i] = last;
+	return top;
+}
+
+// Takes any queued event of type 'type' off the queue, then queues it for 'time' unless that's UINT64_MAX.
+static inline void scheduler_reschedule(SCHEDULER *s, uint64_t time, enum event_types type){
+	EVENT kept[SCHEDULER_MAX_EVENTS];
+	unsigned count = 0;
+	for(unsigned i = 0; i < s->count; i++){
+		if(s->events[i].type != type){
+			kept[count++] = s->events[i];
+		}
+	}
+	if(count != s->count){
+		s->count = 0;
+		for(unsigned i = 0; i < count; i++){
+			scheduler_push(s, kept[i].time, (enum event_types)kept[i].type);
+		}
+	}
+	if(time != UINT64_MAX){
+		scheduler_push(s, time, type);
+	}
+}
+
+// When a periodic event happens in the current frame. The frame's end is where it would be if the frame skips
+// its odd frame dot; if it doesn't, the PPU finishes it off the next time it's caught up.
+static inline uint64_t scheduler_time(const SCHEDULER *s, enum event_types type){
+	switch(type){
+		case EVENT_VBLANK:
+			return timing_frame_start(s->timing, s->frame) + s->delay + timing_master_at(s->timing, s->timing->vblank_scanline, 1);
+		default:
+			return timing_frame_start(s->timing, s->frame + 1) + s->delay;
+	}
+}
+
+// Rebuilds the queue for a CPU at cycle 'cycles' in frame 'frame', which started 'delay' late, as if
+// everything due by then has already happened. Used at power on and after loading a savestate. The next
+// frame's events are queued when this one ends.
+static inline void scheduler_resync(SCHEDULER *s, uint64_t cycles, uint64_t frame, uint64_t delay){
+	uint64_t now = cycles * s->timing->cpu_divider;
+	s->frame = frame;
+	s->delay = delay;
+	s->count = 0;
+	s->limit = UINT64_MAX;
+
+	uint64_t vblank = scheduler_time(s, EVENT_VBLANK);
+	if(vblank > now){
+		scheduler_push(s, vblank, EVENT_VBLANK);
+	}
+	scheduler_push(s, scheduler_time(s, EVENT_FRAME_END), EVENT_FRAME_END);
+}
+
+static inline SCHEDULER new_scheduler(const TIMING *timing){
+	SCHEDULER s;
+	s.timing = timing;
+	for(unsigned i = 0; i < EVENT_TYPE_COUNT; i++){
+		s.dispatched[i] = 0;
+	}
+	scheduler_resync(&s, 0, 0, 0);
+	return s;
+}
+
+#endif
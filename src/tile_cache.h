@@ -0,0 +1,103 @@
+#ifndef tile_cache_h
+#define tile_cache_h
+
+// Cache of decoded CHR tiles for the PPU. Patterns are stored as two bitplanes, 16 bytes to an 8x8 tile, which
+// has to be pulled apart before it can be drawn, so the first time a tile is used it's decoded into 64 bytes,
+// one colour (0-3) per pixel, and kept. Like the decode cache (see decode_cache.h) there's a set of records for
+// every 4KiB CHR bank, and the mapper says which bank is visible in each half of the pattern tables, so a bank
+// switch just points that half somewhere else. CHR ROM never changes, so its tiles are only ever decoded once.
+// The one thing that throws a tile away is a write to CHR RAM, which the mapper passes on.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "render.h"
+
+#define TILE_CACHE_TILES 256 // Per 4KiB bank.
+#define TILE_CACHE_TILE_SIZE 64
+
+typedef struct {
+	uint8_t *pixels; // TILE_CACHE_TILE_SIZE bytes per tile, a row at a time.
+	uint8_t *decoded; // One per tile, nonzero once its pixels are filled in.
+	size_t bank_count; // Number of 4KiB banks.
+	uint8_t *window[2]; // Pixels for the bank visible at 0x0000 and 0x1000 respectively.
+	uint8_t *window_decoded[2];
+	const uint8_t *window_chr[2]; // Where that bank's patterns are.
+	int window_bank[2];
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t invalidations; // CHR RAM writes that threw away a decoded tile.
+} TILE_CACHE;
+
+static inline TILE_CACHE* new_tile_cache(size_t bank_count){
+	TILE_CACHE *cache = (TILE_CACHE*)calloc(1, sizeof(TILE_CACHE));
+	cache->pixels = (uint8_t*)calloc(bank_count * TILE_CACHE_TILES, TILE_CACHE_TILE_SIZE);
+	cache->decoded = (uint8_t*)calloc(bank_count * TILE_CACHE_TILES, sizeof(uint8_t));
+	cache->bank_count = bank_count;
+	cache->window_bank[0] = -1;
+	cache->window_bank[1] = -1;
+	return cache;
+}
+
+// Called by mappers whenever the 4KiB CHR bank visible in 'window' (0 = 0x0000, 1 = 0x1000) might have changed.
+// 'chr' is where that bank's patterns are. Unlike PRG banks, there's always one mapped.
+static inline void tile_cache_map(TILE_CACHE *cache, int window, int bank, const uint8_t *chr){
+	if(cache == NULL || cache->window_bank[window] == bank){
+		return;
+	}
+
+	cache->window[window] = cache->pixels + (size_t)bank * TILE_CACHE_TILES * TILE_CACHE_TILE_SIZE;
+	cache->window_decoded[window] = cache->decoded + (size_t)bank * TILE_CACHE_TILES;
+	cache->window_chr[window] = chr;
+	cache->window_bank[window] = bank;
+}
+
+// Returns the 8 pixels of the pattern row at 'address' (0x0000-0x1FFF, with bit 3 clear, since both planes
+// go into the one row), decoding the tile first if it hasn't been already.
+static inline const uint8_t* tile_cache_row(TILE_CACHE *cache, uint16_t address){
+	unsigned window = (address >> 12) & 1, tile = (address >> 4) & 0xFF;
+	uint8_t *pixels = cache->window[window] + tile * TILE_CACHE_TILE_SIZE;
+	if(cache->window_decoded[window][tile]){
+		cache->hits++;
+	} else {
+		// Two rows at a time, which is what render_decode_tiles does.
+		const uint8_t *pattern = cache->window_chr[window] + tile * 16;
+		for(unsigned row = 0; row < 8; row += 2){
+			render_decode_tiles(pixels + row * 8, pattern[row], pattern[row + 8], 0, pattern[row + 1], pattern[row + 9], 0);
+		}
+		cache->window_decoded[window][tile] = 1;
+		cache->misses++;
+	}
+	return pixels + (address & 7) * 8;
+}
+
+// Called by mappers when a byte of tile 'tile' (0-255) in CHR bank 'bank' has been written.
+static inline void tile_cache_invalidate(TILE_CACHE *cache, size_t bank, unsigned tile){
+	if(cache == NULL){
+		return;
+	}
+
+	uint8_t *decoded = &cache->decoded[bank * TILE_CACHE_TILES + tile];
+	cache->invalidations += *decoded != 0;
+	*decoded = 0;
+}
+
+static inline double tile_cache_hit_rate(const TILE_CACHE *cache){
+	uint64_t lookups = cache->hits + cache->misses;
+	return lookups != 0 ? (double)cache->hits / lookups : 0.0;
+}
+
+// How much memory the cache takes up, all of which is allocated up front.
+static inline size_t tile_cache_bytes(const TILE_CACHE *cache){
+	return sizeof(TILE_CACHE) + cache->bank_count * TILE_CACHE_TILES * (TILE_CACHE_TILE_SIZE + 1);
+}
+
+static inline void destroy_tile_cache(TILE_CACHE *cache){
+	free(cache->pixels);
+	free(cache->decoded);
+	free(cache);
+}
+
+#endif
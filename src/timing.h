@@ -0,0 +1,74 @@
+#ifndef timing_h
+#define timing_h
+
+// Clock rates for each console region. Everything on the NES is derived from a single master clock, which the
+// CPU divides by 12 (NTSC), 16 (PAL) or 15 (Dendy) and the PPU by 4 (NTSC) or 5 (PAL/Dendy). A frame is 262
+// (NTSC) or 312 (PAL/Dendy) scanlines of 341 PPU dots, so the PPU runs at 3 (3.2 on PAL) dots per CPU cycle.
+// NTSC skips a dot every other frame while rendering, which is where the half cycle comes from. Frames are laid
+// out as if it always did, which makes every frame a whole number of master clocks, and the PPU keeps track of
+// how far behind that it's fallen from frames that didn't (see 'delay' in ppu.h).
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "cart.h"
+
+typedef struct {
+	const char *name;
+	double master_clock_hz;
+	unsigned cpu_divider;
+	double cpu_cycles_per_frame;
+	unsigned ppu_divider;
+	unsigned scanlines;
+	unsigned vblank_scanline; // The first line of vertical blank, where NMI happens.
+} TIMING;
+
+static const TIMING timings[] = {
+	[RP2C02] = { "NTSC", 236250000.0 / 11.0, 12, 29780.5, 4, 262, 241 },
+	[RP2C07] = { "PAL", 26601712.5, 16, 33247.5, 5, 312, 241 },
+	[MULTI] = { "NTSC", 236250000.0 / 11.0, 12, 29780.5, 4, 262, 241 }, // Multi-region carts are run as NTSC, see new_cart.
+	[UA6538] = { "Dendy", 26601712.5, 15, 35464.0, 5, 312, 291 },
+};
+
+static inline const TIMING* timing_for(enum timing_modes mode){
+	return &timings[mode <= UA6538 ? mode : RP2C02];
+}
+
+static inline double timing_cpu_hz(const TIMING *timing){
+	return timing->master_clock_hz / timing->cpu_divider;
+}
+
+static inline uint64_t timing_master_per_frame(const TIMING *timing){
+	return (uint64_t)(timing->cpu_cycles_per_frame * timing->cpu_divider);
+}
+
+// The master clock frame 'frame' starts on, if every odd NTSC frame so far has skipped its dot. Frames always
+// start on a whole dot, so on NTSC, where they're half a dot longer than that, odd frames start half a dot late
+// and finish a dot early. That's the dot the real PPU skips on odd frames. It only does that while rendering,
+// so frames after one that didn't start later than this, by the PPU's 'delay'.
+static inline uint64_t timing_frame_start(const TIMING *timing, uint64_t frame){
+	uint64_t dot = (frame * timing_master_per_frame(timing) + timing->ppu_divider - 1) / timing->ppu_divider;
+	return dot * timing->ppu_divider;
+}
+
+// Master clocks from the start of a frame to dot 'dot' of 'scanline'.
+static inline uint64_t timing_master_at(const TIMING *timing, unsigned scanline, unsigned dot){
+	return ((uint64_t)scanline * 341 + dot) * timing->ppu_divider;
+}
+
+// Parses the name given to --override-tv-format. Returns false if it isn't one.
+static inline bool timing_parse(const char *name, enum timing_modes *mode){
+	if(strcmp(name, "NTSC") == 0){
+		*mode = RP2C02;
+	} else if(strcmp(name, "PAL") == 0){
+		*mode = RP2C07;
+	} else if(strcmp(name, "Dendy") == 0){
+		*mode = UA6538;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+#endif
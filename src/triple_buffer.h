@@ -0,0 +1,104 @@
+#ifndef triple_buffer_h
+#define triple_buffer_h
+
+// Hands finished frames from the emulation thread to the thread that shows them, without either ever waiting
+// for the other. There are three buffers: the writer always has one to draw into, the reader always has one it's
+// showing, and the third (the middle) is the latest finished frame. Publishing a frame swaps the writer's buffer
+// with the middle one and taking it swaps the reader's, each with a single atomic exchange, so there's no lock
+// for a slow vsync or compositor to hold the emulator up with.
+//
+// If the writer publishes twice before the reader comes back, the first frame is never shown, which is a drop.
+// If the reader comes back before anything new is published, it has to show the same frame again, which is a
+// duplicate. Both are counted.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define TRIPLE_BUFFER_FRESH 4 // Set alongside the middle buffer's index while it holds a frame nobody's taken yet.
+#define TRIPLE_BUFFER_CACHE_LINE 64
+
+typedef struct {
+	uint8_t *frames[3];
+	size_t frame_size;
+	atomic_uint middle;
+
+	// Each side's own buffer and counts are on their own cache line, so the two threads don't fight over them.
+	// The counts are atomic only so they can be read from the other side while it's running.
+	_Alignas(TRIPLE_BUFFER_CACHE_LINE) unsigned back; // The writer's.
+	atomic_ullong published;
+	atomic_ullong dropped;
+
+	_Alignas(TRIPLE_BUFFER_CACHE_LINE) unsigned front; // The reader's.
+	atomic_ullong taken;
+	atomic_ullong duplicated;
+} TRIPLE_BUFFER;
+
+static inline void destroy_triple_buffer(TRIPLE_BUFFER *buffer){
+	for(int i = 0; i < 3; i++){
+		free(buffer->frames[i]);
+	}
+	free(buffer);
+}
+
+// Three zeroed frames of 'frame_size' bytes each. Returns NULL if out of memory.
+static inline TRIPLE_BUFFER* new_triple_buffer(size_t frame_size){
+	TRIPLE_BUFFER *buffer = (TRIPLE_BUFFER*)aligned_alloc(TRIPLE_BUFFER_CACHE_LINE, sizeof(TRIPLE_BUFFER));
+	if(buffer == NULL){
+		return NULL;
+	}
+	memset(buffer, 0, sizeof(TRIPLE_BUFFER));
+	for(int i = 0; i < 3; i++){
+		buffer->frames[i] = (uint8_t*)calloc(frame_size, sizeof(uint8_t));
+		if(buffer->frames[i] == NULL){
+			destroy_triple_buffer(buffer);
+			return NULL;
+		}
+	}
+	buffer->frame_size = frame_size;
+	buffer->back = 0;
+	atomic_init(&buffer->middle, 1);
+	buffer->front = 2;
+	atomic_init(&buffer->published, 0);
+	atomic_init(&buffer->dropped, 0);
+	atomic_init(&buffer->taken, 0);
+	atomic_init(&buffer->duplicated, 0);
+	return buffer;
+}
+
+// Writer side. The frame to draw into, which nobody else touches until it's published.
+static inline uint8_t* triple_buffer_back(TRIPLE_BUFFER *buffer){
+	return buffer->frames[buffer->back];
+}
+
+// Makes the back frame the latest one, and hands the writer a new one to draw into.
+static inline void triple_buffer_publish(TRIPLE_BUFFER *buffer){
+	unsigned old = atomic_exchange_explicit(&buffer->middle, buffer->back | TRIPLE_BUFFER_FRESH, memory_order_acq_rel);
+	if(old & TRIPLE_BUFFER_FRESH){
+		atomic_fetch_add_explicit(&buffer->dropped, 1, memory_order_relaxed);
+	}
+	buffer->back = old & 3;
+	atomic_fetch_add_explicit(&buffer->published, 1, memory_order_relaxed);
+}
+
+// Reader side. Swaps in the latest frame if there's been one since last time, and returns whether there was.
+// Either way, triple_buffer_front is then the frame to show.
+static inline bool triple_buffer_take(TRIPLE_BUFFER *buffer){
+	// Only the writer sets the fresh flag, so if it's set now it'll still be set when we swap.
+	if(!(atomic_load_explicit(&buffer->middle, memory_order_relaxed) & TRIPLE_BUFFER_FRESH)){
+		atomic_fetch_add_explicit(&buffer->duplicated, 1, memory_order_relaxed);
+		return false;
+	}
+	unsigned old = atomic_exchange_explicit(&buffer->middle, buffer->front, memory_order_acq_rel);
+	buffer->front = old & 3;
+	atomic_fetch_add_explicit(&buffer->taken, 1, memory_order_relaxed);
+	return true;
+}
+
+static inline const uint8_t* triple_buffer_front(const TRIPLE_BUFFER *buffer){
+	return buffer->frames[buffer->front];
+}
+
+#endif
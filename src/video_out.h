@@ -0,0 +1,354 @@
+#ifndef video_out_h
+#define video_out_h
+
+// Writes every frame out as it's finished, for piping into an encoder or keeping for regression tests. The
+// output can be a file, a FIFO or stdout ("-"), in one of three formats:
+//	- indexed: NES colours (0-63), a byte per pixel, after a header (VIDEO_HEADER) that carries the palette
+//	  used for the other two, so a reader can turn them into whatever colours it likes.
+//	- rgb: 24 bit RGB after the same header, for anything that takes raw video (ffmpeg -f rawvideo).
+//	- y4m: YUV4MPEG2, 4:4:4, which most encoders read as is.
+//
+// The emulation thread only copies each picture into a bounded queue, and a thread of its own turns them into
+// the output format and writes them, several frames to a write(). If the output can't keep up, the queue fills
+// and the emulator waits for room rather than dropping frames, since the point is to have all of them. Those
+// waits are counted as stalls, along with how deep the queue got, so a slow disk or encoder shows up in the
+// numbers rather than as a mysteriously slow emulator.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "render.h"
+#include "timing.h"
+#include "log.h"
+#include "platform.h"
+
+#define VIDEO_FRAME_PIXELS (RENDER_WIDTH * RENDER_HEIGHT)
+#define VIDEO_DEFAULT_QUEUE 8 // Frames.
+#define VIDEO_BATCH_FRAMES 4 // Most frames put into one write().
+#define VIDEO_MAGIC "AGNTVID"
+#define VIDEO_VERSION 1
+
+enum video_formats {
+	VIDEO_INDEXED,
+	VIDEO_RGB,
+	VIDEO_Y4M,
+};
+
+// Starts indexed and rgb streams, written as it is in memory, so little endian everywhere we run. Frames
+// follow straight after, with nothing in between.
+typedef struct {
+	char magic[8]; // VIDEO_MAGIC, NUL terminated.
+	uint8_t version;
+	uint8_t format; // enum video_formats.
+	uint16_t width;
+	uint16_t height;
+	uint16_t reserved;
+	uint32_t rate_numerator; // Frames per second, as a fraction.
+	uint32_t rate_denominator;
+	uint8_t palette[64 * 3]; // RGB for each NES colour.
+} VIDEO_HEADER;
+
+_Static_assert(sizeof(VIDEO_HEADER) == 24 + 64 * 3, "VIDEO_HEADER has padding in it");
+
+typedef struct {
+	enum video_formats format;
+	int fd;
+	bool owns_fd; // Not if it's stdout.
+	const LOGGER *logger;
+	size_t frame_bytes; // In the output format, including any per frame header.
+
+	// The queue. 'head' is where the next frame goes in, 'count' how many are waiting; the writer takes them
+	// from head - count. Only the slots themselves are touched outside the lock: the emulation thread's one
+	// at 'head' while it's copying in, and the writer's batch while it's writing out.
+	uint8_t *slots;
+	unsigned capacity;
+	unsigned head;
+	unsigned count;
+	bool closing;
+	bool failed; // The output went away, or some other write error. Nothing more gets written.
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_t thread;
+
+	// Writer thread's own.
+	uint8_t *batch;
+	uint8_t yuv[64][3]; // Y, Cb and Cr for each NES colour.
+
+	// Stats. The emulation thread's are only touched by it; the writer's under the lock.
+	uint64_t frames_queued;
+	uint64_t stalls; // Frames that had to wait for room in the queue.
+	double stall_seconds;
+	uint64_t depth_total; // Sum of the frames already queued each time one's added, for the average.
+	unsigned max_depth;
+	uint64_t frames_written;
+	uint64_t bytes_written;
+	uint64_t writes; // write() calls.
+} VIDEO_OUT;
+
+// Parses the name given to --video-format. Returns false if it isn't one.
+static inline bool video_parse_format(const char *name, enum video_formats *format){
+	if(strcmp(name, "indexed") == 0){
+		*format = VIDEO_INDEXED;
+	} else if(strcmp(name, "rgb") == 0){
+		*format = VIDEO_RGB;
+	} else if(strcmp(name, "y4m") == 0){
+		*format = VIDEO_Y4M;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static inline bool video_write_all(VIDEO_OUT *video, const uint8_t *data, size_t length){
+	if(!platform_write_all(video->fd, data, length, &video->writes)){
+		log_message(video->logger, LOG_ERROR, "Error: couldn't write video. errno = %d\n", errno);
+		return false;
+	}
+	return true;
+}
+
+// Frame rate as a fraction, to the nearest millionth of a frame. Good enough for any encoder.
+static inline void video_rate(const TIMING *timing, uint32_t *numerator, uint32_t *denominator){
+	*numerator = (uint32_t)(timing->master_clock_hz / timing_master_per_frame(timing) * 1000000.0 + 0.5);
+	*denominator = 1000000;
+}
+
+// Converts one frame of NES colours into the output format.
+static inline void video_convert(VIDEO_OUT *video, const uint8_t *picture, uint8_t *out){
+	switch(video->format){
+		case VIDEO_INDEXED:
+			memcpy(out, picture, VIDEO_FRAME_PIXELS);
+			break;
+		case VIDEO_RGB:
+			for(size_t i = 0; i < VIDEO_FRAME_PIXELS; i++){
+				uint32_t rgb = render_rgb[picture[i] & 0x3F];
+				out[i * 3] = (uint8_t)(rgb >> 16);
+				out[i * 3 + 1] = (uint8_t)(rgb >> 8);
+				out[i * 3 + 2] = (uint8_t)rgb;
+			}
+			break;
+		case VIDEO_Y4M:
+			// "FRAME\n", then the Y, Cb and Cr planes, each full size.
+			memcpy(out, "FRAME\n", 6);
+			out += 6;
+			for(size_t i = 0; i < VIDEO_FRAME_PIXELS; i++){
+				const uint8_t *yuv = video->yuv[picture[i] & 0x3F];
+				out[i] = yuv[0];
+				out[VIDEO_FRAME_PIXELS + i] = yuv[1];
+				out[VIDEO_FRAME_PIXELS * 2 + i] = yuv[2];
+			}
+			break;
+	}
+}
+
+static inline void* video_writer(void *arg){
+	VIDEO_OUT *video = (VIDEO_OUT*)arg;
+	pthread_mutex_lock(&video->lock);
+	for(;;){
+		while(video->count == 0 && !video->closing){
+			pthread_cond_wait(&video->not_empty, &video->lock);
+		}
+		if(video->count == 0){
+			break;
+		}
+
+		// Take as many as are waiting, up to a batch. The queue's a ring, so stop at the end of it too, which
+		// keeps the batch in one piece.
+		unsigned first = (video->head + video->capacity - video->count) % video->capacity;
+		unsigned frames = video->count < VIDEO_BATCH_FRAMES ? video->count : VIDEO_BATCH_FRAMES;
+		if(first + frames > video->capacity){
+			frames = video->capacity - first;
+		}
+		bool failed = video->failed;
+		pthread_mutex_unlock(&video->lock);
+
+		// If writing has already failed, just empty the queue so the emulator never waits on it.
+		if(!failed){
+			for(unsigned i = 0; i < frames; i++){
+				video_convert(video, video->slots + (size_t)(first + i) * VIDEO_FRAME_PIXELS, video->batch + i * video->frame_bytes);
+			}
+			failed = !video_write_all(video, video->batch, frames * video->frame_bytes);
+		}
+
+		pthread_mutex_lock(&video->lock);
+		video->count -= frames;
+		video->failed = failed;
+		if(!failed){
+			video->frames_written += frames;
+			video->bytes_written += frames * video->frame_bytes;
+		}
+		pthread_cond_signal(&video->not_full);
+	}
+	pthread_mutex_unlock(&video->lock);
+	return NULL;
+}
+
+// Opens 'path' ("-" for stdout) and writes the stream header. 'queue' is how many frames can be waiting to be
+// written, 0 for the default. Returns NULL, having logged why, if it can't be opened.
+static inline VIDEO_OUT* new_video_out(const char *path, enum video_formats format, unsigned queue, const TIMING *timing,
+	const LOGGER *logger){
+	VIDEO_OUT *video = (VIDEO_OUT*)calloc(1, sizeof(VIDEO_OUT));
+	if(video == NULL){
+		return NULL;
+	}
+	video->format = format;
+	video->logger = logger;
+	video->capacity = queue != 0 ? queue : VIDEO_DEFAULT_QUEUE;
+	video->frame_bytes = format == VIDEO_INDEXED ? VIDEO_FRAME_PIXELS : format == VIDEO_RGB ? VIDEO_FRAME_PIXELS * 3 : 6 + VIDEO_FRAME_PIXELS * 3;
+	video->slots = (uint8_t*)malloc((size_t)video->capacity * VIDEO_FRAME_PIXELS);
+	video->batch = (uint8_t*)malloc(VIDEO_BATCH_FRAMES * video->frame_bytes);
+	if(video->slots == NULL || video->batch == NULL){
+		free(video->slots);
+		free(video->batch);
+		free(video);
+		return NULL;
+	}
+
+	if(strcmp(path, "-") == 0){
+		video->fd = STDOUT_FILENO;
+		video->owns_fd = false;
+	} else {
+		video->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		video->owns_fd = true;
+	}
+	if(video->fd < 0){
+		log_message(logger, LOG_ERROR, "Error: couldn't open %s for video. errno = %d\n", path, errno);
+		free(video->slots);
+		free(video->batch);
+		free(video);
+		return NULL;
+	}
+
+	// Studio range BT.601, which is what Y4M readers assume.
+	for(int i = 0; i < 64; i++){
+		double r = (render_rgb[i] >> 16) & 0xFF, g = (render_rgb[i] >> 8) & 0xFF, b = render_rgb[i] & 0xFF;
+		video->yuv[i][0] = (uint8_t)(16.5 + (65.738 * r + 129.057 * g + 25.064 * b) / 256);
+		video->yuv[i][1] = (uint8_t)(128.5 + (-37.945 * r - 74.494 * g + 112.439 * b) / 256);
+		video->yuv[i][2] = (uint8_t)(128.5 + (112.439 * r - 94.154 * g - 18.285 * b) / 256);
+	}
+
+	uint32_t numerator, denominator;
+	video_rate(timing, &numerator, &denominator);
+	bool ok;
+	if(format == VIDEO_Y4M){
+		// NES pixels are 8:7, not square.
+		char header[96];
+		int length = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%u:%u Ip A8:7 C444\n", RENDER_WIDTH, RENDER_HEIGHT,
+			numerator, denominator);
+		ok = video_write_all(video, (const uint8_t*)header, (size_t)length);
+	} else {
+		VIDEO_HEADER header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, VIDEO_MAGIC, sizeof(VIDEO_MAGIC));
+		header.version = VIDEO_VERSION;
+		header.format = (uint8_t)format;
+		header.width = RENDER_WIDTH;
+		header.height = RENDER_HEIGHT;
+		header.rate_numerator = numerator;
+		header.rate_denominator = denominator;
+		for(int i = 0; i < 64; i++){
+			header.palette[i * 3] = (uint8_t)(render_rgb[i] >> 16);
+			header.palette[i * 3 + 1] = (uint8_t)(render_rgb[i] >> 8);
+			header.palette[i * 3 + 2] = (uint8_t)render_rgb[i];
+		}
+		ok = video_write_all(video, (const uint8_t*)&header, sizeof(header));
+	}
+	video->writes = 0; // The header doesn't count.
+
+	pthread_mutex_init(&video->lock, NULL);
+	pthread_cond_init(&video->not_empty, NULL);
+	pthread_cond_init(&video->not_full, NULL);
+	if(!ok || pthread_create(&video->thread, NULL, video_writer, video) != 0){
+		pthread_mutex_destroy(&video->lock);
+		pthread_cond_destroy(&video->not_empty);
+		pthread_cond_destroy(&video->not_full);
+		if(video->owns_fd){
+			close(video->fd);
+		}
+		free(video->slots);
+		free(video->batch);
+		free(video);
+		return NULL;
+	}
+	return video;
+}
+
+// Queues a finished picture (RENDER_WIDTH x RENDER_HEIGHT NES colours), waiting for room if the queue's full.
+// Returns false if writing has failed, in which case the frame's thrown away.
+static inline bool video_out_frame(VIDEO_OUT *video, const uint8_t *picture){
+	pthread_mutex_lock(&video->lock);
+	if(video->failed){
+		pthread_mutex_unlock(&video->lock);
+		return false;
+	}
+	if(video->count == video->capacity){
+		double start = platform_now();
+		while(video->count == video->capacity){
+			pthread_cond_wait(&video->not_full, &video->lock);
+		}
+		video->stalls++;
+		video->stall_seconds += platform_now() - start;
+	}
+	unsigned slot = video->head, depth = video->count;
+	pthread_mutex_unlock(&video->lock);
+
+	// The slot at 'head' isn't in the queue yet, so the writer won't touch it.
+	memcpy(video->slots + (size_t)slot * VIDEO_FRAME_PIXELS, picture, VIDEO_FRAME_PIXELS);
+
+	pthread_mutex_lock(&video->lock);
+	video->head = (video->head + 1) % video->capacity;
+	video->count++;
+	pthread_cond_signal(&video->not_empty);
+	pthread_mutex_unlock(&video->lock);
+
+	video->frames_queued++;
+	video->depth_total += depth;
+	video->max_depth = depth + 1 > video->max_depth ? depth + 1 : video->max_depth;
+	return true;
+}
+
+// Writes out whatever's still queued, stops the writer and closes the output. No more frames can be queued
+// after this, but the stats are all there. Returns false if anything failed to be written.
+static inline bool video_out_finish(VIDEO_OUT *video){
+	pthread_mutex_lock(&video->lock);
+	video->closing = true;
+	pthread_cond_signal(&video->not_empty);
+	pthread_mutex_unlock(&video->lock);
+	pthread_join(video->thread, NULL);
+
+	bool ok = !video->failed;
+	if(video->owns_fd){
+		ok = close(video->fd) == 0 && ok;
+	}
+	return ok;
+}
+
+// Only once it's finished.
+static inline void destroy_video_out(VIDEO_OUT *video){
+	pthread_mutex_destroy(&video->lock);
+	pthread_cond_destroy(&video->not_empty);
+	pthread_cond_destroy(&video->not_full);
+	free(video->slots);
+	free(video->batch);
+	free(video);
+}
+
+// Once it's finished, see video_out_finish.
+static inline void print_video_stats(const LOGGER *logger, const VIDEO_OUT *video){
+	log_message(logger, LOG_INFO, "Video: %llu of %llu frame(s) written in %llu write(s), %.1fMiB. Queue depth %.2f on average, "
+		"%u at most of %u; %llu stall(s) waiting for room, %.3fs in all.\n", (unsigned long long)video->frames_written,
+		(unsigned long long)video->frames_queued, (unsigned long long)video->writes, video->bytes_written / 1048576.0,
+		video->frames_queued != 0 ? (double)video->depth_total / video->frames_queued : 0.0, video->max_depth, video->capacity,
+		(unsigned long long)video->stalls, video->stall_seconds);
+}
+
+#endif